@@ -0,0 +1,230 @@
+#include "bench/bench.h"
+
+#include "http/parser.h"
+#include "http/scan.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAS_CYCLES 1
+#else
+#define BENCH_HAS_CYCLES 0
+#endif
+
+// Each measurement runs this many times, and the fastest run counts.
+#define BENCH_RUNS 5
+#define BENCH_ITERATIONS 200000
+
+// What browsers send for a page and for something on it, give or take a
+// cookie.
+static const struct {
+	const char *name;
+	const char *request;
+} bench_requests[] = {
+	{
+		"chrome page",
+		"GET /docs/getting-started HTTP/1.1\r\n"
+		"Host: docs.example.com\r\n"
+		"Connection: keep-alive\r\n"
+		"sec-ch-ua: \"Chromium\";v=\"128\", \"Not;A=Brand\";v=\"24\", \"Google Chrome\";v=\"128\"\r\n"
+		"sec-ch-ua-mobile: ?0\r\n"
+		"sec-ch-ua-platform: \"Linux\"\r\n"
+		"Upgrade-Insecure-Requests: 1\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/128.0.0.0 Safari/537.36\r\n"
+		"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7\r\n"
+		"Sec-Fetch-Site: same-origin\r\n"
+		"Sec-Fetch-Mode: navigate\r\n"
+		"Sec-Fetch-User: ?1\r\n"
+		"Sec-Fetch-Dest: document\r\n"
+		"Referer: https://docs.example.com/\r\n"
+		"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+		"Accept-Language: en-US,en;q=0.9\r\n"
+		"\r\n",
+	},
+	{
+		"firefox page",
+		"GET /docs/getting-started HTTP/1.1\r\n"
+		"Host: docs.example.com\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+		"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/png,image/svg+xml,*/*;q=0.8\r\n"
+		"Accept-Language: en-US,en;q=0.5\r\n"
+		"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+		"Referer: https://docs.example.com/\r\n"
+		"Connection: keep-alive\r\n"
+		"Upgrade-Insecure-Requests: 1\r\n"
+		"Sec-Fetch-Dest: document\r\n"
+		"Sec-Fetch-Mode: navigate\r\n"
+		"Sec-Fetch-Site: same-origin\r\n"
+		"Sec-Fetch-User: ?1\r\n"
+		"Priority: u=0, i\r\n"
+		"\r\n",
+	},
+	{
+		"chrome stylesheet",
+		"GET /assets/site.css HTTP/1.1\r\n"
+		"Host: docs.example.com\r\n"
+		"Connection: keep-alive\r\n"
+		"sec-ch-ua-platform: \"Linux\"\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/128.0.0.0 Safari/537.36\r\n"
+		"sec-ch-ua: \"Chromium\";v=\"128\", \"Not;A=Brand\";v=\"24\", \"Google Chrome\";v=\"128\"\r\n"
+		"sec-ch-ua-mobile: ?0\r\n"
+		"Accept: text/css,*/*;q=0.1\r\n"
+		"Sec-Fetch-Site: same-origin\r\n"
+		"Sec-Fetch-Mode: no-cors\r\n"
+		"Sec-Fetch-Dest: style\r\n"
+		"Referer: https://docs.example.com/docs/getting-started\r\n"
+		"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+		"Accept-Language: en-US,en;q=0.9\r\n"
+		"\r\n",
+	},
+};
+
+// Keeps results alive, so that the work that produced them isn't optimized
+// away.
+static volatile size_t bench_sink;
+
+typedef struct BenchClock {
+	struct timespec time;
+	uint64_t cycles;
+} BenchClock;
+
+static BenchClock bench_clock_now(void) {
+	BenchClock clock = { 0 };
+
+	clock_gettime(CLOCK_MONOTONIC, &clock.time);
+#if BENCH_HAS_CYCLES
+	clock.cycles = __rdtsc();
+#endif
+
+	return clock;
+}
+
+// Time per iteration between `start` and `end`.
+static void bench_clock_elapsed(BenchClock start, BenchClock end, double *out_ns, double *out_cycles) {
+	double ns =
+		(end.time.tv_sec - start.time.tv_sec) * 1e9 +
+		(end.time.tv_nsec - start.time.tv_nsec);
+
+	*out_ns = ns / BENCH_ITERATIONS;
+	*out_cycles = (double) (end.cycles - start.cycles) / BENCH_ITERATIONS;
+}
+
+static void bench_print(const char *what, size_t len, double ns, double cycles) {
+#if BENCH_HAS_CYCLES
+	printf("\t%-12s %7.1f ns %7.0f cycles %6.2f bytes/cycle\n", what, ns, cycles, len / cycles);
+#else
+	(void) cycles;
+	printf("\t%-12s %7.1f ns %6.2f bytes/ns\n", what, ns, len / ns);
+#endif
+}
+
+// Scanning each header value, with each implementation, the way the parser
+// does.
+static void bench_http_scan(Slice request) {
+	for (int implementation = 0; implementation < HTTP_SCAN_IMPLEMENTATIONS_COUNT; implementation++) {
+		if (!http_scan_supported(implementation)) continue;
+
+		double best_ns = 0, best_cycles = 0;
+
+		for (int run = 0; run < BENCH_RUNS; run++) {
+			BenchClock start = bench_clock_now();
+
+			for (int i = 0; i < BENCH_ITERATIONS; i++) {
+				// Every line ends at a carriage return, and the next one starts
+				// past its newline.
+				size_t index = 0;
+				while (index < request.len) {
+					index += http_scan_field_value_with(implementation, slice_remove_start(request, index));
+					index += 2;
+				}
+
+				bench_sink = index;
+			}
+
+			double ns, cycles;
+			bench_clock_elapsed(start, bench_clock_now(), &ns, &cycles);
+
+			if (run == 0 || ns < best_ns) {
+				best_ns = ns;
+				best_cycles = cycles;
+			}
+		}
+
+		bench_print(http_scan_name(implementation), request.len, best_ns, best_cycles);
+	}
+}
+
+// Everything a request goes through before it's handled, scanning values with
+// `implementation`.
+static Error bench_http_parser(HttpScanImplementation implementation, Slice request) {
+	http_scan_use(implementation);
+
+	HttpParser parser;
+	http_parser_init(&parser);
+
+	double best_ns = 0, best_cycles = 0;
+
+	for (int run = 0; run < BENCH_RUNS; run++) {
+		BenchClock start = bench_clock_now();
+
+		for (int i = 0; i < BENCH_ITERATIONS; i++) {
+			HttpParserPollResult result;
+
+			Error err = http_parser_poll(&parser, request, &result);
+			if (err != ERR_SUCCESS || !result.done) {
+				http_parser_deinit(&parser);
+				return ERR_PARSE_FAILED;
+			}
+
+			bench_sink = result.request.headers_count;
+
+			http_request_deinit(&result.request);
+			http_parser_reset(&parser);
+		}
+
+		double ns, cycles;
+		bench_clock_elapsed(start, bench_clock_now(), &ns, &cycles);
+
+		if (run == 0 || ns < best_ns) {
+			best_ns = ns;
+			best_cycles = cycles;
+		}
+	}
+
+	http_parser_deinit(&parser);
+
+	char what[32];
+	snprintf(what, sizeof(what), "parse/%s", http_scan_name(implementation));
+
+	bench_print(what, request.len, best_ns, best_cycles);
+
+	return ERR_SUCCESS;
+}
+
+Error bench_all(void) {
+#if BENCH_HAS_CYCLES
+	printf("cycles are timestamp counter ticks, which may not match the core clock\n\n");
+#endif
+
+	for (size_t i = 0; i < sizeof(bench_requests) / sizeof(bench_requests[0]); i++) {
+		Slice request = slice_from_cstr(bench_requests[i].request);
+
+		printf("bench %s (%zu bytes)\n", bench_requests[i].name, request.len);
+
+		bench_http_scan(request);
+
+		for (int implementation = 0; implementation < HTTP_SCAN_IMPLEMENTATIONS_COUNT; implementation++) {
+			if (!http_scan_supported(implementation)) continue;
+
+			Error err = bench_http_parser(implementation, request);
+			if (err != ERR_SUCCESS) return err;
+		}
+
+		printf("\n");
+	}
+
+	return ERR_SUCCESS;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "warble/error.h"
+
+// Run every microbenchmark, and print the results.
+Error bench_all(void);
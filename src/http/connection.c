@@ -0,0 +1,332 @@
+#include "http/connection.h"
+
+#include "warble/util.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+void http_connection_init(HttpConnection *self) {
+	set_undefined(self, sizeof(*self));
+
+	http_parser_init(&self->parser);
+
+	http_output_init(&self->output);
+
+	self->streaming = false;
+	self->closing = false;
+
+	self->body_remaining = 0;
+
+	self->requests_count = 0;
+}
+
+void http_connection_deinit(HttpConnection *self) {
+	// Lets the producer go.
+	if (self->streaming) http_response_deinit(&self->response);
+
+	http_parser_deinit(&self->parser);
+	http_output_deinit(&self->output);
+
+	set_undefined(self, sizeof(*self));
+}
+
+// Answer the request the parser failed on with `err`, and close the
+// connection once that's been written.
+static Error http_connection_reject(HttpConnection *self, Error err) {
+	HttpStatus status;
+	if (err == ERR_OUT_OF_MEMORY) {
+		status = HTTP_SERVICE_UNAVAILABLE;
+	} else if (err != ERR_PARSE_FAILED) {
+		self->closing = true;
+		return err;
+	} else if (self->parser.failure == HTTP_PARSER_REQUEST_LINE_TOO_LONG) {
+		status = HTTP_URI_TOO_LONG;
+	} else if (self->parser.failure == HTTP_PARSER_HEADERS_TOO_LARGE) {
+		status = HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE;
+	} else if (self->parser.failure == HTTP_PARSER_TRANSFER_ENCODING) {
+		status = HTTP_NOT_IMPLEMENTED;
+	} else {
+		status = HTTP_BAD_REQUEST;
+	}
+
+	self->closing = true;
+
+	return http_output_write_borrowed(&self->output, http_response_rejection(status));
+}
+
+// Let the streamed response produce more of its body, until a batch of it is
+// waiting to be written or the body is done.
+static void http_connection_produce(HttpConnection *self) {
+	HttpResponse *response = &self->response;
+
+	Error err = ERR_SUCCESS;
+	while (
+		err == ERR_SUCCESS &&
+		response->state != HTTP_RESPONSE_STATE_DONE &&
+		http_connection_pending_output_len(self) + self->output.chunk.len < HTTP_CONNECTION_MAX_BATCH_OUTPUT
+	) {
+		size_t produced_before = http_connection_pending_output_len(self) + self->output.chunk.len;
+
+		err = response->producer(response->producer_data, response);
+
+		// A producer that neither writes nor ends the body would never finish.
+		if (
+			err == ERR_SUCCESS &&
+			response->state != HTTP_RESPONSE_STATE_DONE &&
+			http_connection_pending_output_len(self) + self->output.chunk.len == produced_before
+		) {
+			err = ERR_UNKNOWN;
+		}
+	}
+
+	if (err == ERR_SUCCESS) err = http_response_flush(response);
+
+	// The body can't be finished; all the client can be told is that it's cut
+	// short.
+	if (err != ERR_SUCCESS) {
+		self->closing = true;
+	} else if (response->state != HTTP_RESPONSE_STATE_DONE) {
+		return;
+	}
+
+	if (!response->keep_alive) self->closing = true;
+
+	http_response_deinit(response);
+	self->streaming = false;
+}
+
+// Answer requests from `input`, which the parser doesn't hold, and then from
+// the bytes it does.
+static Error http_connection_handle(
+	HttpConnection *self,
+	Slice input,
+	HttpHandler handler,
+	void *userdata
+) {
+	Error err = ERR_SUCCESS;
+
+	while (!self->closing) {
+		// A streamed body comes before any other response, a batch at a time,
+		// each once the last one has been written. That's what keeps a body
+		// of any size to a batch of memory.
+		if (self->streaming) {
+			if (http_connection_pending_output_len(self) > 0) break;
+
+			http_connection_produce(self);
+			if (self->streaming) break;
+
+			continue;
+		}
+
+		// Enough output has piled up; stop answering requests until the client
+		// has read some of it.
+		if (
+			http_connection_pending_output_len(self) >= HTTP_CONNECTION_MAX_BATCH_OUTPUT ||
+			http_output_segments_available(&self->output) < HTTP_CONNECTION_SEGMENTS_PER_RESPONSE
+		) {
+			break;
+		}
+
+		// The body of the last request comes before the next one. Nothing reads
+		// it, but it mustn't be taken for a request of its own.
+		if (self->body_remaining > 0) {
+			size_t skipped;
+			if (input.len > 0) {
+				skipped = self->body_remaining < input.len ? self->body_remaining : input.len;
+				input = slice_remove_start(input, skipped);
+			} else {
+				skipped = http_parser_skip(&self->parser, self->body_remaining);
+			}
+
+			self->body_remaining -= skipped;
+			if (self->body_remaining > 0) break;
+		}
+
+		HttpParserPollResult result;
+		if (input.len > 0) {
+			err = http_parser_poll(&self->parser, input, &result);
+		} else {
+			err = http_parser_poll_buffered(&self->parser, &result);
+		}
+		if (err != ERR_SUCCESS) {
+			err = http_connection_reject(self, err);
+			break;
+		}
+
+		if (!result.done) {
+			// The parser has taken all of `input`, or run out of bytes of its own.
+			input = slice_new();
+			break;
+		}
+
+		// Otherwise, the rest stays in the parser.
+		if (input.len > 0) input = result.remainder_slice;
+
+		HttpResponse *response = &self->response;
+		http_response_init(response, &result.request, &self->output);
+
+		self->requests_count += 1;
+		self->body_remaining = result.request.body_len;
+
+		handler(userdata, &result.request, response);
+
+		// The request goes away with the reset below; the producer has taken
+		// what it needs from it.
+		if (response->producer != NULL && response->state != HTTP_RESPONSE_STATE_DONE) {
+			http_request_deinit(&result.request);
+			http_parser_reset(&self->parser);
+
+			// Anything the handler wrote goes out before the first batch.
+			if (http_response_flush(response) != ERR_SUCCESS) {
+				http_response_deinit(response);
+				self->closing = true;
+				break;
+			}
+
+			self->streaming = true;
+			continue;
+		}
+
+		bool keep_alive = response->keep_alive;
+		http_response_deinit(response);
+		http_request_deinit(&result.request);
+
+		if (!keep_alive) {
+			self->closing = true;
+			break;
+		}
+
+		// Start over for the next request.
+		http_parser_reset(&self->parser);
+	}
+
+	// Keep whatever wasn't parsed for a later call. Nothing more is read from a
+	// closing connection, so there's no point keeping anything then.
+	if (!self->closing && input.len > 0) {
+		err = http_parser_append(&self->parser, input);
+		if (err != ERR_SUCCESS) err = http_connection_reject(self, err);
+	}
+
+	return err;
+}
+
+Error http_connection_receive(
+	HttpConnection *self,
+	Slice bytes,
+	HttpHandler handler,
+	void *userdata
+) {
+	// Bytes left over from a previous call come first.
+	if (bytes.len > 0 && http_parser_unparsed_len(&self->parser) > 0) {
+		Error err = http_parser_append(&self->parser, bytes);
+		if (err != ERR_SUCCESS) return http_connection_reject(self, err);
+
+		bytes = slice_new();
+	}
+
+	return http_connection_handle(self, bytes, handler, userdata);
+}
+
+Error http_connection_reserve(HttpConnection *self, Slice *out_space) {
+	Error err = http_parser_reserve(&self->parser, out_space);
+	if (err == ERR_SUCCESS) return ERR_SUCCESS;
+
+	*out_space = slice_new();
+
+	return http_connection_reject(self, err);
+}
+
+Error http_connection_commit(
+	HttpConnection *self,
+	size_t len,
+	HttpHandler handler,
+	void *userdata
+) {
+	http_parser_commit(&self->parser, len);
+
+	return http_connection_handle(self, slice_new(), handler, userdata);
+}
+
+bool http_connection_has_buffered_input(HttpConnection *self) {
+	return !self->closing && (self->streaming || http_parser_unparsed_len(&self->parser) > 0);
+}
+
+bool http_connection_reading_request(HttpConnection *self) {
+	if (self->closing || self->streaming) return false;
+
+	return self->body_remaining > 0 || http_parser_held_len(&self->parser) > 0;
+}
+
+size_t http_connection_pending_output_len(HttpConnection *self) {
+	return http_output_pending_len(&self->output);
+}
+
+void http_connection_consume_output(HttpConnection *self, size_t count) {
+	http_output_consume(&self->output, count);
+}
+
+Error http_connection_send(HttpConnection *self, int fd, bool *out_blocked) {
+	*out_blocked = false;
+
+	struct iovec iovecs[HTTP_OUTPUT_MAX_SEGMENTS];
+
+	while (http_output_pending_len(&self->output) > 0) {
+		int file_fd;
+		off_t file_offset;
+		size_t file_len;
+		if (http_output_pending_file(&self->output, &file_fd, &file_offset, &file_len)) {
+			ssize_t amount_sent = sendfile(fd, file_fd, &file_offset, file_len);
+			if (amount_sent < 0) {
+				if (errno == EINTR) continue;
+
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					*out_blocked = true;
+					return ERR_SUCCESS;
+				}
+
+				return ERR_UNKNOWN;
+			}
+
+			// The file shrank since it was loaded; the response can't be finished.
+			if (amount_sent == 0) return ERR_UNKNOWN;
+
+			http_output_consume(&self->output, amount_sent);
+			continue;
+		}
+
+		struct msghdr message = {
+			.msg_iov = iovecs,
+			.msg_iovlen = http_output_pending_iovecs(
+				&self->output,
+				iovecs,
+				HTTP_OUTPUT_MAX_SEGMENTS
+			),
+		};
+
+		// `MSG_NOSIGNAL`: a client hanging up on us shouldn't kill the server with
+		// SIGPIPE.
+		ssize_t amount_written = sendmsg(fd, &message, MSG_NOSIGNAL);
+		if (amount_written < 0) {
+			if (errno == EINTR) continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				*out_blocked = true;
+				return ERR_SUCCESS;
+			}
+
+			return ERR_UNKNOWN;
+		}
+
+		http_output_consume(&self->output, amount_written);
+	}
+
+	return ERR_SUCCESS;
+}
+
+bool http_connection_finished(HttpConnection *self) {
+	return self->closing && http_output_pending_len(&self->output) == 0;
+}
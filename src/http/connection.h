@@ -0,0 +1,118 @@
+#pragma once
+
+#include "http/output.h"
+#include "http/parser.h"
+#include "http/request.h"
+#include "http/response.h"
+#include "warble/buffer.h"
+
+// Once this much output is waiting to be written, pipelined requests are left
+// unanswered until the client catches up.
+#define HTTP_CONNECTION_MAX_BATCH_OUTPUT (64 * 1024)
+
+// Output segments that have to be free before another request is answered. A
+// response takes at most its copied headers, a release once the body has been
+// written, and a body: one borrowed or file segment, or for a multipart one,
+// a copied head and a borrowed or file segment for each range, and the copied
+// closing boundary.
+#define HTTP_CONNECTION_SEGMENTS_PER_RESPONSE (2 * HTTP_REQUEST_MAX_RANGES + 3)
+
+// Called once for every complete request. The handler must write a response
+// into `response`, or start streaming one; if it doesn't,
+// `http_response_deinit` answers with a 500.
+typedef void (*HttpHandler)(
+	void *userdata,
+	const HttpRequest *request,
+	HttpResponse *response
+);
+
+// The protocol side of a single client connection, independent of how bytes
+// actually get to and from the socket.
+typedef struct HttpConnection {
+	// Also holds bytes that arrived after the last request, and haven't been
+	// parsed yet.
+	HttpParser parser;
+
+	// Responses that have been produced, but not yet written to the socket.
+	HttpOutput output;
+
+	// The response whose body is being streamed, when `streaming` is set. No
+	// other requests are handled until it's done.
+	HttpResponse response;
+	bool streaming;
+
+	// Set once no more requests will be read from this connection, because
+	// either side doesn't want to keep it alive. The connection should be
+	// closed once `output` has been written.
+	bool closing;
+
+	// Bytes of the last request's body that haven't arrived yet. They're
+	// skipped, rather than parsed as the start of the next request.
+	size_t body_remaining;
+
+	// Requests handed to the handler so far.
+	size_t requests_count;
+} HttpConnection;
+
+void http_connection_init(HttpConnection *self);
+void http_connection_deinit(HttpConnection *self);
+
+// Feed `bytes` received from the client into the parser. Every request that's
+// completed is passed to `handler` in order, and its response is queued onto
+// `self->output`, so that pipelined requests are answered with a single write.
+//
+// Once `HTTP_CONNECTION_MAX_BATCH_OUTPUT` bytes of output are pending, no more
+// requests are handled; the rest of the input is kept for a later call. See
+// `http_connection_has_buffered_input`. Request bodies are skipped, as nothing
+// reads them.
+//
+// If a request is malformed or too large, has a body with `Transfer-Encoding`,
+// or there isn't enough memory to hold it, the client is sent a 400, 414, 431,
+// 501 or 503 as appropriate, and `closing` is set.
+Error http_connection_receive(
+	HttpConnection *self,
+	Slice bytes,
+	HttpHandler handler,
+	void *userdata
+);
+
+// Returns space for reading from the client straight into the parser; once
+// the read is done, pass how much it read to `http_connection_commit`. If
+// there's no memory to spare, the space is empty, and the client is sent a 503
+// and `closing` is set instead.
+Error http_connection_reserve(HttpConnection *self, Slice *out_space);
+
+// Like `http_connection_receive`, for the first `len` bytes of the space
+// returned by `http_connection_reserve`. No bytes are copied.
+Error http_connection_commit(
+	HttpConnection *self,
+	size_t len,
+	HttpHandler handler,
+	void *userdata
+);
+
+// Returns true if bytes from the client are waiting to be parsed, or a
+// streamed body is waiting to produce more, and the caller should call
+// `http_connection_receive` (with no new bytes) once the pending output has
+// been written.
+bool http_connection_has_buffered_input(HttpConnection *self);
+
+// Returns true if part of a request has arrived, head or body, and the rest is
+// waited for.
+bool http_connection_reading_request(HttpConnection *self);
+
+// Number of bytes of `output` that still need to be written.
+size_t http_connection_pending_output_len(HttpConnection *self);
+
+// Mark the first `count` pending bytes of `output` as written.
+void http_connection_consume_output(HttpConnection *self, size_t count);
+
+// Write as much pending output to the non-blocking socket `fd` as it will
+// accept. Bytes in memory are gathered into one `sendmsg`, and file ranges go
+// out with `sendfile`. `*out_blocked` is set to true if the socket couldn't
+// take all of it, and the caller should wait until `fd` is writable before
+// trying again.
+Error http_connection_send(HttpConnection *self, int fd, bool *out_blocked);
+
+// Returns true once this connection has nothing more to do, and can be closed.
+bool http_connection_finished(HttpConnection *self);
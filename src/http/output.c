@@ -0,0 +1,256 @@
+#include "http/output.h"
+
+#include "warble/util.h"
+
+#include <assert.h>
+
+void http_output_init(HttpOutput *self) {
+	set_undefined(self, sizeof(*self));
+
+	buffer_init(&self->bytes);
+
+	self->segments_count = 0;
+	self->first_segment = 0;
+	self->first_segment_written = 0;
+	self->pending_len = 0;
+	self->consumed_len = 0;
+
+	buffer_init(&self->headers);
+	buffer_init(&self->chunk);
+}
+
+// Call the release of every pending release segment.
+static void http_output_release_pending(HttpOutput *self) {
+	for (size_t i = self->first_segment; i < self->segments_count; i++) {
+		HttpOutputSegment *segment = &self->segments[i];
+		if (segment->kind == HTTP_OUTPUT_SEGMENT_RELEASE) {
+			segment->release(segment->release_data);
+		}
+	}
+}
+
+void http_output_deinit(HttpOutput *self) {
+	http_output_release_pending(self);
+
+	buffer_deinit(&self->bytes);
+	buffer_deinit(&self->headers);
+	buffer_deinit(&self->chunk);
+
+	set_undefined(self, sizeof(*self));
+}
+
+Error http_output_write(HttpOutput *self, Slice bytes) {
+	if (bytes.len == 0) return ERR_SUCCESS;
+
+	size_t offset = self->bytes.len;
+
+	Error err = buffer_concat(&self->bytes, bytes);
+	if (err != ERR_SUCCESS) return err;
+
+	self->pending_len += bytes.len;
+
+	// Everything copied goes to the end of `bytes`, so a copied segment at the
+	// end of the list can just grow.
+	if (self->segments_count > 0) {
+		HttpOutputSegment *last = &self->segments[self->segments_count - 1];
+		if (last->kind == HTTP_OUTPUT_SEGMENT_COPIED) {
+			assert(last->offset + last->len == offset);
+			last->len += bytes.len;
+			return ERR_SUCCESS;
+		}
+	}
+
+	// Borrowed and file segments always leave a segment to spare.
+	assert(self->segments_count < HTTP_OUTPUT_MAX_SEGMENTS);
+
+	self->segments[self->segments_count] = (HttpOutputSegment) {
+		.kind = HTTP_OUTPUT_SEGMENT_COPIED,
+		.borrowed = NULL,
+		.fd = -1,
+		.offset = offset,
+		.len = bytes.len,
+		.release = NULL,
+		.release_data = NULL,
+	};
+	self->segments_count += 1;
+
+	return ERR_SUCCESS;
+}
+
+Error http_output_write_borrowed(HttpOutput *self, Slice bytes) {
+	// Borrowing takes one segment, and one more has to be left over for
+	// whatever is copied after it.
+	if (
+		bytes.len < HTTP_OUTPUT_MIN_BORROW ||
+		http_output_segments_available(self) == 0
+	) {
+		return http_output_write(self, bytes);
+	}
+
+	self->segments[self->segments_count] = (HttpOutputSegment) {
+		.kind = HTTP_OUTPUT_SEGMENT_BORROWED,
+		.borrowed = bytes.bytes,
+		.fd = -1,
+		.offset = 0,
+		.len = bytes.len,
+		.release = NULL,
+		.release_data = NULL,
+	};
+	self->segments_count += 1;
+
+	self->pending_len += bytes.len;
+
+	return ERR_SUCCESS;
+}
+
+void http_output_write_file(HttpOutput *self, int fd, size_t offset, size_t len) {
+	if (len == 0) return;
+
+	assert(http_output_segments_available(self) > 0);
+
+	self->segments[self->segments_count] = (HttpOutputSegment) {
+		.kind = HTTP_OUTPUT_SEGMENT_FILE,
+		.borrowed = NULL,
+		.fd = fd,
+		.offset = offset,
+		.len = len,
+		.release = NULL,
+		.release_data = NULL,
+	};
+	self->segments_count += 1;
+
+	self->pending_len += len;
+}
+
+void http_output_release_after(
+	HttpOutput *self,
+	HttpOutputRelease release,
+	void *release_data
+) {
+	if (self->pending_len == 0) {
+		release(release_data);
+		return;
+	}
+
+	assert(http_output_segments_available(self) > 0);
+
+	self->segments[self->segments_count] = (HttpOutputSegment) {
+		.kind = HTTP_OUTPUT_SEGMENT_RELEASE,
+		.borrowed = NULL,
+		.fd = -1,
+		.offset = 0,
+		.len = 0,
+		.release = release,
+		.release_data = release_data,
+	};
+	self->segments_count += 1;
+}
+
+size_t http_output_segments_available(const HttpOutput *self) {
+	// One segment is always kept for whatever is copied after the last one.
+	if (self->segments_count + 1 >= HTTP_OUTPUT_MAX_SEGMENTS) return 0;
+
+	return HTTP_OUTPUT_MAX_SEGMENTS - self->segments_count - 1;
+}
+
+size_t http_output_pending_len(const HttpOutput *self) {
+	return self->pending_len;
+}
+
+bool http_output_pending_file(
+	const HttpOutput *self,
+	int *out_fd,
+	off_t *out_offset,
+	size_t *out_len
+) {
+	if (self->pending_len == 0) return false;
+
+	const HttpOutputSegment *segment = &self->segments[self->first_segment];
+	if (segment->kind != HTTP_OUTPUT_SEGMENT_FILE) return false;
+
+	*out_fd = segment->fd;
+	*out_offset = segment->offset + self->first_segment_written;
+	*out_len = segment->len - self->first_segment_written;
+
+	return true;
+}
+
+size_t http_output_pending_iovecs(
+	const HttpOutput *self,
+	struct iovec *iovecs,
+	size_t max_iovecs
+) {
+	size_t iovecs_count = 0;
+
+	for (
+		size_t i = self->first_segment;
+		i < self->segments_count && iovecs_count < max_iovecs;
+		i++
+	) {
+		const HttpOutputSegment *segment = &self->segments[i];
+		if (segment->kind == HTTP_OUTPUT_SEGMENT_FILE) break;
+		if (segment->kind == HTTP_OUTPUT_SEGMENT_RELEASE) continue;
+
+		const uint8_t *start = segment->borrowed;
+		if (segment->kind == HTTP_OUTPUT_SEGMENT_COPIED) {
+			start = self->bytes.bytes + segment->offset;
+		}
+
+		size_t skip = i == self->first_segment ? self->first_segment_written : 0;
+
+		iovecs[iovecs_count] = (struct iovec) {
+			.iov_base = (void*) (start + skip),
+			.iov_len = segment->len - skip,
+		};
+		iovecs_count += 1;
+	}
+
+	return iovecs_count;
+}
+
+void http_output_consume(HttpOutput *self, size_t count) {
+	assert(count <= self->pending_len);
+
+	self->pending_len -= count;
+	self->consumed_len += count;
+
+	// Everything's been written; start over, reusing the buffer unless one big
+	// response grew it.
+	if (self->pending_len == 0) {
+		http_output_release_pending(self);
+
+		if (self->bytes.capacity > HTTP_OUTPUT_MAX_RETAINED) {
+			buffer_clear_capacity(&self->bytes);
+		} else {
+			buffer_clear(&self->bytes);
+		}
+
+		self->segments_count = 0;
+		self->first_segment = 0;
+		self->first_segment_written = 0;
+		return;
+	}
+
+	// Stops at the first segment with bytes left, releasing everything that's
+	// been passed on the way.
+	while (true) {
+		HttpOutputSegment *segment = &self->segments[self->first_segment];
+
+		if (segment->kind == HTTP_OUTPUT_SEGMENT_RELEASE) {
+			segment->release(segment->release_data);
+			self->first_segment += 1;
+			continue;
+		}
+
+		size_t remaining = segment->len - self->first_segment_written;
+
+		if (count < remaining) {
+			self->first_segment_written += count;
+			return;
+		}
+
+		count -= remaining;
+		self->first_segment += 1;
+		self->first_segment_written = 0;
+	}
+}
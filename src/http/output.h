@@ -0,0 +1,145 @@
+#pragma once
+
+#include "warble/buffer.h"
+#include "warble/error.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Most segments queued at once. Kept well below `IOV_MAX`, so that everything
+// pending fits in a single `writev`.
+#define HTTP_OUTPUT_MAX_SEGMENTS 64
+
+// Slices shorter than this are copied rather than borrowed; for a handful of
+// bytes, a copy is cheaper than another iovec entry.
+#define HTTP_OUTPUT_MIN_BORROW 1024
+
+// Most capacity `HttpOutput.bytes` keeps once everything's been written. A
+// bigger buffer was grown for one large copied response, and is freed rather
+// than held for as long as the connection stays open.
+#define HTTP_OUTPUT_MAX_RETAINED (128 * 1024)
+
+typedef enum HttpOutputSegmentKind {
+	// A range of `HttpOutput.bytes` starting at `offset`. An offset rather than
+	// a pointer, because `bytes` may move as it grows.
+	HTTP_OUTPUT_SEGMENT_COPIED = 0,
+
+	// `borrowed` bytes, owned by someone else.
+	HTTP_OUTPUT_SEGMENT_BORROWED,
+
+	// A range of the file `fd` starting at `offset`, sent with `sendfile`.
+	HTTP_OUTPUT_SEGMENT_FILE,
+
+	// No bytes; `release` is called once everything before it is written.
+	HTTP_OUTPUT_SEGMENT_RELEASE,
+} HttpOutputSegmentKind;
+
+// Lets go of whatever borrowed bytes or files were being kept alive for the
+// output.
+typedef void (*HttpOutputRelease)(void *data);
+
+typedef struct HttpOutputSegment {
+	HttpOutputSegmentKind kind;
+
+	const uint8_t *borrowed;
+	int fd;
+	size_t offset;
+
+	size_t len;
+
+	HttpOutputRelease release;
+	void *release_data;
+} HttpOutputSegment;
+
+// Bytes waiting to be written to a socket, as a list of segments that can be
+// handed to `writev` as-is. Small writes are copied into one growing buffer;
+// large ones can be borrowed, and are written straight from where they are.
+// Ranges of files can be queued too, and go out with `sendfile` without
+// passing through userspace.
+typedef struct HttpOutput {
+	Buffer bytes;
+
+	HttpOutputSegment segments[HTTP_OUTPUT_MAX_SEGMENTS];
+	size_t segments_count;
+
+	// Segments before this one have been written completely.
+	size_t first_segment;
+
+	// Bytes at the start of `segments[first_segment]` that have been written.
+	size_t first_segment_written;
+
+	// Total bytes that haven't been written yet.
+	size_t pending_len;
+
+	// Total bytes that have been written, since the output was initialized.
+	size_t consumed_len;
+
+	// Headers of the response that's currently being produced. Lives here so
+	// that its capacity is reused from one response to the next.
+	Buffer headers;
+
+	// Bytes of the current response's chunked body that are being held, to be
+	// sent as one chunk. Lives here for the same reason.
+	Buffer chunk;
+} HttpOutput;
+
+void http_output_init(HttpOutput *self);
+void http_output_deinit(HttpOutput *self);
+
+// Queue a copy of `bytes`.
+Error http_output_write(HttpOutput *self, Slice bytes);
+
+// Queue `bytes` without copying them. They must stay valid and unchanged until
+// they've been consumed. Short slices are copied anyway, and so is everything
+// once there are no more segments to spare.
+Error http_output_write_borrowed(HttpOutput *self, Slice bytes);
+
+// Queue `len` bytes of the file `fd`, starting at `offset`. The file isn't
+// read; `fd` must stay open until the range has been consumed.
+//
+// There must be room for it; see `http_output_segments_available`.
+void http_output_write_file(HttpOutput *self, int fd, size_t offset, size_t len);
+
+// Call `release(release_data)` once everything queued so far has been
+// consumed, or when `self` is deinitialized, whichever comes first. This is
+// how the owner of borrowed bytes or files learns that they're no longer in
+// use. If nothing is pending, `release` is called right away.
+//
+// Takes a segment; there must be room for it.
+void http_output_release_after(
+	HttpOutput *self,
+	HttpOutputRelease release,
+	void *release_data
+);
+
+// Number of segments that can still be queued without anything being copied.
+size_t http_output_segments_available(const HttpOutput *self);
+
+// Total bytes queued that haven't been consumed yet.
+size_t http_output_pending_len(const HttpOutput *self);
+
+// If the next pending bytes are a range of a file, return true and set
+// `*out_fd`, `*out_offset` and `*out_len` to the part of it that's left.
+bool http_output_pending_file(
+	const HttpOutput *self,
+	int *out_fd,
+	off_t *out_offset,
+	size_t *out_len
+);
+
+// Fill in up to `max_iovecs` entries of `iovecs` with the pending bytes, in
+// order, and return how many were filled in. Stops at the first file range,
+// so it may not cover everything that's pending.
+size_t http_output_pending_iovecs(
+	const HttpOutput *self,
+	struct iovec *iovecs,
+	size_t max_iovecs
+);
+
+// Mark the first `count` pending bytes as written. Once everything's been
+// written, the buffer is reused from the start, or freed if it's grown past
+// `HTTP_OUTPUT_MAX_RETAINED`.
+void http_output_consume(HttpOutput *self, size_t count);
@@ -1,216 +1,548 @@
 #include "http/parser.h"
 
 #include "http/request.h"
-#include "print.h"
+#include "http/scan.h"
 #include "util.h"
 
 #include "warble/util.h"
 
 #include <assert.h>
-#include <limits.h>
+#include <stddef.h>
 #include <stdint.h>
-#include <stdio.h>
 #include <string.h>
 
+static HttpParserLimits http_parser_limits = {
+	.max_request_line = HTTP_PARSER_DEFAULT_MAX_REQUEST_LINE,
+	.max_head = HTTP_PARSER_DEFAULT_MAX_HEAD,
+	.max_headers = HTTP_REQUEST_MAX_HEADERS,
+	.memory_budget = 0,
+};
+
+// The capacity of every parser's buffer, added up.
+static size_t http_parser_memory;
+
+void http_parser_set_limits(HttpParserLimits limits) {
+	if (limits.max_headers > HTTP_REQUEST_MAX_HEADERS) {
+		limits.max_headers = HTTP_REQUEST_MAX_HEADERS;
+	}
+
+	http_parser_limits = limits;
+}
+
+HttpParserLimits http_parser_get_limits(void) {
+	return http_parser_limits;
+}
+
+size_t http_parser_memory_used(void) {
+	return __atomic_load_n(&http_parser_memory, __ATOMIC_RELAXED);
+}
+
+// Bring the memory count up to date with the capacity of `self->buffer`.
+static void http_parser_account(HttpParser *self) {
+	size_t capacity = self->buffer.capacity;
+
+	if (capacity > self->accounted) {
+		__atomic_add_fetch(&http_parser_memory, capacity - self->accounted, __ATOMIC_RELAXED);
+	} else if (capacity < self->accounted) {
+		__atomic_sub_fetch(&http_parser_memory, self->accounted - capacity, __ATOMIC_RELAXED);
+	}
+
+	self->accounted = capacity;
+}
+
+// Make room for `len` more bytes in `self->buffer`, if the memory budget
+// allows it.
+static Error http_parser_grow(HttpParser *self, size_t len) {
+	if (self->buffer.capacity - self->buffer.len >= len) return ERR_SUCCESS;
+
+	size_t budget = http_parser_limits.memory_budget;
+	if (budget != 0 && http_parser_memory_used() + len > budget) return ERR_OUT_OF_MEMORY;
+
+	Error err = buffer_reserve_additional(&self->buffer, len);
+	if (err != ERR_SUCCESS) return err;
+
+	http_parser_account(self);
+
+	return ERR_SUCCESS;
+}
+
 void http_parser_init(HttpParser *self) {
 	set_undefined(self, sizeof(*self));
 
 	buffer_init(&self->buffer);
 
+	self->start = 0;
+	self->parsed = 0;
+
+	self->read_size = HTTP_PARSER_MIN_READ_SIZE;
+	self->reserved = 0;
+	self->accounted = 0;
+
+	self->state = HTTP_PARSER_METHOD;
+	self->headers_count = 0;
+	self->failure = HTTP_PARSER_MALFORMED;
+
 	self->done = false;
 }
 
 void http_parser_deinit(HttpParser *self) {
 	buffer_deinit(&self->buffer);
+	http_parser_account(self);
 }
 
-// Return the index of the first occurence of `byte` in `slice`, starting from `start`.
-// If there are no `byte` bytes in `slice`, instead return `-1`.
-static ssize_t find_char(Slice slice, uint8_t byte, size_t start) {
-	assert(start >= 0 && start <= slice.len);
-	uint8_t *ptr_to_character = (uint8_t*) memchr(slice.bytes + start, byte, slice.len - start);
-	if (ptr_to_character == NULL) return -1;
+void http_parser_reset(HttpParser *self) {
+	// A request that isn't done yet is thrown away, along with everything after
+	// it.
+	self->start = self->done ? self->start + self->parsed : self->buffer.len;
+	self->parsed = 0;
+
+	if (self->start == self->buffer.len) {
+		buffer_clear(&self->buffer);
+		self->start = 0;
+
+		// Don't let one big request or burst of them pin memory for as long as
+		// the connection lasts.
+		if (self->buffer.capacity > 2 * self->read_size) {
+			buffer_clear_capacity(&self->buffer);
+			http_parser_account(self);
+		}
+	}
 
-	size_t offset = ptr_to_character - slice.bytes;
-	assert(offset >= 0 && offset < SSIZE_MAX);
+	self->state = HTTP_PARSER_METHOD;
+	self->headers_count = 0;
+	self->failure = HTTP_PARSER_MALFORMED;
 
-	return offset;
+	self->done = false;
 }
 
-static void slice_split_at_index(Slice slice, size_t index, Slice *out_before, Slice *out_after) {
-	assert(index >= 0 && index < slice.len);
+Error http_parser_reserve(HttpParser *self, Slice *out_space) {
+	assert(!self->done);
+
+	// Handled requests are only moved out of the way once there's no room
+	// after them.
+	if (self->start > 0 && self->buffer.capacity - self->buffer.len < self->read_size) {
+		size_t len = self->buffer.len - self->start;
+		memmove(self->buffer.bytes, self->buffer.bytes + self->start, len);
+
+		self->buffer.len = len;
+		self->start = 0;
+	}
 
-	out_before->bytes = slice.bytes;
-	out_before->len = index;
+	Error err = http_parser_grow(self, self->read_size);
+	if (err != ERR_SUCCESS) return err;
 
-	out_after->bytes = slice.bytes + index;
-	out_after->len = slice.len - index;
+	*out_space = buffer_uninitialized(&self->buffer);
+	self->reserved = out_space->len;
+
+	return ERR_SUCCESS;
 }
 
-// Remove all occurences of `ch` from the start of `rest`.
-static void trim_start(Slice *rest, uint8_t ch) {
-	while (rest->len > 0 && rest->bytes[0] == ch) {
-		rest->bytes += 1;
-		rest->len -= 1;
+void http_parser_commit(HttpParser *self, size_t len) {
+	assert(len <= self->reserved);
+
+	self->buffer.len += len;
+
+	// There's probably more where that came from.
+	if (len == self->reserved && self->read_size < HTTP_PARSER_MAX_READ_SIZE) {
+		self->read_size *= 2;
 	}
+
+	self->reserved = 0;
 }
 
-// Remove exactly one space character from `rest`.
-// If `rest` does not start with a space, return false.
-static bool remove_space(Slice *rest) {
-	if (rest->len < 1) return false;
-	if (rest->bytes[0] != ' ') return false;
+Error http_parser_append(HttpParser *self, Slice bytes) {
+	Error err = http_parser_grow(self, bytes.len);
+	if (err != ERR_SUCCESS) return err;
 
-	*rest = slice_remove_start(*rest, 1);
+	buffer_concat_assume_capacity(&self->buffer, bytes);
 
-	return true;
+	return ERR_SUCCESS;
 }
 
-// Remove at least one space character from `rest`.
-// If `rest` does not start with a space, return false.
-static bool remove_many_spaces(Slice *rest) {
-	if (rest->len < 1) return false;
-	if (rest->bytes[0] != ' ') return false;
+size_t http_parser_unparsed_len(const HttpParser *self) {
+	return self->buffer.len - self->start - self->parsed;
+}
+
+size_t http_parser_skip(HttpParser *self, size_t len) {
+	assert(!self->done);
+	assert(self->parsed == 0);
+
+	size_t unparsed = http_parser_unparsed_len(self);
+	if (len > unparsed) len = unparsed;
+
+	self->start += len;
+
+	if (self->start == self->buffer.len) {
+		buffer_clear(&self->buffer);
+		self->start = 0;
+	}
 
-	trim_start(rest, ' ');
+	return len;
+}
 
-	return true;
+size_t http_parser_held_len(const HttpParser *self) {
+	return self->buffer.len - self->start;
 }
 
-// Remove exactly one carriage return and newline from `rest`.
-// If `rest` does not start with `\r\n`, return false.
-static bool remove_newline(Slice *rest) {
-	if (rest->len < 2) return false;
-	if (rest->bytes[0] != '\r' || rest->bytes[1] != '\n') return false;
+// Returns how many bytes from `index` on are in `class`.
+static size_t count_class(Slice bytes, size_t index, HttpByteClass class) {
+	size_t start = index;
+	while (index < bytes.len && (http_byte_classes[bytes.bytes[index]] & class)) {
+		index += 1;
+	}
 
-	*rest = slice_remove_start(*rest, 2);
+	return index - start;
+}
 
-	return true;
+static bool is_class(uint8_t byte, HttpByteClass class) {
+	return (http_byte_classes[byte] & class) != 0;
 }
 
-// Return a single field that starts from exactly `rest`, and ends *before* the
-// first byte that `allow_byte` returns `false` for.
-static Slice cut_field(
-	Slice *rest,
-	bool (*allow_byte)(uint8_t byte)
-) {
+// Run the state machine over `bytes`, which start `offset` bytes into the
+// request. Returns how many bytes it took; if that's short of `bytes.len`, the
+// request ended there, and `done` is set.
+static Error http_parser_advance(HttpParser *self, Slice bytes, size_t offset, size_t *out_taken) {
+	const HttpParserLimits *limits = &http_parser_limits;
+
 	size_t index = 0;
-	for (; index < rest->len; index++) {
-		if (allow_byte(rest->bytes[index])) {
-			continue;
-		}
 
-		break;
-	}
+	while (index < bytes.len) {
+		uint8_t byte = bytes.bytes[index];
+		size_t position = offset + index;
+
+		switch (self->state) {
+		// The method must be uppercase.
+		case HTTP_PARSER_METHOD:
+			if (is_class(byte, HTTP_BYTE_TOKEN)) {
+				index += count_class(bytes, index, HTTP_BYTE_TOKEN);
+			} else if (byte == ' ' && position > 0) {
+				self->method = (HttpParserRange) { 0, position };
+				self->state = HTTP_PARSER_AFTER_METHOD;
+				index += 1;
+			} else {
+				return ERR_PARSE_FAILED;
+			}
+			break;
 
-	Slice field;
-	slice_split_at_index(
-		// slice
-		*rest,
+		case HTTP_PARSER_AFTER_METHOD:
+			if (byte == ' ') {
+				index += 1;
+			} else if (is_class(byte, HTTP_BYTE_TARGET)) {
+				self->target.start = position;
+				self->state = HTTP_PARSER_TARGET;
+			} else {
+				return ERR_PARSE_FAILED;
+			}
+			break;
 
-		// index
-		index,
+		// An empty version is allowed, and understood as an HTTP/1.0
+		// Simple-Request.
+		case HTTP_PARSER_TARGET:
+			if (is_class(byte, HTTP_BYTE_TARGET)) {
+				index += count_class(bytes, index, HTTP_BYTE_TARGET);
+			} else if (byte == ' ' || byte == '\r') {
+				self->target.end = position;
+				self->version = (HttpParserRange) { position, position };
+				self->state = byte == ' ' ? HTTP_PARSER_AFTER_TARGET : HTTP_PARSER_REQUEST_LINE_LF;
+				index += 1;
+			} else {
+				return ERR_PARSE_FAILED;
+			}
+			break;
 
-		// before
-		&field,
+		case HTTP_PARSER_AFTER_TARGET:
+			if (byte == ' ') {
+				index += 1;
+			} else if (byte == '\r') {
+				self->version = (HttpParserRange) { position, position };
+				self->state = HTTP_PARSER_REQUEST_LINE_LF;
+				index += 1;
+			} else if (is_class(byte, HTTP_BYTE_VERSION)) {
+				self->version.start = position;
+				self->state = HTTP_PARSER_VERSION;
+			} else {
+				return ERR_PARSE_FAILED;
+			}
+			break;
 
-		// after
-		rest
-	);
+		// Allowing any token as a version is more lenient than spec. Anything
+		// after the version, even whitespace, is not.
+		case HTTP_PARSER_VERSION:
+			if (is_class(byte, HTTP_BYTE_VERSION)) {
+				index += count_class(bytes, index, HTTP_BYTE_VERSION);
+			} else if (byte == '\r') {
+				self->version.end = position;
+				self->state = HTTP_PARSER_REQUEST_LINE_LF;
+				index += 1;
+			} else {
+				return ERR_PARSE_FAILED;
+			}
+			break;
 
-	return field;
-}
+		// Bare newlines aren't allowed anywhere.
+		case HTTP_PARSER_REQUEST_LINE_LF:
+		case HTTP_PARSER_HEADER_LF:
+			if (byte != '\n') return ERR_PARSE_FAILED;
 
-static bool is_token_byte(uint8_t byte) {
-	// `token`, from https://datatracker.ietf.org/doc/html/rfc9110#appendix-A-2
-	switch (byte) {
-	case '!':
-	case '#':
-	case '$':
-	case '%':
-	case '&':
-	case '\'':
-	case '*':
-	case '+':
-	case '-':
-	case '.':
-	case '^':
-	case '_':
-	case '`':
-	case '|':
-	case '~':
-		return true;
-	}
+			if (self->state == HTTP_PARSER_HEADER_LF) self->headers_count += 1;
+			self->state = HTTP_PARSER_LINE_START;
+			index += 1;
+			break;
 
-	if (byte >= '0' && byte <= '9') {
-		return true;
-	}
+		// Whitespace before a name (obsolete line folding, among others) isn't
+		// a token byte, so it's rejected here.
+		case HTTP_PARSER_LINE_START:
+			if (byte == '\r') {
+				self->state = HTTP_PARSER_END_LF;
+				index += 1;
+			} else if (is_class(byte, HTTP_BYTE_TOKEN)) {
+				if (self->headers_count == limits->max_headers) {
+					self->failure = HTTP_PARSER_HEADERS_TOO_LARGE;
+					return ERR_PARSE_FAILED;
+				}
+
+				self->headers[self->headers_count].name.start = position;
+				self->state = HTTP_PARSER_NAME;
+			} else {
+				return ERR_PARSE_FAILED;
+			}
+			break;
 
-	if (
-		(byte >= 'a' && byte <= 'z') ||
-		(byte >= 'A' && byte <= 'Z')
-	) {
-		return true;
+		case HTTP_PARSER_NAME:
+			if (is_class(byte, HTTP_BYTE_TOKEN)) {
+				index += count_class(bytes, index, HTTP_BYTE_TOKEN);
+			} else if (byte == ':') {
+				self->headers[self->headers_count].name.end = position;
+				self->state = HTTP_PARSER_BEFORE_VALUE;
+				index += 1;
+			} else {
+				return ERR_PARSE_FAILED;
+			}
+			break;
+
+		case HTTP_PARSER_BEFORE_VALUE:
+			if (byte == ' ' || byte == '\t') {
+				index += 1;
+			} else if (byte == '\r') {
+				self->headers[self->headers_count].value = (HttpParserRange) { position, position };
+				self->state = HTTP_PARSER_HEADER_LF;
+				index += 1;
+			} else if (is_class(byte, HTTP_BYTE_FIELD_VALUE)) {
+				self->headers[self->headers_count].value = (HttpParserRange) { position, position };
+				self->state = HTTP_PARSER_VALUE;
+			} else {
+				return ERR_PARSE_FAILED;
+			}
+			break;
+
+		// Values make up most of a request, so they're scanned a block at a
+		// time. Whitespace at the end isn't part of the value.
+		case HTTP_PARSER_VALUE: {
+			size_t len = http_scan_field_value(slice_remove_start(bytes, index));
+
+			size_t last = index + len;
+			while (last > index && (bytes.bytes[last - 1] == ' ' || bytes.bytes[last - 1] == '\t')) {
+				last -= 1;
+			}
+			if (last > index) self->headers[self->headers_count].value.end = offset + last;
+
+			index += len;
+			if (index == bytes.len) break;
+
+			if (bytes.bytes[index] != '\r') return ERR_PARSE_FAILED;
+
+			self->state = HTTP_PARSER_HEADER_LF;
+			index += 1;
+			break;
+		}
+
+		case HTTP_PARSER_END_LF:
+			if (byte != '\n') return ERR_PARSE_FAILED;
+
+			self->done = true;
+			*out_taken = index + 1;
+			return ERR_SUCCESS;
+		}
+
+		// Checked once per step rather than once per byte, so a limit may be
+		// passed by the length of a run before it's noticed.
+		size_t len = offset + index;
+		if (self->state < HTTP_PARSER_LINE_START && len > limits->max_request_line) {
+			self->failure = HTTP_PARSER_REQUEST_LINE_TOO_LONG;
+			return ERR_PARSE_FAILED;
+		}
+		if (len > limits->max_head) {
+			self->failure = HTTP_PARSER_HEADERS_TOO_LARGE;
+			return ERR_PARSE_FAILED;
+		}
 	}
 
-	return false;
+	*out_taken = index;
+
+	return ERR_SUCCESS;
 }
 
-static bool is_target_byte(uint8_t byte) {
-	if (byte == '\r' || byte == '\n') return false;
-	if (byte == ' ' || byte == '\t') return false;
+// Header fields that get a field of their own in `HttpRequest`, as bits of a
+// set.
+typedef enum HttpKnownHeader {
+	HTTP_KNOWN_HEADER_HOST = 1 << 0,
+	HTTP_KNOWN_HEADER_CONNECTION = 1 << 1,
+	HTTP_KNOWN_HEADER_ACCEPT_ENCODING = 1 << 2,
+	HTTP_KNOWN_HEADER_IF_NONE_MATCH = 1 << 3,
+	HTTP_KNOWN_HEADER_RANGE = 1 << 4,
+	HTTP_KNOWN_HEADER_CONTENT_LENGTH = 1 << 5,
+	HTTP_KNOWN_HEADER_IF_MODIFIED_SINCE = 1 << 6,
+	HTTP_KNOWN_HEADER_TRANSFER_ENCODING = 1 << 7,
+	HTTP_KNOWN_HEADER_IF_RANGE = 1 << 8,
+} HttpKnownHeader;
+
+// Header fields that mustn't be sent more than once.
+#define HTTP_KNOWN_HEADERS_SINGLETON ( \
+	HTTP_KNOWN_HEADER_HOST | \
+	HTTP_KNOWN_HEADER_RANGE | \
+	HTTP_KNOWN_HEADER_CONTENT_LENGTH \
+)
+
+// If `name` is one of the header fields that `HttpRequest` has a field for,
+// store `value` there. Only `If-Modified-Since` and `Transfer-Encoding` have
+// names of the same length, and those start differently, so this only ever
+// compares one name. `seen` is the set of those already found.
+static Error parse_known_header(HttpRequest *request, Slice name, Slice value, unsigned *seen) {
+	Slice *slot;
+	const char *known_name;
+	HttpKnownHeader known;
+
+	switch (name.len) {
+	case 4:
+		slot = &request->host;
+		known_name = "Host";
+		known = HTTP_KNOWN_HEADER_HOST;
+		break;
+	case 5:
+		slot = &request->range;
+		known_name = "Range";
+		known = HTTP_KNOWN_HEADER_RANGE;
+		break;
+	case 8:
+		slot = &request->if_range;
+		known_name = "If-Range";
+		known = HTTP_KNOWN_HEADER_IF_RANGE;
+		break;
+	case 10:
+		slot = &request->connection;
+		known_name = "Connection";
+		known = HTTP_KNOWN_HEADER_CONNECTION;
+		break;
+	case 13:
+		slot = &request->if_none_match;
+		known_name = "If-None-Match";
+		known = HTTP_KNOWN_HEADER_IF_NONE_MATCH;
+		break;
+	case 14:
+		slot = &request->content_length;
+		known_name = "Content-Length";
+		known = HTTP_KNOWN_HEADER_CONTENT_LENGTH;
+		break;
+	case 15:
+		slot = &request->accept_encoding;
+		known_name = "Accept-Encoding";
+		known = HTTP_KNOWN_HEADER_ACCEPT_ENCODING;
+		break;
+	case 17:
+		if ((name.bytes[0] | 0x20) == 't') {
+			slot = &request->transfer_encoding;
+			known_name = "Transfer-Encoding";
+			known = HTTP_KNOWN_HEADER_TRANSFER_ENCODING;
+			break;
+		}
+
+		slot = &request->if_modified_since;
+		known_name = "If-Modified-Since";
+		known = HTTP_KNOWN_HEADER_IF_MODIFIED_SINCE;
+		break;
+	default:
+		return ERR_SUCCESS;
+	}
 
-	// Exclude all control characters.
-	if (byte < ' ') return false;
+	if (!slice_equal_ignore_case(name, slice_from_cstr(known_name))) return ERR_SUCCESS;
 
-	return true;
+	if (*seen & known) {
+		// Two different `Content-Length`s are how requests get smuggled past
+		// proxies.
+		if (known & HTTP_KNOWN_HEADERS_SINGLETON) return ERR_PARSE_FAILED;
+
+		return ERR_SUCCESS;
+	}
+
+	*seen |= known;
+	*slot = value;
+
+	return ERR_SUCCESS;
 }
 
-static bool is_version_byte(uint8_t byte) {
-	return is_token_byte(byte) || byte == '/' || byte == '.';
+static Slice range_slice(Slice request, HttpParserRange range) {
+	return slice_from_len(request.bytes + range.start, range.end - range.start);
 }
 
-// Returns `0` if the parse was successful or `-1` otherwise.
-// Only takes ownership of `buffer` if the parse was successful.
-static Error parse_headers(
-	Buffer buffer,
-	HttpRequest *request
-) {
-	// Make sure it's very loud if we forget to set any field.
-	set_undefined(request, sizeof(*request));
+// Fill in `request`, whose bytes are `bytes`, from what the parser found.
+static Error http_parser_finish(HttpParser *self, Slice bytes, HttpRequest *request) {
+	// Make sure it's very loud if we forget to set any field. Entries of
+	// `headers` past `headers_count` aren't meant to be set, and poisoning all
+	// of them would cost more than the rest of the parse.
+	set_undefined(request, offsetof(HttpRequest, headers));
+
+	request->method = range_slice(bytes, self->method);
+	request->target = range_slice(bytes, self->target);
+	request->version = range_slice(bytes, self->version);
 
-	request->buffer = buffer;
-	Slice bytes = buffer_slice(&buffer);
+	request->headers_count = self->headers_count;
 
-	// The method must be uppercase.
-	Slice method = cut_field(&bytes, is_token_byte);
-	if (method.len == 0) return ERR_PARSE_FAILED;
-	if (!remove_many_spaces(&bytes)) return ERR_PARSE_FAILED;
+	request->host = slice_new();
+	request->connection = slice_new();
+	request->accept_encoding = slice_new();
+	request->if_none_match = slice_new();
+	request->if_modified_since = slice_new();
+	request->if_range = slice_new();
+	request->range = slice_new();
+	request->content_length = slice_new();
+	request->transfer_encoding = slice_new();
 
-	Slice target = cut_field(&bytes, is_target_byte);
-	if (target.len == 0) return ERR_PARSE_FAILED;
+	unsigned seen = 0;
 
-	// Allowing any token as a version is more lenient than spec.
-	// An empty version is allowed, and understood as an HTTP/1.0 Simple-Request.
-	Slice version = slice_new();
-	if (remove_space(&bytes)) {
-		remove_many_spaces(&bytes);
+	for (size_t i = 0; i < self->headers_count; i++) {
+		Slice name = range_slice(bytes, self->headers[i].name);
+		Slice value = range_slice(bytes, self->headers[i].value);
 
-		version = cut_field(&bytes, is_version_byte);
+		request->headers[i] = (HttpHeader) { .name = name, .value = value };
+
+		Error err = parse_known_header(request, name, value, &seen);
+		if (err != ERR_SUCCESS) return err;
 	}
 
-	// `cut_field` removes trailing whitespace; if `bytes` doesn't start with a
-	// newline, that means there are more fields than method, path, and version;
-	// and the request is malformed.
-	if (!remove_newline(&bytes)) {
+	// Whatever body the request has is skipped to get to the next one, so where
+	// it ends has to be known exactly; otherwise its bytes would be taken for
+	// another request. A chunked body would have to be decoded for that, and
+	// nothing reads bodies.
+	if (seen & HTTP_KNOWN_HEADER_TRANSFER_ENCODING) {
+		self->failure = HTTP_PARSER_TRANSFER_ENCODING;
 		return ERR_PARSE_FAILED;
 	}
 
-	request->buffer = buffer;
+	request->body_len = 0;
+
+	if (seen & HTTP_KNOWN_HEADER_CONTENT_LENGTH) {
+		Slice digits = request->content_length;
+		if (digits.len == 0) return ERR_PARSE_FAILED;
+
+		for (size_t i = 0; i < digits.len; i++) {
+			if (digits.bytes[i] < '0' || digits.bytes[i] > '9') return ERR_PARSE_FAILED;
 
-	request->method = method;
-	request->target = target;
-	request->version = version;
+			size_t digit = digits.bytes[i] - '0';
+			if (request->body_len > (SIZE_MAX - digit) / 10) return ERR_PARSE_FAILED;
+
+			request->body_len = request->body_len * 10 + digit;
+		}
+	}
 
 	return ERR_SUCCESS;
 }
@@ -221,97 +553,81 @@ Error http_parser_poll(
 	HttpParserPollResult *out_result
 ) {
 	assert(!self->done);
+	assert(http_parser_unparsed_len(self) == 0);
 
-	// We do nothing until we find two newlines in a row, and parse the header then.
 	out_result->done = false;
 
 	// We successfully parsed zero bytes.
 	if (bytes.len == 0) return ERR_SUCCESS;
 
-	size_t index = self->buffer.len;
+	// Bytes from earlier polls come first.
+	size_t offset = self->parsed;
 
-	// self->buffer may already end in `\r\n\r`, so we may have to look two
-	// characters back for the newline.
-	if (index > 2) {
-		index -= 2;
-	} else {
-		index = 0;
-	}
+	size_t taken;
+	Error err = http_parser_advance(self, bytes, offset, &taken);
+	if (err != ERR_SUCCESS) return err;
 
-	buffer_concat(&self->buffer, bytes);
+	if (!self->done) {
+		// `bytes` are only valid until we return, and the request will need
+		// them.
+		err = http_parser_append(self, bytes);
+		if (err != ERR_SUCCESS) return err;
 
-	ssize_t prev_newline = -1;
+		self->parsed += bytes.len;
+		return ERR_SUCCESS;
+	}
 
-	Slice all_bytes = buffer_slice(&self->buffer);
+	Slice request_bytes = slice_from_len(bytes.bytes, taken);
+	if (offset > 0) {
+		err = http_parser_append(self, request_bytes);
+		if (err != ERR_SUCCESS) return err;
 
-	while (true) {
-		ssize_t next_newline = find_char(all_bytes, '\n', index);
-		if (next_newline < 0) break;
+		self->parsed += taken;
+		request_bytes = slice_from_len(self->buffer.bytes + self->start, self->parsed);
+	}
 
-		// Start looking for the next newline after this '\n' character.
-		index = next_newline + 1;
+	out_result->done = true;
+	out_result->remainder_slice = slice_remove_start(bytes, taken);
 
-		if (prev_newline < 0) {
-			prev_newline = next_newline;
-			continue;
-		}
+	return http_parser_finish(self, request_bytes, &out_result->request);
+}
 
-		// There are two cases where we'd want to stop:
-		// 1) `next_newline` immediately follows `prev_newline`
-		// 2) `next_newline` is two characters away from `prev_newline` and there's
-		//    a carriage return between them.
-		//
-		// Line endings will be enforced later. Let's be lenient for now, so there's only
-		// one place to change that later.
+Error http_parser_poll_buffered(HttpParser *self, HttpParserPollResult *out_result) {
+	assert(!self->done);
 
-		// `prev_newline + 1` must be in-bounds, because we advance one character every time,
-		// and we found an index for `next_newline`.
-		if ((prev_newline + 1 == next_newline) || (
-			prev_newline + 2 == next_newline &&
-			self->buffer.bytes[prev_newline + 1] == '\r'
-	    )) {
-			// Truncate the buffer to include the character at `next_newline`.
-			size_t new_buffer_end = next_newline + 1;
+	out_result->done = false;
 
-			size_t removed_bytes = self->buffer.len - new_buffer_end;
+	Slice unparsed = slice_from_len(
+		self->buffer.bytes + self->start + self->parsed,
+		http_parser_unparsed_len(self)
+	);
+	if (unparsed.len == 0) return ERR_SUCCESS;
 
-			self->buffer.len = new_buffer_end;
+	size_t taken;
+	Error err = http_parser_advance(self, unparsed, self->parsed, &taken);
+	if (err != ERR_SUCCESS) return err;
 
-			out_result->remainder_slice = slice_keep_bytes_from_end(all_bytes, removed_bytes);
+	self->parsed += taken;
 
-			// We'll fill in `out_result->request` later.
-			self->done = true;
-			break;
-		}
+	if (!self->done) return ERR_SUCCESS;
 
-		prev_newline = next_newline;
-	}
-
-	if (!self->done) {
-		out_result->done = false;
-		return ERR_SUCCESS;
+	// This request arrived in a read of its own, and the next is likely to be
+	// about as big; don't keep asking for far more than that.
+	bool whole_read = self->start == 0 && taken == unparsed.len && self->parsed == unparsed.len;
+	if (
+		whole_read &&
+		self->parsed * 4 <= self->read_size &&
+		self->read_size > HTTP_PARSER_MIN_READ_SIZE
+	) {
+		self->read_size /= 2;
 	}
 
-	// `out_result->remainder_slice` has already been initialized above, in the only
-	// place that `self->done` is set to true.
 	out_result->done = true;
+	out_result->remainder_slice = slice_remove_start(unparsed, taken);
 
-	// Move `buffer` out of `self`.
-	Buffer buffer = self->buffer;
-
-	// Set `self->buffer` to a newly created buffer that can be freed without
-	// consequence in `http_parser_deinit`.
-	buffer_init(&self->buffer);
-
-	// All the actual parsing is in here.
-	Error err = parse_headers(buffer, &out_result->request);
-	if (err != 0) {
-		// `result->request` won't be accessible because we're returning an error. Don't
-		// let it leak.
-		buffer_deinit(&buffer);
-
-		return ERR_PARSE_FAILED;
-	}
-
-	return ERR_SUCCESS;
+	return http_parser_finish(
+		self,
+		slice_from_len(self->buffer.bytes + self->start, self->parsed),
+		&out_result->request
+	);
 }
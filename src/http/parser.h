@@ -3,9 +3,112 @@
 #include "http/request.h"
 #include "warble/buffer.h"
 
+// Bounds on how much space `http_parser_reserve` hands out for a read. Most
+// requests from browsers fit in the smallest, cookies and all.
+#define HTTP_PARSER_MIN_READ_SIZE 2048
+#define HTTP_PARSER_MAX_READ_SIZE (64 * 1024)
+
+// What every parser will accept. A parser holds at most `max_head` bytes of a
+// request, plus one read, so these also bound how much memory a connection
+// takes.
+typedef struct HttpParserLimits {
+	// Longest request line, in bytes.
+	size_t max_request_line;
+
+	// Longest head: the request line and every header field, up to and
+	// including the empty line that ends them.
+	size_t max_head;
+
+	// Most header fields. Can't be more than `HTTP_REQUEST_MAX_HEADERS`.
+	size_t max_headers;
+
+	// Most bytes all parsers together may hold in their buffers. Growing a
+	// buffer past it fails with `ERR_OUT_OF_MEMORY`. Zero means no limit.
+	size_t memory_budget;
+} HttpParserLimits;
+
+#define HTTP_PARSER_DEFAULT_MAX_REQUEST_LINE (8 * 1024)
+#define HTTP_PARSER_DEFAULT_MAX_HEAD (16 * 1024)
+
+// Why a parse failed, so that the client can be told.
+typedef enum HttpParserFailure {
+	// Not a well-formed request: 400 Bad Request.
+	HTTP_PARSER_MALFORMED = 0,
+
+	// Past `max_request_line`: 414 URI Too Long.
+	HTTP_PARSER_REQUEST_LINE_TOO_LONG,
+
+	// Past `max_head` or `max_headers`: 431 Request Header Fields Too Large.
+	HTTP_PARSER_HEADERS_TOO_LARGE,
+
+	// A body sent with `Transfer-Encoding`: 501 Not Implemented.
+	HTTP_PARSER_TRANSFER_ENCODING,
+} HttpParserFailure;
+
+// Where the parser is in a request's head. Each state is named after what it
+// expects next.
+typedef enum HttpParserState {
+	HTTP_PARSER_METHOD = 0,
+	HTTP_PARSER_AFTER_METHOD,
+	HTTP_PARSER_TARGET,
+	HTTP_PARSER_AFTER_TARGET,
+	HTTP_PARSER_VERSION,
+	HTTP_PARSER_REQUEST_LINE_LF,
+	HTTP_PARSER_LINE_START,
+	HTTP_PARSER_NAME,
+	HTTP_PARSER_BEFORE_VALUE,
+	HTTP_PARSER_VALUE,
+	HTTP_PARSER_HEADER_LF,
+	HTTP_PARSER_END_LF,
+} HttpParserState;
+
+// A part of the request, by offset from its first byte, so that it can be
+// found whether the request ends up in the parser's buffer or not.
+typedef struct HttpParserRange {
+	size_t start;
+	size_t end;
+} HttpParserRange;
+
+typedef struct HttpParserHeader {
+	HttpParserRange name;
+	HttpParserRange value;
+} HttpParserHeader;
+
 typedef struct HttpParser {
+	// The part of the request that arrived in earlier polls, and anything read
+	// into the parser that hasn't been parsed yet. Kept from one request to the
+	// next, so that its capacity is reused. A request given to `poll` all at
+	// once is never copied in here.
 	Buffer buffer;
 
+	// The current request starts `start` bytes into `buffer`; bytes before that
+	// belonged to requests that have been handled. The first `parsed` bytes
+	// from there have been through the state machine.
+	size_t start;
+	size_t parsed;
+
+	// How much `http_parser_reserve` asks for. Doubles when a read fills all of
+	// it, and halves when a request that arrived in one read needed far less.
+	size_t read_size;
+	size_t reserved;
+
+	// The part of the capacity of `buffer` that's been counted against the
+	// memory budget.
+	size_t accounted;
+
+	// Carried between polls, so that no byte is looked at twice.
+	HttpParserState state;
+
+	HttpParserRange method;
+	HttpParserRange target;
+	HttpParserRange version;
+
+	HttpParserHeader headers[HTTP_REQUEST_MAX_HEADERS];
+	size_t headers_count;
+
+	// Set when `poll` returns `ERR_PARSE_FAILED`.
+	HttpParserFailure failure;
+
 	// Set when this parser has completed parsing, and returned a result with `done`
 	// set to true. Only use for lifecycle validation!
 	bool done;
@@ -14,18 +117,70 @@ typedef struct HttpParser {
 typedef struct HttpParserPollResult {
 	bool done;
 
-	// Only defined when `done` is `true`.
+	// Only defined when `done` is `true`. The bytes after the end of this
+	// request, pointing into the `bytes` passed to the poll that completed it.
 	Slice remainder_slice;
 	HttpRequest request;
 } HttpParserPollResult;
 
+// Limits every parser enforces from now on, shared by all threads. Set them
+// before any request is parsed.
+void http_parser_set_limits(HttpParserLimits limits);
+HttpParserLimits http_parser_get_limits(void);
+
+// Bytes all parsers together are holding in their buffers right now.
+size_t http_parser_memory_used(void);
+
 void http_parser_init(HttpParser *self);
 void http_parser_deinit(HttpParser *self);
 
-// If parsing fails, `poll` will return `ERR_PARSE_FAILED`.
+// Get ready to parse another request, invalidating the previous one. Bytes
+// after the previous request that haven't been parsed yet are kept, as is
+// memory.
+void http_parser_reset(HttpParser *self);
+
+// Returns space at the end of the parser's buffer, for a read straight into
+// it; see `http_parser_commit`. May move bytes the parser holds, so it can't be
+// called while a request is done and not yet reset. Fails with
+// `ERR_OUT_OF_MEMORY` if the memory budget is used up.
+Error http_parser_reserve(HttpParser *self, Slice *out_space);
+
+// Take the first `len` bytes of the space returned by `http_parser_reserve`,
+// to be parsed by `http_parser_poll_buffered`.
+void http_parser_commit(HttpParser *self, size_t len);
+
+// Take a copy of `bytes`, to be parsed by `http_parser_poll_buffered`.
+Error http_parser_append(HttpParser *self, Slice bytes);
+
+// Number of bytes the parser holds that haven't been parsed yet.
+size_t http_parser_unparsed_len(const HttpParser *self);
+
+// Throw away up to `len` of the bytes the parser holds that haven't been parsed
+// yet, as though they never arrived, and return how many were. Only between
+// requests, right after a reset.
+size_t http_parser_skip(HttpParser *self, size_t len);
+
+// Number of bytes the parser holds of the current request and anything after
+// it, parsed or not.
+size_t http_parser_held_len(const HttpParser *self);
+
+// Bytes are validated as they arrive, and only bytes up to the end of the
+// request are taken. If the request arrives in a single poll, it points into
+// `bytes`; otherwise, it's copied into the parser.
+//
+// If parsing fails, `poll` will return `ERR_PARSE_FAILED`, as soon as the first
+// byte that doesn't belong is seen, or a limit is passed; `failure` says why.
+// If the parser would need more memory than the budget allows, it returns
+// `ERR_OUT_OF_MEMORY`.
+//
+// Must not be called while the parser holds unparsed bytes.
 Error http_parser_poll(
 	HttpParser *self,
 	Slice bytes,
 	HttpParserPollResult *out_result
 );
 
+// Like `http_parser_poll`, but parses the bytes the parser holds. The request
+// points into the parser's buffer, as does `remainder_slice`, which stays there
+// to be parsed after a reset.
+Error http_parser_poll_buffered(HttpParser *self, HttpParserPollResult *out_result);
@@ -1,8 +1,206 @@
 #include "http/request.h"
 
+#include "util.h"
+
 #include "warble/util.h"
 
+#include <stdint.h>
+#include <string.h>
+
 void http_request_deinit(HttpRequest *self) {
-	buffer_deinit(&self->buffer);
 	set_undefined(self, sizeof(*self));
 }
+
+Slice http_request_header(const HttpRequest *self, Slice name) {
+	for (size_t i = 0; i < self->headers_count; i++) {
+		if (slice_equal_ignore_case(self->headers[i].name, name)) return self->headers[i].value;
+	}
+
+	return slice_new();
+}
+
+Slice http_request_path(const HttpRequest *self) {
+	Slice path = self->target;
+
+	const uint8_t *query = path.len > 0 ? memchr(path.bytes, '?', path.len) : NULL;
+	if (query != NULL) path.len = query - path.bytes;
+
+	return path;
+}
+
+bool http_request_is_http_1_0(const HttpRequest *self) {
+	return slice_equal(self->version, slice_from_cstr("HTTP/1.0"));
+}
+
+bool http_request_accepts_encoding(const HttpRequest *self, Slice coding) {
+	return list_accepts_token(self->accept_encoding, coding);
+}
+
+bool http_request_not_modified(const HttpRequest *self, Slice etag, int64_t modified) {
+	bool get = slice_equal(self->method, slice_from_cstr("GET"));
+	bool head = slice_equal(self->method, slice_from_cstr("HEAD"));
+	if (!get && !head) return false;
+
+	if (self->if_none_match.len > 0) return list_matches_etag(self->if_none_match, etag);
+
+	int64_t since;
+	if (self->if_modified_since.len > 0 && parse_http_date(self->if_modified_since, &since)) {
+		return modified <= since;
+	}
+
+	return false;
+}
+
+// Returns true if `If-Range` allows ranges of the representation with ETag
+// `etag`, last modified at `modified`, to be sent. An ETag has to match
+// exactly, and a weak one never does; a date has to be the modification time.
+static bool if_range_matches(Slice if_range, Slice etag, int64_t modified) {
+	if (if_range.len == 0) return true;
+
+	if (if_range.bytes[0] == '"') return slice_equal(if_range, etag);
+	if (if_range.bytes[0] == 'W') return false;
+
+	int64_t date;
+	return parse_http_date(if_range, &date) && date == modified;
+}
+
+// Parse a decimal number at the start of `*bytes`, taking it off. Returns false
+// if there isn't one, or it doesn't fit.
+static bool take_size(Slice *bytes, size_t *out_value) {
+	size_t index = 0;
+	size_t value = 0;
+
+	while (index < bytes->len && bytes->bytes[index] >= '0' && bytes->bytes[index] <= '9') {
+		size_t digit = bytes->bytes[index] - '0';
+		if (value > (SIZE_MAX - digit) / 10) return false;
+
+		value = value * 10 + digit;
+		index += 1;
+	}
+
+	if (index == 0) return false;
+
+	*bytes = slice_remove_start(*bytes, index);
+	*out_value = value;
+
+	return true;
+}
+
+// Add `range` to the `*count` ranges in `ranges`, which are sorted and don't
+// overlap or touch, keeping them that way. Returns false if there's no room.
+static bool add_range(HttpByteRange *ranges, size_t *count, HttpByteRange range) {
+	size_t start = range.offset;
+	size_t end = range.offset + range.len;
+
+	// Ranges before this one, and ranges after it, are kept; the ones in
+	// between are merged into it.
+	size_t before = 0;
+	while (before < *count && ranges[before].offset + ranges[before].len < start) before += 1;
+
+	size_t after = before;
+	while (after < *count && ranges[after].offset <= end) {
+		if (ranges[after].offset < start) start = ranges[after].offset;
+		if (ranges[after].offset + ranges[after].len > end) end = ranges[after].offset + ranges[after].len;
+
+		after += 1;
+	}
+
+	size_t new_count = *count - (after - before) + 1;
+	if (new_count > HTTP_REQUEST_MAX_RANGES) return false;
+
+	memmove(&ranges[before + 1], &ranges[after], (*count - after) * sizeof(*ranges));
+	ranges[before] = (HttpByteRange) { .offset = start, .len = end - start };
+	*count = new_count;
+
+	return true;
+}
+
+// See https://datatracker.ietf.org/doc/html/rfc9110#section-14.1.
+HttpRanges http_request_ranges(
+	const HttpRequest *self,
+	size_t size,
+	Slice etag,
+	int64_t modified,
+	HttpByteRange *out_ranges,
+	size_t *out_count
+) {
+	*out_count = 0;
+
+	if (self->range.len == 0 || size == 0) return HTTP_RANGES_NONE;
+	if (!slice_equal(self->method, slice_from_cstr("GET"))) return HTTP_RANGES_NONE;
+	if (!if_range_matches(self->if_range, etag, modified)) return HTTP_RANGES_NONE;
+
+	Slice unit = slice_from_cstr("bytes=");
+	if (self->range.len < unit.len) return HTTP_RANGES_NONE;
+	if (!slice_equal_ignore_case(slice_from_len(self->range.bytes, unit.len), unit)) return HTTP_RANGES_NONE;
+
+	Slice list = slice_remove_start(self->range, unit.len);
+
+	bool any = false;
+	while (list.len > 0) {
+		// Skip separators, and any whitespace around them.
+		uint8_t byte = list.bytes[0];
+		if (byte == ',' || byte == ' ' || byte == '\t') {
+			list = slice_remove_start(list, 1);
+			continue;
+		}
+
+		size_t first, last;
+		if (byte == '-') {
+			list = slice_remove_start(list, 1);
+
+			size_t suffix_len;
+			if (!take_size(&list, &suffix_len)) return HTTP_RANGES_NONE;
+
+			// The last `suffix_len` bytes, or all of them. None at all can't
+			// be satisfied.
+			first = suffix_len == 0 ? size : size - (suffix_len < size ? suffix_len : size);
+			last = size - 1;
+		} else {
+			if (!take_size(&list, &first)) return HTTP_RANGES_NONE;
+			if (list.len == 0 || list.bytes[0] != '-') return HTTP_RANGES_NONE;
+			list = slice_remove_start(list, 1);
+
+			last = SIZE_MAX;
+			if (list.len > 0 && list.bytes[0] >= '0' && list.bytes[0] <= '9') {
+				if (!take_size(&list, &last) || last < first) return HTTP_RANGES_NONE;
+			}
+		}
+
+		// Anything else has to be a separator.
+		if (list.len > 0 && list.bytes[0] != ',' && list.bytes[0] != ' ' && list.bytes[0] != '\t') {
+			return HTTP_RANGES_NONE;
+		}
+
+		any = true;
+
+		// Ranges past the end are dropped; ranges that go past it are cut
+		// short.
+		if (first >= size) continue;
+		if (last >= size) last = size - 1;
+
+		HttpByteRange range = { .offset = first, .len = last - first + 1 };
+		if (!add_range(out_ranges, out_count, range)) {
+			*out_count = 0;
+			return HTTP_RANGES_NONE;
+		}
+	}
+
+	if (!any) return HTTP_RANGES_NONE;
+	if (*out_count == 0) return HTTP_RANGES_NOT_SATISFIABLE;
+
+	return HTTP_RANGES_SATISFIABLE;
+}
+
+bool http_request_keep_alive(const HttpRequest *self) {
+	if (slice_equal(self->version, slice_from_cstr("HTTP/1.1"))) {
+		return !list_contains_token(self->connection, slice_from_cstr("close"));
+	}
+
+	if (http_request_is_http_1_0(self)) {
+		return list_contains_token(self->connection, slice_from_cstr("keep-alive"));
+	}
+
+	// HTTP/0.9, or something we don't understand.
+	return false;
+}
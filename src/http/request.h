@@ -2,18 +2,117 @@
 
 #include "warble/buffer.h"
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
-typedef struct HttpRequest {
-	// All slices point into ranges of this buffer.
-	// At the moment, this is simply the entire HTTP request, but this may change later.
-	Buffer buffer;
+// Requests with more header fields than this are rejected.
+#define HTTP_REQUEST_MAX_HEADERS 64
+
+// Most ranges a `Range` header may ask for, once overlapping ones are merged.
+// Asking for more gets the whole representation instead.
+#define HTTP_REQUEST_MAX_RANGES 8
+
+typedef struct HttpHeader {
+	Slice name;
+	Slice value;
+} HttpHeader;
 
+// All slices point into the bytes given to the `HttpParser` that produced the
+// request, or into its buffer, and are only valid until that parser is reset
+// or deinitialized, or those bytes go away, whichever comes first.
+typedef struct HttpRequest {
 	Slice method;
 	Slice target;
 	Slice version;
+
+	// Every header field, in the order they were sent.
+	HttpHeader headers[HTTP_REQUEST_MAX_HEADERS];
+	size_t headers_count;
+
+	// The values of the header fields the server acts on, picked out while
+	// parsing. Each is an empty slice if the request didn't have that field.
+	// Requests with more than one `Host`, `Content-Length` or `Range`, or with
+	// any `Transfer-Encoding`, are rejected; of the others, the first is kept.
+	Slice host;
+	Slice connection;
+	Slice accept_encoding;
+	Slice if_none_match;
+	Slice if_modified_since;
+	Slice if_range;
+	Slice range;
+	Slice content_length;
+	Slice transfer_encoding;
+
+	// Length of the body that follows the head, from `Content-Length`. The
+	// connection skips it before reading the next request.
+	size_t body_len;
 } HttpRequest;
 
 void http_request_deinit(HttpRequest *self);
 
+// The value of the first header field called `name`, ignoring case, or an
+// empty slice if there isn't one. Searches every field; the ones the server
+// acts on have fields of their own in `HttpRequest`.
+Slice http_request_header(const HttpRequest *self, Slice name);
+
+// The path that `target` asks for: everything before its query, if it has
+// one.
+Slice http_request_path(const HttpRequest *self);
+
+// Returns true if the client is willing to send another request on the same
+// connection after this one. HTTP/1.1 connections persist unless the client
+// sends `Connection: close`; HTTP/1.0 connections only persist if the client
+// sends `Connection: keep-alive`.
+bool http_request_keep_alive(const HttpRequest *self);
+
+// Returns true if this is an HTTP/1.0 request, where persistent connections
+// have to be announced explicitly.
+bool http_request_is_http_1_0(const HttpRequest *self);
+
+// Returns true if the client accepts a response body in the content coding
+// `coding`, e.g. `gzip`.
+bool http_request_accepts_encoding(const HttpRequest *self, Slice coding);
+
+// Returns true if this is a conditional GET or HEAD, and the copy the client
+// has is still the one with ETag `etag`, last modified at `modified` (seconds
+// since the epoch); it can be answered with 304 Not Modified. `If-None-Match`
+// takes precedence over `If-Modified-Since`.
+bool http_request_not_modified(const HttpRequest *self, Slice etag, int64_t modified);
+
+// `len` bytes of a representation, starting `offset` bytes in.
+typedef struct HttpByteRange {
+	size_t offset;
+	size_t len;
+} HttpByteRange;
+
+typedef enum HttpRanges {
+	// Send the whole representation: there's no `Range`, or it's ignored.
+	HTTP_RANGES_NONE = 0,
+
+	// Send the ranges that were found, with 206 Partial Content.
+	HTTP_RANGES_SATISFIABLE,
+
+	// None of the ranges are within the representation: 416 Range Not
+	// Satisfiable.
+	HTTP_RANGES_NOT_SATISFIABLE,
+} HttpRanges;
+
+// Work out which parts of a representation of `size` bytes, with ETag `etag`
+// and last modified at `modified`, a GET asks for. Up to
+// `HTTP_REQUEST_MAX_RANGES` of them are stored in `out_ranges`, in order and
+// without overlaps, and their number in `*out_count`.
+//
+// `Range` is ignored, as allowed, unless it's a well-formed list of byte
+// ranges, the method is GET, `If-Range` (if any) matches, and the
+// representation isn't empty.
+HttpRanges http_request_ranges(
+	const HttpRequest *self,
+	size_t size,
+	Slice etag,
+	int64_t modified,
+	HttpByteRange *out_ranges,
+	size_t *out_count
+);
+
 
@@ -1,32 +1,85 @@
 #include "http/response.h"
 
-#include "util.h"
 #include "warble/util.h"
 
 #include <assert.h>
+#include <stdio.h>
 
 const char *http_status_to_string(HttpStatus status) {
 	switch (status) {
 	case HTTP_OK:	return "OK";
+	case HTTP_PARTIAL_CONTENT:	return "Partial Content";
+	case HTTP_NOT_MODIFIED:	return "Not Modified";
 	case HTTP_BAD_REQUEST:	return "Bad Request";
 	case HTTP_NOT_FOUND:	return "Not Found";
+	case HTTP_URI_TOO_LONG:	return "URI Too Long";
+	case HTTP_RANGE_NOT_SATISFIABLE:	return "Range Not Satisfiable";
+	case HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE:	return "Request Header Fields Too Large";
 	case HTTP_INTERNAL_SERVER_ERROR:	return "Internal Server Error";
+	case HTTP_NOT_IMPLEMENTED:	return "Not Implemented";
+	case HTTP_SERVICE_UNAVAILABLE:	return "Service Unavailable";
 	}
 
 	return "";
 }
 
-void http_response_init(HttpResponse *self, HttpRequest *req, int write_fd) {
+// Returns the complete status line for `status`, or an empty slice if the
+// status code is unrecognized.
+static Slice http_status_line(HttpStatus status) {
+	switch (status) {
+	case HTTP_OK:	return slice_from_cstr("HTTP/1.1 200 OK\r\n");
+	case HTTP_PARTIAL_CONTENT:	return slice_from_cstr("HTTP/1.1 206 Partial Content\r\n");
+	case HTTP_NOT_MODIFIED:	return slice_from_cstr("HTTP/1.1 304 Not Modified\r\n");
+	case HTTP_BAD_REQUEST:	return slice_from_cstr("HTTP/1.1 400 Bad Request\r\n");
+	case HTTP_NOT_FOUND:	return slice_from_cstr("HTTP/1.1 404 Not Found\r\n");
+	case HTTP_URI_TOO_LONG:	return slice_from_cstr("HTTP/1.1 414 URI Too Long\r\n");
+	case HTTP_RANGE_NOT_SATISFIABLE:	return slice_from_cstr("HTTP/1.1 416 Range Not Satisfiable\r\n");
+	case HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE:	return slice_from_cstr("HTTP/1.1 431 Request Header Fields Too Large\r\n");
+	case HTTP_INTERNAL_SERVER_ERROR:	return slice_from_cstr("HTTP/1.1 500 Internal Server Error\r\n");
+	case HTTP_NOT_IMPLEMENTED:	return slice_from_cstr("HTTP/1.1 501 Not Implemented\r\n");
+	case HTTP_SERVICE_UNAVAILABLE:	return slice_from_cstr("HTTP/1.1 503 Service Unavailable\r\n");
+	}
+
+	return slice_new();
+}
+
+// Write `value` in decimal into the end of `digits`, and return the slice of
+// `digits` that was written to.
+static Slice format_size(uint8_t digits[20], size_t value) {
+	size_t start = 20;
+
+	do {
+		start -= 1;
+		digits[start] = '0' + value % 10;
+		value /= 10;
+	} while (value > 0);
+
+	return slice_from_len(digits + start, 20 - start);
+}
+
+void http_response_init(HttpResponse *self, const HttpRequest *req, HttpOutput *output) {
 	set_undefined(self, sizeof(*self));
 
-	self->write_fd = write_fd;
+	self->output = output;
 
 	self->state = HTTP_RESPONSE_STATE_HEADERS;
 
 	self->status = HTTP_INTERNAL_SERVER_ERROR;
-	buffer_init(&self->headers);
+
+	self->headers = &output->headers;
+	buffer_clear(self->headers);
 
 	self->was_head_request = slice_equal(req->method, slice_from_cstr("HEAD"));
+
+	self->keep_alive = http_request_keep_alive(req);
+	self->announce_keep_alive = http_request_is_http_1_0(req);
+
+	self->chunked = !http_request_is_http_1_0(req);
+	buffer_clear(&output->chunk);
+
+	self->producer = NULL;
+	self->producer_release = NULL;
+	self->producer_data = NULL;
 }
 
 void http_response_deinit(HttpResponse *self) {
@@ -40,11 +93,21 @@ void http_response_deinit(HttpResponse *self) {
 
 		break;
 	case HTTP_RESPONSE_STATE_BODY_CHUNKS:
+		// A streamed body that wasn't ended is being cut short by the
+		// connection closing; anything else just wasn't ended.
+		if (self->producer == NULL) {
+			err = http_response_end(self);
+			(void) err;
+		}
+
 		break;
 	case HTTP_RESPONSE_STATE_DONE:
 		break;
 	}
-	buffer_deinit(&self->headers);
+	buffer_clear(self->headers);
+	buffer_clear(&self->output->chunk);
+
+	if (self->producer_release != NULL) self->producer_release(self->producer_data);
 
 	set_undefined(self, sizeof(*self));
 }
@@ -54,7 +117,7 @@ Error http_response_not_found(HttpResponse *self) {
 
 	Error err;
 
-	buffer_clear(&self->headers);
+	http_response_clear_headers(self);
 	http_response_set_status(self, HTTP_NOT_FOUND);
 
 	err = http_response_end_with_body(self, slice_from_cstr("not found"));
@@ -68,7 +131,7 @@ Error http_response_internal_server_error(HttpResponse *self) {
 
 	Error err;
 
-	buffer_clear(&self->headers);
+	http_response_clear_headers(self);
 	http_response_set_status(self, HTTP_INTERNAL_SERVER_ERROR);
 
 	err = http_response_end_with_body(self, slice_from_cstr("internal server error"));
@@ -77,6 +140,72 @@ Error http_response_internal_server_error(HttpResponse *self) {
 	return ERR_SUCCESS;
 }
 
+Error http_response_range_not_satisfiable(HttpResponse *self, size_t size) {
+	if (self->state != HTTP_RESPONSE_STATE_HEADERS) return ERR_SUCCESS;
+
+	Error err;
+
+	http_response_clear_headers(self);
+	http_response_set_status(self, HTTP_RANGE_NOT_SATISFIABLE);
+
+	char content_range[32];
+	snprintf(content_range, sizeof(content_range), "bytes */%zu", size);
+
+	err = http_response_add_header(self, slice_from_cstr("Content-Range"), slice_from_cstr(content_range));
+	if (err != ERR_SUCCESS) return err;
+
+	err = http_response_end_with_body(self, slice_from_cstr("range not satisfiable"));
+	if (err != ERR_SUCCESS) return err;
+
+	return ERR_SUCCESS;
+}
+
+// Bodies are lowercase reason phrases, like the ones above.
+Slice http_response_rejection(HttpStatus status) {
+	switch (status) {
+	case HTTP_URI_TOO_LONG:
+		return slice_from_cstr(
+			"HTTP/1.1 414 URI Too Long\r\n"
+			"Connection: close\r\n"
+			"Content-Length: 12\r\n"
+			"\r\n"
+			"uri too long"
+		);
+	case HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE:
+		return slice_from_cstr(
+			"HTTP/1.1 431 Request Header Fields Too Large\r\n"
+			"Connection: close\r\n"
+			"Content-Length: 31\r\n"
+			"\r\n"
+			"request header fields too large"
+		);
+	case HTTP_NOT_IMPLEMENTED:
+		return slice_from_cstr(
+			"HTTP/1.1 501 Not Implemented\r\n"
+			"Connection: close\r\n"
+			"Content-Length: 15\r\n"
+			"\r\n"
+			"not implemented"
+		);
+	case HTTP_SERVICE_UNAVAILABLE:
+		return slice_from_cstr(
+			"HTTP/1.1 503 Service Unavailable\r\n"
+			"Connection: close\r\n"
+			"Content-Length: 19\r\n"
+			"\r\n"
+			"service unavailable"
+		);
+	default:
+		return slice_from_cstr(
+			"HTTP/1.1 400 Bad Request\r\n"
+			"Connection: close\r\n"
+			"Content-Length: 11\r\n"
+			"\r\n"
+			"bad request"
+		);
+	}
+}
+
 void http_response_set_status(HttpResponse *self, HttpStatus status) {
 	// The status can only be changed if headers haven't been sent yet.
 	assert(self->state == HTTP_RESPONSE_STATE_HEADERS);
@@ -84,12 +213,17 @@ void http_response_set_status(HttpResponse *self, HttpStatus status) {
 	self->status = status;
 }
 
-Error http_response_add_header(HttpResponse *self, Slice name, Slice value) {
-	// More headers can only be added if headers haven't been sent yet.
+void http_response_clear_headers(HttpResponse *self) {
+	// Headers can only be changed if they haven't been sent yet.
 	assert(self->state == HTTP_RESPONSE_STATE_HEADERS);
 
+	buffer_clear(self->headers);
+}
+
+// Append a header line to `buffer`.
+static Error append_header(Buffer *buffer, Slice name, Slice value) {
 	Error err = buffer_reserve_additional(
-		&self->headers,
+		buffer,
 		name.len +
 		// ": "
 		2 +
@@ -100,14 +234,50 @@ Error http_response_add_header(HttpResponse *self, Slice name, Slice value) {
 	if (err != ERR_SUCCESS) return err;
 
 	// @TODO: Any validation at all. Urgent!
-	buffer_concat(&self->headers, name);
-	buffer_concat(&self->headers, slice_from_cstr(": "));
-	buffer_concat(&self->headers, value);
-	buffer_concat(&self->headers, slice_from_cstr("\n"));
+	buffer_concat_assume_capacity(buffer, name);
+	buffer_concat_assume_capacity(buffer, slice_from_cstr(": "));
+	buffer_concat_assume_capacity(buffer, value);
+	buffer_concat_assume_capacity(buffer, slice_from_cstr("\r\n"));
 
 	return ERR_SUCCESS;
 }
 
+Error http_response_add_header(HttpResponse *self, Slice name, Slice value) {
+	// More headers can only be added if headers haven't been sent yet.
+	assert(self->state == HTTP_RESPONSE_STATE_HEADERS);
+
+	return append_header(self->headers, name, value);
+}
+
+Error http_response_head_begin(Buffer *head, HttpStatus status) {
+	Slice status_line = http_status_line(status);
+	if (status_line.len > 0) return buffer_concat(head, status_line);
+
+	return buffer_concat_printf(head, "HTTP/1.1 %03d \r\n", status);
+}
+
+Error http_response_head_add_header(Buffer *head, Slice name, Slice value) {
+	return append_header(head, name, value);
+}
+
+Error http_response_head_end(Buffer *head, size_t content_length) {
+	Error err;
+
+	uint8_t digits[20];
+	err = append_header(
+		head,
+		slice_from_cstr("Content-Length"),
+		format_size(digits, content_length)
+	);
+	if (err != ERR_SUCCESS) return err;
+
+	return buffer_concat(head, slice_from_cstr("\r\n"));
+}
+
+Error http_response_head_end_without_body(Buffer *head) {
+	return buffer_concat(head, slice_from_cstr("\r\n"));
+}
+
 // This function does not transition out of the `HTTP_RESPONSE_STATE_HEADERS`
 // state, because it doesn't know whether it should go into the BODY_CHUNKS
 // or DONE state.
@@ -117,59 +287,58 @@ static Error http_response_send_headers(HttpResponse *self) {
 
 	Error err;
 
-	Buffer status_line;
-	buffer_init(&status_line);
-
-	err = buffer_concat_printf(
-		&status_line,
-		"HTTP/1.1 %03d %s\r\n",
-		self->status,
-		http_status_to_string(self->status)
-	);
-	if (err != ERR_SUCCESS) {
-		buffer_deinit(&status_line);
-		return err;
+	if (!self->keep_alive) {
+		err = http_response_add_header(self, slice_from_cstr("Connection"), slice_from_cstr("close"));
+		if (err != ERR_SUCCESS) return err;
+	} else if (self->announce_keep_alive) {
+		err = http_response_add_header(self, slice_from_cstr("Connection"), slice_from_cstr("keep-alive"));
+		if (err != ERR_SUCCESS) return err;
 	}
 
-	err = write_all_to_fd(self->write_fd, buffer_slice(&status_line));
-	buffer_deinit(&status_line);
-	if (err != ERR_SUCCESS) return err;
-
 	// The end of this response's headers should be marked by two newlines. It
 	// doesn't really belong in `self->headers`, but a buffer is a buffer.
 	err = buffer_concat(
-		&self->headers,
+		self->headers,
 		slice_from_cstr("\r\n")
 	);
 	if (err != ERR_SUCCESS) return err;
 
-	err = write_all_to_fd(self->write_fd, buffer_slice(&self->headers));
+	Slice status_line = http_status_line(self->status);
+	if (status_line.len > 0) {
+		err = http_output_write(self->output, status_line);
+		if (err != ERR_SUCCESS) return err;
+	} else {
+		uint8_t digits[20];
+		Slice status_code = format_size(digits, self->status);
+
+		err = http_output_write(self->output, slice_from_cstr("HTTP/1.1 "));
+		if (err != ERR_SUCCESS) return err;
+
+		err = http_output_write(self->output, status_code);
+		if (err != ERR_SUCCESS) return err;
+
+		err = http_output_write(self->output, slice_from_cstr(" \r\n"));
+		if (err != ERR_SUCCESS) return err;
+	}
+
+	err = http_output_write(self->output, buffer_slice(self->headers));
 	if (err != ERR_SUCCESS) return err;
 
-	// We won't need to look at headers again; might as well free the memory.
-	buffer_clear_capacity(&self->headers);
+	buffer_clear(self->headers);
 
 	return ERR_SUCCESS;
 }
 
-Error http_response_end_with_body(HttpResponse *self, Slice body) {
-	Buffer content_length;
-	buffer_init(&content_length);
-
+// Send headers and then `body`, borrowing it if `borrow` is true.
+static Error http_response_end_body(HttpResponse *self, Slice body, bool borrow) {
 	Error err;
 
-	err = buffer_concat_printf(&content_length, "%zu", body.len);
-	if (err != ERR_SUCCESS) {
-		buffer_deinit(&content_length);
-		return err;
-	}
-
+	uint8_t digits[20];
 	err = http_response_add_header(
 		self,
 		slice_from_cstr("Content-Length"),
-		buffer_slice(&content_length)
+		format_size(digits, body.len)
 	);
-	buffer_deinit(&content_length);
 	if (err != ERR_SUCCESS) return err;
 
 	err = http_response_send_headers(self);
@@ -179,8 +348,328 @@ Error http_response_end_with_body(HttpResponse *self, Slice body) {
 
 	if (self->was_head_request) return ERR_SUCCESS;
 
-	err = write_all_to_fd(self->write_fd, body);
+	if (borrow) {
+		err = http_output_write_borrowed(self->output, body);
+	} else {
+		err = http_output_write(self->output, body);
+	}
 	if (err != ERR_SUCCESS) return err;
 
 	return ERR_SUCCESS;
 }
+
+Error http_response_end_with_body(HttpResponse *self, Slice body) {
+	return http_response_end_body(self, body, false);
+}
+
+Error http_response_end_with_borrowed_body(HttpResponse *self, Slice body) {
+	return http_response_end_body(self, body, true);
+}
+
+// Send the headers of a body of unknown length.
+static Error http_response_begin_chunks(HttpResponse *self) {
+	Error err;
+
+	// Without chunks, the only way to tell where the body ends is to close the
+	// connection after it.
+	if (self->chunked) {
+		err = http_response_add_header(self, slice_from_cstr("Transfer-Encoding"), slice_from_cstr("chunked"));
+		if (err != ERR_SUCCESS) return err;
+	} else {
+		self->keep_alive = false;
+	}
+
+	err = http_response_send_headers(self);
+	// Don't send headers twice, even if there's an error while sending headers.
+	self->state = HTTP_RESPONSE_STATE_BODY_CHUNKS;
+
+	return err;
+}
+
+// Queue a copy of `bytes` as a chunk of its own.
+static Error http_response_write_framed(HttpResponse *self, Slice bytes) {
+	if (!self->chunked) return http_output_write(self->output, bytes);
+
+	// Copies at the end of the output are all one segment, so this is still a
+	// single iovec.
+	char size_line[24];
+	int size_line_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", bytes.len);
+
+	Error err = http_output_write(self->output, slice_from_len((uint8_t*) size_line, size_line_len));
+	if (err != ERR_SUCCESS) return err;
+
+	err = http_output_write(self->output, bytes);
+	if (err != ERR_SUCCESS) return err;
+
+	return http_output_write(self->output, slice_from_cstr("\r\n"));
+}
+
+Error http_response_write_chunk(HttpResponse *self, Slice bytes) {
+	Error err;
+
+	if (self->state == HTTP_RESPONSE_STATE_HEADERS) {
+		err = http_response_begin_chunks(self);
+		if (err != ERR_SUCCESS) return err;
+	}
+
+	// Chunks can only be written until the body's ended.
+	assert(self->state == HTTP_RESPONSE_STATE_BODY_CHUNKS);
+
+	if (self->was_head_request || bytes.len == 0) return ERR_SUCCESS;
+
+	Buffer *chunk = &self->output->chunk;
+	if (chunk->len + bytes.len > HTTP_RESPONSE_CHUNK_SIZE) {
+		err = http_response_flush(self);
+		if (err != ERR_SUCCESS) return err;
+	}
+
+	// Big enough on its own; holding it would only add a copy.
+	if (bytes.len >= HTTP_RESPONSE_CHUNK_SIZE) return http_response_write_framed(self, bytes);
+
+	return buffer_concat(chunk, bytes);
+}
+
+Error http_response_flush(HttpResponse *self) {
+	Buffer *chunk = &self->output->chunk;
+	if (self->state != HTTP_RESPONSE_STATE_BODY_CHUNKS || chunk->len == 0) return ERR_SUCCESS;
+
+	Error err = http_response_write_framed(self, buffer_slice(chunk));
+	buffer_clear(chunk);
+
+	return err;
+}
+
+Error http_response_end(HttpResponse *self) {
+	Error err;
+
+	if (self->state == HTTP_RESPONSE_STATE_HEADERS) {
+		err = http_response_begin_chunks(self);
+		if (err != ERR_SUCCESS) return err;
+	}
+
+	// The body can only be ended once.
+	assert(self->state == HTTP_RESPONSE_STATE_BODY_CHUNKS);
+
+	err = http_response_flush(self);
+	self->state = HTTP_RESPONSE_STATE_DONE;
+	if (err != ERR_SUCCESS) return err;
+
+	if (!self->chunked || self->was_head_request) return ERR_SUCCESS;
+
+	// The last chunk is empty, and has no trailer fields after it.
+	return http_output_write(self->output, slice_from_cstr("0\r\n\r\n"));
+}
+
+Error http_response_stream(
+	HttpResponse *self,
+	HttpResponseProducer produce,
+	HttpOutputRelease release,
+	void *data
+) {
+	// Only one body per response.
+	assert(self->state != HTTP_RESPONSE_STATE_DONE);
+	assert(self->producer == NULL);
+
+	self->producer = produce;
+	self->producer_release = release;
+	self->producer_data = data;
+
+	if (self->was_head_request) return http_response_end(self);
+
+	return ERR_SUCCESS;
+}
+
+// Send `head` as prepared, adding a `Connection` header if needed.
+static Error http_response_send_prepared_head(HttpResponse *self, Slice head) {
+	// Headers can only be sent once.
+	assert(self->state == HTTP_RESPONSE_STATE_HEADERS);
+
+	// Anything added with `http_response_add_header` would be lost.
+	assert(self->headers->len == 0);
+
+	// Don't send headers twice, even if there's an error while sending them.
+	self->state = HTTP_RESPONSE_STATE_DONE;
+
+	Slice connection = slice_new();
+	if (!self->keep_alive) {
+		connection = slice_from_cstr("Connection: close\r\n\r\n");
+	} else if (self->announce_keep_alive) {
+		connection = slice_from_cstr("Connection: keep-alive\r\n\r\n");
+	}
+
+	// Unless the connection's persistence has to be spelled out, the head goes
+	// out exactly as it was prepared.
+	if (connection.len == 0) {
+		return http_output_write_borrowed(self->output, head);
+	}
+
+	// Slip the `Connection` header in before the empty line that ends `head`.
+	assert(head.len >= 2);
+
+	Error err = http_output_write_borrowed(self->output, slice_from_len(head.bytes, head.len - 2));
+	if (err != ERR_SUCCESS) return err;
+
+	return http_output_write(self->output, connection);
+}
+
+Error http_response_end_prepared(HttpResponse *self, Slice head, Slice body) {
+	Error err = http_response_send_prepared_head(self, head);
+	if (err != ERR_SUCCESS) return err;
+
+	if (self->was_head_request) return ERR_SUCCESS;
+
+	return http_output_write_borrowed(self->output, body);
+}
+
+Error http_response_end_prepared_with_file(
+	HttpResponse *self,
+	Slice head,
+	int fd,
+	size_t size
+) {
+	Error err = http_response_send_prepared_head(self, head);
+	if (err != ERR_SUCCESS) return err;
+
+	if (self->was_head_request) return ERR_SUCCESS;
+
+	http_output_write_file(self->output, fd, 0, size);
+
+	return ERR_SUCCESS;
+}
+
+// Separates the parts of a `multipart/byteranges` body. Bodies aren't checked
+// for it; clients find parts by their `Content-Range`s and lengths.
+#define HTTP_RESPONSE_BOUNDARY "userve-byteranges-3d1c8f0b7a6e5942"
+
+// Queue `range` of the representation: a slice of `body`, or if `fd` isn't -1,
+// a range of the file.
+static Error http_response_write_range(HttpResponse *self, HttpByteRange range, Slice body, int fd) {
+	if (fd != -1) {
+		http_output_write_file(self->output, fd, range.offset, range.len);
+		return ERR_SUCCESS;
+	}
+
+	return http_output_write_borrowed(self->output, slice_from_len(body.bytes + range.offset, range.len));
+}
+
+Error http_response_end_ranges(
+	HttpResponse *self,
+	Slice content_type,
+	size_t size,
+	const HttpByteRange *ranges,
+	size_t ranges_count,
+	Slice body,
+	int fd
+) {
+	assert(ranges_count > 0 && ranges_count <= HTTP_REQUEST_MAX_RANGES);
+
+	Error err;
+
+	http_response_set_status(self, HTTP_PARTIAL_CONTENT);
+
+	char content_range[64];
+
+	if (ranges_count == 1) {
+		HttpByteRange range = ranges[0];
+		snprintf(
+			content_range,
+			sizeof(content_range),
+			"bytes %zu-%zu/%zu",
+			range.offset,
+			range.offset + range.len - 1,
+			size
+		);
+
+		err = http_response_add_header(self, slice_from_cstr("Content-Type"), content_type);
+		if (err != ERR_SUCCESS) return err;
+
+		err = http_response_add_header(self, slice_from_cstr("Content-Range"), slice_from_cstr(content_range));
+		if (err != ERR_SUCCESS) return err;
+
+		uint8_t digits[20];
+		err = http_response_add_header(self, slice_from_cstr("Content-Length"), format_size(digits, range.len));
+		if (err != ERR_SUCCESS) return err;
+
+		err = http_response_send_headers(self);
+		self->state = HTTP_RESPONSE_STATE_DONE;
+		if (err != ERR_SUCCESS) return err;
+
+		if (self->was_head_request) return ERR_SUCCESS;
+
+		return http_response_write_range(self, range, body, fd);
+	}
+
+	// Every part's head, and the closing boundary after them, are formatted
+	// up front, because together with the ranges they make up the length.
+	Buffer parts;
+	buffer_init(&parts);
+
+	size_t part_ends[HTTP_REQUEST_MAX_RANGES];
+	size_t content_length = 0;
+
+	err = ERR_SUCCESS;
+	for (size_t i = 0; i < ranges_count && err == ERR_SUCCESS; i++) {
+		err = buffer_concat_printf(
+			&parts,
+			"%s--" HTTP_RESPONSE_BOUNDARY "\r\n"
+			"Content-Type: %.*s\r\n"
+			"Content-Range: bytes %zu-%zu/%zu\r\n"
+			"\r\n",
+			i > 0 ? "\r\n" : "",
+			(int) content_type.len,
+			(const char*) content_type.bytes,
+			ranges[i].offset,
+			ranges[i].offset + ranges[i].len - 1,
+			size
+		);
+
+		part_ends[i] = parts.len;
+		content_length += ranges[i].len;
+	}
+	if (err == ERR_SUCCESS) {
+		err = buffer_concat(&parts, slice_from_cstr("\r\n--" HTTP_RESPONSE_BOUNDARY "--\r\n"));
+	}
+
+	content_length += parts.len;
+
+	if (err == ERR_SUCCESS) {
+		err = http_response_add_header(
+			self,
+			slice_from_cstr("Content-Type"),
+			slice_from_cstr("multipart/byteranges; boundary=" HTTP_RESPONSE_BOUNDARY)
+		);
+	}
+	if (err == ERR_SUCCESS) {
+		uint8_t digits[20];
+		err = http_response_add_header(self, slice_from_cstr("Content-Length"), format_size(digits, content_length));
+	}
+	if (err == ERR_SUCCESS) {
+		err = http_response_send_headers(self);
+		self->state = HTTP_RESPONSE_STATE_DONE;
+	}
+
+	size_t part_start = 0;
+	for (size_t i = 0; i < ranges_count && err == ERR_SUCCESS && !self->was_head_request; i++) {
+		err = http_output_write(self->output, slice_from_len(parts.bytes + part_start, part_ends[i] - part_start));
+		if (err == ERR_SUCCESS) {
+			err = http_response_write_range(self, ranges[i], body, fd);
+		}
+
+		part_start = part_ends[i];
+	}
+	if (err == ERR_SUCCESS && !self->was_head_request) {
+		err = http_output_write(self->output, slice_from_len(parts.bytes + part_start, parts.len - part_start));
+	}
+
+	buffer_deinit(&parts);
+
+	return err;
+}
+
+void http_response_release_after(
+	HttpResponse *self,
+	HttpOutputRelease release,
+	void *release_data
+) {
+	http_output_release_after(self->output, release, release_data);
+}
@@ -1,23 +1,45 @@
 #pragma once
 
+#include "http/output.h"
 #include "http/request.h"
 #include "warble/buffer.h"
 
 // Long ago, the four nations lived in harmony.
 typedef enum HttpStatus {
 	HTTP_OK = 200,
+	HTTP_PARTIAL_CONTENT = 206,
+
+	HTTP_NOT_MODIFIED = 304,
 
 	HTTP_BAD_REQUEST = 400,
 
 	HTTP_NOT_FOUND = 404,
+	HTTP_URI_TOO_LONG = 414,
+	HTTP_RANGE_NOT_SATISFIABLE = 416,
+	HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE = 431,
 
 	HTTP_INTERNAL_SERVER_ERROR = 500,
+	HTTP_NOT_IMPLEMENTED = 501,
+	HTTP_SERVICE_UNAVAILABLE = 503,
 } HttpStatus;
 
 // Returns the HTTP status code string associated with `status`, or an
 // empty string if the status code is unrecognized.
 const char *http_status_to_string(HttpStatus status);
 
+// Bytes written to a chunked body are held until there are this many, and then
+// sent as a single chunk, so that many small writes don't each pay for a
+// chunk's framing.
+#define HTTP_RESPONSE_CHUNK_SIZE (16 * 1024)
+
+typedef struct HttpResponse HttpResponse;
+
+// Produces a streamed body a piece at a time; see `http_response_stream`.
+// Each call writes the next piece with `http_response_write_chunk`, or ends
+// the body with `http_response_end`. Returning an error closes the
+// connection, cutting the body short.
+typedef Error (*HttpResponseProducer)(void *data, HttpResponse *response);
+
 typedef enum HttpResponseState {
 	// Nothing has been sent.
 	HTTP_RESPONSE_STATE_HEADERS = 0,
@@ -30,24 +52,48 @@ typedef enum HttpResponseState {
 	HTTP_RESPONSE_STATE_DONE,
 } HttpResponseState;
 
-typedef struct {
-	// A file descriptor to write the response to.
-	int write_fd;
+struct HttpResponse {
+	// The response is queued onto this; it's up to the owner of the output to
+	// get those bytes onto the wire.
+	HttpOutput *output;
 
 	HttpResponseState state;
 
 	int status;
-	Buffer headers;
+
+	// Points to `output->headers`.
+	Buffer *headers;
 
 	// `true` if the request was a `HEAD` request, and no body should be sent back.
 	bool was_head_request;
-} HttpResponse;
 
-// Initialize `self`, in preparation for writing an HTTP response to `write_fd`.
+	// `true` if the connection stays open for another request after this
+	// response. Starts out as whatever the client asked for, and may be cleared
+	// before headers are sent to close the connection anyway.
+	bool keep_alive;
+
+	// `true` if a persistent connection has to be announced with
+	// `Connection: keep-alive`, because the request was HTTP/1.0.
+	bool announce_keep_alive;
+
+	// `true` if the body is sent with `Transfer-Encoding: chunked`. HTTP/1.0
+	// clients don't understand it, and get the body as it is, ended by closing
+	// the connection.
+	bool chunked;
+
+	// Set by `http_response_stream`; `NULL` otherwise.
+	HttpResponseProducer producer;
+	HttpOutputRelease producer_release;
+	void *producer_data;
+};
+
+// Initialize `self`, in preparation for queueing an HTTP response onto `output`.
 // `request` is used to to check if the request is a HEAD method.
-void http_response_init(HttpResponse *self, HttpRequest *request, int write_fd);
+void http_response_init(HttpResponse *self, const HttpRequest *request, HttpOutput *output);
 
 // If headers haven't been sent yet, send 500 Internal Server Error in response.
+// A chunked body that wasn't ended is ended here, unless it's being streamed:
+// then the connection is going away, and the producer's data is released.
 void http_response_deinit(HttpResponse *self);
 
 // Write a 404 Not Found to `response`, with a body of "not found" and no added
@@ -58,6 +104,15 @@ Error http_response_not_found(HttpResponse *self);
 // server error" and no added headers.
 Error http_response_internal_server_error(HttpResponse *self);
 
+// Write a 416 Range Not Satisfiable to `response`, for a representation of
+// `size` bytes, with a body of "range not satisfiable".
+Error http_response_range_not_satisfiable(HttpResponse *self, size_t size);
+
+// Returns a complete response, closing the connection, for a request that was
+// turned away before it could be handled: 400, 414, 431, 501 or 503. Prepared
+// ahead of time, so that it costs nothing to send. Any other status gets a 400.
+Slice http_response_rejection(HttpStatus status);
+
 void http_response_set_status(HttpResponse *self, HttpStatus status);
 
 // Remove all headers from `self`.
@@ -67,8 +122,99 @@ void http_response_clear_headers(HttpResponse *self);
 // Not written immediately.
 Error http_response_add_header(HttpResponse *self, Slice name, Slice value);
 
-Error http_response_end_with_body(HttpResponse *self, Slice slice);
-
-// Not implemented.
-//Error http_response_write_chunk(HttpResponse *self, Slice slice);
-//Error http_response_end(HttpResponse *self);
+// Send headers, followed by a copy of `body`.
+Error http_response_end_with_body(HttpResponse *self, Slice body);
+
+// Like `http_response_end_with_body`, but `body` isn't copied: it's written to
+// the socket straight from where it is, so it must stay valid and unchanged
+// until the connection has finished writing it.
+Error http_response_end_with_borrowed_body(HttpResponse *self, Slice body);
+
+// Build a response ahead of time, for `http_response_end_prepared`. The head
+// is started with a status line, followed by any number of headers, and ended
+// with `Content-Length` and the empty line that finishes the headers.
+Error http_response_head_begin(Buffer *head, HttpStatus status);
+Error http_response_head_add_header(Buffer *head, Slice name, Slice value);
+Error http_response_head_end(Buffer *head, size_t content_length);
+
+// Like `http_response_head_end`, for a status that never has a body, such as
+// 304 Not Modified, and so has no `Content-Length`.
+Error http_response_head_end_without_body(Buffer *head);
+
+// Send `head`, built with the functions above, followed by `body` unless this
+// is a response to a HEAD request. Nothing is formatted: the only header added
+// is `Connection`, when the connection's persistence has to be spelled out.
+// Neither `head` nor `body` is copied, so both must stay valid and unchanged
+// until the connection has finished writing them.
+Error http_response_end_prepared(HttpResponse *self, Slice head, Slice body);
+
+// Like `http_response_end_prepared`, but the body is the first `size` bytes of
+// the file `fd`, sent with `sendfile`. `fd` must stay open until the
+// connection has finished writing it.
+Error http_response_end_prepared_with_file(
+	HttpResponse *self,
+	Slice head,
+	int fd,
+	size_t size
+);
+
+// Send a 206 Partial Content with `ranges_count` ranges, from
+// `http_request_ranges`, of a representation of `size` bytes and type
+// `content_type`. Other headers, such as the ETag, are added beforehand with
+// `http_response_add_header`.
+//
+// The representation is `body`, or if `fd` isn't -1, the file `fd`, in which
+// case `body` is ignored. Neither is copied, and they must stay valid until the
+// connection has finished writing them. A single range is sent as it is; more
+// are sent as `multipart/byteranges`.
+Error http_response_end_ranges(
+	HttpResponse *self,
+	Slice content_type,
+	size_t size,
+	const HttpByteRange *ranges,
+	size_t ranges_count,
+	Slice body,
+	int fd
+);
+
+// Call `release(release_data)` once everything sent so far in this response
+// has been written, or the connection is closed. Lets responses borrow bytes
+// or files that are shared with other responses.
+void http_response_release_after(
+	HttpResponse *self,
+	HttpOutputRelease release,
+	void *release_data
+);
+
+// Send the headers, unless they've been sent already, followed by a copy of
+// `bytes` as part of a body of unknown length. Set the status first. Small
+// writes are held and sent together; see `HTTP_RESPONSE_CHUNK_SIZE`.
+//
+// Everything written this way is queued at once. To send a body too large to
+// hold, use `http_response_stream`.
+Error http_response_write_chunk(HttpResponse *self, Slice bytes);
+
+// Send whatever's been held back by `http_response_write_chunk`, and end the
+// body. Sends the headers first if nothing was written.
+Error http_response_end(HttpResponse *self);
+
+// Queue what's been held back by `http_response_write_chunk` as a chunk of its
+// own. The connection does this whenever it's about to write; handlers don't
+// need to.
+Error http_response_flush(HttpResponse *self);
+
+// Stream the body: once the handler returns, the connection calls
+// `produce(data, self)` whenever what's been written so far has gone out to
+// the client, for as long as the client keeps up and until the body's ended.
+// A body of any size takes no more memory than a batch of output.
+//
+// `release(data)` is called once the body's done, or the connection's closed,
+// whichever comes first. Requests on the same connection wait until the body's
+// done. The request isn't valid once the handler has returned, so anything
+// `produce` needs from it has to be copied into `data`.
+Error http_response_stream(
+	HttpResponse *self,
+	HttpResponseProducer produce,
+	HttpOutputRelease release,
+	void *data
+);
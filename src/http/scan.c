@@ -0,0 +1,201 @@
+#include "http/scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_SCAN_X86 1
+#else
+#define HTTP_SCAN_X86 0
+#endif
+
+#define TOKEN (HTTP_BYTE_TOKEN | HTTP_BYTE_TARGET | HTTP_BYTE_VERSION | HTTP_BYTE_FIELD_VALUE)
+#define VISIBLE (HTTP_BYTE_TARGET | HTTP_BYTE_FIELD_VALUE)
+
+const uint8_t http_byte_classes[256] = {
+	['\t'] = HTTP_BYTE_FIELD_VALUE,
+	[' '] = HTTP_BYTE_FIELD_VALUE,
+
+	// Every other printable character is visible, and some are tokens.
+	['"'] = VISIBLE,
+	['('] = VISIBLE,
+	[')'] = VISIBLE,
+	[','] = VISIBLE,
+	['/'] = VISIBLE | HTTP_BYTE_VERSION,
+	[':'] = VISIBLE,
+	[';'] = VISIBLE,
+	['<'] = VISIBLE,
+	['='] = VISIBLE,
+	['>'] = VISIBLE,
+	['?'] = VISIBLE,
+	['@'] = VISIBLE,
+	['['] = VISIBLE,
+	['\\'] = VISIBLE,
+	[']'] = VISIBLE,
+	['{'] = VISIBLE,
+	['}'] = VISIBLE,
+
+	['!'] = TOKEN,
+	['#'] = TOKEN,
+	['$'] = TOKEN,
+	['%'] = TOKEN,
+	['&'] = TOKEN,
+	['\''] = TOKEN,
+	['*'] = TOKEN,
+	['+'] = TOKEN,
+	['-'] = TOKEN,
+	['.'] = TOKEN,
+	['^'] = TOKEN,
+	['_'] = TOKEN,
+	['`'] = TOKEN,
+	['|'] = TOKEN,
+	['~'] = TOKEN,
+	['0' ... '9'] = TOKEN,
+	['a' ... 'z'] = TOKEN,
+	['A' ... 'Z'] = TOKEN,
+
+	// DEL is only allowed in targets.
+	[0x7F] = HTTP_BYTE_TARGET,
+
+	// Anything that isn't ASCII, such as UTF-8, is passed along untouched.
+	[0x80 ... 0xFF] = VISIBLE,
+};
+
+static size_t scan_scalar(Slice bytes) {
+	size_t index = 0;
+	while (index < bytes.len && (http_byte_classes[bytes.bytes[index]] & HTTP_BYTE_FIELD_VALUE)) {
+		index += 1;
+	}
+
+	return index;
+}
+
+#if HTTP_SCAN_X86
+
+// Flags the bytes in `block` that end a field value: DEL, and any control
+// character other than a tab, which is usually the carriage return at the end
+// of the line.
+__attribute__((target("sse2")))
+static inline __m128i value_end_sse2(__m128i block) {
+	// Bytes up to 0x1F are the ones that `min` leaves alone.
+	__m128i control = _mm_cmpeq_epi8(_mm_min_epu8(block, _mm_set1_epi8(0x1F)), block);
+	control = _mm_andnot_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('\t')), control);
+
+	return _mm_or_si128(control, _mm_cmpeq_epi8(block, _mm_set1_epi8(0x7F)));
+}
+
+__attribute__((target("sse2")))
+static size_t scan_sse2(Slice bytes) {
+	size_t index = 0;
+	for (; index + 16 <= bytes.len; index += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i*) (bytes.bytes + index));
+
+		unsigned mask = _mm_movemask_epi8(value_end_sse2(block));
+		if (mask != 0) return index + __builtin_ctz(mask);
+	}
+
+	return index + scan_scalar(slice_remove_start(bytes, index));
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(Slice bytes) {
+	const __m256i control_max = _mm256_set1_epi8(0x1F);
+	const __m256i tab = _mm256_set1_epi8('\t');
+	const __m256i del = _mm256_set1_epi8(0x7F);
+
+	size_t index = 0;
+	for (; index + 32 <= bytes.len; index += 32) {
+		__m256i block = _mm256_loadu_si256((const __m256i*) (bytes.bytes + index));
+
+		__m256i control = _mm256_cmpeq_epi8(_mm256_min_epu8(block, control_max), block);
+		control = _mm256_andnot_si256(_mm256_cmpeq_epi8(block, tab), control);
+		control = _mm256_or_si256(control, _mm256_cmpeq_epi8(block, del));
+
+		unsigned mask = _mm256_movemask_epi8(control);
+		if (mask != 0) return index + __builtin_ctz(mask);
+	}
+
+	// Most values are shorter than a block. Compiled here, the SSE2 step uses
+	// the same encoding as the rest, instead of paying to switch back.
+	if (index + 16 <= bytes.len) {
+		__m128i block = _mm_loadu_si128((const __m128i*) (bytes.bytes + index));
+
+		unsigned mask = _mm_movemask_epi8(value_end_sse2(block));
+		if (mask != 0) return index + __builtin_ctz(mask);
+
+		index += 16;
+	}
+
+	return index + scan_scalar(slice_remove_start(bytes, index));
+}
+
+#endif
+
+bool http_scan_supported(HttpScanImplementation implementation) {
+	switch (implementation) {
+	case HTTP_SCAN_SCALAR:
+		return true;
+#if HTTP_SCAN_X86
+	case HTTP_SCAN_SSE2:
+		return __builtin_cpu_supports("sse2");
+	case HTTP_SCAN_AVX2:
+		// Finishes with SSE2.
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("sse2");
+#else
+	case HTTP_SCAN_SSE2:
+	case HTTP_SCAN_AVX2:
+		return false;
+#endif
+	case HTTP_SCAN_IMPLEMENTATIONS_COUNT:
+		break;
+	}
+
+	return false;
+}
+
+const char *http_scan_name(HttpScanImplementation implementation) {
+	switch (implementation) {
+	case HTTP_SCAN_SCALAR:
+		return "scalar";
+	case HTTP_SCAN_SSE2:
+		return "sse2";
+	case HTTP_SCAN_AVX2:
+		return "avx2";
+	case HTTP_SCAN_IMPLEMENTATIONS_COUNT:
+		break;
+	}
+
+	return "unknown";
+}
+
+size_t http_scan_field_value_with(HttpScanImplementation implementation, Slice bytes) {
+	switch (implementation) {
+#if HTTP_SCAN_X86
+	case HTTP_SCAN_SSE2:
+		return scan_sse2(bytes);
+	case HTTP_SCAN_AVX2:
+		return scan_avx2(bytes);
+#endif
+	default:
+		return scan_scalar(bytes);
+	}
+}
+
+// Chosen on first use. Every thread that races to choose picks the same one.
+static HttpScanImplementation current_implementation = HTTP_SCAN_IMPLEMENTATIONS_COUNT;
+
+void http_scan_use(HttpScanImplementation implementation) {
+	__atomic_store_n(&current_implementation, implementation, __ATOMIC_RELAXED);
+}
+
+size_t http_scan_field_value(Slice bytes) {
+	HttpScanImplementation implementation = __atomic_load_n(&current_implementation, __ATOMIC_RELAXED);
+
+	if (implementation == HTTP_SCAN_IMPLEMENTATIONS_COUNT) {
+		implementation = HTTP_SCAN_SCALAR;
+		if (http_scan_supported(HTTP_SCAN_SSE2)) implementation = HTTP_SCAN_SSE2;
+		if (http_scan_supported(HTTP_SCAN_AVX2)) implementation = HTTP_SCAN_AVX2;
+
+		http_scan_use(implementation);
+	}
+
+	return http_scan_field_value_with(implementation, bytes);
+}
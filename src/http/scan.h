@@ -0,0 +1,54 @@
+#pragma once
+
+#include "warble/slice.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// What each byte can be part of in a request's head, as bits of
+// `http_byte_classes`.
+typedef enum HttpByteClass {
+	// `token`, from https://datatracker.ietf.org/doc/html/rfc9110#appendix-A-2.
+	// Methods and header names.
+	HTTP_BYTE_TOKEN = 1 << 0,
+
+	// Anything but whitespace and control characters.
+	HTTP_BYTE_TARGET = 1 << 1,
+
+	// A token, or `/`.
+	HTTP_BYTE_VERSION = 1 << 2,
+
+	// `field-vchar` from https://datatracker.ietf.org/doc/html/rfc9110#section-5.5,
+	// and the spaces and tabs that are allowed between them.
+	HTTP_BYTE_FIELD_VALUE = 1 << 3,
+} HttpByteClass;
+
+extern const uint8_t http_byte_classes[256];
+
+// Ways of scanning header field values. They all give the same answers; the
+// vectorized ones look at a whole block of bytes at a time.
+typedef enum HttpScanImplementation {
+	HTTP_SCAN_SCALAR = 0,
+	HTTP_SCAN_SSE2,
+	HTTP_SCAN_AVX2,
+
+	HTTP_SCAN_IMPLEMENTATIONS_COUNT,
+} HttpScanImplementation;
+
+// Returns true if this CPU can run `implementation`.
+bool http_scan_supported(HttpScanImplementation implementation);
+
+const char *http_scan_name(HttpScanImplementation implementation);
+
+// Use `implementation`, which must be supported, from now on, instead of the
+// fastest one. For benchmarks.
+void http_scan_use(HttpScanImplementation implementation);
+
+// Returns how many bytes at the start of `bytes` can be part of a header
+// field's value. Uses the fastest implementation this CPU can run.
+size_t http_scan_field_value(Slice bytes);
+
+// `http_scan_field_value` with a given implementation, which must be
+// supported.
+size_t http_scan_field_value_with(HttpScanImplementation implementation, Slice bytes);
@@ -2,6 +2,9 @@
 
 #include "main/arguments.h"
 
+#include "http/parser.h"
+
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -36,9 +39,56 @@ static const char *remove_prefix(const char *prefix, const char *arg) {
 	}
 }
 
+// Parse `arg` as a non-negative decimal count. Returns false if it isn't one.
+static bool parse_count(const char *arg, unsigned *out_count) {
+	if (*arg == '\0') return false;
+
+	unsigned long count = 0;
+	for (const char *cursor = arg; *cursor != '\0'; cursor++) {
+		if (*cursor < '0' || *cursor > '9') return false;
+
+		count = count * 10 + (*cursor - '0');
+		if (count > 65535) return false;
+	}
+
+	*out_count = count;
+	return true;
+}
+
+// Parse `arg` as a size in bytes, optionally followed by `k`, `m` or `g` for
+// units of 1024 bytes, 1024 kilobytes, or 1024 megabytes. Returns false if it
+// isn't one.
+static bool parse_size(const char *arg, size_t *out_size) {
+	if (*arg < '0' || *arg > '9') return false;
+
+	size_t size = 0;
+	const char *cursor = arg;
+	for (; *cursor >= '0' && *cursor <= '9'; cursor++) {
+		if (size > (SIZE_MAX - 9) / 10) return false;
+
+		size = size * 10 + (*cursor - '0');
+	}
+
+	unsigned shift = 0;
+	switch (*cursor) {
+	case '\0':	break;
+	case 'k': case 'K':	shift = 10;	cursor++;	break;
+	case 'm': case 'M':	shift = 20;	cursor++;	break;
+	case 'g': case 'G':	shift = 30;	cursor++;	break;
+	default:	return false;
+	}
+
+	if (*cursor != '\0') return false;
+	if (size > (SIZE_MAX >> shift)) return false;
+
+	*out_size = size << shift;
+	return true;
+}
+
 static void print_usage(const char *argv0) {
 	fprintf(stderr, "userve %s\n", USERVE_VERSION);
 	fprintf(stderr, "usage: %s [--address <address>] [--port <port>]\n", argv0);
+	fprintf(stderr, "       %s pack <directory> <output>\n", argv0);
 
 	fprintf(stderr, "\n");
 	fprintf(stderr, "options:\n");
@@ -56,10 +106,83 @@ static void print_usage(const char *argv0) {
 	fprintf(stderr, "\t\tserve all files in [path] (default: .)\n");
 	fprintf(stderr, "\n");
 
+	fprintf(stderr, "\t-w [count], --workers [count]\n");
+	fprintf(stderr, "\t\tserve from [count] threads, each with its own listen sockets (default: 1)\n");
+	fprintf(stderr, "\t\tnote: a count of 0 starts one worker per CPU\n");
+	fprintf(stderr, "\n");
+
+	fprintf(stderr, "\t--idle-timeout [seconds]\n");
+	fprintf(stderr, "\t\tclose connections that have been idle for [seconds] (default: 10)\n");
+	fprintf(stderr, "\t\tnote: a timeout of 0 keeps idle connections open forever\n");
+	fprintf(stderr, "\n");
+
+	fprintf(stderr, "\t--header-timeout [seconds]\n");
+	fprintf(stderr, "\t\tclose connections that take more than [seconds] to send a request's headers, once they've started (default: 10)\n");
+	fprintf(stderr, "\n");
+
+	fprintf(stderr, "\t--send-timeout [seconds]\n");
+	fprintf(stderr, "\t\tclose connections whose responses have been backed up for [seconds] without being read (default: 10)\n");
+	fprintf(stderr, "\n");
+
+	fprintf(stderr, "\t--min-send-rate [size]\n");
+	fprintf(stderr, "\t\tclose connections that read their backed-up responses slower than [size] bytes per second, past --send-timeout (default: 1k)\n");
+	fprintf(stderr, "\t\tnote: a rate of 0 lets connections read as slowly as they like, as long as they read something every --send-timeout\n");
+	fprintf(stderr, "\n");
+
+	fprintf(stderr, "\t--sendfile-threshold [size]\n");
+	fprintf(stderr, "\t\tsend files larger than [size] bytes straight from disk instead of loading them into memory (default: 1m)\n");
+	fprintf(stderr, "\t\tnote: [size] may end in k, m or g\n");
+	fprintf(stderr, "\n");
+
+	fprintf(stderr, "\t--mmap\n");
+	fprintf(stderr, "\t\tmap files into memory instead of reading them, sharing their pages with the page cache\n");
+	fprintf(stderr, "\t\tnote: files must not be truncated while they're being served\n");
+	fprintf(stderr, "\n");
+
+	fprintf(stderr, "\t--cache-size [size]\n");
+	fprintf(stderr, "\t\tload files when they're first requested, and keep at most [size] bytes of them in memory\n");
+	fprintf(stderr, "\t\tnote: by default, every file is loaded at startup; send SIGUSR1 to print cache statistics\n");
+	fprintf(stderr, "\n");
+
+	fprintf(stderr, "\t--pack [file]\n");
+	fprintf(stderr, "\t\tserve from [file], written by '%s pack', instead of from a directory\n", argv0);
+	fprintf(stderr, "\n");
+
+	fprintf(stderr, "\t--watch\n");
+	fprintf(stderr, "\t\twatch the served directory with inotify, and serve files as they're added, changed and removed\n");
+	fprintf(stderr, "\n");
+
+	fprintf(stderr, "\t--io-uring\n");
+	fprintf(stderr, "\t\tserve connections with io_uring instead of epoll\n");
+	fprintf(stderr, "\t\tnote: if the kernel doesn't support io_uring, userve falls back to epoll\n");
+	fprintf(stderr, "\n");
+
+	fprintf(stderr, "\t--max-request-line [size]\n");
+	fprintf(stderr, "\t\tanswer requests whose request line is longer than [size] bytes with 414 URI Too Long (default: 8k)\n");
+	fprintf(stderr, "\n");
+
+	fprintf(stderr, "\t--max-header-size [size]\n");
+	fprintf(stderr, "\t\tanswer requests whose head, request line included, is longer than [size] bytes with 431 Request Header Fields Too Large (default: 16k)\n");
+	fprintf(stderr, "\n");
+
+	fprintf(stderr, "\t--max-headers [count]\n");
+	fprintf(stderr, "\t\tanswer requests with more than [count] header fields with 431 Request Header Fields Too Large (default: %d)\n", HTTP_REQUEST_MAX_HEADERS);
+	fprintf(stderr, "\t\tnote: [count] can't be more than %d\n", HTTP_REQUEST_MAX_HEADERS);
+	fprintf(stderr, "\n");
+
+	fprintf(stderr, "\t--request-memory [size]\n");
+	fprintf(stderr, "\t\tonce [size] bytes of requests are held in memory across all connections, answer further reads with 503 Service Unavailable\n");
+	fprintf(stderr, "\t\tnote: by default, there's no limit\n");
+	fprintf(stderr, "\n");
+
 	fprintf(stderr, "\t-t, --test\n");
 	fprintf(stderr, "\t\trun tests\n");
 	fprintf(stderr, "\n");
 
+	fprintf(stderr, "\t--bench\n");
+	fprintf(stderr, "\t\trun microbenchmarks\n");
+	fprintf(stderr, "\n");
+
 	fprintf(stderr, "\t-f [system], --fuzz [system]\n");
 	fprintf(stderr, "\t\tentrypoint for fuzzing [system] (so WIP it's literally one line of code)\n");
 	fprintf(stderr, "\n");
@@ -79,11 +202,44 @@ void arguments_parse(Arguments *self, int argc, const char **argv) {
 		.port = "3000",
 
 		.serve_path = ".",
+		.pack = NULL,
+		.pack_directory = NULL,
+		.pack_output = NULL,
+
+		.workers = 1,
+		.idle_timeout = 10,
+		.header_timeout = 10,
+		.send_timeout = 10,
+		.min_send_rate = 1024,
+		.sendfile_threshold = 1024 * 1024,
+		.mmap = false,
+		.cache_size = 0,
+		.watch = false,
+		.io_uring = false,
+
+		.max_request_line = HTTP_PARSER_DEFAULT_MAX_REQUEST_LINE,
+		.max_header_size = HTTP_PARSER_DEFAULT_MAX_HEAD,
+		.max_headers = HTTP_REQUEST_MAX_HEADERS,
+		.request_memory = 0,
 
 		.test = false,
+		.bench = false,
 		.fuzz = NULL,
 	};
 
+	// pack <directory> <output>
+	if (argc >= 2 && match(argv[1], "pack")) {
+		if (argc != 4) {
+			fprintf(stderr, "error: expected a directory and an output file after pack\n\n");
+			print_usage(argv[0]);
+			exit(1);
+		}
+
+		self->pack_directory = argv[2];
+		self->pack_output = argv[3];
+		return;
+	}
+
 	for (int i = 1; i < argc; i++) {
 		const char *arg = argv[i];
 
@@ -134,9 +290,289 @@ void arguments_parse(Arguments *self, int argc, const char **argv) {
 		} else if ((parsed = remove_prefix("--serve=", arg)) != NULL) {
 			self->serve_path = parsed;
 
+		// --workers [count], -w [count]
+		} else if (match(arg, "-w") || match(arg, "--workers")) {
+			i++;
+			if (i >= argc) {
+				fprintf(stderr, "error: expected worker count after %s\n\n", arg);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+			if (!parse_count(argv[i], &self->workers)) {
+				fprintf(stderr, "error: invalid worker count '%s'\n\n", argv[i]);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+		// --workers=[count]
+		} else if ((parsed = remove_prefix("--workers=", arg)) != NULL) {
+			if (!parse_count(parsed, &self->workers)) {
+				fprintf(stderr, "error: invalid worker count '%s'\n\n", parsed);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+		// --idle-timeout [seconds]
+		} else if (match(arg, "--idle-timeout")) {
+			i++;
+			if (i >= argc) {
+				fprintf(stderr, "error: expected timeout after %s\n\n", arg);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+			if (!parse_count(argv[i], &self->idle_timeout)) {
+				fprintf(stderr, "error: invalid timeout '%s'\n\n", argv[i]);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+		// --idle-timeout=[seconds]
+		} else if ((parsed = remove_prefix("--idle-timeout=", arg)) != NULL) {
+			if (!parse_count(parsed, &self->idle_timeout)) {
+				fprintf(stderr, "error: invalid timeout '%s'\n\n", parsed);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+		// --header-timeout [seconds]
+		} else if (match(arg, "--header-timeout")) {
+			i++;
+			if (i >= argc) {
+				fprintf(stderr, "error: expected timeout after %s\n\n", arg);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+			if (!parse_count(argv[i], &self->header_timeout)) {
+				fprintf(stderr, "error: invalid timeout '%s'\n\n", argv[i]);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+		// --header-timeout=[seconds]
+		} else if ((parsed = remove_prefix("--header-timeout=", arg)) != NULL) {
+			if (!parse_count(parsed, &self->header_timeout)) {
+				fprintf(stderr, "error: invalid timeout '%s'\n\n", parsed);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+		// --send-timeout [seconds]
+		} else if (match(arg, "--send-timeout")) {
+			i++;
+			if (i >= argc) {
+				fprintf(stderr, "error: expected timeout after %s\n\n", arg);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+			if (!parse_count(argv[i], &self->send_timeout)) {
+				fprintf(stderr, "error: invalid timeout '%s'\n\n", argv[i]);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+		// --send-timeout=[seconds]
+		} else if ((parsed = remove_prefix("--send-timeout=", arg)) != NULL) {
+			if (!parse_count(parsed, &self->send_timeout)) {
+				fprintf(stderr, "error: invalid timeout '%s'\n\n", parsed);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+		// --min-send-rate [size]
+		} else if (match(arg, "--min-send-rate")) {
+			i++;
+			if (i >= argc) {
+				fprintf(stderr, "error: expected rate after %s\n\n", arg);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+			if (!parse_size(argv[i], &self->min_send_rate)) {
+				fprintf(stderr, "error: invalid rate '%s'\n\n", argv[i]);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+		// --min-send-rate=[size]
+		} else if ((parsed = remove_prefix("--min-send-rate=", arg)) != NULL) {
+			if (!parse_size(parsed, &self->min_send_rate)) {
+				fprintf(stderr, "error: invalid rate '%s'\n\n", parsed);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+		// --sendfile-threshold [size]
+		} else if (match(arg, "--sendfile-threshold")) {
+			i++;
+			if (i >= argc) {
+				fprintf(stderr, "error: expected size after %s\n\n", arg);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+			if (!parse_size(argv[i], &self->sendfile_threshold)) {
+				fprintf(stderr, "error: invalid size '%s'\n\n", argv[i]);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+		// --sendfile-threshold=[size]
+		} else if ((parsed = remove_prefix("--sendfile-threshold=", arg)) != NULL) {
+			if (!parse_size(parsed, &self->sendfile_threshold)) {
+				fprintf(stderr, "error: invalid size '%s'\n\n", parsed);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+		// --cache-size [size]
+		} else if (match(arg, "--cache-size")) {
+			i++;
+			if (i >= argc) {
+				fprintf(stderr, "error: expected size after %s\n\n", arg);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+			if (!parse_size(argv[i], &self->cache_size)) {
+				fprintf(stderr, "error: invalid size '%s'\n\n", argv[i]);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+		// --cache-size=[size]
+		} else if ((parsed = remove_prefix("--cache-size=", arg)) != NULL) {
+			if (!parse_size(parsed, &self->cache_size)) {
+				fprintf(stderr, "error: invalid size '%s'\n\n", parsed);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+		} else if (match(arg, "--mmap")) {
+			self->mmap = true;
+
+		// --pack [file]
+		} else if (match(arg, "--pack")) {
+			i++;
+			if (i >= argc) {
+				fprintf(stderr, "error: expected path after %s\n\n", arg);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+			self->pack = argv[i];
+
+		// --pack=[file]
+		} else if ((parsed = remove_prefix("--pack=", arg)) != NULL) {
+			self->pack = parsed;
+
+		} else if (match(arg, "--watch")) {
+			self->watch = true;
+
+		} else if (match(arg, "--io-uring")) {
+			self->io_uring = true;
+
+		// --max-request-line [size]
+		} else if (match(arg, "--max-request-line")) {
+			i++;
+			if (i >= argc) {
+				fprintf(stderr, "error: expected size after %s\n\n", arg);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+			if (!parse_size(argv[i], &self->max_request_line)) {
+				fprintf(stderr, "error: invalid size '%s'\n\n", argv[i]);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+		// --max-request-line=[size]
+		} else if ((parsed = remove_prefix("--max-request-line=", arg)) != NULL) {
+			if (!parse_size(parsed, &self->max_request_line)) {
+				fprintf(stderr, "error: invalid size '%s'\n\n", parsed);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+		// --max-header-size [size]
+		} else if (match(arg, "--max-header-size")) {
+			i++;
+			if (i >= argc) {
+				fprintf(stderr, "error: expected size after %s\n\n", arg);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+			if (!parse_size(argv[i], &self->max_header_size)) {
+				fprintf(stderr, "error: invalid size '%s'\n\n", argv[i]);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+		// --max-header-size=[size]
+		} else if ((parsed = remove_prefix("--max-header-size=", arg)) != NULL) {
+			if (!parse_size(parsed, &self->max_header_size)) {
+				fprintf(stderr, "error: invalid size '%s'\n\n", parsed);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+		// --max-headers [count]
+		} else if (match(arg, "--max-headers")) {
+			i++;
+			if (i >= argc) {
+				fprintf(stderr, "error: expected header count after %s\n\n", arg);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+			if (!parse_count(argv[i], &self->max_headers) || self->max_headers > HTTP_REQUEST_MAX_HEADERS) {
+				fprintf(stderr, "error: invalid header count '%s'\n\n", argv[i]);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+		// --max-headers=[count]
+		} else if ((parsed = remove_prefix("--max-headers=", arg)) != NULL) {
+			if (!parse_count(parsed, &self->max_headers) || self->max_headers > HTTP_REQUEST_MAX_HEADERS) {
+				fprintf(stderr, "error: invalid header count '%s'\n\n", parsed);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+		// --request-memory [size]
+		} else if (match(arg, "--request-memory")) {
+			i++;
+			if (i >= argc) {
+				fprintf(stderr, "error: expected size after %s\n\n", arg);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+			if (!parse_size(argv[i], &self->request_memory)) {
+				fprintf(stderr, "error: invalid size '%s'\n\n", argv[i]);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
+		// --request-memory=[size]
+		} else if ((parsed = remove_prefix("--request-memory=", arg)) != NULL) {
+			if (!parse_size(parsed, &self->request_memory)) {
+				fprintf(stderr, "error: invalid size '%s'\n\n", parsed);
+				print_usage(argv[0]);
+				exit(1);
+			}
+
 		} else if (match(arg, "-t") || match(arg, "--test")) {
 			self->test = true;
 
+		} else if (match(arg, "--bench")) {
+			self->bench = true;
+
 		} else if (match(arg, "-f") || match(arg, "--fuzz")) {
 			i++;
 			if (i >= argc) {
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
 // Command-line arguments.
 // Always a pointer into `argv`, not allocated memory.
@@ -10,7 +11,63 @@ typedef struct Arguments {
 
 	const char *serve_path;
 
+	// Serve from a pack written by `userve pack`, instead of from `serve_path`.
+	const char *pack;
+
+	// `userve pack <directory> <output>` packs `pack_directory` into
+	// `pack_output` and exits.
+	const char *pack_directory;
+	const char *pack_output;
+
+	// Number of worker threads, each with its own event loop. Zero means one
+	// per online CPU.
+	unsigned workers;
+
+	// Close connections that have been idle for this many seconds. Zero means
+	// never.
+	unsigned idle_timeout;
+
+	// Close connections that take longer than this many seconds to send the
+	// rest of a request's head once it's started, or to take any of their
+	// output. Zero means never.
+	unsigned header_timeout;
+	unsigned send_timeout;
+
+	// Bytes per second that clients have to keep taking their output at.
+	size_t min_send_rate;
+
+	// Files larger than this many bytes are sent from disk with `sendfile`,
+	// instead of being loaded into memory.
+	size_t sendfile_threshold;
+
+	// Map files into memory instead of reading them.
+	bool mmap;
+
+	// Load files lazily, and keep at most this many bytes of them in memory.
+	// Zero means load everything up front.
+	size_t cache_size;
+
+	// Pick up changes to the served directory while running.
+	bool watch;
+
+	// Serve with io_uring instead of epoll, if the kernel supports it.
+	bool io_uring;
+
+	// Requests with a longer request line, a longer head, or more header
+	// fields than these are turned away.
+	size_t max_request_line;
+	size_t max_header_size;
+	unsigned max_headers;
+
+	// Stop reading requests once this many bytes of them are held in memory,
+	// across all connections. Zero means no limit.
+	size_t request_memory;
+
 	bool test;
+
+	// Run microbenchmarks instead of serving.
+	bool bench;
+
 	const char *fuzz;
 } Arguments;
 
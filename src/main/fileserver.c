@@ -7,106 +7,1137 @@
 
 #include <assert.h>
 #include <dirent.h>
-#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
+
+// Mapped files up to this size are faulted in at startup.
+#define FILESERVER_MMAP_WILLNEED_MAX (256 * 1024)
+
+// An update's overlay is merged into a new base once it has more files than
+// both of these: a fixed minimum, and a fraction of the base.
+#define FILESERVER_OVERLAY_MAX 64
+#define FILESERVER_OVERLAY_BASE_RATIO 8
+
+// Files that turn out to be bigger than they were when they were measured are
+// read the rest of the way in chunks of this size.
+#define FILESERVER_READ_CHUNK (64 * 1024)
+
+// Directories with fewer files than this are loaded on the updating thread;
+// starting loader threads isn't worth it.
+#define FILESERVER_PARALLEL_LOAD_MIN 64
+
+// Most threads that load files at once.
+#define FILESERVER_LOAD_THREADS_MAX 64
 
 void fileserver_init(FileServer *self) {
 	set_undefined(self, sizeof(*self));
 
-	hashmap_init(&self->files, sizeof(StaticFile));
+	self->sendfile_threshold = SIZE_MAX;
+	self->use_mmap = false;
+	self->load_threads = 0;
+	self->load_stats = (FileServerLoadStats) { 0 };
+
+	self->snapshot = NULL;
+	self->epoch = 1;
+	pthread_mutex_init(&self->update_lock, NULL);
+	self->readers = NULL;
+
+	self->cache_size = 0;
+	self->cache_max_fds = FILESERVER_CACHE_MAX_FDS;
+	pthread_mutex_init(&self->cache_lock, NULL);
+	self->cache_oldest = NULL;
+	self->cache_newest = NULL;
+	self->cache_stats = (FileServerCacheStats) { 0 };
+}
+
+static void fileserver_snapshot_free(FileServer *self, FileServerSnapshot *snapshot);
+
+void fileserver_deinit(FileServer *self) {
+	assert(self->readers == NULL);
+
+	if (self->snapshot != NULL) fileserver_snapshot_free(self, self->snapshot);
+
+	pthread_mutex_destroy(&self->update_lock);
+	pthread_mutex_destroy(&self->cache_lock);
+}
+
+void loaded_file_release(void *userdata) {
+	LoadedFile *self = (LoadedFile*) userdata;
+
+	if (__atomic_sub_fetch(&self->references, 1, __ATOMIC_ACQ_REL) > 0) return;
+
+	if (self->contents_mapped) {
+		munmap(self->contents.bytes, self->contents.len);
+	} else {
+		slice_free(self->contents);
+	}
+	slice_free(self->head);
+	if (self->fd != -1) close(self->fd);
+
+	slice_free(self->gzip_head);
+	slice_free(self->gzip_contents);
+
+	slice_free(self->etag);
+	slice_free(self->gzip_etag);
+	slice_free(self->last_modified);
+	slice_free(self->not_modified_head);
+	slice_free(self->gzip_not_modified_head);
+
+	free(self);
+}
+
+// Read all of `fd`, which is expected to be `size` bytes long, into a new
+// allocation.
+static Error read_contents(int fd, size_t size, Slice *out_contents) {
+	Error err;
+
+	Buffer file_contents;
+	buffer_init(&file_contents);
+
+	// One byte more than expected, so that the read that finds the end of the
+	// file doesn't need a bigger buffer.
+	size_t chunk_size = size + 1;
+
+	while (true) {
+		err = buffer_reserve_additional(&file_contents, chunk_size);
+		if (err != ERR_SUCCESS) {
+			buffer_deinit(&file_contents);
+			return err;
+		}
+
+		Slice uninit = buffer_uninitialized(&file_contents);
+		ssize_t read_amount = read(fd, uninit.bytes, uninit.len);
+		if (read_amount == -1 && errno == EINTR) continue;
+		if (read_amount == -1) {
+			buffer_deinit(&file_contents);
+			return ERR_UNKNOWN;
+		}
+		if (read_amount == 0) break;
+
+		// The last `read_amount` bytes of `file_contents` were written to by `read`.
+		// Update its length accordingly.
+		file_contents.len += read_amount;
+
+		// The file grew since it was measured.
+		chunk_size = FILESERVER_READ_CHUNK;
+	}
+
+	*out_contents = buffer_to_owned(&file_contents);
+
+	return ERR_SUCCESS;
+}
+
+// Read the `.gz` sidecar of the file at `path`, if it has one. Empty if it
+// doesn't, or if it isn't gzip.
+static Error read_sidecar(const char *path, Slice *out_gzip) {
+	*out_gzip = slice_new();
+
+	Buffer sidecar_path;
+	buffer_init(&sidecar_path);
+
+	Error err = buffer_concat_printf(&sidecar_path, "%s.gz", path);
+	if (err == ERR_SUCCESS) {
+		err = buffer_concat(&sidecar_path, slice_from_len((uint8_t*) "\x00", 1));
+	}
+	if (err != ERR_SUCCESS) {
+		buffer_deinit(&sidecar_path);
+		return err;
+	}
+
+	int fd = open((const char*) sidecar_path.bytes, O_RDONLY | O_CLOEXEC);
+	buffer_deinit(&sidecar_path);
+	if (fd == -1) return ERR_SUCCESS;
+
+	struct stat sidecar_stat;
+	if (fstat(fd, &sidecar_stat) != 0 || !S_ISREG(sidecar_stat.st_mode)) {
+		close(fd);
+		return ERR_SUCCESS;
+	}
+
+	Slice gzip;
+	err = read_contents(fd, sidecar_stat.st_size, &gzip);
+	close(fd);
+	if (err != ERR_SUCCESS) return err;
+
+	if (gzip.len < 2 || gzip.bytes[0] != 0x1f || gzip.bytes[1] != 0x8b) {
+		slice_free(gzip);
+		return ERR_SUCCESS;
+	}
+
+	*out_gzip = gzip;
+
+	return ERR_SUCCESS;
+}
+
+Error fileserver_compress_file(const StaticFile *file, Slice contents, int level, Slice *out_gzip) {
+	Error err;
+
+	Slice gzip;
+	err = read_sidecar(file->path, &gzip);
+	if (err != ERR_SUCCESS) return err;
+
+	if (gzip.len == 0 && content_type_is_compressible(file->content_type)) {
+		Buffer compressed;
+		buffer_init(&compressed);
+
+		err = gzip_compress(contents, level, &compressed);
+		if (err != ERR_SUCCESS) {
+			buffer_deinit(&compressed);
+			return err;
+		}
+
+		gzip = buffer_to_owned(&compressed);
+	}
+
+	// Small files, and ones that are compressed already, don't shrink.
+	if (gzip.len >= contents.len) {
+		slice_free(gzip);
+		gzip = slice_new();
+	}
+
+	*out_gzip = gzip;
+
+	return ERR_SUCCESS;
+}
+
+// Format the heads of the responses for one representation of a file of
+// `content_type`: the 200 with a body of `size` bytes, compressed with
+// `encoding` unless it's empty, and the 304 for clients that already have it.
+// `vary` says that another representation is served to other clients.
+static Error fileserver_format_heads(
+	Slice content_type,
+	Slice encoding,
+	Slice etag,
+	Slice last_modified,
+	bool vary,
+	size_t size,
+	Slice *out_head,
+	Slice *out_not_modified_head
+) {
+	Buffer head, not_modified_head;
+	buffer_init(&head);
+	buffer_init(&not_modified_head);
+
+	Error err = http_response_head_begin(&head, HTTP_OK);
+	if (err == ERR_SUCCESS) {
+		err = http_response_head_add_header(&head, slice_from_cstr("Content-Type"), content_type);
+	}
+	if (err == ERR_SUCCESS && encoding.len > 0) {
+		err = http_response_head_add_header(&head, slice_from_cstr("Content-Encoding"), encoding);
+	}
+	if (err == ERR_SUCCESS) {
+		err = http_response_head_add_header(&head, slice_from_cstr("Accept-Ranges"), slice_from_cstr("bytes"));
+	}
+
+	// A 304 has the validators and `Vary`, so that caches can update what
+	// they have, and nothing about a body that isn't there.
+	if (err == ERR_SUCCESS) {
+		err = http_response_head_begin(&not_modified_head, HTTP_NOT_MODIFIED);
+	}
+
+	Buffer *heads[] = { &head, &not_modified_head };
+	for (size_t i = 0; i < 2 && err == ERR_SUCCESS; i++) {
+		err = http_response_head_add_header(heads[i], slice_from_cstr("ETag"), etag);
+		if (err == ERR_SUCCESS) {
+			err = http_response_head_add_header(heads[i], slice_from_cstr("Last-Modified"), last_modified);
+		}
+		if (err == ERR_SUCCESS && vary) {
+			err = http_response_head_add_header(heads[i], slice_from_cstr("Vary"), slice_from_cstr("Accept-Encoding"));
+		}
+	}
+
+	if (err == ERR_SUCCESS) {
+		err = http_response_head_end(&head, size);
+	}
+	if (err == ERR_SUCCESS) {
+		err = http_response_head_end_without_body(&not_modified_head);
+	}
+
+	if (err != ERR_SUCCESS) {
+		buffer_deinit(&head);
+		buffer_deinit(&not_modified_head);
+		return err;
+	}
+
+	*out_head = buffer_to_owned(&head);
+	*out_not_modified_head = buffer_to_owned(&not_modified_head);
+
+	return ERR_SUCCESS;
+}
+
+// Format the strong ETag for contents with `hash`, with `suffix` inside the
+// quotes.
+static Error fileserver_format_etag(uint64_t hash, const char *suffix, Slice *out_etag) {
+	Buffer etag;
+	buffer_init(&etag);
+
+	Error err = format_etag(&etag, hash, suffix);
+	if (err != ERR_SUCCESS) {
+		buffer_deinit(&etag);
+		return err;
+	}
+
+	*out_etag = buffer_to_owned(&etag);
+
+	return ERR_SUCCESS;
+}
+
+// Load `file` from disk, with a single reference held by the caller. If it's
+// compressed, it's compressed at `gzip_level`.
+static Error fileserver_load_file(
+	FileServer *self,
+	const StaticFile *file,
+	int gzip_level,
+	LoadedFile **out_loaded
+) {
+	Error err;
+
+	int fd = open(file->path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return ERR_NOT_FOUND;
+
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0) {
+		close(fd);
+		return ERR_NOT_FOUND;
+	}
+
+	LoadedFile *loaded = malloc(sizeof(*loaded));
+	if (loaded == NULL) {
+		close(fd);
+		return ERR_OUT_OF_MEMORY;
+	}
+
+	*loaded = (LoadedFile) {
+		.references = 1,
+		.head = slice_new(),
+		.contents = slice_new(),
+		.contents_mapped = false,
+		.fd = -1,
+		.size = file_stat.st_size,
+		.gzip_head = slice_new(),
+		.gzip_contents = slice_new(),
+		.etag = slice_new(),
+		.gzip_etag = slice_new(),
+		.modified = file_stat.st_mtime,
+		.last_modified = slice_new(),
+		.content_type = file->content_type,
+		.not_modified_head = slice_new(),
+		.gzip_not_modified_head = slice_new(),
+	};
+
+	if (loaded->size > self->sendfile_threshold) {
+		// Big files stay on disk, and are sent from there.
+		loaded->fd = fd;
+	} else if (self->use_mmap && loaded->size > 0) {
+		// Empty files can't be mapped, and don't need to be.
+		void *mapping = mmap(NULL, loaded->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (mapping == MAP_FAILED) {
+			free(loaded);
+			return ERR_OUT_OF_MEMORY;
+		}
+
+		// Small files are likely to be asked for over and over, and are
+		// faulted in now. Big ones are read front to back when they're sent.
+		int advice = loaded->size <= FILESERVER_MMAP_WILLNEED_MAX ? MADV_WILLNEED : MADV_SEQUENTIAL;
+		(void) madvise(mapping, loaded->size, advice);
+
+		loaded->contents = slice_from_len(mapping, loaded->size);
+		loaded->contents_mapped = true;
+	} else {
+		err = read_contents(fd, loaded->size, &loaded->contents);
+		close(fd);
+		if (err != ERR_SUCCESS) {
+			free(loaded);
+			return err;
+		}
+
+		loaded->size = loaded->contents.len;
+	}
+
+	// Files sent from disk are never compressed.
+	if (loaded->fd == -1) {
+		err = fileserver_compress_file(file, loaded->contents, gzip_level, &loaded->gzip_contents);
+		if (err != ERR_SUCCESS) {
+			loaded_file_release(loaded);
+			return err;
+		}
+	}
+
+	bool vary = loaded->gzip_contents.len > 0;
+
+	// Validators are worked out once, here, so that answering a conditional
+	// request costs no more than answering any other. Contents in memory are
+	// hashed; files sent from disk are too big to read through on every load,
+	// so they're identified by their inode, modification time and size.
+	Buffer last_modified;
+	buffer_init(&last_modified);
+
+	err = format_http_date(&last_modified, loaded->modified);
+	if (err == ERR_SUCCESS) {
+		loaded->last_modified = buffer_to_owned(&last_modified);
+	} else {
+		buffer_deinit(&last_modified);
+	}
+
+	if (err == ERR_SUCCESS && loaded->fd != -1) {
+		Buffer etag;
+		buffer_init(&etag);
+
+		err = format_file_etag(
+			&etag,
+			file_stat.st_ino,
+			(int64_t) file_stat.st_mtim.tv_sec * 1000000000 + file_stat.st_mtim.tv_nsec,
+			loaded->size
+		);
+		if (err == ERR_SUCCESS) {
+			loaded->etag = buffer_to_owned(&etag);
+		} else {
+			buffer_deinit(&etag);
+		}
+	} else if (err == ERR_SUCCESS) {
+		err = fileserver_format_etag(content_hash(loaded->contents), "", &loaded->etag);
+	}
+	if (err == ERR_SUCCESS) {
+		err = fileserver_format_heads(
+			file->content_type,
+			slice_new(),
+			loaded->etag,
+			loaded->last_modified,
+			vary,
+			loaded->size,
+			&loaded->head,
+			&loaded->not_modified_head
+		);
+	}
+
+	// The compressed copy is a different representation, with an ETag of its
+	// own. It's hashed separately, because a `.gz` sidecar can change without
+	// the file changing.
+	if (err == ERR_SUCCESS && vary) {
+		err = fileserver_format_etag(content_hash(loaded->gzip_contents), "-gzip", &loaded->gzip_etag);
+	}
+	if (err == ERR_SUCCESS && vary) {
+		err = fileserver_format_heads(
+			file->content_type,
+			slice_from_cstr("gzip"),
+			loaded->gzip_etag,
+			loaded->last_modified,
+			vary,
+			loaded->gzip_contents.len,
+			&loaded->gzip_head,
+			&loaded->gzip_not_modified_head
+		);
+	}
+
+	if (err != ERR_SUCCESS) {
+		loaded_file_release(loaded);
+		return err;
+	}
+
+	*out_loaded = loaded;
+
+	return ERR_SUCCESS;
+}
+
+static void fileserver_cache_unlink(FileServer *self, StaticFile *file) {
+	if (file->prev != NULL) {
+		file->prev->next = file->next;
+	} else {
+		self->cache_oldest = file->next;
+	}
+
+	if (file->next != NULL) {
+		file->next->prev = file->prev;
+	} else {
+		self->cache_newest = file->prev;
+	}
+}
+
+static void fileserver_cache_append(FileServer *self, StaticFile *file) {
+	file->prev = self->cache_newest;
+	file->next = NULL;
+
+	if (self->cache_newest != NULL) {
+		self->cache_newest->next = file;
+	} else {
+		self->cache_oldest = file;
+	}
+
+	self->cache_newest = file;
+}
+
+// Take `file` out of the cache's list and counts, leaving it loaded. Must be
+// called with `cache_lock` held.
+static void fileserver_cache_forget(FileServer *self, StaticFile *file) {
+	fileserver_cache_unlink(self, file);
+
+	self->cache_stats.used -= file->cost;
+	if (file->loaded->fd != -1) self->cache_stats.fds -= 1;
+}
+
+static void fileserver_cache_unload(FileServer *self, StaticFile *file) {
+	fileserver_cache_forget(self, file);
+
+	self->cache_stats.evictions += 1;
+
+	// Responses that are still being written keep their own references.
+	loaded_file_release(file->loaded);
+	file->loaded = NULL;
+}
+
+// Unload the least recently used files until the cache is within budget,
+// sparing `keep`. Must be called with `cache_lock` held.
+static void fileserver_cache_evict(FileServer *self, StaticFile *keep) {
+	while (self->cache_stats.used > self->cache_size) {
+		StaticFile *oldest = self->cache_oldest;
+		if (oldest == keep) oldest = oldest->next;
+		if (oldest == NULL) break;
+
+		fileserver_cache_unload(self, oldest);
+	}
+
+	// Files sent from disk hardly use any memory, but each one holds a
+	// descriptor open.
+	while (self->cache_stats.fds > self->cache_max_fds) {
+		StaticFile *oldest = self->cache_oldest;
+		while (oldest != NULL && (oldest == keep || oldest->loaded->fd == -1)) {
+			oldest = oldest->next;
+		}
+		if (oldest == NULL) break;
+
+		fileserver_cache_unload(self, oldest);
+	}
+}
+
+// Get a reference to `file`'s loaded contents, loading them if they aren't in
+// the cache.
+static Error fileserver_cache_get(FileServer *self, StaticFile *file, LoadedFile **out_loaded) {
+	pthread_mutex_lock(&self->cache_lock);
+
+	if (file->loaded != NULL) {
+		__atomic_add_fetch(&file->loaded->references, 1, __ATOMIC_RELAXED);
+		*out_loaded = file->loaded;
+
+		fileserver_cache_unlink(self, file);
+		fileserver_cache_append(self, file);
+
+		self->cache_stats.hits += 1;
+
+		pthread_mutex_unlock(&self->cache_lock);
+		return ERR_SUCCESS;
+	}
+
+	self->cache_stats.misses += 1;
+
+	pthread_mutex_unlock(&self->cache_lock);
+
+	// Other workers can keep serving while this one reads from disk.
+	LoadedFile *loaded;
+	Error err = fileserver_load_file(self, file, FILESERVER_CACHE_GZIP_LEVEL, &loaded);
+	if (err != ERR_SUCCESS) return err;
+
+	pthread_mutex_lock(&self->cache_lock);
+
+	if (file->loaded != NULL) {
+		// Another worker loaded it in the meantime; use theirs.
+		loaded_file_release(loaded);
+
+		loaded = file->loaded;
+		__atomic_add_fetch(&loaded->references, 1, __ATOMIC_RELAXED);
+	} else {
+		// One reference for the cache, and one for the caller.
+		loaded->references = 2;
+
+		file->loaded = loaded;
+		file->cost =
+			loaded->head.len +
+			loaded->contents.len +
+			loaded->gzip_head.len +
+			loaded->gzip_contents.len +
+			loaded->last_modified.len +
+			loaded->not_modified_head.len +
+			loaded->gzip_not_modified_head.len;
+		fileserver_cache_append(self, file);
+
+		self->cache_stats.used += file->cost;
+		if (loaded->fd != -1) self->cache_stats.fds += 1;
+
+		fileserver_cache_evict(self, file);
+	}
+
+	pthread_mutex_unlock(&self->cache_lock);
+
+	*out_loaded = loaded;
+
+	return ERR_SUCCESS;
+}
+
+FileServerCacheStats fileserver_cache_stats(FileServer *self) {
+	pthread_mutex_lock(&self->cache_lock);
+
+	FileServerCacheStats stats = self->cache_stats;
+	stats.size = self->cache_size;
+
+	pthread_mutex_unlock(&self->cache_lock);
+
+	return stats;
+}
+
+void fileserver_reader_init(FileServerReader *self, FileServer *fileserver) {
+	set_undefined(self, sizeof(*self));
+
+	self->fileserver = fileserver;
+	self->epoch = 0;
+
+	pthread_mutex_lock(&fileserver->update_lock);
+	self->next = fileserver->readers;
+	fileserver->readers = self;
+	pthread_mutex_unlock(&fileserver->update_lock);
+}
+
+void fileserver_reader_deinit(FileServerReader *self) {
+	FileServer *fileserver = self->fileserver;
+
+	pthread_mutex_lock(&fileserver->update_lock);
+
+	FileServerReader **cursor = &fileserver->readers;
+	while (*cursor != self) cursor = &(*cursor)->next;
+	*cursor = self->next;
+
+	pthread_mutex_unlock(&fileserver->update_lock);
+
+	set_undefined(self, sizeof(*self));
+}
+
+// Start a lookup, and return the snapshot to look in, which stays valid until
+// `fileserver_reader_leave`. Never blocks.
+static FileServerSnapshot *fileserver_reader_enter(FileServerReader *self) {
+	FileServer *fileserver = self->fileserver;
+
+	// If the epoch we announce is older than an update's, that update waits for
+	// us. If it isn't, the update had already published its snapshot before we
+	// read the epoch, so that's the snapshot we load.
+	uint64_t epoch = __atomic_load_n(&fileserver->epoch, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&self->epoch, epoch, __ATOMIC_SEQ_CST);
+
+	return __atomic_load_n(&fileserver->snapshot, __ATOMIC_SEQ_CST);
+}
+
+static void fileserver_reader_leave(FileServerReader *self) {
+	__atomic_store_n(&self->epoch, 0, __ATOMIC_RELEASE);
+}
+
+// Wait until no reader can still be looking at a snapshot that was replaced
+// before this was called. Must be called with `update_lock` held.
+static void fileserver_synchronize(FileServer *self) {
+	uint64_t epoch = __atomic_add_fetch(&self->epoch, 1, __ATOMIC_SEQ_CST);
+
+	for (FileServerReader *reader = self->readers; reader != NULL; reader = reader->next) {
+		while (true) {
+			uint64_t reader_epoch = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST);
+			if (reader_epoch == 0 || reader_epoch >= epoch) break;
+
+			// Lookups are short, unless they're loading a file into the cache.
+			sched_yield();
+		}
+	}
+}
+
+static void static_file_free(StaticFile *file) {
+	// Responses that are still being written keep their own references.
+	if (file->loaded != NULL) loaded_file_release(file->loaded);
+
+	free(file->path);
+	free(file);
+}
+
+// Drop one index's reference to `file`, freeing it once no index contains it.
+// By then, no reader can reach it anymore.
+static void fileserver_file_unref(FileServer *self, StaticFile *file) {
+	file->references -= 1;
+	if (file->references > 0) return;
+
+	// Readers may still be evicting it.
+	if (self->cache_size > 0) {
+		pthread_mutex_lock(&self->cache_lock);
+
+		if (file->loaded != NULL) fileserver_cache_forget(self, file);
+
+		pthread_mutex_unlock(&self->cache_lock);
+	}
+
+	static_file_free(file);
+}
+
+static FileIndex *file_index_new(void) {
+	FileIndex *index = malloc(sizeof(*index));
+	if (index == NULL) return NULL;
+
+	hashmap_init(&index->files, sizeof(StaticFile*));
+	index->count = 0;
+	index->references = 1;
+
+	return index;
+}
+
+// Drop one reference to `index`, freeing it, and dropping its references to
+// its files, if that was the last one.
+static void fileserver_index_unref(FileServer *self, FileIndex *index) {
+	if (index == NULL) return;
+
+	index->references -= 1;
+	if (index->references > 0) return;
+
+	HashMapIterator it = { 0 };
+
+	HashMapEntry entry;
+	while ((entry = hashmap_next(&index->files, &it)).occupied) {
+		slice_free(*entry.key_ptr);
+
+		StaticFile *file = *(StaticFile**) entry.value_ptr;
+		if (file != NULL) fileserver_file_unref(self, file);
+	}
+
+	hashmap_deinit(&index->files);
+	free(index);
+}
+
+// Map `url` to `file` in `index`, which mustn't be published yet, replacing
+// whatever it was mapped to.
+static Error fileserver_index_put(
+	FileServer *self,
+	FileIndex *index,
+	Slice url,
+	StaticFile *file
+) {
+	HashMapEntry entry;
+	Error err = hashmap_put(&index->files, url, &entry);
+	if (err != ERR_SUCCESS) return err;
+
+	StaticFile **value = (StaticFile**) entry.value_ptr;
+
+	// Taken before the old file is let go of, in case they're the same.
+	if (file != NULL) file->references += 1;
+
+	if (entry.occupied) {
+		if (*value != NULL) fileserver_file_unref(self, *value);
+	} else {
+		*entry.key_ptr = slice_clone(url);
+		index->count += 1;
+	}
+
+	*value = file;
+
+	return ERR_SUCCESS;
+}
+
+// A new index with the same contents as `index`, or an empty one if `index` is
+// `NULL`.
+static FileIndex *fileserver_index_copy(FileServer *self, FileIndex *index) {
+	FileIndex *copy = file_index_new();
+	if (copy == NULL || index == NULL) return copy;
+
+	HashMapIterator it = { 0 };
+
+	HashMapEntry entry;
+	while ((entry = hashmap_next(&index->files, &it)).occupied) {
+		Error err = fileserver_index_put(self, copy, *entry.key_ptr, *(StaticFile**) entry.value_ptr);
+		if (err != ERR_SUCCESS) {
+			fileserver_index_unref(self, copy);
+			return NULL;
+		}
+	}
+
+	return copy;
+}
+
+// A new index with everything from `overlay` on top of `base`, leaving out
+// removed files.
+static FileIndex *fileserver_index_merge(FileServer *self, FileIndex *base, FileIndex *overlay) {
+	FileIndex *merged = file_index_new();
+	if (merged == NULL) return NULL;
+
+	Error err = ERR_SUCCESS;
+	HashMapIterator it = { 0 };
+	HashMapEntry entry;
+
+	while (base != NULL && err == ERR_SUCCESS && (entry = hashmap_next(&base->files, &it)).occupied) {
+		if (hashmap_get(&overlay->files, *entry.key_ptr).occupied) continue;
+
+		err = fileserver_index_put(self, merged, *entry.key_ptr, *(StaticFile**) entry.value_ptr);
+	}
+
+	it = (HashMapIterator) { 0 };
+
+	while (err == ERR_SUCCESS && (entry = hashmap_next(&overlay->files, &it)).occupied) {
+		StaticFile *file = *(StaticFile**) entry.value_ptr;
+		if (file == NULL) continue;
+
+		err = fileserver_index_put(self, merged, *entry.key_ptr, file);
+	}
+
+	if (err != ERR_SUCCESS) {
+		fileserver_index_unref(self, merged);
+		return NULL;
+	}
+
+	return merged;
+}
+
+static void fileserver_snapshot_free(FileServer *self, FileServerSnapshot *snapshot) {
+	fileserver_index_unref(self, snapshot->base);
+	fileserver_index_unref(self, snapshot->overlay);
+
+	free(snapshot);
+}
+
+// The file served at `url` in `snapshot`, or `NULL`.
+static StaticFile *fileserver_snapshot_get(FileServerSnapshot *snapshot, Slice url) {
+	if (snapshot == NULL) return NULL;
+
+	HashMapEntry entry = hashmap_get(&snapshot->overlay->files, url);
+	if (entry.occupied) return *(StaticFile**) entry.value_ptr;
+
+	if (snapshot->base == NULL) return NULL;
+
+	entry = hashmap_get(&snapshot->base->files, url);
+	if (entry.occupied) return *(StaticFile**) entry.value_ptr;
+
+	return NULL;
+}
+
+// The URL that a file is served at, given the URL of its path.
+static Slice fileserver_served_url(Slice url) {
+	// /path/index.html -> /path/
+	slice_remove_suffix(&url, slice_from_cstr("index.html"));
+
+	// /path.html -> /path
+	slice_remove_suffix(&url, slice_from_cstr(".html"));
+
+	return url;
+}
+
+// The base of the snapshot that the update is replacing.
+static FileIndex *fileserver_update_base(FileServerUpdate *self) {
+	FileServerSnapshot *current = self->fileserver->snapshot;
+
+	return current != NULL ? current->base : NULL;
+}
+
+Error fileserver_update_begin(FileServer *fileserver, FileServerUpdate *self) {
+	set_undefined(self, sizeof(*self));
+
+	self->fileserver = fileserver;
+	self->on_directory = NULL;
+	self->on_directory_userdata = NULL;
+
+	self->snapshot = malloc(sizeof(*self->snapshot));
+	if (self->snapshot == NULL) return ERR_OUT_OF_MEMORY;
+
+	pthread_mutex_lock(&fileserver->update_lock);
+
+	// Nothing else replaces the snapshot while we hold the lock.
+	FileServerSnapshot *current = fileserver->snapshot;
+	self->overlay = fileserver_index_copy(fileserver, current != NULL ? current->overlay : NULL);
+	if (self->overlay == NULL) {
+		pthread_mutex_unlock(&fileserver->update_lock);
+		free(self->snapshot);
+		return ERR_OUT_OF_MEMORY;
+	}
+
+	return ERR_SUCCESS;
 }
 
-void fileserver_deinit(FileServer *self) {
-	HashMapIterator it = { 0 };
+// A file that isn't in any index yet, or `NULL` if out of memory.
+static StaticFile *static_file_new(const char *path) {
+	StaticFile *file = malloc(sizeof(*file));
+	if (file == NULL) return NULL;
 
-	HashMapEntry entry;
-	while ((entry = hashmap_next(&self->files, &it)).occupied) {
-		slice_free(*entry.key_ptr);
+	*file = (StaticFile) {
+		.references = 0,
+		.content_type = detect_content_type(slice_from_cstr(path)),
+		.path = strdup(path),
+		.loaded = NULL,
+		.cost = 0,
+		.prev = NULL,
+		.next = NULL,
+	};
 
-		StaticFile *file = (StaticFile*) entry.value_ptr;
-		slice_free(file->contents);
+	if (file->path == NULL) {
+		free(file);
+		return NULL;
 	}
 
-	hashmap_deinit(&self->files);
+	return file;
 }
 
-static Error fileserver_load_file(
-	FileServer *self,
-	const char *path,
-	Slice url
-) {
-	Error err;
+// Add `file`, whose path has the URL `url`, to the update's overlay.
+static Error fileserver_update_put_file(FileServerUpdate *self, Slice url, StaticFile *file) {
+	FileServer *fileserver = self->fileserver;
 
-	FILE *fp = fopen(path, "rb");
-	if (fp == NULL) return ERR_NOT_FOUND;
+	Error err = fileserver_index_put(fileserver, self->overlay, fileserver_served_url(url), file);
+	if (err != ERR_SUCCESS) return err;
 
-	Buffer file_contents;
-	buffer_init(&file_contents);
+	fileserver->load_stats.files += 1;
+	if (file->loaded != NULL) fileserver->load_stats.bytes += file->loaded->contents.len;
 
-	size_t chunk_size = 128;
+	return ERR_SUCCESS;
+}
 
-	while (true) {
-		err = buffer_reserve_additional(&file_contents, chunk_size);
+Error fileserver_update_add_file(FileServerUpdate *self, const char *path, Slice url) {
+	Error err;
+
+	StaticFile *file = static_file_new(path);
+	if (file == NULL) return ERR_OUT_OF_MEMORY;
+
+	if (self->fileserver->cache_size == 0) {
+		err = fileserver_load_file(self->fileserver, file, FILESERVER_GZIP_LEVEL, &file->loaded);
 		if (err != ERR_SUCCESS) {
-			fclose(fp);
-			buffer_deinit(&file_contents);
+			static_file_free(file);
 			return err;
 		}
+	}
 
-		Slice uninit = buffer_uninitialized(&file_contents);
-		size_t read_amount = fread(uninit.bytes, 1, uninit.len, fp);
-		if (read_amount == 0) break;
+	err = fileserver_update_put_file(self, url, file);
+	if (err != ERR_SUCCESS) {
+		static_file_free(file);
+		return err;
+	}
 
-		// The last `read_amount` bytes of `file_contents` were written to by `fread`.
-		// Update its length accordingly.
-		file_contents.len += read_amount;
+	return ERR_SUCCESS;
+}
 
-		chunk_size = read_amount * 2;
+// Stop serving whatever is at the served URL `url`.
+static Error fileserver_update_remove(FileServerUpdate *self, Slice url) {
+	if (!hashmap_get(&self->overlay->files, url).occupied) {
+		FileIndex *base = fileserver_update_base(self);
+		if (base == NULL || !hashmap_get(&base->files, url).occupied) return ERR_SUCCESS;
 	}
 
-	fclose(fp);
+	return fileserver_index_put(self->fileserver, self->overlay, url, NULL);
+}
 
-	// /path/index.html -> /path/
-	slice_remove_suffix(&url, slice_from_cstr("index.html"));
+Error fileserver_update_remove_file(FileServerUpdate *self, Slice url) {
+	return fileserver_update_remove(self, fileserver_served_url(url));
+}
 
-	// /path.html -> /path
-	slice_remove_suffix(&url, slice_from_cstr(".html"));
+// Whether `url` starts with `prefix`.
+static bool url_has_prefix(Slice url, Slice prefix) {
+	return url.len >= prefix.len && memcmp(url.bytes, prefix.bytes, prefix.len) == 0;
+}
 
-	HashMapEntry entry;
-	err = hashmap_put(&self->files, url, &entry);
+Error fileserver_update_remove_directory(FileServerUpdate *self, Slice url) {
+	Error err;
+
+	Buffer prefix;
+	buffer_init(&prefix);
+
+	err = buffer_concat(&prefix, url);
+	if (err == ERR_SUCCESS && (url.len == 0 || url.bytes[url.len - 1] != '/')) {
+		err = buffer_concat(&prefix, slice_from_cstr("/"));
+	}
 	if (err != ERR_SUCCESS) {
-		buffer_deinit(&file_contents);
+		buffer_deinit(&prefix);
 		return err;
 	}
 
-	assert(!entry.occupied);
+	// Nothing keeps an index of directories, so this looks at every file.
+	HashMapIterator it = { 0 };
+	HashMapEntry entry;
+
+	while ((entry = hashmap_next(&self->overlay->files, &it)).occupied) {
+		StaticFile **value = (StaticFile**) entry.value_ptr;
+		if (*value == NULL || !url_has_prefix(*entry.key_ptr, buffer_slice(&prefix))) continue;
+
+		fileserver_file_unref(self->fileserver, *value);
+		*value = NULL;
+	}
 
-	*entry.key_ptr = slice_clone(url);
-	StaticFile *file = (StaticFile*) entry.value_ptr;
+	FileIndex *base = fileserver_update_base(self);
+	it = (HashMapIterator) { 0 };
 
-	file->content_type = detect_content_type(slice_from_cstr(path));
-	file->contents = buffer_to_owned(&file_contents);
+	while (base != NULL && err == ERR_SUCCESS && (entry = hashmap_next(&base->files, &it)).occupied) {
+		if (!url_has_prefix(*entry.key_ptr, buffer_slice(&prefix))) continue;
 
-	return ERR_SUCCESS;
+		err = fileserver_index_put(self->fileserver, self->overlay, *entry.key_ptr, NULL);
+	}
+
+	buffer_deinit(&prefix);
+
+	return err;
 }
 
-Error fileserver_register_directory(
-	FileServer *self,
+Error fileserver_entry_location(
 	const char *path,
-	Slice url
+	Slice url,
+	Slice name,
+	Buffer *out_path,
+	Buffer *out_url
 ) {
 	Error err;
 
-	// We don't take the `path` argument as a slice because it must be NUL-terminated.
-	// This is an extra `strlen` per call, but that's acceptable.
 	Slice path_slice = slice_from_cstr(path);
 
-	DIR *dp = opendir(path);
-	if (dp == NULL) return ERR_NOT_FOUND;
+	err = buffer_reserve_additional(
+		out_path,
+		path_slice.len
+			// "/"
+			+ 1
+			+ name.len
+			// "\x00"
+			+ 1 
+	);
+	if (err != ERR_SUCCESS) return err;
+
+	err = buffer_reserve_additional(
+		out_url,
+		url.len
+			+ 1 /* "/" */
+			+ name.len
+	);
+	if (err != ERR_SUCCESS) return err;
+
+	buffer_concat_assume_capacity(out_path, path_slice);
+	buffer_concat_assume_capacity(out_path, slice_from_cstr("/"));
+	buffer_concat_assume_capacity(out_path, name);
+	// NUL-terminate `out_path`.
+	buffer_concat_assume_capacity(out_path, slice_from_len((uint8_t*) "\x00", 1));
+
+	buffer_concat_assume_capacity(out_url, url);
+	if (url.len > 0 && url.bytes[url.len - 1] != '/') {
+		buffer_concat_assume_capacity(out_url, slice_from_cstr("/"));
+	}
+	buffer_concat_assume_capacity(out_url, name);
+
+	return ERR_SUCCESS;
+}
+
+// A file found while walking a directory, waiting to be loaded.
+typedef struct FileServerLoadJob {
+	StaticFile *file;
+
+	// Owned; the URL of the file's path.
+	Slice url;
+
+	Error err;
+} FileServerLoadJob;
+
+// The files found by one `fileserver_update_add_directory`, loaded all at
+// once by a handful of threads.
+typedef struct FileServerLoader {
+	FileServer *fileserver;
+
+	FileServerLoadJob *jobs;
+	size_t jobs_count;
+	size_t jobs_capacity;
+
+	// The next job for a loader thread to take.
+	size_t next_job;
+} FileServerLoader;
+
+static Error fileserver_loader_add(FileServerLoader *self, const char *path, Slice url) {
+	if (self->jobs_count == self->jobs_capacity) {
+		size_t capacity = self->jobs_capacity > 0 ? self->jobs_capacity * 2 : 64;
+
+		FileServerLoadJob *jobs = realloc(self->jobs, capacity * sizeof(*jobs));
+		if (jobs == NULL) return ERR_OUT_OF_MEMORY;
+
+		self->jobs = jobs;
+		self->jobs_capacity = capacity;
+	}
+
+	StaticFile *file = static_file_new(path);
+	if (file == NULL) return ERR_OUT_OF_MEMORY;
+
+	self->jobs[self->jobs_count] = (FileServerLoadJob) {
+		.file = file,
+		.url = slice_clone(url),
+		.err = ERR_SUCCESS,
+	};
+	self->jobs_count += 1;
+
+	return ERR_SUCCESS;
+}
+
+static void *fileserver_loader_run(void *userdata) {
+	FileServerLoader *self = (FileServerLoader*) userdata;
+
+	while (true) {
+		size_t i = __atomic_fetch_add(&self->next_job, 1, __ATOMIC_RELAXED);
+		if (i >= self->jobs_count) break;
+
+		FileServerLoadJob *job = &self->jobs[i];
+		job->err = fileserver_load_file(self->fileserver, job->file, FILESERVER_GZIP_LEVEL, &job->file->loaded);
+	}
+
+	return NULL;
+}
+
+// Load every file that's been found, spread across `FileServer.load_threads`
+// threads, including this one.
+static void fileserver_loader_load(FileServerLoader *self) {
+	size_t threads_count = self->fileserver->load_threads;
+	if (threads_count == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads_count = cpus > 0 ? cpus : 1;
+	}
+	if (threads_count > FILESERVER_LOAD_THREADS_MAX) threads_count = FILESERVER_LOAD_THREADS_MAX;
+	if (self->jobs_count < FILESERVER_PARALLEL_LOAD_MIN) threads_count = 1;
+
+	pthread_t threads[FILESERVER_LOAD_THREADS_MAX];
+	size_t threads_started = 0;
+
+	// If a thread can't be started, the ones that were pick up its share.
+	while (threads_started + 1 < threads_count) {
+		if (pthread_create(&threads[threads_started], NULL, fileserver_loader_run, self) != 0) break;
+		threads_started += 1;
+	}
+
+	fileserver_loader_run(self);
+
+	for (size_t i = 0; i < threads_started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
+// Find every file in the directory open at `dir_fd`, recursively. `path` holds
+// the directory's path, NUL-terminated, and `url` its URL; both are put back
+// the way they were before returning. Closes `dir_fd`.
+static Error fileserver_update_walk(
+	FileServerUpdate *self,
+	FileServerLoader *loader,
+	int dir_fd,
+	Buffer *path,
+	Buffer *url
+) {
+	Error err = ERR_SUCCESS;
+
+	DIR *dp = fdopendir(dir_fd);
+	if (dp == NULL) {
+		close(dir_fd);
+		return ERR_NOT_FOUND;
+	}
+
+	if (self->on_directory != NULL) {
+		self->on_directory(self->on_directory_userdata, (const char*) path->bytes, buffer_slice(url));
+	}
+
+	// Not counting the NUL.
+	size_t path_len = path->len - 1;
+	size_t url_len = url->len;
+	bool url_needs_slash = url_len > 0 && url->bytes[url_len - 1] != '/';
 
 	struct dirent *dent;
-	while ((dent = readdir(dp)) != NULL) {
+	while (err == ERR_SUCCESS && (dent = readdir(dp)) != NULL) {
 		Slice entry_name = slice_from_cstr(dent->d_name);
 
 		if (
@@ -119,104 +1150,345 @@ Error fileserver_register_directory(
 		// Skip filenames that start with `.`
 		if (entry_name.len > 0 && entry_name.bytes[0] == '.') continue;
 
-		Buffer entry_path, entry_url;
-		buffer_init(&entry_path);
-		buffer_init(&entry_url);
+		path->len = path_len;
+		url->len = url_len;
 
 		err = buffer_reserve_additional(
-			&entry_path,
-			path_slice.len
-				// "/"
-				+ 1
+			path,
+			// "/"
+			1
 				+ entry_name.len
 				// "\x00"
-				+ 1 
+				+ 1
 		);
-		if (err != ERR_SUCCESS) {
-			closedir(dp);
-			return err;
-		}
+		if (err != ERR_SUCCESS) break;
 
 		err = buffer_reserve_additional(
-			&entry_url,
-			url.len
-				+ 1 /* "/" */
+			url,
+			1 /* "/" */
 				+ entry_name.len
 		);
-		if (err != ERR_SUCCESS) {
-			buffer_deinit(&entry_path);
-			closedir(dp);
-			return err;
+		if (err != ERR_SUCCESS) break;
+
+		buffer_concat_assume_capacity(path, slice_from_cstr("/"));
+		buffer_concat_assume_capacity(path, entry_name);
+		// NUL-terminate `path`.
+		buffer_concat_assume_capacity(path, slice_from_len((uint8_t*) "\x00", 1));
+
+		if (url_needs_slash) buffer_concat_assume_capacity(url, slice_from_cstr("/"));
+		buffer_concat_assume_capacity(url, entry_name);
+
+		// Most filesystems say what an entry is without a `stat`. Symlinks are
+		// followed.
+		unsigned char type = dent->d_type;
+		if (type != DT_DIR && type != DT_REG) {
+			struct stat entry_stat;
+			if (fstatat(dir_fd, dent->d_name, &entry_stat, 0) != 0) continue;
+
+			if (S_ISDIR(entry_stat.st_mode)) {
+				type = DT_DIR;
+			} else if (S_ISREG(entry_stat.st_mode)) {
+				type = DT_REG;
+			}
 		}
 
-		buffer_concat_assume_capacity(&entry_path, path_slice);
-		buffer_concat_assume_capacity(&entry_path, slice_from_cstr("/"));
-		buffer_concat_assume_capacity(&entry_path, entry_name);
-		// NUL-terminate `entry_path`.
-		buffer_concat_assume_capacity(&entry_path, slice_from_len((uint8_t*) "\x00", 1));
+		if (type == DT_DIR) {
+			int entry_fd = openat(dir_fd, dent->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (entry_fd == -1) continue;
 
-		buffer_concat_assume_capacity(&entry_url, url);
-		if (url.len > 0 && url.bytes[url.len - 1] != '/') {
-			buffer_concat_assume_capacity(&entry_url, slice_from_cstr("/"));
+			// Directories that can't be read are skipped.
+			err = fileserver_update_walk(self, loader, entry_fd, path, url);
+			if (err == ERR_NOT_FOUND) err = ERR_SUCCESS;
+		} else if (type == DT_REG) {
+			err = fileserver_loader_add(loader, (const char*) path->bytes, buffer_slice(url));
 		}
-		buffer_concat_assume_capacity(&entry_url, entry_name);
+	}
+
+	closedir(dp);
+
+	path->len = path_len;
+	(void) buffer_concat(path, slice_from_len((uint8_t*) "\x00", 1));
+	url->len = url_len;
+
+	return err;
+}
+
+Error fileserver_update_add_directory(FileServerUpdate *self, const char *path, Slice url) {
+	Error err;
+
+	int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd == -1) return ERR_NOT_FOUND;
+
+	Buffer path_buffer, url_buffer;
+	buffer_init(&path_buffer);
+	buffer_init(&url_buffer);
+
+	err = buffer_concat(&path_buffer, slice_from_cstr(path));
+	if (err == ERR_SUCCESS) {
+		err = buffer_concat(&path_buffer, slice_from_len((uint8_t*) "\x00", 1));
+	}
+	if (err == ERR_SUCCESS) {
+		err = buffer_concat(&url_buffer, url);
+	}
+	if (err != ERR_SUCCESS) {
+		buffer_deinit(&path_buffer);
+		buffer_deinit(&url_buffer);
+		close(dir_fd);
+		return err;
+	}
+
+	FileServerLoader loader = {
+		.fileserver = self->fileserver,
+		.jobs = NULL,
+		.jobs_count = 0,
+		.jobs_capacity = 0,
+		.next_job = 0,
+	};
 
-		const char *entry_path_cstr = (const char*) entry_path.bytes;
+	err = fileserver_update_walk(self, &loader, dir_fd, &path_buffer, &url_buffer);
 
-		// @FIXME: there's a TOCTOU attack here!
-		struct stat entry_stat;
-		stat(entry_path_cstr, &entry_stat);
+	buffer_deinit(&path_buffer);
+	buffer_deinit(&url_buffer);
 
-		if (S_ISDIR(entry_stat.st_mode)) {
-			fileserver_register_directory(
-				self,
-				entry_path_cstr,
-				buffer_slice(&entry_url)
-			);
-		} else if (S_ISREG(entry_stat.st_mode)) {
-			fileserver_load_file(
-				self,
-				entry_path_cstr,
-				buffer_slice(&entry_url)
-			);
+	// Whatever was found before an error is still added.
+	if (self->fileserver->cache_size == 0) fileserver_loader_load(&loader);
+
+	for (size_t i = 0; i < loader.jobs_count; i++) {
+		FileServerLoadJob *job = &loader.jobs[i];
+
+		Error job_err = job->err;
+		if (job_err == ERR_SUCCESS) {
+			job_err = fileserver_update_put_file(self, job->url, job->file);
 		}
+		if (job_err != ERR_SUCCESS) static_file_free(job->file);
 
-		buffer_deinit(&entry_path);
-		buffer_deinit(&entry_url);
+		slice_free(job->url);
 	}
 
-	closedir(dp);
+	free(loader.jobs);
 
-	return ERR_SUCCESS;
+	return err;
+}
+
+void fileserver_update_commit(FileServerUpdate *self) {
+	FileServer *fileserver = self->fileserver;
+
+	FileServerSnapshot *previous = fileserver->snapshot;
+
+	FileServerSnapshot *snapshot = self->snapshot;
+	*snapshot = (FileServerSnapshot) {
+		.base = previous != NULL ? previous->base : NULL,
+		.overlay = self->overlay,
+	};
+
+	if (snapshot->base != NULL) snapshot->base->references += 1;
+
+	// Every update copies the overlay, so once it's grown big enough to matter,
+	// it's folded into a new base.
+	size_t base_count = snapshot->base != NULL ? snapshot->base->count : 0;
+	if (
+		snapshot->overlay->count > FILESERVER_OVERLAY_MAX &&
+		snapshot->overlay->count > base_count / FILESERVER_OVERLAY_BASE_RATIO
+	) {
+		FileIndex *merged = fileserver_index_merge(fileserver, snapshot->base, snapshot->overlay);
+		FileIndex *empty = file_index_new();
+
+		// If that fails, the overlay just keeps growing until next time.
+		if (merged != NULL && empty != NULL) {
+			fileserver_index_unref(fileserver, snapshot->base);
+			fileserver_index_unref(fileserver, snapshot->overlay);
+
+			snapshot->base = merged;
+			snapshot->overlay = empty;
+		} else {
+			fileserver_index_unref(fileserver, merged);
+			fileserver_index_unref(fileserver, empty);
+		}
+	}
+
+	__atomic_store_n(&fileserver->snapshot, snapshot, __ATOMIC_SEQ_CST);
+
+	fileserver_synchronize(fileserver);
+
+	if (previous != NULL) fileserver_snapshot_free(fileserver, previous);
+
+	pthread_mutex_unlock(&fileserver->update_lock);
+
+	set_undefined(self, sizeof(*self));
 }
+
+Error fileserver_register_directory(
+	FileServer *self,
+	const char *path,
+	Slice url
+) {
+	FileServerUpdate update;
+	Error err = fileserver_update_begin(self, &update);
+	if (err != ERR_SUCCESS) return err;
+
+	err = fileserver_update_add_directory(&update, path, url);
+
+	// Whatever was added before an error is still served.
+	fileserver_update_commit(&update);
+
+	return err;
+}
+
+Error fileserver_for_each_file(
+	FileServer *self,
+	Error (*callback)(void *userdata, Slice url, const StaticFile *file),
+	void *userdata
+) {
+	Error err = ERR_SUCCESS;
+
+	pthread_mutex_lock(&self->update_lock);
+
+	FileServerSnapshot *snapshot = self->snapshot;
+
+	HashMapIterator it = { 0 };
+	HashMapEntry entry;
+
+	while (snapshot != NULL && err == ERR_SUCCESS && (entry = hashmap_next(&snapshot->overlay->files, &it)).occupied) {
+		StaticFile *file = *(StaticFile**) entry.value_ptr;
+		if (file == NULL) continue;
+
+		err = callback(userdata, *entry.key_ptr, file);
+	}
+
+	FileIndex *base = snapshot != NULL ? snapshot->base : NULL;
+	it = (HashMapIterator) { 0 };
+
+	while (base != NULL && err == ERR_SUCCESS && (entry = hashmap_next(&base->files, &it)).occupied) {
+		// Replaced or removed.
+		if (hashmap_get(&snapshot->overlay->files, *entry.key_ptr).occupied) continue;
+
+		err = callback(userdata, *entry.key_ptr, *(StaticFile**) entry.value_ptr);
+	}
+
+	pthread_mutex_unlock(&self->update_lock);
+
+	return err;
+}
+
+// Send `ranges` of the file, compressed if `gzip` is true, with the same
+// headers as the whole of it would have, but for its length.
+static Error fileserver_respond_ranges(
+	const LoadedFile *loaded,
+	bool gzip,
+	const HttpByteRange *ranges,
+	size_t ranges_count,
+	HttpResponse *res
+) {
+	Error err = ERR_SUCCESS;
+
+	if (gzip) {
+		err = http_response_add_header(res, slice_from_cstr("Content-Encoding"), slice_from_cstr("gzip"));
+	}
+	if (err == ERR_SUCCESS) {
+		err = http_response_add_header(res, slice_from_cstr("ETag"), gzip ? loaded->gzip_etag : loaded->etag);
+	}
+	if (err == ERR_SUCCESS) {
+		err = http_response_add_header(res, slice_from_cstr("Last-Modified"), loaded->last_modified);
+	}
+	if (err == ERR_SUCCESS && loaded->gzip_head.len > 0) {
+		err = http_response_add_header(res, slice_from_cstr("Vary"), slice_from_cstr("Accept-Encoding"));
+	}
+	if (err != ERR_SUCCESS) return err;
+
+	if (gzip) {
+		return http_response_end_ranges(
+			res,
+			loaded->content_type,
+			loaded->gzip_contents.len,
+			ranges,
+			ranges_count,
+			loaded->gzip_contents,
+			-1
+		);
+	}
+
+	return http_response_end_ranges(
+		res,
+		loaded->content_type,
+		loaded->size,
+		ranges,
+		ranges_count,
+		loaded->contents,
+		loaded->fd
+	);
+}
+
 // Returns `ERR_HTTP_NOT_FOUND` if `req.path` was not found.
 Error fileserver_respond(
-	FileServer *self,
+	FileServerReader *reader,
 	const HttpRequest *req,
 	HttpResponse *res
 ) {
-	Error err;
+	Error err = ERR_SUCCESS;
 
-	// TODO: remove query parameters
-	Slice path = req->target;
+	FileServer *self = reader->fileserver;
 
-	HashMapEntry entry = hashmap_get(&self->files, path);
-	if (!entry.occupied) return ERR_HTTP_NOT_FOUND;
+	Slice path = http_request_path(req);
 
-	StaticFile *file = (StaticFile*) entry.value_ptr;
+	FileServerSnapshot *snapshot = fileserver_reader_enter(reader);
 
-	http_response_set_status(res, HTTP_OK);
-	err = http_response_add_header(
-		res,
-		slice_from_cstr("Content-Type"),
-		file->content_type
-	);
+	StaticFile *file = fileserver_snapshot_get(snapshot, path);
+	if (file == NULL) {
+		fileserver_reader_leave(reader);
+		return ERR_HTTP_NOT_FOUND;
+	}
+
+	LoadedFile *loaded = file->loaded;
+	if (self->cache_size > 0) {
+		err = fileserver_cache_get(self, file, &loaded);
+	} else {
+		// Loaded up front and never unloaded; no lock needed.
+		__atomic_add_fetch(&loaded->references, 1, __ATOMIC_RELAXED);
+	}
+
+	// `file` may be freed by an update from here on, but `loaded` lives until
+	// our reference to it is released.
+	fileserver_reader_leave(reader);
+
+	// Deleted since it was indexed, and the update removing it hasn't landed
+	// yet.
+	if (err == ERR_NOT_FOUND) return ERR_HTTP_NOT_FOUND;
 	if (err != ERR_SUCCESS) return err;
 
-	err = http_response_end_with_body(res, file->contents);
+	bool gzip = loaded->gzip_head.len > 0 && http_request_accepts_encoding(req, slice_from_cstr("gzip"));
+	Slice etag = gzip ? loaded->gzip_etag : loaded->etag;
+
+	// Ranges are of the representation being sent, compressed or not.
+	HttpByteRange ranges[HTTP_REQUEST_MAX_RANGES];
+	size_t ranges_count = 0;
+	HttpRanges ranged = HTTP_RANGES_NONE;
+
+	bool not_modified = http_request_not_modified(req, etag, loaded->modified);
+	if (!not_modified) {
+		size_t size = gzip ? loaded->gzip_contents.len : loaded->size;
+		ranged = http_request_ranges(req, size, etag, loaded->modified, ranges, &ranges_count);
+	}
+
+	if (not_modified) {
+		Slice head = gzip ? loaded->gzip_not_modified_head : loaded->not_modified_head;
+		err = http_response_end_prepared(res, head, slice_new());
+	} else if (ranged == HTTP_RANGES_NOT_SATISFIABLE) {
+		err = http_response_range_not_satisfiable(res, gzip ? loaded->gzip_contents.len : loaded->size);
+	} else if (ranged == HTTP_RANGES_SATISFIABLE) {
+		err = fileserver_respond_ranges(loaded, gzip, ranges, ranges_count, res);
+	} else if (loaded->fd != -1) {
+		err = http_response_end_prepared_with_file(res, loaded->head, loaded->fd, loaded->size);
+	} else if (gzip) {
+		err = http_response_end_prepared(res, loaded->gzip_head, loaded->gzip_contents);
+	} else {
+		err = http_response_end_prepared(res, loaded->head, loaded->contents);
+	}
+
+	// Keep `loaded` alive until the response has been written, even if it's
+	// evicted in the meantime.
+	http_response_release_after(res, loaded_file_release, loaded);
+
 	if (err != ERR_SUCCESS) return err;
 
 	return ERR_SUCCESS;
 }
-
-
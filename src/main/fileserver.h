@@ -2,32 +2,293 @@
 
 #include "http/request.h"
 #include "http/response.h"
+#include "warble/buffer.h"
 #include "warble/hashmap.h"
 #include "warble/slice.h"
 
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The default `FileServer.cache_max_fds`: well within the usual limit of 1024
+// descriptors, leaving the rest for connections.
+#define FILESERVER_CACHE_MAX_FDS 256
+
+// What responses for a file are sent from. Shared between the file server and
+// every response that's still being written from it, and freed once the last
+// of them lets go; see `loaded_file_release`.
+typedef struct LoadedFile {
+	size_t references;
+
+	// Status line and headers of the response to this file, ready to be sent
+	// as-is. A GET is answered with `head` followed by the file's contents, and
+	// a HEAD with `head` alone.
+	Slice head;
+
+	// Empty if the file is sent from `fd` instead.
+	Slice contents;
+
+	// `contents` is a read-only mapping of the file, rather than an allocation.
+	bool contents_mapped;
+
+	// An open descriptor for files larger than `FileServer.sendfile_threshold`,
+	// whose contents are sent with `sendfile` rather than kept in memory, or
+	// -1.
+	int fd;
+	size_t size;
+
+	// A gzip-compressed copy of `contents`, and the head to send it with, for
+	// clients that accept it. Both empty if there isn't one.
+	Slice gzip_head;
+	Slice gzip_contents;
+
+	// Strong ETags for the contents as they are and for the compressed copy;
+	// the second is empty if there isn't one. Both are hashes of what's sent,
+	// except for files sent from disk, whose ETag comes from the file's inode,
+	// modification time and size (see `format_file_etag`).
+	Slice etag;
+	Slice gzip_etag;
+
+	// When the file was last modified, in seconds since the epoch, and as an
+	// HTTP date.
+	int64_t modified;
+	Slice last_modified;
+
+	// Static memory; see `StaticFile.content_type`.
+	Slice content_type;
+
+	// Heads of the 304 Not Modified responses for clients whose copy is still
+	// current, one for each of `head` and `gzip_head`.
+	Slice not_modified_head;
+	Slice gzip_not_modified_head;
+} LoadedFile;
+
+// Drop one reference to `self`, freeing it if that was the last one. Takes a
+// `void*` so that it can be handed to `http_response_release_after`.
+void loaded_file_release(void *self);
+
 typedef struct StaticFile {
+	// Indexes that contain this file. Only touched while updating.
+	size_t references;
+
 	// Static memory.
 	Slice content_type;
 
-	Slice contents;
+	// Owned and NUL-terminated; where the file is loaded from.
+	char *path;
+
+	// `NULL` until the file is first asked for, and again after it's evicted,
+	// when the file server has a cache budget. Otherwise loaded up front, and
+	// never unloaded.
+	LoadedFile *loaded;
+
+	// Memory counted against the cache budget while loaded.
+	size_t cost;
+
+	// Links in `FileServer.cache_oldest`, while loaded.
+	struct StaticFile *prev;
+	struct StaticFile *next;
 } StaticFile;
 
-typedef struct FileServer {
-	// HashMap from owned URLs to StaticFile
+// Files compressed ahead of time, when they're registered or packed, are only
+// compressed once, so it's worth taking the time to compress them as well as
+// possible.
+#define FILESERVER_GZIP_LEVEL 9
+
+// Files loaded on a cache miss are compressed by the worker that asked for
+// them, while its other connections wait, so speed matters more than size.
+#define FILESERVER_CACHE_GZIP_LEVEL 1
+
+// A gzip-compressed copy of `contents`, the contents of `file`: its `.gz`
+// sidecar on disk if it has one, or else `contents` compressed at `level`, if
+// that's worth trying for its content type. Empty unless it's smaller than
+// `contents`.
+Error fileserver_compress_file(const StaticFile *file, Slice contents, int level, Slice *out_gzip);
+
+// A map from owned URLs to `StaticFile*`. Never changed once it's part of a
+// published snapshot.
+typedef struct FileIndex {
 	HashMap files;
+	size_t count;
+
+	// Snapshots that use this index.
+	size_t references;
+} FileIndex;
+
+// Everything lookups need, replaced as a whole whenever the served files
+// change. Most files are in `base`, which is shared from one snapshot to the
+// next; recent changes are in the much smaller `overlay`, so that publishing a
+// change doesn't copy the whole tree.
+typedef struct FileServerSnapshot {
+	FileIndex *base;
+
+	// Takes precedence over `base`. Files that were removed map to `NULL`.
+	FileIndex *overlay;
+} FileServerSnapshot;
+
+typedef struct FileServerCacheStats {
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+
+	// Memory held by loaded files, and the budget for it.
+	size_t used;
+	size_t size;
+
+	// Loaded files that are sent from disk, each holding a descriptor open.
+	size_t fds;
+} FileServerCacheStats;
+
+// Files added by updates, and how many bytes of them were read or mapped while
+// adding them.
+typedef struct FileServerLoadStats {
+	size_t files;
+	size_t bytes;
+} FileServerLoadStats;
+
+struct FileServerReader;
+
+typedef struct FileServer {
+	// Files larger than this are kept open and sent from disk, instead of being
+	// loaded into memory. Only affects files loaded after it's changed;
+	// defaults to `SIZE_MAX`.
+	size_t sendfile_threshold;
+
+	// Map files that are served from memory, instead of reading them into
+	// allocations. Only affects files loaded after it's changed.
+	bool use_mmap;
+
+	// If nonzero, files are only indexed when they're registered, loaded when
+	// they're first asked for, and the least recently used ones are unloaded
+	// to keep their contents within this many bytes. If zero, every file is
+	// loaded when it's registered. Must be set before registering anything.
+	size_t cache_size;
+
+	// With a cache budget, files that are sent from disk are unloaded, least
+	// recently used first, to keep at most this many of their descriptors
+	// open. They only count a few bytes against `cache_size`, which would
+	// otherwise let them pile up until the process runs out of descriptors.
+	// Defaults to `FILESERVER_CACHE_MAX_FDS`.
+	size_t cache_max_fds;
+
+	// Threads that load the files of a directory that's being added. Zero means
+	// one per online CPU.
+	size_t load_threads;
+
+	// Only touched while updating.
+	FileServerLoadStats load_stats;
+
+	// The snapshot lookups go through. Swapped atomically by updates, and only
+	// freed once every reader has moved past it.
+	FileServerSnapshot *snapshot;
+
+	// Incremented every time a snapshot is replaced. Never zero.
+	uint64_t epoch;
+
+	// Serializes updates, and guards `readers`.
+	pthread_mutex_t update_lock;
+	struct FileServerReader *readers;
+
+	// Guards everything below, and every `StaticFile`'s `loaded`, `prev` and
+	// `next`, when there's a cache budget.
+	pthread_mutex_t cache_lock;
+
+	// Loaded files, least recently used first.
+	StaticFile *cache_oldest;
+	StaticFile *cache_newest;
+
+	FileServerCacheStats cache_stats;
 } FileServer;
 
+// A thread's registration for looking files up. An update only frees the
+// snapshot it replaced once every reader has either finished the lookup it
+// was in the middle of, or isn't looking anything up.
+typedef struct FileServerReader {
+	FileServer *fileserver;
+
+	// The `FileServer.epoch` that the current lookup started in, or zero
+	// between lookups.
+	uint64_t epoch;
+
+	struct FileServerReader *next;
+} FileServerReader;
+
 void fileserver_init(FileServer *self);
+
+// No readers may be registered anymore.
 void fileserver_deinit(FileServer *self);
 
+void fileserver_reader_init(FileServerReader *self, FileServer *fileserver);
+void fileserver_reader_deinit(FileServerReader *self);
+
+// A batch of changes to the served files, all published at once.
+typedef struct FileServerUpdate {
+	FileServer *fileserver;
+
+	// A copy of the current overlay, with this update's changes applied.
+	FileIndex *overlay;
+
+	// Allocated up front, so that committing can't fail.
+	FileServerSnapshot *snapshot;
+
+	// If set, called for every directory that's added, so it can be watched.
+	void (*on_directory)(void *userdata, const char *path, Slice url);
+	void *on_directory_userdata;
+} FileServerUpdate;
+
+// Start an update. Only one update happens at a time; others wait until this
+// one is committed.
+Error fileserver_update_begin(FileServer *fileserver, FileServerUpdate *self);
+
+// Add, or replace, the file at `path` that's served at `url`.
+Error fileserver_update_add_file(FileServerUpdate *self, const char *path, Slice url);
+
+// Add every file in the directory at `path`, recursively, served under `url`.
+Error fileserver_update_add_directory(FileServerUpdate *self, const char *path, Slice url);
+
+// Stop serving the file that `fileserver_update_add_file` added at `url`.
+Error fileserver_update_remove_file(FileServerUpdate *self, Slice url);
+
+// Stop serving every file under `url`.
+Error fileserver_update_remove_directory(FileServerUpdate *self, Slice url);
+
+// Publish the update's changes. Waits until no reader can still be using the
+// previous snapshot, and frees it.
+void fileserver_update_commit(FileServerUpdate *self);
+
+// Add every file in the directory at `path`, recursively, served under `url`,
+// in an update of its own.
 Error fileserver_register_directory(
 	FileServer *self,
 	const char *path,
 	Slice url
 );
 
-Error fileserver_respond(
+// Call `callback` with every file that's currently served, and the URL it's
+// served at, stopping at the first error. Updates wait until it's done.
+Error fileserver_for_each_file(
 	FileServer *self,
+	Error (*callback)(void *userdata, Slice url, const StaticFile *file),
+	void *userdata
+);
+
+// Build the path and URL of the entry `name` in the directory at `path`, which
+// is served at `url`. `out_path` is NUL-terminated.
+Error fileserver_entry_location(
+	const char *path,
+	Slice url,
+	Slice name,
+	Buffer *out_path,
+	Buffer *out_url
+);
+
+// May be called from several threads at once, each with its own reader.
+Error fileserver_respond(
+	FileServerReader *reader,
 	const HttpRequest *req,
 	HttpResponse *res
 );
+
+// A snapshot of the cache's counters.
+FileServerCacheStats fileserver_cache_stats(FileServer *self);
@@ -1,8 +1,15 @@
+#include "bench/bench.h"
+#include "http/connection.h"
 #include "http/parser.h"
 #include "http/response.h"
 #include "main/arguments.h"
 #include "main/fileserver.h"
+#include "main/pack.h"
+#include "main/watcher.h"
+#include "net/event_loop.h"
 #include "net/server.h"
+#include "net/timeout.h"
+#include "net/uring_loop.h"
 #include "print.h"
 #include "test/test.h"
 #include "warble/buffer.h"
@@ -12,11 +19,14 @@
 #include "warble/hashmap.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <netdb.h>
@@ -27,6 +37,162 @@
 #include <dirent.h>
 #include <sys/stat.h>
 
+static void log_request(const HttpRequest *request) {
+	// Workers share `stdout`; keep each request's lines together.
+	flockfile(stdout);
+	print_http_request(stdout, request);
+	funlockfile(stdout);
+}
+
+// Answer `response` with an error page, if serving it failed with `err`.
+static void respond_to_error(HttpResponse *response, Error err) {
+	if (err == ERR_HTTP_NOT_FOUND) {
+		(void) http_response_not_found(response);
+	} else if (err != ERR_SUCCESS) {
+		printf("error serving from file server: %s\n", error_to_string(err));
+
+		(void) http_response_internal_server_error(response);
+	}
+}
+
+// Serve `request` through the `FileServerReader` pointed to by `userdata`.
+static void handle_request(
+	void *userdata,
+	const HttpRequest *request,
+	HttpResponse *response
+) {
+	FileServerReader *reader = (FileServerReader*) userdata;
+
+	log_request(request);
+
+	respond_to_error(response, fileserver_respond(reader, request, response));
+}
+
+// Serve `request` from the `Pack` pointed to by `userdata`.
+static void handle_pack_request(
+	void *userdata,
+	const HttpRequest *request,
+	HttpResponse *response
+) {
+	const Pack *pack = (const Pack*) userdata;
+
+	log_request(request);
+
+	respond_to_error(response, pack_respond(pack, request, response));
+}
+
+// Print how many connections have timed out, and the file server's cache
+// statistics if it has a cache, whenever SIGUSR1 arrives. Runs on its own
+// thread, with the signal blocked everywhere else.
+static void *report_stats(void *userdata) {
+	FileServer *fileserver = (FileServer*) userdata;
+
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+
+	while (true) {
+		int signal_number;
+		if (sigwait(&signals, &signal_number) != 0) continue;
+
+		printf(
+			"timeouts: %zu idle, %zu header, %zu send\n",
+			connection_timeouts_count(CONNECTION_TIMEOUT_IDLE),
+			connection_timeouts_count(CONNECTION_TIMEOUT_HEADER),
+			connection_timeouts_count(CONNECTION_TIMEOUT_SEND)
+		);
+
+		if (fileserver->cache_size > 0) {
+			FileServerCacheStats stats = fileserver_cache_stats(fileserver);
+			printf(
+				"cache: %zu hits, %zu misses, %zu evictions, %zu of %zu bytes used, %zu files open\n",
+				stats.hits,
+				stats.misses,
+				stats.evictions,
+				stats.used,
+				stats.size,
+				stats.fds
+			);
+		}
+
+		fflush(stdout);
+	}
+
+	return NULL;
+}
+
+// One thread's worth of serving: its own listen sockets and event loop. All
+// workers share the same `FileServer`.
+typedef struct Worker {
+	Server server;
+
+	// Exactly one of `uring_loop` and `event_loop` is initialized.
+	bool uses_io_uring;
+	UringLoop uring_loop;
+	EventLoop event_loop;
+
+	// How this worker looks files up.
+	FileServerReader reader;
+
+	pthread_t thread;
+} Worker;
+
+// Serves from `pack` if it isn't `NULL`, and from `fileserver` otherwise.
+static Error worker_init_loop(Worker *self, bool try_io_uring, FileServer *fileserver, Pack *pack) {
+	self->uses_io_uring = false;
+
+	fileserver_reader_init(&self->reader, fileserver);
+
+	HttpHandler handler = handle_request;
+	void *handler_userdata = &self->reader;
+	if (pack != NULL) {
+		handler = handle_pack_request;
+		handler_userdata = pack;
+	}
+
+	if (try_io_uring) {
+		Error err = uring_loop_init(&self->uring_loop, &self->server, handler, handler_userdata);
+		if (err == ERR_SUCCESS) {
+			self->uses_io_uring = true;
+			return ERR_SUCCESS;
+		}
+
+		printf("io_uring is unavailable (%s), falling back to epoll\n", error_to_string(err));
+	}
+
+	Error err = event_loop_init(&self->event_loop, &self->server, handler, handler_userdata);
+	if (err != ERR_SUCCESS) fileserver_reader_deinit(&self->reader);
+
+	return err;
+}
+
+static void worker_deinit_loop(Worker *self) {
+	if (self->uses_io_uring) {
+		uring_loop_deinit(&self->uring_loop);
+	} else {
+		event_loop_deinit(&self->event_loop);
+	}
+
+	fileserver_reader_deinit(&self->reader);
+}
+
+static void *worker_run(void *userdata) {
+	Worker *worker = (Worker*) userdata;
+
+	Error err;
+	if (worker->uses_io_uring) {
+		err = uring_loop_run(&worker->uring_loop);
+	} else {
+		err = event_loop_run(&worker->event_loop);
+	}
+
+	if (err != ERR_SUCCESS) {
+		printf("error running event loop: %s\n", error_to_string(err));
+	}
+
+	return NULL;
+}
+
 int main(int argc, const char **argv) {
 	Arguments arguments;
 	arguments_parse(&arguments, argc, argv);
@@ -39,11 +205,36 @@ int main(int argc, const char **argv) {
 		return EXIT_FAILURE;
 	}
 
+	if (arguments.bench) {
+		Error err = bench_all();
+
+		if (err == ERR_SUCCESS) return EXIT_SUCCESS;
+
+		return EXIT_FAILURE;
+	}
+
 	if (arguments.fuzz) {
 		fprintf(stderr, "todo: fuzzer\n");
 		return 1;
 	}
 
+	if (arguments.pack_output != NULL) {
+		PackWriteStats stats;
+		Error err = pack_write(arguments.pack_directory, arguments.pack_output, &stats);
+		if (err != ERR_SUCCESS) {
+			fprintf(stderr, "error writing pack: %s\n", error_to_string(err));
+			return 1;
+		}
+
+		printf("packed %zu files into %s (%zu bytes)\n", stats.files, arguments.pack_output, stats.bytes);
+		return 0;
+	}
+
+	if (arguments.pack != NULL && arguments.watch) {
+		fprintf(stderr, "error: a pack can't be watched for changes\n");
+		return 1;
+	}
+
 	struct addrinfo *listen_addresses = NULL;
 
 	int err = getaddrinfo(
@@ -61,15 +252,41 @@ int main(int argc, const char **argv) {
 		return 1;
 	}
 
-	Server server;
-	server_init(&server);
+	size_t workers_count = arguments.workers;
+	if (workers_count == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		workers_count = cpus > 0 ? cpus : 1;
+	}
+
+	Worker *workers = calloc(workers_count, sizeof(Worker));
+	if (workers == NULL) {
+		fprintf(stderr, "error allocating workers\n");
+		return 1;
+	}
+
+	// The first worker finds addresses to listen on, and every other worker
+	// listens on exactly the same ones.
+	Server *server = &workers[0].server;
+	server_init(server);
+	server->reuse_port = workers_count > 1;
+	server->idle_timeout_ms = arguments.idle_timeout * 1000;
+	server->header_timeout_ms = arguments.header_timeout * 1000;
+	server->send_timeout_ms = arguments.send_timeout * 1000;
+	server->min_send_rate = arguments.min_send_rate;
+
+	http_parser_set_limits((HttpParserLimits) {
+		.max_request_line = arguments.max_request_line,
+		.max_head = arguments.max_header_size,
+		.max_headers = arguments.max_headers,
+		.memory_budget = arguments.request_memory,
+	});
 
 	for (struct addrinfo *cursor = listen_addresses; cursor != NULL; cursor = cursor->ai_next) {
 		Error err;
 
 		// Try a handful of ports.
 		for (int i = 0; i < 5; i++) {
-			err = server_listen(&server, (ListenAddress) {
+			err = server_listen(server, (ListenAddress) {
 				.socket_family = cursor->ai_family,
 				.socket_type = cursor->ai_socktype,
 				.addr = cursor->ai_addr,
@@ -110,95 +327,139 @@ int main(int argc, const char **argv) {
 
 	freeaddrinfo(listen_addresses);
 
-	FileServer fileserver;
-	fileserver_init(&fileserver);
+	for (size_t i = 1; i < workers_count; i++) {
+		server_init(&workers[i].server);
+		workers[i].server.reuse_port = true;
 
-	{
-		Error err = fileserver_register_directory(&fileserver, arguments.serve_path, slice_from_cstr("/"));
+		Error err = server_listen_like(&workers[i].server, server);
 		if (err != ERR_SUCCESS) {
-			printf("error loading static files from directory: %s\n", error_to_string(err));
+			printf("error listening from worker %zu: %s\n", i, error_to_string(err));
+			return 1;
 		}
 	}
 
-	while (true) {
-		Error err;
-
-		ServerConnection connection;
-		err = server_accept(&server, &connection);
-		if (err != ERR_SUCCESS) {
-			printf("couldn't accept new connection: %s\n", error_to_string(err));
-			continue;
-		}
+	// `sendfile` has no equivalent of `MSG_NOSIGNAL`, and a client hanging up
+	// in the middle of a file shouldn't kill the server.
+	signal(SIGPIPE, SIG_IGN);
 
-		HttpParser parser;
-		http_parser_init(&parser);
+	FileServer fileserver;
+	fileserver_init(&fileserver);
+	fileserver.sendfile_threshold = arguments.sendfile_threshold;
+	fileserver.use_mmap = arguments.mmap;
+	fileserver.cache_size = arguments.cache_size;
 
-		bool request_parsed = false;
-		HttpRequest request;
-		set_undefined(&request, sizeof(request));
+	Pack pack;
 
-		while (true) {
-			// Read 512 bytes at a time.
-			uint8_t buffer[512];
+	FileWatcher watcher;
+	if (arguments.watch) {
+		Error err = file_watcher_init(&watcher, &fileserver);
+		if (err != ERR_SUCCESS) {
+			printf("error starting file watcher: %s\n", error_to_string(err));
+			return 1;
+		}
+	}
 
-			ssize_t recv_result = recv(connection.fd, &buffer, sizeof(buffer), 0);
-			if (recv_result == -1) {
-				perror("read");
-				break;
-			}
+	{
+		struct timespec load_start, load_end;
+		clock_gettime(CLOCK_MONOTONIC, &load_start);
 
-			if (recv_result == 0) {
-				// End of file?
-				break;
+		Error err;
+		if (arguments.pack != NULL) {
+			err = pack_open(&pack, arguments.pack);
+			if (err != ERR_SUCCESS) {
+				printf("error opening pack: %s\n", error_to_string(err));
+				return 1;
 			}
+		} else if (arguments.watch) {
+			err = file_watcher_watch_directory(&watcher, arguments.serve_path, slice_from_cstr("/"));
+		} else {
+			err = fileserver_register_directory(&fileserver, arguments.serve_path, slice_from_cstr("/"));
+		}
+		if (err != ERR_SUCCESS) {
+			printf("error loading static files from directory: %s\n", error_to_string(err));
+		}
 
-			assert(recv_result >= 0);
+		clock_gettime(CLOCK_MONOTONIC, &load_end);
 
-			size_t buffer_len = recv_result;
-			assert(buffer_len <= sizeof(buffer));
+		double load_seconds =
+			(load_end.tv_sec - load_start.tv_sec) +
+			(load_end.tv_nsec - load_start.tv_nsec) / 1e9;
+		if (load_seconds <= 0) load_seconds = 1e-9;
 
-			// Poll the parser with these bytes.
-			HttpParserPollResult result;
-			Error err = http_parser_poll(&parser, slice_from_len(buffer, buffer_len), &result);
-			if (err != ERR_SUCCESS) {
-				printf("error parsing request: %s\n", error_to_string(err));
-				break;
-			}
-
-			if (!result.done) {
-				continue;
-			}
+		FileServerLoadStats stats = fileserver.load_stats;
+		if (arguments.pack != NULL) {
+			// Nothing's read until it's asked for.
+			stats = (FileServerLoadStats) { .files = pack_files_count(&pack), .bytes = 0 };
+		}
+		printf(
+			" loaded %zu files (%zu bytes) in %.3fs: %.0f files/s, %.1f MiB/s\n",
+			stats.files,
+			stats.bytes,
+			load_seconds,
+			stats.files / load_seconds,
+			stats.bytes / load_seconds / (1024 * 1024)
+		);
+	}
 
-			// We've parsed one request.
-			request_parsed = true;
-			request = result.request;
-			break;
+	for (size_t i = 0; i < workers_count; i++) {
+		Error err = worker_init_loop(&workers[i], arguments.io_uring, &fileserver, arguments.pack != NULL ? &pack : NULL);
+		if (err != ERR_SUCCESS) {
+			printf("error starting event loop: %s\n", error_to_string(err));
+			return 1;
 		}
+	}
 
-		if (request_parsed) {
-			print_http_request(stdout, &request);
+	{
+		// Block SIGUSR1 before starting any threads, so that they all inherit
+		// that, and only the reporting thread receives it.
+		sigset_t signals;
+		sigemptyset(&signals);
+		sigaddset(&signals, SIGUSR1);
+		pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+		pthread_t reporter;
+		int err = pthread_create(&reporter, NULL, report_stats, &fileserver);
+		if (err != 0) {
+			fprintf(stderr, "error starting reporter: %s\n", strerror(err));
+			return 1;
+		}
+		pthread_detach(reporter);
+	}
 
-			HttpResponse response;
-			http_response_init(&response, &request, connection.fd);
+	if (arguments.watch) {
+		Error err = file_watcher_start(&watcher);
+		if (err != ERR_SUCCESS) {
+			printf("error watching for changes: %s\n", error_to_string(err));
+			return 1;
+		}
+	}
 
-			err = fileserver_respond(&fileserver, &request, &response);
+	// The first worker runs on the main thread.
+	for (size_t i = 1; i < workers_count; i++) {
+		int err = pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+		if (err != 0) {
+			fprintf(stderr, "error starting worker %zu: %s\n", i, strerror(err));
+			return 1;
+		}
+	}
 
-			if (err == ERR_HTTP_NOT_FOUND) {
-				(void) http_response_not_found(&response);
-			} else if (err != ERR_SUCCESS) {
-				printf("error serving from file server: %s\n", error_to_string(err));
+	if (workers_count > 1) {
+		printf(" serving from %zu workers\n", workers_count);
+	}
 
-				(void) http_response_internal_server_error(&response);
-			}
+	worker_run(&workers[0]);
 
-			http_response_deinit(&response);
-			http_request_deinit(&request);
-		}
+	for (size_t i = 1; i < workers_count; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
 
-		http_parser_deinit(&parser);
-		server_connection_deinit(&connection);
+	for (size_t i = 0; i < workers_count; i++) {
+		worker_deinit_loop(&workers[i]);
+		server_deinit(&workers[i].server);
 	}
 
+	free(workers);
+
+	if (arguments.pack != NULL) pack_close(&pack);
 	fileserver_deinit(&fileserver);
-	server_deinit(&server);
 }
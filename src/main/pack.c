@@ -0,0 +1,788 @@
+#include "main/pack.h"
+
+#include "main/fileserver.h"
+#include "util.h"
+
+#include "warble/buffer.h"
+#include "warble/util.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The first bytes of every pack. The last one is the version of the format.
+static const uint8_t pack_magic[8] = { 'u', 's', 'e', 'r', 'v', 'e', 'p', 4 };
+
+// Everything in a pack is in the byte order of the machine that wrote it. This
+// reads differently on a machine with the other byte order.
+#define PACK_BYTE_ORDER 0x01020304
+
+// Contents start at multiples of this, so that no two files share a page.
+#define PACK_ALIGNMENT 4096
+
+// Files are copied into a pack through a buffer this big.
+#define PACK_COPY_CHUNK (64 * 1024)
+
+// A range of bytes in the pack.
+typedef struct PackRange {
+	uint64_t offset;
+	uint64_t len;
+} PackRange;
+
+// At the very start of the pack.
+typedef struct PackHeader {
+	uint8_t magic[8];
+	uint32_t byte_order;
+	uint32_t alignment;
+
+	// Of the whole pack, so that a truncated one can be told apart.
+	uint64_t size;
+
+	uint64_t entries_count;
+
+	// A power of two, and more than `entries_count`, so that every probe ends
+	// at an empty bucket.
+	uint64_t buckets_count;
+
+	uint64_t buckets_offset;
+	uint64_t entries_offset;
+} PackHeader;
+
+typedef struct PackEntry {
+	uint64_t hash;
+
+	PackRange url;
+	PackRange content_type;
+	PackRange etag;
+	PackRange gzip_etag;
+
+	// See `LoadedFile.modified`.
+	int64_t modified;
+	PackRange last_modified;
+
+	// Status line and headers, ready to be sent as-is; see `LoadedFile.head`.
+	PackRange head;
+
+	// See `LoadedFile.not_modified_head`.
+	PackRange not_modified_head;
+	PackRange gzip_not_modified_head;
+
+	// Starts at a multiple of `PackHeader.alignment`.
+	PackRange contents;
+
+	// A gzip-compressed copy of `contents`, and the head to send it with; see
+	// `LoadedFile.gzip_head`. Both empty if there isn't one.
+	PackRange gzip_head;
+	PackRange gzip_contents;
+} PackEntry;
+
+// FNV-1a. Part of the format, so it mustn't change.
+static uint64_t pack_hash(Slice url) {
+	uint64_t hash = 0xcbf29ce484222325;
+
+	for (size_t i = 0; i < url.len; i++) {
+		hash ^= url.bytes[i];
+		hash *= 0x100000001b3;
+	}
+
+	return hash;
+}
+
+static uint64_t pack_align(uint64_t offset, uint64_t alignment) {
+	return (offset + alignment - 1) / alignment * alignment;
+}
+
+// A file on its way into a pack.
+typedef struct PackSource {
+	// Owned.
+	char *path;
+
+	// Ranges of strings are relative to the start of `PackWriter.strings`
+	// until the pack is laid out.
+	PackEntry entry;
+} PackSource;
+
+typedef struct PackWriter {
+	PackSource *sources;
+	size_t sources_count;
+	size_t sources_capacity;
+
+	// Every file's URL, content type, ETag and heads.
+	Buffer strings;
+
+	// Compressed copies of files. Ranges in `PackEntry.gzip_contents` are
+	// relative to the start of this until the pack is laid out.
+	Buffer compressed;
+} PackWriter;
+
+// Append `bytes` to `self->strings`, and set `*out_range` to where they went.
+static Error pack_writer_add_string(PackWriter *self, Slice bytes, PackRange *out_range) {
+	*out_range = (PackRange) { .offset = self->strings.len, .len = bytes.len };
+
+	return buffer_concat(&self->strings, bytes);
+}
+
+// Append the heads of the 200 and 304 responses for one representation of a
+// file of `content_type` to `self->strings`, and set `*out_head` and
+// `*out_not_modified_head` to where they went. See `fileserver_format_heads`.
+static Error pack_writer_add_heads(
+	PackWriter *self,
+	Slice content_type,
+	Slice etag,
+	Slice last_modified,
+	Slice encoding,
+	bool vary,
+	uint64_t size,
+	PackRange *out_head,
+	PackRange *out_not_modified_head
+) {
+	size_t head_offset = self->strings.len;
+
+	Error err = http_response_head_begin(&self->strings, HTTP_OK);
+	if (err == ERR_SUCCESS) {
+		err = http_response_head_add_header(&self->strings, slice_from_cstr("Content-Type"), content_type);
+	}
+	if (err == ERR_SUCCESS && encoding.len > 0) {
+		err = http_response_head_add_header(&self->strings, slice_from_cstr("Content-Encoding"), encoding);
+	}
+	if (err == ERR_SUCCESS) {
+		err = http_response_head_add_header(&self->strings, slice_from_cstr("Accept-Ranges"), slice_from_cstr("bytes"));
+	}
+	if (err == ERR_SUCCESS) {
+		err = http_response_head_add_header(&self->strings, slice_from_cstr("ETag"), etag);
+	}
+	if (err == ERR_SUCCESS) {
+		err = http_response_head_add_header(&self->strings, slice_from_cstr("Last-Modified"), last_modified);
+	}
+	if (err == ERR_SUCCESS && vary) {
+		err = http_response_head_add_header(&self->strings, slice_from_cstr("Vary"), slice_from_cstr("Accept-Encoding"));
+	}
+	if (err == ERR_SUCCESS) {
+		err = http_response_head_end(&self->strings, size);
+	}
+	if (err != ERR_SUCCESS) return err;
+
+	*out_head = (PackRange) {
+		.offset = head_offset,
+		.len = self->strings.len - head_offset,
+	};
+
+	size_t not_modified_offset = self->strings.len;
+
+	err = http_response_head_begin(&self->strings, HTTP_NOT_MODIFIED);
+	if (err == ERR_SUCCESS) {
+		err = http_response_head_add_header(&self->strings, slice_from_cstr("ETag"), etag);
+	}
+	if (err == ERR_SUCCESS) {
+		err = http_response_head_add_header(&self->strings, slice_from_cstr("Last-Modified"), last_modified);
+	}
+	if (err == ERR_SUCCESS && vary) {
+		err = http_response_head_add_header(&self->strings, slice_from_cstr("Vary"), slice_from_cstr("Accept-Encoding"));
+	}
+	if (err == ERR_SUCCESS) {
+		err = http_response_head_end_without_body(&self->strings);
+	}
+	if (err != ERR_SUCCESS) return err;
+
+	*out_not_modified_head = (PackRange) {
+		.offset = not_modified_offset,
+		.len = self->strings.len - not_modified_offset,
+	};
+
+	return ERR_SUCCESS;
+}
+
+// Format the strong ETag for contents with `hash`, with `suffix` inside the
+// quotes, and append it to `self->strings`.
+static Error pack_writer_add_etag(PackWriter *self, uint64_t hash, const char *suffix, PackRange *out_range) {
+	size_t offset = self->strings.len;
+
+	Error err = format_etag(&self->strings, hash, suffix);
+	if (err != ERR_SUCCESS) return err;
+
+	*out_range = (PackRange) { .offset = offset, .len = self->strings.len - offset };
+
+	return ERR_SUCCESS;
+}
+
+// Append a gzip-compressed copy of `file`, whose contents are `contents`, to
+// `self->compressed`, if that's smaller, and set `*out_range` to where it
+// went. Empty if it isn't.
+static Error pack_writer_add_compressed(
+	PackWriter *self,
+	const StaticFile *file,
+	Slice contents,
+	PackRange *out_range
+) {
+	*out_range = (PackRange) { 0 };
+
+	Slice gzip;
+	Error err = fileserver_compress_file(file, contents, FILESERVER_GZIP_LEVEL, &gzip);
+	if (err != ERR_SUCCESS) return err;
+
+	*out_range = (PackRange) { .offset = self->compressed.len, .len = gzip.len };
+
+	err = buffer_concat(&self->compressed, gzip);
+	slice_free(gzip);
+
+	return err;
+}
+
+// Add `file` to the pack, at `url`. Called for every file in the directory
+// that's being packed.
+static Error pack_writer_add(void *userdata, Slice url, const StaticFile *file) {
+	Error err;
+
+	PackWriter *self = (PackWriter*) userdata;
+
+	// Removed since the directory was walked.
+	struct stat file_stat;
+	if (stat(file->path, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) return ERR_SUCCESS;
+
+	if (self->sources_count == self->sources_capacity) {
+		size_t capacity = self->sources_capacity > 0 ? self->sources_capacity * 2 : 64;
+
+		PackSource *sources = realloc(self->sources, capacity * sizeof(*sources));
+		if (sources == NULL) return ERR_OUT_OF_MEMORY;
+
+		self->sources = sources;
+		self->sources_capacity = capacity;
+	}
+
+	char *path = strdup(file->path);
+	if (path == NULL) return ERR_OUT_OF_MEMORY;
+
+	PackSource source = {
+		.path = path,
+		.entry = {
+			.hash = pack_hash(url),
+			.contents = { .offset = 0, .len = file_stat.st_size },
+		},
+	};
+
+	// Mapped to be hashed and compressed. Empty files can't be mapped, and
+	// have nothing to compress.
+	Slice contents = slice_new();
+	if (file_stat.st_size > 0) {
+		int fd = open(file->path, O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			free(path);
+			return ERR_NOT_FOUND;
+		}
+
+		void *mapping = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (mapping == MAP_FAILED) {
+			free(path);
+			return ERR_OUT_OF_MEMORY;
+		}
+
+		contents = slice_from_len(mapping, file_stat.st_size);
+	}
+
+	Buffer last_modified;
+	buffer_init(&last_modified);
+
+	err = format_http_date(&last_modified, file_stat.st_mtime);
+	if (err == ERR_SUCCESS) {
+		err = pack_writer_add_string(self, url, &source.entry.url);
+	}
+	if (err == ERR_SUCCESS) {
+		err = pack_writer_add_string(self, file->content_type, &source.entry.content_type);
+	}
+	if (err == ERR_SUCCESS) {
+		err = pack_writer_add_string(self, buffer_slice(&last_modified), &source.entry.last_modified);
+	}
+	if (err == ERR_SUCCESS) {
+		err = pack_writer_add_etag(self, content_hash(contents), "", &source.entry.etag);
+	}
+	if (err == ERR_SUCCESS && contents.len > 0) {
+		err = pack_writer_add_compressed(self, file, contents, &source.entry.gzip_contents);
+	}
+
+	if (contents.len > 0) munmap(contents.bytes, contents.len);
+
+	source.entry.modified = file_stat.st_mtime;
+
+	bool vary = source.entry.gzip_contents.len > 0;
+
+	if (err == ERR_SUCCESS) {
+		err = pack_writer_add_heads(
+			self,
+			file->content_type,
+			slice_from_len(self->strings.bytes + source.entry.etag.offset, source.entry.etag.len),
+			buffer_slice(&last_modified),
+			slice_new(),
+			vary,
+			file_stat.st_size,
+			&source.entry.head,
+			&source.entry.not_modified_head
+		);
+	}
+
+	// The compressed copy is a different representation, with an ETag of its
+	// own, from the hash of the compressed bytes.
+	if (err == ERR_SUCCESS && vary) {
+		Slice gzip = slice_from_len(
+			self->compressed.bytes + source.entry.gzip_contents.offset,
+			source.entry.gzip_contents.len
+		);
+		err = pack_writer_add_etag(self, content_hash(gzip), "-gzip", &source.entry.gzip_etag);
+	}
+	if (err == ERR_SUCCESS && vary) {
+		err = pack_writer_add_heads(
+			self,
+			file->content_type,
+			slice_from_len(self->strings.bytes + source.entry.gzip_etag.offset, source.entry.gzip_etag.len),
+			buffer_slice(&last_modified),
+			slice_from_cstr("gzip"),
+			vary,
+			source.entry.gzip_contents.len,
+			&source.entry.gzip_head,
+			&source.entry.gzip_not_modified_head
+		);
+	}
+
+	buffer_deinit(&last_modified);
+
+	if (err != ERR_SUCCESS) {
+		free(path);
+		return err;
+	}
+
+	self->sources[self->sources_count] = source;
+	self->sources_count += 1;
+
+	return ERR_SUCCESS;
+}
+
+// Copy exactly `len` bytes of the file at `path` to `out_fd`, at `offset`.
+static Error pack_copy_file(const char *path, int out_fd, uint64_t offset, uint64_t len, uint8_t *chunk) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return ERR_NOT_FOUND;
+
+	Error err = ERR_SUCCESS;
+
+	if (lseek(out_fd, offset, SEEK_SET) == -1) err = ERR_UNKNOWN;
+
+	while (err == ERR_SUCCESS && len > 0) {
+		size_t attempt_read = len < PACK_COPY_CHUNK ? len : PACK_COPY_CHUNK;
+
+		ssize_t amount_read = read(fd, chunk, attempt_read);
+		if (amount_read <= 0) {
+			// Shrunk since it was measured; its head would be wrong.
+			fprintf(stderr, "error: %s changed while it was being packed\n", path);
+			err = ERR_UNKNOWN;
+			break;
+		}
+
+		err = write_all_to_fd(out_fd, slice_from_len(chunk, amount_read));
+		len -= amount_read;
+	}
+
+	close(fd);
+
+	return err;
+}
+
+// Lay out everything that `writer` found, and write it to `out_fd`.
+static Error pack_writer_write(PackWriter *self, int out_fd, PackWriteStats *out_stats) {
+	Error err;
+
+	uint64_t buckets_count = 1;
+	while (buckets_count <= self->sources_count * 2) buckets_count *= 2;
+
+	PackHeader header = {
+		.byte_order = PACK_BYTE_ORDER,
+		.alignment = PACK_ALIGNMENT,
+		.entries_count = self->sources_count,
+		.buckets_count = buckets_count,
+	};
+	memcpy(header.magic, pack_magic, sizeof(pack_magic));
+
+	uint64_t offset = sizeof(header);
+
+	header.buckets_offset = offset;
+	offset += buckets_count * sizeof(uint32_t);
+
+	header.entries_offset = pack_align(offset, _Alignof(PackEntry));
+	offset = header.entries_offset + self->sources_count * sizeof(PackEntry);
+
+	uint64_t strings_offset = offset;
+	offset += self->strings.len;
+
+	uint64_t compressed_offset = offset;
+	offset += self->compressed.len;
+
+	for (size_t i = 0; i < self->sources_count; i++) {
+		PackEntry *entry = &self->sources[i].entry;
+
+		entry->url.offset += strings_offset;
+		entry->content_type.offset += strings_offset;
+		entry->etag.offset += strings_offset;
+		entry->gzip_etag.offset += strings_offset;
+		entry->last_modified.offset += strings_offset;
+		entry->head.offset += strings_offset;
+		entry->not_modified_head.offset += strings_offset;
+		entry->gzip_head.offset += strings_offset;
+		entry->gzip_not_modified_head.offset += strings_offset;
+		entry->gzip_contents.offset += compressed_offset;
+
+		offset = pack_align(offset, PACK_ALIGNMENT);
+		entry->contents.offset = offset;
+		offset += entry->contents.len;
+	}
+
+	header.size = offset;
+
+	// The index, up to the first file's contents, is built in memory.
+	Buffer index;
+	buffer_init(&index);
+
+	err = buffer_reserve_additional(&index, strings_offset - sizeof(header));
+	if (err != ERR_SUCCESS) {
+		buffer_deinit(&index);
+		return err;
+	}
+
+	uint32_t *buckets = (uint32_t*) index.bytes;
+	memset(buckets, 0, buckets_count * sizeof(uint32_t));
+
+	for (size_t i = 0; i < self->sources_count; i++) {
+		uint64_t bucket = self->sources[i].entry.hash & (buckets_count - 1);
+		while (buckets[bucket] != 0) bucket = (bucket + 1) & (buckets_count - 1);
+
+		// Zero means empty.
+		buckets[bucket] = i + 1;
+	}
+
+	memset(index.bytes + buckets_count * sizeof(uint32_t), 0, header.entries_offset - header.buckets_offset - buckets_count * sizeof(uint32_t));
+
+	PackEntry *entries = (PackEntry*) (index.bytes + header.entries_offset - sizeof(header));
+	for (size_t i = 0; i < self->sources_count; i++) {
+		entries[i] = self->sources[i].entry;
+	}
+
+	index.len = strings_offset - sizeof(header);
+
+	err = write_all_to_fd(out_fd, slice_from_len((uint8_t*) &header, sizeof(header)));
+	if (err == ERR_SUCCESS) {
+		err = write_all_to_fd(out_fd, buffer_slice(&index));
+	}
+	if (err == ERR_SUCCESS) {
+		err = write_all_to_fd(out_fd, buffer_slice(&self->strings));
+	}
+	if (err == ERR_SUCCESS) {
+		err = write_all_to_fd(out_fd, buffer_slice(&self->compressed));
+	}
+
+	buffer_deinit(&index);
+
+	if (err != ERR_SUCCESS) return err;
+
+	uint8_t *chunk = malloc(PACK_COPY_CHUNK);
+	if (chunk == NULL) return ERR_OUT_OF_MEMORY;
+
+	for (size_t i = 0; i < self->sources_count && err == ERR_SUCCESS; i++) {
+		PackSource *source = &self->sources[i];
+
+		err = pack_copy_file(source->path, out_fd, source->entry.contents.offset, source->entry.contents.len, chunk);
+	}
+
+	free(chunk);
+
+	if (err != ERR_SUCCESS) return err;
+
+	// Padding after the last file, if it's empty.
+	if (ftruncate(out_fd, header.size) != 0) return ERR_UNKNOWN;
+
+	*out_stats = (PackWriteStats) {
+		.files = self->sources_count,
+		.bytes = header.size,
+	};
+
+	return ERR_SUCCESS;
+}
+
+Error pack_write(const char *path, const char *out_path, PackWriteStats *out_stats) {
+	Error err;
+
+	// Only index the files; they're read as they're copied into the pack.
+	FileServer fileserver;
+	fileserver_init(&fileserver);
+	fileserver.cache_size = SIZE_MAX;
+
+	PackWriter writer = {
+		.sources = NULL,
+		.sources_count = 0,
+		.sources_capacity = 0,
+	};
+	buffer_init(&writer.strings);
+	buffer_init(&writer.compressed);
+
+	err = fileserver_register_directory(&fileserver, path, slice_from_cstr("/"));
+	if (err == ERR_SUCCESS) {
+		err = fileserver_for_each_file(&fileserver, pack_writer_add, &writer);
+	}
+
+	fileserver_deinit(&fileserver);
+
+	// Written next to `out_path`, and renamed over it once it's complete, so
+	// that nothing ever sees half a pack.
+	Buffer temporary_path;
+	buffer_init(&temporary_path);
+
+	if (err == ERR_SUCCESS) {
+		err = buffer_concat_printf(&temporary_path, "%s.tmp", out_path);
+	}
+	if (err == ERR_SUCCESS) {
+		err = buffer_concat(&temporary_path, slice_from_len((uint8_t*) "\x00", 1));
+	}
+
+	if (err == ERR_SUCCESS) {
+		const char *temporary_path_cstr = (const char*) temporary_path.bytes;
+
+		int out_fd = open(temporary_path_cstr, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (out_fd == -1) {
+			err = ERR_NOT_FOUND;
+		} else {
+			err = pack_writer_write(&writer, out_fd, out_stats);
+			if (err == ERR_SUCCESS && fsync(out_fd) != 0) err = ERR_UNKNOWN;
+			close(out_fd);
+
+			if (err == ERR_SUCCESS && rename(temporary_path_cstr, out_path) != 0) err = ERR_UNKNOWN;
+			if (err != ERR_SUCCESS) unlink(temporary_path_cstr);
+		}
+	}
+
+	buffer_deinit(&temporary_path);
+
+	for (size_t i = 0; i < writer.sources_count; i++) {
+		free(writer.sources[i].path);
+	}
+	free(writer.sources);
+	buffer_deinit(&writer.strings);
+	buffer_deinit(&writer.compressed);
+
+	return err;
+}
+
+// Returns true if `range` is within a pack of `size` bytes.
+static bool pack_range_valid(PackRange range, uint64_t size) {
+	return range.offset <= size && range.len <= size - range.offset;
+}
+
+// Check that the header, the index and every entry's ranges are within the
+// pack, and that the hash table has an empty bucket to end lookups of URLs
+// that aren't in it, so that lookups don't have to. Entries' contents aren't
+// checked: a damaged pack serves damaged files, but can't crash the server.
+static bool pack_valid(const Pack *self) {
+	uint64_t size = self->mapping.len;
+	if (size < sizeof(PackHeader)) return false;
+
+	const PackHeader *header = self->header;
+
+	if (memcmp(header->magic, pack_magic, sizeof(pack_magic)) != 0) return false;
+	if (header->byte_order != PACK_BYTE_ORDER) return false;
+	if (header->size != size) return false;
+
+	uint64_t buckets_count = header->buckets_count;
+	if (buckets_count == 0 || (buckets_count & (buckets_count - 1)) != 0) return false;
+	if (buckets_count <= header->entries_count) return false;
+
+	if (header->buckets_offset % _Alignof(uint32_t) != 0) return false;
+	if (buckets_count > size / sizeof(uint32_t)) return false;
+	if (!pack_range_valid((PackRange) { header->buckets_offset, buckets_count * sizeof(uint32_t) }, size)) return false;
+
+	if (header->entries_offset % _Alignof(PackEntry) != 0) return false;
+	if (header->entries_count > size / sizeof(PackEntry)) return false;
+	if (!pack_range_valid((PackRange) { header->entries_offset, header->entries_count * sizeof(PackEntry) }, size)) return false;
+
+	const uint32_t *buckets = (const uint32_t*) (self->mapping.bytes + header->buckets_offset);
+	uint64_t empty_buckets = 0;
+	for (uint64_t i = 0; i < buckets_count; i++) {
+		if (buckets[i] > header->entries_count) return false;
+		if (buckets[i] == 0) empty_buckets += 1;
+	}
+
+	// Lookups probe until they find the URL or an empty bucket. Buckets can
+	// name the same entry more than once, so there being more buckets than
+	// entries doesn't mean any are empty.
+	if (empty_buckets == 0) return false;
+
+	const PackEntry *entries = (const PackEntry*) (self->mapping.bytes + header->entries_offset);
+	for (uint64_t i = 0; i < header->entries_count; i++) {
+		const PackEntry *entry = &entries[i];
+
+		if (
+			!pack_range_valid(entry->url, size) ||
+			!pack_range_valid(entry->content_type, size) ||
+			!pack_range_valid(entry->etag, size) ||
+			!pack_range_valid(entry->gzip_etag, size) ||
+			!pack_range_valid(entry->last_modified, size) ||
+			!pack_range_valid(entry->head, size) ||
+			!pack_range_valid(entry->not_modified_head, size) ||
+			!pack_range_valid(entry->contents, size) ||
+			!pack_range_valid(entry->gzip_head, size) ||
+			!pack_range_valid(entry->gzip_not_modified_head, size) ||
+			!pack_range_valid(entry->gzip_contents, size)
+		) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+Error pack_open(Pack *self, const char *path) {
+	set_undefined(self, sizeof(*self));
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return ERR_NOT_FOUND;
+
+	struct stat pack_stat;
+	if (fstat(fd, &pack_stat) != 0) {
+		close(fd);
+		return ERR_NOT_FOUND;
+	}
+
+	if ((size_t) pack_stat.st_size < sizeof(PackHeader)) {
+		close(fd);
+		return ERR_PARSE_FAILED;
+	}
+
+	void *mapping = mmap(NULL, pack_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) return ERR_OUT_OF_MEMORY;
+
+	self->mapping = slice_from_len(mapping, pack_stat.st_size);
+	self->header = (const PackHeader*) mapping;
+
+	if (!pack_valid(self)) {
+		munmap(mapping, pack_stat.st_size);
+		return ERR_PARSE_FAILED;
+	}
+
+	self->buckets = (const uint32_t*) (self->mapping.bytes + self->header->buckets_offset);
+	self->entries = (const PackEntry*) (self->mapping.bytes + self->header->entries_offset);
+
+	// Every lookup goes through the index; contents are only read in as
+	// they're asked for.
+	(void) madvise(mapping, self->header->entries_offset + self->header->entries_count * sizeof(PackEntry), MADV_WILLNEED);
+
+	return ERR_SUCCESS;
+}
+
+void pack_close(Pack *self) {
+	munmap(self->mapping.bytes, self->mapping.len);
+
+	set_undefined(self, sizeof(*self));
+}
+
+size_t pack_files_count(const Pack *self) {
+	return self->header->entries_count;
+}
+
+static Slice pack_slice(const Pack *self, PackRange range) {
+	return slice_from_len(self->mapping.bytes + range.offset, range.len);
+}
+
+// The entry for `url`, or `NULL`.
+static const PackEntry *pack_get(const Pack *self, Slice url) {
+	uint64_t hash = pack_hash(url);
+	uint64_t mask = self->header->buckets_count - 1;
+
+	for (uint64_t bucket = hash & mask; ; bucket = (bucket + 1) & mask) {
+		uint32_t index = self->buckets[bucket];
+		if (index == 0) return NULL;
+
+		const PackEntry *entry = &self->entries[index - 1];
+		if (entry->hash == hash && slice_equal(pack_slice(self, entry->url), url)) return entry;
+	}
+}
+
+// Send `ranges` of the entry, compressed if `gzip` is true, with the same
+// headers as the whole of it would have, but for its length. See
+// `fileserver_respond_ranges`.
+static Error pack_respond_ranges(
+	const Pack *self,
+	const PackEntry *entry,
+	bool gzip,
+	const HttpByteRange *ranges,
+	size_t ranges_count,
+	HttpResponse *res
+) {
+	Error err = ERR_SUCCESS;
+
+	if (gzip) {
+		err = http_response_add_header(res, slice_from_cstr("Content-Encoding"), slice_from_cstr("gzip"));
+	}
+	if (err == ERR_SUCCESS) {
+		err = http_response_add_header(res, slice_from_cstr("ETag"), pack_slice(self, gzip ? entry->gzip_etag : entry->etag));
+	}
+	if (err == ERR_SUCCESS) {
+		err = http_response_add_header(res, slice_from_cstr("Last-Modified"), pack_slice(self, entry->last_modified));
+	}
+	if (err == ERR_SUCCESS && entry->gzip_head.len > 0) {
+		err = http_response_add_header(res, slice_from_cstr("Vary"), slice_from_cstr("Accept-Encoding"));
+	}
+	if (err != ERR_SUCCESS) return err;
+
+	Slice body = pack_slice(self, gzip ? entry->gzip_contents : entry->contents);
+
+	return http_response_end_ranges(
+		res,
+		pack_slice(self, entry->content_type),
+		body.len,
+		ranges,
+		ranges_count,
+		body,
+		-1
+	);
+}
+
+Error pack_respond(const Pack *self, const HttpRequest *req, HttpResponse *res) {
+	const PackEntry *entry = pack_get(self, http_request_path(req));
+	if (entry == NULL) return ERR_HTTP_NOT_FOUND;
+
+	bool gzip = entry->gzip_head.len > 0 && http_request_accepts_encoding(req, slice_from_cstr("gzip"));
+	Slice etag = pack_slice(self, gzip ? entry->gzip_etag : entry->etag);
+
+	// The pack stays mapped for as long as anything's served from it.
+	if (http_request_not_modified(req, etag, entry->modified)) {
+		PackRange head = gzip ? entry->gzip_not_modified_head : entry->not_modified_head;
+		return http_response_end_prepared(res, pack_slice(self, head), slice_new());
+	}
+
+	HttpByteRange ranges[HTTP_REQUEST_MAX_RANGES];
+	size_t ranges_count;
+	size_t size = gzip ? entry->gzip_contents.len : entry->contents.len;
+
+	switch (http_request_ranges(req, size, etag, entry->modified, ranges, &ranges_count)) {
+	case HTTP_RANGES_NONE:
+		break;
+	case HTTP_RANGES_SATISFIABLE:
+		return pack_respond_ranges(self, entry, gzip, ranges, ranges_count, res);
+	case HTTP_RANGES_NOT_SATISFIABLE:
+		return http_response_range_not_satisfiable(res, size);
+	}
+
+	if (gzip) {
+		return http_response_end_prepared(
+			res,
+			pack_slice(self, entry->gzip_head),
+			pack_slice(self, entry->gzip_contents)
+		);
+	}
+
+	return http_response_end_prepared(
+		res,
+		pack_slice(self, entry->head),
+		pack_slice(self, entry->contents)
+	);
+}
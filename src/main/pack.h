@@ -0,0 +1,46 @@
+#pragma once
+
+#include "http/request.h"
+#include "http/response.h"
+#include "warble/error.h"
+#include "warble/slice.h"
+
+#include <stddef.h>
+
+// Defined in `pack.c`; only pointed to from here.
+struct PackHeader;
+struct PackEntry;
+
+// A site packed into a single file by `pack_write`: every file's contents and
+// prepared response head, and a hash table to find them by URL. Opening one
+// maps it, checks that it's intact, and does nothing else; files are read in
+// by the kernel as they're asked for.
+typedef struct Pack {
+	// The whole file, mapped read-only.
+	Slice mapping;
+
+	const struct PackHeader *header;
+	const uint32_t *buckets;
+	const struct PackEntry *entries;
+} Pack;
+
+typedef struct PackWriteStats {
+	size_t files;
+
+	// Size of the whole pack, padding included.
+	size_t bytes;
+} PackWriteStats;
+
+// Pack every file in the directory at `path` into a new file at `out_path`,
+// replacing it atomically once it's complete.
+Error pack_write(const char *path, const char *out_path, PackWriteStats *out_stats);
+
+// Returns `ERR_PARSE_FAILED` if the file at `path` isn't a pack, or is damaged.
+Error pack_open(Pack *self, const char *path);
+void pack_close(Pack *self);
+
+size_t pack_files_count(const Pack *self);
+
+// Returns `ERR_HTTP_NOT_FOUND` if the path of `req.target`, without its query,
+// isn't in the pack. May be called from several threads at once.
+Error pack_respond(const Pack *self, const HttpRequest *req, HttpResponse *res);
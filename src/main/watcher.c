@@ -0,0 +1,324 @@
+#include "main/watcher.h"
+
+#include "util.h"
+
+#include "warble/buffer.h"
+#include "warble/util.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Everything that can change what's served from a watched directory.
+#define FILE_WATCHER_EVENTS ( \
+	IN_CLOSE_WRITE | \
+	IN_CREATE | \
+	IN_DELETE | \
+	IN_MOVED_FROM | \
+	IN_MOVED_TO | \
+	IN_ONLYDIR \
+)
+
+// After a change arrives, further changes are collected into the same update
+// until none have arrived for this long. Editors and build tools tend to touch
+// several files in a row.
+#define FILE_WATCHER_SETTLE_MS 10
+
+// Changes that keep arriving without a pause, such as from a long copy, are
+// published at least this often, so that an update is never held open for
+// long and what has changed already gets served.
+#define FILE_WATCHER_SETTLE_MAX_MS 500
+
+static void file_watcher_forget(FileWatcher *self, int wd) {
+	if (wd < 0 || (size_t) wd >= self->directories_count) return;
+
+	FileWatcherDirectory *directory = &self->directories[wd];
+	if (directory->path == NULL) return;
+
+	free(directory->path);
+	slice_free(directory->url);
+	directory->path = NULL;
+}
+
+// Watch the directory at `path`, which is served at `url`. Called for every
+// directory a `FileServerUpdate` adds.
+static void file_watcher_on_directory(void *userdata, const char *path, Slice url) {
+	FileWatcher *self = (FileWatcher*) userdata;
+
+	// Watching a directory that's already watched, such as one that was moved
+	// within the tree, gives back its existing descriptor.
+	int wd = inotify_add_watch(self->inotify_fd, path, FILE_WATCHER_EVENTS);
+	if (wd == -1) {
+		printf("error watching %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	if ((size_t) wd >= self->directories_count) {
+		size_t count = self->directories_count * 2;
+		if (count <= (size_t) wd) count = (size_t) wd + 1;
+
+		FileWatcherDirectory *directories = realloc(self->directories, count * sizeof(*directories));
+		if (directories == NULL) {
+			inotify_rm_watch(self->inotify_fd, wd);
+			return;
+		}
+
+		for (size_t i = self->directories_count; i < count; i++) {
+			directories[i].path = NULL;
+		}
+
+		self->directories = directories;
+		self->directories_count = count;
+	}
+
+	file_watcher_forget(self, wd);
+
+	char *owned_path = strdup(path);
+	if (owned_path == NULL) {
+		inotify_rm_watch(self->inotify_fd, wd);
+		return;
+	}
+
+	self->directories[wd] = (FileWatcherDirectory) {
+		.path = owned_path,
+		.url = slice_clone(url),
+	};
+}
+
+// Stop watching the directory at `path`, and everything below it.
+static void file_watcher_unwatch(FileWatcher *self, Slice path) {
+	for (size_t wd = 0; wd < self->directories_count; wd++) {
+		FileWatcherDirectory *directory = &self->directories[wd];
+		if (directory->path == NULL) continue;
+
+		Slice directory_path = slice_from_cstr(directory->path);
+		if (directory_path.len < path.len) continue;
+		if (memcmp(directory_path.bytes, path.bytes, path.len) != 0) continue;
+		if (directory_path.len > path.len && directory_path.bytes[path.len] != '/') continue;
+
+		inotify_rm_watch(self->inotify_fd, wd);
+		file_watcher_forget(self, wd);
+	}
+}
+
+Error file_watcher_init(FileWatcher *self, FileServer *fileserver) {
+	set_undefined(self, sizeof(*self));
+
+	self->fileserver = fileserver;
+	self->directories = NULL;
+	self->directories_count = 0;
+	self->root_path = NULL;
+	self->root_url = slice_new();
+
+	self->inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (self->inotify_fd == -1) return ERR_UNKNOWN;
+
+	return ERR_SUCCESS;
+}
+
+void file_watcher_deinit(FileWatcher *self) {
+	for (size_t wd = 0; wd < self->directories_count; wd++) {
+		file_watcher_forget(self, wd);
+	}
+	free(self->directories);
+
+	free(self->root_path);
+	slice_free(self->root_url);
+
+	close(self->inotify_fd);
+
+	set_undefined(self, sizeof(*self));
+}
+
+Error file_watcher_watch_directory(FileWatcher *self, const char *path, Slice url) {
+	Error err;
+
+	assert(self->root_path == NULL);
+
+	self->root_path = strdup(path);
+	if (self->root_path == NULL) return ERR_OUT_OF_MEMORY;
+	self->root_url = slice_clone(url);
+
+	FileServerUpdate update;
+	err = fileserver_update_begin(self->fileserver, &update);
+	if (err != ERR_SUCCESS) return err;
+
+	update.on_directory = file_watcher_on_directory;
+	update.on_directory_userdata = self;
+
+	err = fileserver_update_add_directory(&update, path, url);
+
+	// Whatever was added before an error is still served.
+	fileserver_update_commit(&update);
+
+	return err;
+}
+
+// Add the change described by `event` to `update`.
+static void file_watcher_apply(
+	FileWatcher *self,
+	FileServerUpdate *update,
+	const struct inotify_event *event
+) {
+	if (event->mask & IN_Q_OVERFLOW) {
+		// Events were lost; start over from what's on disk.
+		(void) fileserver_update_remove_directory(update, self->root_url);
+		(void) fileserver_update_add_directory(update, self->root_path, self->root_url);
+		return;
+	}
+
+	if (event->mask & IN_IGNORED) {
+		file_watcher_forget(self, event->wd);
+		return;
+	}
+
+	if (event->wd < 0 || (size_t) event->wd >= self->directories_count) return;
+
+	FileWatcherDirectory *directory = &self->directories[event->wd];
+	if (directory->path == NULL) return;
+
+	Slice name = slice_from_cstr(event->len > 0 ? event->name : "");
+
+	// Skip filenames that start with `.`, as when registering.
+	if (name.len == 0 || name.bytes[0] == '.') return;
+
+	Buffer entry_path, entry_url;
+	buffer_init(&entry_path);
+	buffer_init(&entry_url);
+
+	Error err = fileserver_entry_location(directory->path, directory->url, name, &entry_path, &entry_url);
+	if (err != ERR_SUCCESS) {
+		buffer_deinit(&entry_path);
+		buffer_deinit(&entry_url);
+		return;
+	}
+
+	const char *entry_path_cstr = (const char*) entry_path.bytes;
+	Slice url = buffer_slice(&entry_url);
+
+	if (event->mask & IN_ISDIR) {
+		if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+			(void) fileserver_update_add_directory(update, entry_path_cstr, url);
+		} else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+			(void) fileserver_update_remove_directory(update, url);
+
+			// A directory that's moved away keeps its watches, wherever it ends
+			// up. If it's moved within the tree, it's watched again when it
+			// arrives.
+			if (event->mask & IN_MOVED_FROM) {
+				file_watcher_unwatch(self, slice_from_cstr(entry_path_cstr));
+			}
+		}
+	} else {
+		// Files that are created are picked up once they've been written.
+		if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+			(void) fileserver_update_add_file(update, entry_path_cstr, url);
+		} else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+			(void) fileserver_update_remove_file(update, url);
+		}
+
+		// The file that `name` is a compressed copy of is loaded again, to
+		// pick up the new copy, or to go without it.
+		Slice sidecar_url = url;
+		if (
+			(event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM)) &&
+			slice_remove_suffix(&sidecar_url, slice_from_cstr(".gz"))
+		) {
+			// `entry_path` is NUL-terminated; cut it before its `.gz`.
+			entry_path.bytes[entry_path.len - 1 - strlen(".gz")] = '\0';
+
+			struct stat file_stat;
+			if (stat(entry_path_cstr, &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+				(void) fileserver_update_add_file(update, entry_path_cstr, sidecar_url);
+			}
+		}
+	}
+
+	buffer_deinit(&entry_path);
+	buffer_deinit(&entry_url);
+}
+
+// Read whatever events are available, and add them to `update`. Blocks if
+// there aren't any. Returns the number of events read.
+static size_t file_watcher_read(FileWatcher *self, FileServerUpdate *update) {
+	alignas(struct inotify_event) uint8_t events[4096];
+
+	ssize_t events_len = read(self->inotify_fd, events, sizeof(events));
+	if (events_len <= 0) return 0;
+
+	size_t count = 0;
+
+	for (size_t offset = 0; offset < (size_t) events_len; count++) {
+		const struct inotify_event *event = (const struct inotify_event*) &events[offset];
+
+		file_watcher_apply(self, update, event);
+
+		offset += sizeof(*event) + event->len;
+	}
+
+	return count;
+}
+
+Error file_watcher_apply_changes(FileWatcher *self, size_t *out_changes) {
+	*out_changes = 0;
+
+	FileServerUpdate update;
+	Error err = fileserver_update_begin(self->fileserver, &update);
+	if (err != ERR_SUCCESS) return err;
+
+	update.on_directory = file_watcher_on_directory;
+	update.on_directory_userdata = self;
+
+	uint64_t started_ms = monotonic_ms();
+
+	struct pollfd pollfd = { .fd = self->inotify_fd, .events = POLLIN };
+	do {
+		*out_changes += file_watcher_read(self, &update);
+	} while (
+		monotonic_ms() - started_ms < FILE_WATCHER_SETTLE_MAX_MS &&
+		poll(&pollfd, 1, FILE_WATCHER_SETTLE_MS) > 0
+	);
+
+	fileserver_update_commit(&update);
+
+	return ERR_SUCCESS;
+}
+
+static void *file_watcher_run(void *userdata) {
+	FileWatcher *self = (FileWatcher*) userdata;
+
+	while (true) {
+		// Wait for the first change before starting an update, so that no
+		// update is held open while nothing happens.
+		struct pollfd pollfd = { .fd = self->inotify_fd, .events = POLLIN };
+		if (poll(&pollfd, 1, -1) <= 0) continue;
+
+		size_t changes;
+		Error err = file_watcher_apply_changes(self, &changes);
+		if (err != ERR_SUCCESS) {
+			printf("error reloading files: %s\n", error_to_string(err));
+			continue;
+		}
+
+		printf(" reloaded %zu changes\n", changes);
+	}
+
+	return NULL;
+}
+
+Error file_watcher_start(FileWatcher *self) {
+	int err = pthread_create(&self->thread, NULL, file_watcher_run, self);
+	if (err != 0) return ERR_UNKNOWN;
+
+	pthread_detach(self->thread);
+
+	return ERR_SUCCESS;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "main/fileserver.h"
+
+#include "warble/error.h"
+#include "warble/slice.h"
+
+#include <pthread.h>
+#include <stddef.h>
+
+typedef struct FileWatcherDirectory {
+	// Owned and NUL-terminated, or `NULL` if this slot isn't in use.
+	char *path;
+
+	// Owned.
+	Slice url;
+} FileWatcherDirectory;
+
+// Keeps a `FileServer` in sync with a directory on disk. Changes are picked up
+// with inotify, and everything that arrives together is published as a single
+// update, so a reload only costs as much as what changed.
+typedef struct FileWatcher {
+	// Not owned.
+	FileServer *fileserver;
+
+	int inotify_fd;
+
+	// Indexed by watch descriptor.
+	FileWatcherDirectory *directories;
+	size_t directories_count;
+
+	// Rescanned from scratch if inotify drops events. `url` is owned.
+	char *root_path;
+	Slice root_url;
+
+	pthread_t thread;
+} FileWatcher;
+
+// `fileserver` must outlive `self`.
+Error file_watcher_init(FileWatcher *self, FileServer *fileserver);
+
+// Must not be running.
+void file_watcher_deinit(FileWatcher *self);
+
+// Start serving every file in the directory at `path` under `url`, and watch
+// it for changes. Only one directory can be watched.
+Error file_watcher_watch_directory(FileWatcher *self, const char *path, Slice url);
+
+// Read the changes that have arrived, and any that follow closely behind
+// them, and publish them all as one update. Blocks until there's at least
+// one. Called by the watcher's own thread; only called directly by tests.
+Error file_watcher_apply_changes(FileWatcher *self, size_t *out_changes);
+
+// Apply changes on a thread of its own, until the process exits.
+Error file_watcher_start(FileWatcher *self);
@@ -0,0 +1,449 @@
+#include "net/event_loop.h"
+
+#include "util.h"
+
+#include "warble/util.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// How many events to take from the kernel per `epoll_wait`.
+#define EVENT_LOOP_MAX_EVENTS 256
+
+// How many times to read from a single connection before answering what's been
+// read so far.
+#define EVENT_LOOP_MAX_READS 64
+
+// How many connections to accept from a single listener before going back to
+// serving existing connections.
+#define EVENT_LOOP_MAX_ACCEPTS 64
+
+// Add every listener to the epoll set, or remove them all from it. Stops at
+// the first one that fails; listeners that are already where they're meant to
+// be are skipped, so this can be tried again after a failure.
+static Error event_loop_watch_listeners(EventLoop *self, int op) {
+	for (size_t i = 0; i < self->server->addresses_count; i++) {
+		EventLoopListener *listener = &self->listeners[i];
+
+		struct epoll_event event = {
+			.events = EPOLLIN,
+			.data.ptr = listener,
+		};
+
+		int err = epoll_ctl(
+			self->epoll_fd,
+			op,
+			self->server->addresses[i].listen_fd,
+			&event
+		);
+		if (err != 0) {
+			if (op == EPOLL_CTL_ADD && errno == EEXIST) continue;
+			if (op == EPOLL_CTL_DEL && errno == ENOENT) continue;
+
+			perror("epoll_ctl");
+			return ERR_UNKNOWN;
+		}
+	}
+
+	return ERR_SUCCESS;
+}
+
+Error event_loop_init(
+	EventLoop *self,
+	Server *server,
+	HttpHandler handler,
+	void *handler_userdata
+) {
+	set_undefined(self, sizeof(*self));
+
+	self->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (self->epoll_fd == -1) {
+		perror("epoll_create1");
+		return ERR_UNKNOWN;
+	}
+
+	self->server = server;
+
+	self->handler = handler;
+	self->handler_userdata = handler_userdata;
+
+	self->connections = NULL;
+	self->connections_tail = NULL;
+	self->connections_count = 0;
+
+	self->now_ms = monotonic_ms();
+
+	timer_wheel_init(&self->timers, self->now_ms);
+
+	self->accept_paused = false;
+	self->accept_resume_on_close = false;
+	timer_init(&self->accept_backoff, NULL);
+
+	accept_error_log_init(&self->accept_errors);
+
+	for (size_t i = 0; i < server->addresses_count; i++) {
+		EventLoopListener *listener = &self->listeners[i];
+
+		listener->kind = EVENT_SOURCE_LISTENER;
+		listener->address_index = i;
+	}
+
+	Error err = event_loop_watch_listeners(self, EPOLL_CTL_ADD);
+	if (err != ERR_SUCCESS) {
+		timer_wheel_deinit(&self->timers);
+		close(self->epoll_fd);
+		return err;
+	}
+
+	return ERR_SUCCESS;
+}
+
+// Stop accepting connections for a while, after accepting failed with
+// `errnum`.
+static void event_loop_pause_accepting(EventLoop *self, int errnum) {
+	accept_error_log_report(&self->accept_errors, errnum, self->now_ms);
+
+	if (event_loop_watch_listeners(self, EPOLL_CTL_DEL) != ERR_SUCCESS) return;
+
+	self->accept_paused = true;
+	self->accept_resume_on_close = server_accept_error_exhausted(errnum);
+	timer_wheel_schedule(
+		&self->timers,
+		&self->accept_backoff,
+		self->now_ms + SERVER_ACCEPT_BACKOFF_MS
+	);
+}
+
+static void event_loop_resume_accepting(EventLoop *self) {
+	assert(self->accept_paused);
+
+	timer_wheel_cancel(&self->timers, &self->accept_backoff);
+
+	if (event_loop_watch_listeners(self, EPOLL_CTL_ADD) != ERR_SUCCESS) {
+		// Try again later rather than never accepting anything again.
+		timer_wheel_schedule(
+			&self->timers,
+			&self->accept_backoff,
+			self->now_ms + SERVER_ACCEPT_BACKOFF_MS
+		);
+		return;
+	}
+
+	self->accept_paused = false;
+	self->accept_resume_on_close = false;
+}
+
+static void event_loop_unlink_connection(EventLoop *self, EventLoopConnection *connection) {
+	if (connection->prev != NULL) {
+		connection->prev->next = connection->next;
+	} else {
+		self->connections = connection->next;
+	}
+
+	if (connection->next != NULL) {
+		connection->next->prev = connection->prev;
+	} else {
+		self->connections_tail = connection->prev;
+	}
+}
+
+static void event_loop_append_connection(EventLoop *self, EventLoopConnection *connection) {
+	connection->prev = self->connections_tail;
+	connection->next = NULL;
+
+	if (self->connections_tail != NULL) {
+		self->connections_tail->next = connection;
+	} else {
+		self->connections = connection;
+	}
+
+	self->connections_tail = connection;
+}
+
+static void event_loop_close_connection(EventLoop *self, EventLoopConnection *connection) {
+	connection_timeout_deinit(&connection->timeout, &self->timers);
+
+	// Closing the socket removes it from the epoll set.
+	http_connection_deinit(&connection->http);
+	server_connection_deinit(&connection->connection);
+
+	event_loop_unlink_connection(self, connection);
+
+	assert(self->connections_count > 0);
+	self->connections_count -= 1;
+
+	free(connection);
+
+	// That's a descriptor free to accept another connection with.
+	if (self->accept_resume_on_close) event_loop_resume_accepting(self);
+}
+
+void event_loop_deinit(EventLoop *self) {
+	timer_wheel_cancel(&self->timers, &self->accept_backoff);
+	self->accept_resume_on_close = false;
+
+	while (self->connections != NULL) {
+		event_loop_close_connection(self, self->connections);
+	}
+
+	timer_wheel_deinit(&self->timers);
+
+	close(self->epoll_fd);
+
+	set_undefined(self, sizeof(*self));
+}
+
+// Register interest in either readability or writability of `connection`.
+static Error event_loop_watch_connection(
+	EventLoop *self,
+	EventLoopConnection *connection,
+	int op,
+	bool wait_for_write
+) {
+	struct epoll_event event = {
+		.events = wait_for_write ? EPOLLOUT : EPOLLIN,
+		.data.ptr = connection,
+	};
+
+	if (epoll_ctl(self->epoll_fd, op, connection->connection.fd, &event) != 0) {
+		perror("epoll_ctl");
+		return ERR_UNKNOWN;
+	}
+
+	connection->waiting_for_write = wait_for_write;
+
+	return ERR_SUCCESS;
+}
+
+static void event_loop_accept(EventLoop *self, EventLoopListener *listener) {
+	// Paused by an earlier listener's event in the same batch.
+	if (self->accept_paused) return;
+
+	for (int i = 0; i < EVENT_LOOP_MAX_ACCEPTS; i++) {
+		ServerConnection server_connection;
+		bool accepted;
+
+		Error err = server_try_accept(
+			self->server,
+			listener->address_index,
+			&server_connection,
+			&accepted
+		);
+		if (err != ERR_SUCCESS) {
+			event_loop_pause_accepting(self, errno);
+			return;
+		}
+
+		if (!accepted) return;
+
+		EventLoopConnection *connection = malloc(sizeof(*connection));
+		if (connection == NULL) {
+			server_connection_deinit(&server_connection);
+			return;
+		}
+
+		connection->kind = EVENT_SOURCE_CONNECTION;
+		connection->connection = server_connection;
+		http_connection_init(&connection->http);
+
+		event_loop_append_connection(self, connection);
+		self->connections_count += 1;
+
+		connection_timeout_init(&connection->timeout, connection);
+		connection_timeout_update(
+			&connection->timeout,
+			&self->timers,
+			self->server,
+			&connection->http,
+			0,
+			self->now_ms
+		);
+
+		err = event_loop_watch_connection(self, connection, EPOLL_CTL_ADD, false);
+		if (err != ERR_SUCCESS) {
+			event_loop_close_connection(self, connection);
+			return;
+		}
+	}
+}
+
+// Write whatever output `connection` has queued, handle any requests that
+// were waiting behind it, and decide what to wait for next. May close
+// `connection`.
+static void event_loop_flush_connection(EventLoop *self, EventLoopConnection *connection) {
+	Error err;
+	bool blocked;
+
+	while (true) {
+		err = http_connection_send(&connection->http, connection->connection.fd, &blocked);
+		if (err != ERR_SUCCESS) {
+			event_loop_close_connection(self, connection);
+			return;
+		}
+
+		if (blocked || !http_connection_has_buffered_input(&connection->http)) break;
+
+		// The client sent another request along with the last one.
+		err = http_connection_receive(
+			&connection->http,
+			slice_new(),
+			self->handler,
+			self->handler_userdata
+		);
+		if (err != ERR_SUCCESS) {
+			printf("error parsing request: %s\n", error_to_string(err));
+			event_loop_close_connection(self, connection);
+			return;
+		}
+	}
+
+	if (!blocked && http_connection_finished(&connection->http)) {
+		event_loop_close_connection(self, connection);
+		return;
+	}
+
+	// Everything sent has been seen being written, so nothing's in flight.
+	connection_timeout_update(
+		&connection->timeout,
+		&self->timers,
+		self->server,
+		&connection->http,
+		0,
+		self->now_ms
+	);
+
+	if (blocked == connection->waiting_for_write) return;
+
+	err = event_loop_watch_connection(self, connection, EPOLL_CTL_MOD, blocked);
+	if (err != ERR_SUCCESS) {
+		event_loop_close_connection(self, connection);
+		return;
+	}
+}
+
+// Read everything the client has sent so far, handle every request in it,
+// and write all of their responses together.
+static void event_loop_read_connection(EventLoop *self, EventLoopConnection *connection) {
+	for (int i = 0; i < EVENT_LOOP_MAX_READS; i++) {
+		// Read straight into the parser, as much as it asks for.
+		Slice space;
+		Error err = http_connection_reserve(&connection->http, &space);
+		if (err != ERR_SUCCESS) {
+			event_loop_close_connection(self, connection);
+			return;
+		}
+
+		// Turned away for want of memory.
+		if (space.len == 0) break;
+
+		ssize_t recv_result = recv(connection->connection.fd, space.bytes, space.len, 0);
+		if (recv_result == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) break;
+
+			event_loop_close_connection(self, connection);
+			return;
+		}
+
+		if (recv_result == 0) {
+			// End of file.
+			event_loop_close_connection(self, connection);
+			return;
+		}
+
+		size_t read_len = recv_result;
+		assert(read_len <= space.len);
+
+		err = http_connection_commit(
+			&connection->http,
+			read_len,
+			self->handler,
+			self->handler_userdata
+		);
+		if (err != ERR_SUCCESS) {
+			printf("error parsing request: %s\n", error_to_string(err));
+			event_loop_close_connection(self, connection);
+			return;
+		}
+
+		// A short read means the socket has been drained, and a connection that's
+		// closing or backed up won't handle anything more until it's flushed.
+		if (read_len < space.len) break;
+		if (connection->http.closing) break;
+		if (http_connection_has_buffered_input(&connection->http)) break;
+	}
+
+	event_loop_flush_connection(self, connection);
+}
+
+// Close every connection whose timer has expired, counting what it timed out
+// waiting for, and start accepting again if it's been paused long enough.
+static void event_loop_close_timed_out_connections(EventLoop *self) {
+	while (true) {
+		Timer *timer = timer_wheel_take_expired(&self->timers, self->now_ms);
+		if (timer == NULL) break;
+
+		if (timer == &self->accept_backoff) {
+			event_loop_resume_accepting(self);
+			continue;
+		}
+
+		EventLoopConnection *connection = (EventLoopConnection*) timer->data;
+
+		connection_timeout_count(connection->timeout.kind);
+		event_loop_close_connection(self, connection);
+	}
+}
+
+Error event_loop_run(EventLoop *self) {
+	while (true) {
+		struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+		int ready_count = epoll_wait(
+			self->epoll_fd,
+			events,
+			EVENT_LOOP_MAX_EVENTS,
+			timer_wheel_wait_timeout(&self->timers, self->now_ms)
+		);
+
+		self->now_ms = monotonic_ms();
+
+		if (ready_count < 0) {
+			if (errno == EINTR) continue;
+
+			perror("epoll_wait");
+			return ERR_UNKNOWN;
+		}
+
+		for (int i = 0; i < ready_count; i++) {
+			struct epoll_event *event = &events[i];
+
+			EventSourceKind kind = *(EventSourceKind*) event->data.ptr;
+
+			switch (kind) {
+			case EVENT_SOURCE_LISTENER:
+				event_loop_accept(self, (EventLoopListener*) event->data.ptr);
+				break;
+
+			case EVENT_SOURCE_CONNECTION: {
+				EventLoopConnection *connection = (EventLoopConnection*) event->data.ptr;
+
+				// Errors and hangups are noticed by the next `recv` or `send`.
+				if (connection->waiting_for_write) {
+					event_loop_flush_connection(self, connection);
+				} else {
+					event_loop_read_connection(self, connection);
+				}
+				break;
+			}
+			}
+		}
+
+		event_loop_close_timed_out_connections(self);
+	}
+}
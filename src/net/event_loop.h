@@ -0,0 +1,90 @@
+#pragma once
+
+#include "http/connection.h"
+#include "net/server.h"
+#include "net/timeout.h"
+#include "net/timer_wheel.h"
+
+#include "warble/error.h"
+
+// Everything registered with epoll starts with one of these, so that events
+// can be dispatched without looking anything up.
+typedef enum EventSourceKind {
+	EVENT_SOURCE_LISTENER,
+	EVENT_SOURCE_CONNECTION,
+} EventSourceKind;
+
+typedef struct EventLoopListener {
+	EventSourceKind kind;
+
+	// Index into `Server.addresses`.
+	size_t address_index;
+} EventLoopListener;
+
+typedef struct EventLoopConnection {
+	EventSourceKind kind;
+
+	ServerConnection connection;
+	HttpConnection http;
+
+	// `true` while the socket is registered for writability instead of
+	// readability. No more input is read until the pending output is written.
+	bool waiting_for_write;
+
+	// Closes the connection if it waits too long for the client.
+	ConnectionTimeout timeout;
+
+	// Links in `EventLoop.connections`.
+	struct EventLoopConnection *prev;
+	struct EventLoopConnection *next;
+} EventLoopConnection;
+
+// A single-threaded, epoll-based event loop that accepts connections from
+// every address of a `Server` and serves HTTP requests on all of them.
+typedef struct EventLoop {
+	int epoll_fd;
+
+	// Not owned.
+	Server *server;
+
+	EventLoopListener listeners[SERVER_MAX_ADDRESSES];
+
+	HttpHandler handler;
+	void *handler_userdata;
+
+	// Every open connection, oldest first.
+	EventLoopConnection *connections;
+	EventLoopConnection *connections_tail;
+	size_t connections_count;
+
+	// Every connection's `timeout`.
+	TimerWheel timers;
+
+	// The time that events are being handled at, updated after every wait.
+	uint64_t now_ms;
+
+	// Set while the listeners are out of the epoll set because accepting
+	// failed. They're put back when `accept_backoff` expires, or, if the
+	// loop ran out of descriptors, as soon as one of its connections closes.
+	bool accept_paused;
+	bool accept_resume_on_close;
+	Timer accept_backoff;
+
+	AcceptErrorLog accept_errors;
+} EventLoop;
+
+// `server` must outlive `self`, and must not start listening on more addresses
+// after this is called.
+Error event_loop_init(
+	EventLoop *self,
+	Server *server,
+	HttpHandler handler,
+	void *handler_userdata
+);
+
+// Closes all open connections.
+void event_loop_deinit(EventLoop *self);
+
+// Serve connections forever, closing connections that wait longer than the
+// server's timeouts allow. Only returns if waiting for events fails.
+Error event_loop_run(EventLoop *self);
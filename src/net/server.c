@@ -3,16 +3,16 @@
 #include "warble/util.h"
 
 #include <assert.h>
-#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 void server_connection_deinit(ServerConnection *self) {
-	close(self->fd);
-
-	free(self->client_addr);
+	if (self->fd != -1) close(self->fd);
 
 	set_undefined(self, sizeof(*self));
 }
@@ -21,6 +21,13 @@ void server_init(Server *self) {
 	set_undefined(self, sizeof(*self));
 
 	self->addresses_count = 0;
+
+	self->reuse_port = false;
+
+	self->idle_timeout_ms = 0;
+	self->header_timeout_ms = 0;
+	self->send_timeout_ms = 0;
+	self->min_send_rate = 0;
 }
 
 void server_deinit(Server *self) {
@@ -33,15 +40,21 @@ void server_deinit(Server *self) {
 	set_undefined(self, sizeof(*self));
 }
 
+// Put `fd` into non-blocking mode. Returns `false` if that fails.
+static bool set_nonblocking(int fd) {
+	int flags = fcntl(fd, F_GETFL);
+	if (flags == -1) return false;
+
+	if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) return false;
+
+	return true;
+}
+
 static Error open_listen_socket(
 	Server *self,
 	ListenAddress listen_address,
 	int *out_listen_fd
 ) {
-	// We may want to put some configuration in `Server` later, e.g. REUSEADDR or
-	// backlog size, so let's keep the argument for now.
-	(void) self;
-
 	set_undefined(out_listen_fd, sizeof(*out_listen_fd));
 
 	// In this function, `err` is a POSIX error, not an `Error` error.
@@ -57,12 +70,36 @@ static Error open_listen_socket(
 		return ERR_UNKNOWN;
 	}
 
+	// Accepting happens from an event loop, which must never block.
+	if (!set_nonblocking(listen_fd)) {
+		perror("fcntl");
+		close(listen_fd);
+		return ERR_UNKNOWN;
+	}
+
 	int one = 1;
 
 	// Enable REUSEADDR.
 	// If it fails, it fails.
 	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
 
+	// Responses are written in as few writes as possible, so there's nothing for
+	// Nagle's algorithm to coalesce; it would only hold back the last segment of
+	// a response until the previous one is acknowledged. Accepted sockets
+	// inherit this. Not every socket type supports it, so failure is fine.
+	setsockopt(listen_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	// Unlike REUSEADDR, if this was asked for and fails, the other servers
+	// wouldn't be able to bind to the same address.
+	if (self->reuse_port) {
+		err = setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+		if (err != 0) {
+			perror("setsockopt(SO_REUSEPORT)");
+			close(listen_fd);
+			return ERR_UNKNOWN;
+		}
+	}
+
 	// Bind the socket to the specified address.
 	err = bind(
 		listen_fd,
@@ -79,8 +116,9 @@ static Error open_listen_socket(
 	err = listen(
 		listen_fd,
 
-		// Kernel-side backlog buffer size
-		32
+		// Kernel-side backlog buffer size. Connections arrive in bursts, and the
+		// kernel clamps this to `net.core.somaxconn` anyway.
+		SOMAXCONN
 	);
 	if (err != 0) {
 		perror("listen");
@@ -107,6 +145,7 @@ Error server_listen(Server *self, ListenAddress listen_address) {
 	set_undefined(&address, sizeof(address));
 
 	address.listen_fd = listen_fd;
+	address.socket_type = listen_address.socket_type;
 
 	// Allocate our own `addr` so it can last longer than `listen_address`.
 	address.addr = malloc(listen_address.addr_len);
@@ -124,73 +163,106 @@ Error server_listen(Server *self, ListenAddress listen_address) {
 	return ERR_SUCCESS;
 }
 
-Error server_accept(Server *self, ServerConnection *out_connection) {
-	set_undefined(out_connection, sizeof(*out_connection));
+Error server_listen_like(Server *self, const Server *other) {
+	assert(self->reuse_port && other->reuse_port);
 
-	struct pollfd pollfds[SERVER_MAX_ADDRESSES];
-	set_undefined(pollfds, sizeof(pollfds));
+	self->idle_timeout_ms = other->idle_timeout_ms;
+	self->header_timeout_ms = other->header_timeout_ms;
+	self->send_timeout_ms = other->send_timeout_ms;
+	self->min_send_rate = other->min_send_rate;
 
-	for (size_t i = 0; i < self->addresses_count; i++) {
-		ServerAddress *address = &self->addresses[i];
+	for (size_t i = 0; i < other->addresses_count; i++) {
+		const ServerAddress *address = &other->addresses[i];
 
-		pollfds[i] = (struct pollfd) {
-			.fd = address->listen_fd,
-			.events = POLLIN,
-			.revents = 0,
-		};
+		Error err = server_listen(self, (ListenAddress) {
+			.socket_family = address->addr->sa_family,
+			.socket_type = address->socket_type,
+			.addr = address->addr,
+			.addr_len = address->addr_len,
+		});
+		if (err != ERR_SUCCESS) return err;
 	}
 
-	int ready_count = poll(
-		pollfds,
-		self->addresses_count,
-		-1
-	);
-
-	// Blocking server; the only way `poll` should return is by a socket being ready.
-	if (ready_count <= 0) return ERR_UNKNOWN;
-
-	ssize_t ready_index = -1;
-
-	for (size_t i = 0; i < self->addresses_count; i++) {
-		if ((pollfds[i].revents & POLLIN) != POLLIN) continue;
+	return ERR_SUCCESS;
+}
 
-		ready_index = i;
-		break;
-	}
+Error server_try_accept(
+	Server *self,
+	size_t address_index,
+	ServerConnection *out_connection,
+	bool *out_accepted
+) {
+	assert(address_index < self->addresses_count);
 
-	// Some other event happened, not `POLLIN`?
-	// Error.
-	if (ready_index < 0) return ERR_UNKNOWN;
+	set_undefined(out_connection, sizeof(*out_connection));
+	*out_accepted = false;
 
-	ServerAddress *address = &self->addresses[ready_index];
+	ServerAddress *address = &self->addresses[address_index];
 
-	struct sockaddr_storage client_addr_buffer;
-	socklen_t client_addr_len = sizeof(client_addr_buffer);
+	struct sockaddr_storage client_addr;
+	socklen_t client_addr_len = sizeof(client_addr);
 
 	int client_fd = accept(
 		address->listen_fd,
-		(struct sockaddr*) &client_addr_buffer,
+		(struct sockaddr*) &client_addr,
 		&client_addr_len
 	);
 	if (client_fd == -1) {
-		perror("accept");
+		// Nothing to accept right now. `ECONNABORTED` means a connection was
+		// reset while waiting in the backlog, which is just as uninteresting.
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) {
+			return ERR_SUCCESS;
+		}
+
 		return ERR_UNKNOWN;
 	}
 
-	struct sockaddr *client_addr = malloc(client_addr_len);
-	if (client_addr == NULL) {
+	if (!set_nonblocking(client_fd)) {
+		int errnum = errno;
 		close(client_fd);
-		return ERR_OUT_OF_MEMORY;
+		errno = errnum;
+		return ERR_UNKNOWN;
 	}
 
-	memcpy(client_addr, &client_addr_buffer, client_addr_len);
-
 	*out_connection = (ServerConnection) {
 		.fd = client_fd,
 
 		.client_addr = client_addr,
 		.client_addr_len = client_addr_len,
 	};
+	*out_accepted = true;
 
 	return ERR_SUCCESS;
 }
+
+bool server_accept_error_exhausted(int errnum) {
+	return errnum == EMFILE || errnum == ENFILE || errnum == ENOBUFS || errnum == ENOMEM;
+}
+
+void accept_error_log_init(AcceptErrorLog *self) {
+	set_undefined(self, sizeof(*self));
+
+	self->printed = false;
+	self->suppressed = 0;
+}
+
+void accept_error_log_report(AcceptErrorLog *self, int errnum, uint64_t now_ms) {
+	if (self->printed && now_ms - self->printed_ms < SERVER_ACCEPT_BACKOFF_MS) {
+		self->suppressed += 1;
+		return;
+	}
+
+	if (self->suppressed > 0) {
+		printf(
+			"couldn't accept new connection: %s (%zu more errors since last logged)\n",
+			strerror(errnum),
+			self->suppressed
+		);
+	} else {
+		printf("couldn't accept new connection: %s\n", strerror(errnum));
+	}
+
+	self->printed_ms = now_ms;
+	self->printed = true;
+	self->suppressed = 0;
+}
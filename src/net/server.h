@@ -3,6 +3,9 @@
 #include "warble/error.h"
 
 #include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #define SERVER_MAX_ADDRESSES 32
 
@@ -19,12 +22,13 @@ typedef struct ListenAddress {
 } ListenAddress;
 
 typedef struct ServerConnection {
-	// This will be closed by `server_connection_deinit`.
+	// This will be closed by `server_connection_deinit`, unless it's `-1`
+	// because whoever owns the connection has already closed it.
 	int fd;
 
-	// The address of the connected client. This is an allocation that will be
-	// freed by `server_connection_deinit`.
-	struct sockaddr *client_addr;
+	// The address of the connected client. `client_addr_len` is zero if the
+	// address wasn't retrieved when accepting.
+	struct sockaddr_storage client_addr;
 	socklen_t client_addr_len;
 } ServerConnection;
 
@@ -35,6 +39,9 @@ void server_connection_deinit(ServerConnection *self);
 typedef struct ServerAddress {
 	int listen_fd;
 
+	// SOCK_STREAM
+	int socket_type;
+
 	// Allocated separately.
 	struct sockaddr *addr;
 	socklen_t addr_len;
@@ -47,6 +54,24 @@ typedef struct ServerAddress {
 typedef struct Server {
 	ServerAddress addresses[SERVER_MAX_ADDRESSES];
 	size_t addresses_count;
+
+	// Set SO_REUSEPORT on listen sockets, so that several servers (usually one
+	// per thread) can listen on the same address and have the kernel spread
+	// incoming connections between them. Only affects later `server_listen`s.
+	bool reuse_port;
+
+	// Connections are closed by whichever loop is serving them once they've
+	// waited this many milliseconds: for a request, for the rest of a request's
+	// head once it's started arriving, or for the client to take any output.
+	// Zero means never. See `ConnectionTimeoutKind`.
+	unsigned idle_timeout_ms;
+	unsigned header_timeout_ms;
+	unsigned send_timeout_ms;
+
+	// Bytes per second a client has to keep taking output at, once its output
+	// is backed up. Every byte taken adds to the time `send_timeout_ms` allows,
+	// up to that timeout again. Zero means any progress at all will do.
+	size_t min_send_rate;
 } Server;
 
 void server_init(Server *self);
@@ -56,8 +81,49 @@ void server_deinit(Server *self);
 // unaffected. All fields of `listen_address` are copied out and left unchanged.
 Error server_listen(Server *self, ListenAddress listen_address);
 
-// Accept a single connection from any of this servers' addresses. If this
-// fails, `out_connection` is set to undefined and an error is returned.
-// Otherwise, `out_connection` is a valid `ServerConnection` and must be
-// deinitialized by calling `server_connection_deinit`.
-Error server_accept(Server *self, ServerConnection *out_connection);
+// Listen on every address that `other` is listening on, and copy its other
+// settings. Both servers must have `reuse_port` set. If listening on any
+// address fails, an error is returned, and `self` may be listening on some of
+// the addresses.
+Error server_listen_like(Server *self, const Server *other);
+
+// Accept a single pending connection from the address at `address_index`,
+// without blocking. Listen sockets and accepted sockets are both non-blocking.
+//
+// If no connection is pending, `*out_accepted` is set to false and
+// `ERR_SUCCESS` is returned. If accepting fails, an error is returned and
+// `errno` says why; see `server_accept_error_exhausted`. Otherwise,
+// `out_connection` is a valid `ServerConnection` and must be deinitialized by
+// calling `server_connection_deinit`.
+Error server_try_accept(
+	Server *self,
+	size_t address_index,
+	ServerConnection *out_connection,
+	bool *out_accepted
+);
+
+// How long a loop stops accepting for after accepting fails, unless one of its
+// connections closes first. A listen socket stays readable while connections
+// wait in its backlog, so trying again straight away would only fail again.
+#define SERVER_ACCEPT_BACKOFF_MS 1000
+
+// Returns true if accepting failed with `errnum` because the process or the
+// system ran out of descriptors or memory, which only closing a connection
+// (this loop's or anyone else's) will fix.
+bool server_accept_error_exhausted(int errnum);
+
+// Logs accept errors, at most once per `SERVER_ACCEPT_BACKOFF_MS`, counting
+// the ones in between rather than printing them.
+typedef struct AcceptErrorLog {
+	// When the last error was printed, if `printed`.
+	uint64_t printed_ms;
+	bool printed;
+
+	// Errors since then that weren't printed.
+	size_t suppressed;
+} AcceptErrorLog;
+
+void accept_error_log_init(AcceptErrorLog *self);
+
+// Log that accepting failed with `errnum` at `now_ms`.
+void accept_error_log_report(AcceptErrorLog *self, int errnum, uint64_t now_ms);
@@ -0,0 +1,96 @@
+#include "net/timeout.h"
+
+#include <assert.h>
+
+// Connections closed for each kind of timeout, by every thread.
+static size_t connection_timeouts[CONNECTION_TIMEOUT_KINDS_COUNT];
+
+void connection_timeout_init(ConnectionTimeout *self, void *data) {
+	timer_init(&self->timer, data);
+
+	self->kind = CONNECTION_TIMEOUT_IDLE;
+	self->requests_count = 0;
+	self->consumed_len = 0;
+}
+
+void connection_timeout_deinit(ConnectionTimeout *self, TimerWheel *timers) {
+	timer_wheel_cancel(timers, &self->timer);
+}
+
+void connection_timeout_update(
+	ConnectionTimeout *self,
+	TimerWheel *timers,
+	const Server *server,
+	HttpConnection *http,
+	size_t in_flight,
+	uint64_t now_ms
+) {
+	size_t written = http->output.consumed_len - self->consumed_len;
+	bool handled_request = http->requests_count != self->requests_count;
+
+	self->consumed_len = http->output.consumed_len;
+	self->requests_count = http->requests_count;
+
+	ConnectionTimeoutKind kind;
+	unsigned timeout_ms;
+	if (http_connection_pending_output_len(http) > 0) {
+		kind = CONNECTION_TIMEOUT_SEND;
+		timeout_ms = server->send_timeout_ms;
+	} else if (http_connection_reading_request(http)) {
+		kind = CONNECTION_TIMEOUT_HEADER;
+		timeout_ms = server->header_timeout_ms;
+	} else {
+		kind = CONNECTION_TIMEOUT_IDLE;
+		timeout_ms = server->idle_timeout_ms;
+	}
+
+	// Each request, and each change in what's being waited for, starts the
+	// clock again. Bytes of a head trickling in don't.
+	bool restart = kind != self->kind || handled_request || !timer_scheduled(&self->timer);
+	self->kind = kind;
+
+	if (timeout_ms == 0) {
+		timer_wheel_cancel(timers, &self->timer);
+		return;
+	}
+
+	if (kind != CONNECTION_TIMEOUT_SEND) {
+		if (restart) timer_wheel_schedule(timers, &self->timer, now_ms + timeout_ms);
+		return;
+	}
+
+	// The most a client is ever allowed: the timeout from now, plus enough time
+	// to take whatever's in flight at the minimum rate.
+	size_t min_send_rate = server->min_send_rate;
+	uint64_t latest_ms = now_ms + timeout_ms;
+	if (min_send_rate > 0) latest_ms += (uint64_t) in_flight * 1000 / min_send_rate;
+
+	uint64_t deadline_ms = self->timer.deadline_ms;
+	if (restart) {
+		deadline_ms = latest_ms;
+	} else if (min_send_rate == 0) {
+		// Any progress will do.
+		if (written > 0) deadline_ms = latest_ms;
+	} else {
+		// Every byte taken buys a little more time, so a client that keeps up
+		// with the minimum rate never runs out of it.
+		deadline_ms += (uint64_t) written * 1000 / min_send_rate;
+		if (deadline_ms > latest_ms) deadline_ms = latest_ms;
+	}
+
+	if (restart || deadline_ms != self->timer.deadline_ms) {
+		timer_wheel_schedule(timers, &self->timer, deadline_ms);
+	}
+}
+
+void connection_timeout_count(ConnectionTimeoutKind kind) {
+	assert(kind < CONNECTION_TIMEOUT_KINDS_COUNT);
+
+	__atomic_add_fetch(&connection_timeouts[kind], 1, __ATOMIC_RELAXED);
+}
+
+size_t connection_timeouts_count(ConnectionTimeoutKind kind) {
+	assert(kind < CONNECTION_TIMEOUT_KINDS_COUNT);
+
+	return __atomic_load_n(&connection_timeouts[kind], __ATOMIC_RELAXED);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "http/connection.h"
+#include "net/server.h"
+#include "net/timer_wheel.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// What a connection is waiting for, and so which of the server's timeouts it's
+// up against.
+typedef enum ConnectionTimeoutKind {
+	// The next request, on a connection that's been kept alive or that hasn't
+	// sent anything yet: `Server.idle_timeout_ms`.
+	CONNECTION_TIMEOUT_IDLE = 0,
+
+	// The rest of a request's head, once some of it has arrived:
+	// `Server.header_timeout_ms` from then, however slowly the rest trickles
+	// in.
+	CONNECTION_TIMEOUT_HEADER,
+
+	// The client to take pending output: `Server.send_timeout_ms`, plus however
+	// long `Server.min_send_rate` allows for what it has taken.
+	CONNECTION_TIMEOUT_SEND,
+
+	CONNECTION_TIMEOUT_KINDS_COUNT,
+} ConnectionTimeoutKind;
+
+// A connection's deadline, kept in the `TimerWheel` of the loop serving it.
+typedef struct ConnectionTimeout {
+	Timer timer;
+	ConnectionTimeoutKind kind;
+
+	// `HttpConnection.requests_count` and `HttpOutput.consumed_len` as of the
+	// last update, to tell when a new request has been handled and how much
+	// has been written since.
+	size_t requests_count;
+	size_t consumed_len;
+} ConnectionTimeout;
+
+// `data` is given back with the timer when it expires.
+void connection_timeout_init(ConnectionTimeout *self, void *data);
+
+// Cancels the timer.
+void connection_timeout_deinit(ConnectionTimeout *self, TimerWheel *timers);
+
+// Point the timer at whatever deadline `http` is up against, now that it's
+// waiting for the socket again. `in_flight` is how many bytes are in a send
+// that's been handed to the kernel and hasn't completed, which can't be seen
+// being written until it does.
+void connection_timeout_update(
+	ConnectionTimeout *self,
+	TimerWheel *timers,
+	const Server *server,
+	HttpConnection *http,
+	size_t in_flight,
+	uint64_t now_ms
+);
+
+// Count a connection closed because its timer for `kind` expired. Counts are
+// shared by all threads.
+void connection_timeout_count(ConnectionTimeoutKind kind);
+
+// Connections closed so far because their timer for `kind` expired.
+size_t connection_timeouts_count(ConnectionTimeoutKind kind);
@@ -0,0 +1,144 @@
+#include "net/timer_wheel.h"
+
+#include "warble/util.h"
+
+#include <assert.h>
+#include <limits.h>
+
+static void timer_list_init(Timer *head) {
+	head->prev = head;
+	head->next = head;
+}
+
+static bool timer_list_empty(const Timer *head) {
+	return head->next == head;
+}
+
+static void timer_list_append(Timer *head, Timer *timer) {
+	timer->prev = head->prev;
+	timer->next = head;
+
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+static void timer_list_remove(Timer *timer) {
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+
+	timer->prev = NULL;
+	timer->next = NULL;
+}
+
+void timer_wheel_init(TimerWheel *self, uint64_t now_ms) {
+	set_undefined(self, sizeof(*self));
+
+	for (size_t i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+		timer_list_init(&self->slots[i]);
+	}
+	timer_list_init(&self->expired);
+
+	self->tick = now_ms / TIMER_WHEEL_TICK_MS;
+	self->count = 0;
+}
+
+void timer_wheel_deinit(TimerWheel *self) {
+	set_undefined(self, sizeof(*self));
+}
+
+void timer_init(Timer *self, void *data) {
+	self->deadline_ms = 0;
+	self->data = data;
+	self->prev = NULL;
+	self->next = NULL;
+}
+
+bool timer_scheduled(const Timer *self) {
+	return self->next != NULL;
+}
+
+void timer_wheel_schedule(TimerWheel *self, Timer *timer, uint64_t deadline_ms) {
+	if (timer_scheduled(timer)) {
+		timer_list_remove(timer);
+	} else {
+		self->count += 1;
+	}
+
+	// Ticks that have been looked through won't be again until the next turn.
+	uint64_t tick = deadline_ms / TIMER_WHEEL_TICK_MS;
+	if (tick < self->tick) tick = self->tick;
+
+	timer->deadline_ms = deadline_ms;
+	timer_list_append(&self->slots[tick & (TIMER_WHEEL_SLOTS - 1)], timer);
+}
+
+void timer_wheel_cancel(TimerWheel *self, Timer *timer) {
+	if (!timer_scheduled(timer)) return;
+
+	timer_list_remove(timer);
+
+	assert(self->count > 0);
+	self->count -= 1;
+}
+
+Timer *timer_wheel_take_expired(TimerWheel *self, uint64_t now_ms) {
+	uint64_t now_tick = now_ms / TIMER_WHEEL_TICK_MS;
+
+	if (self->count == 0) {
+		if (now_tick > self->tick) self->tick = now_tick;
+		return NULL;
+	}
+
+	// A turn's worth of ticks looks through every slot; any more would only
+	// look through them again.
+	if (now_tick > self->tick + TIMER_WHEEL_SLOTS) {
+		self->tick = now_tick - TIMER_WHEEL_SLOTS;
+	}
+
+	// Look through ticks that have passed in full, until one has something in
+	// it that's expired. Timers whose deadline is a turn or more away stay
+	// where they are.
+	while (timer_list_empty(&self->expired) && self->tick < now_tick) {
+		Timer *slot = &self->slots[self->tick & (TIMER_WHEEL_SLOTS - 1)];
+
+		Timer *timer = slot->next;
+		while (timer != slot) {
+			Timer *next = timer->next;
+
+			if (timer->deadline_ms / TIMER_WHEEL_TICK_MS < now_tick) {
+				timer_list_remove(timer);
+				timer_list_append(&self->expired, timer);
+			}
+
+			timer = next;
+		}
+
+		self->tick += 1;
+	}
+
+	if (timer_list_empty(&self->expired)) return NULL;
+
+	Timer *timer = self->expired.next;
+	timer_wheel_cancel(self, timer);
+
+	return timer;
+}
+
+int timer_wheel_wait_timeout(const TimerWheel *self, uint64_t now_ms) {
+	if (self->count == 0) return -1;
+	if (!timer_list_empty(&self->expired)) return 0;
+
+	// The first slot with anything in it is looked through once its tick has
+	// passed. What's in it may turn out to be a turn or more away, which only
+	// costs a wakeup.
+	uint64_t tick = self->tick;
+	for (size_t i = 0; i < TIMER_WHEEL_SLOTS; i++, tick++) {
+		if (!timer_list_empty(&self->slots[tick & (TIMER_WHEEL_SLOTS - 1)])) break;
+	}
+
+	uint64_t wake_ms = (tick + 1) * TIMER_WHEEL_TICK_MS;
+	if (wake_ms <= now_ms) return 0;
+	if (wake_ms - now_ms > INT_MAX) return INT_MAX;
+
+	return wake_ms - now_ms;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// How long each slot of a `TimerWheel` covers. Timers fire up to this late.
+#define TIMER_WHEEL_TICK_MS 100
+
+// Slots in a `TimerWheel`; a power of two. Timers further away than a full
+// turn of the wheel wait in their slot for as many turns as it takes.
+#define TIMER_WHEEL_SLOTS 1024
+
+// A deadline, kept in a `TimerWheel`. Embedded in whatever it's the deadline
+// of, so scheduling one never allocates.
+typedef struct Timer {
+	uint64_t deadline_ms;
+
+	// Whatever the timer belongs to, for whoever finds it expired.
+	void *data;
+
+	// Links in one of the wheel's lists; both `NULL` when the timer isn't
+	// scheduled.
+	struct Timer *prev;
+	struct Timer *next;
+} Timer;
+
+// A hashed timer wheel: timers are kept in a list per slot, by the tick their
+// deadline falls in, so scheduling and cancelling a timer are constant time
+// however many there are. Each slot is only looked through once per turn,
+// after its tick has passed.
+typedef struct TimerWheel {
+	// Circular lists, each headed by one of these; only their links are used.
+	Timer slots[TIMER_WHEEL_SLOTS];
+
+	// Timers that have been found expired, but not taken yet.
+	Timer expired;
+
+	// Every tick before this one has been looked through.
+	uint64_t tick;
+
+	// Timers scheduled, expired ones that haven't been taken included.
+	size_t count;
+} TimerWheel;
+
+void timer_wheel_init(TimerWheel *self, uint64_t now_ms);
+
+// Expired timers that haven't been taken are left scheduled; cancel them
+// first if they need to know.
+void timer_wheel_deinit(TimerWheel *self);
+
+void timer_init(Timer *self, void *data);
+
+// Returns true if `self` is scheduled in a wheel.
+bool timer_scheduled(const Timer *self);
+
+// Schedule `timer` to expire at `deadline_ms`, moving it if it's already
+// scheduled. A deadline in the past expires on the next tick.
+void timer_wheel_schedule(TimerWheel *self, Timer *timer, uint64_t deadline_ms);
+
+// Unschedule `timer`, if it's scheduled.
+void timer_wheel_cancel(TimerWheel *self, Timer *timer);
+
+// Take a timer whose deadline has passed by `now_ms`, or return `NULL` if
+// there are none left. Taken timers aren't scheduled anymore.
+Timer *timer_wheel_take_expired(TimerWheel *self, uint64_t now_ms);
+
+// Returns how many milliseconds from `now_ms` it's worth waiting before
+// looking for expired timers again, or `-1` if nothing is scheduled.
+int timer_wheel_wait_timeout(const TimerWheel *self, uint64_t now_ms);
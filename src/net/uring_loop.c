@@ -0,0 +1,825 @@
+#include "net/uring_loop.h"
+
+#include "util.h"
+
+#include "warble/util.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Size of the submission queue. The completion queue is twice as large.
+#define URING_LOOP_ENTRIES 1024
+
+// Number and size of the buffers that `recv`s pick from. The count must be a
+// power of two.
+#define URING_LOOP_BUFFERS_COUNT 256
+#define URING_LOOP_BUFFER_SIZE 4096
+
+#define URING_LOOP_BUFFER_GROUP 0
+
+// The low bits of every submission's `user_data` say what kind of operation it
+// was, and the rest is a pointer to its listener, connection or loop. All of
+// them are aligned to at least eight bytes.
+typedef enum UringOperation {
+	URING_OPERATION_ACCEPT = 0,
+	URING_OPERATION_RECV = 1,
+	URING_OPERATION_SEND = 2,
+	URING_OPERATION_CLOSE = 3,
+	URING_OPERATION_TIMEOUT_CHECK = 4,
+	URING_OPERATION_POLL_WRITE = 5,
+	URING_OPERATION_ACCEPT_BACKOFF = 6,
+} UringOperation;
+
+#define URING_OPERATION_MASK 7
+
+static uint64_t pack_user_data(void *ptr, UringOperation operation) {
+	assert(((uintptr_t) ptr & URING_OPERATION_MASK) == 0);
+
+	return (uint64_t) (uintptr_t) ptr | operation;
+}
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+	return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int ring_fd, unsigned opcode, void *arg, unsigned nr_args) {
+	return (int) syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+// Map the rings described by `params` into `self`.
+static Error uring_loop_map_rings(UringLoop *self, struct io_uring_params *params) {
+	self->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+	self->cq_ring_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+
+	bool single_mmap = (params->features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_mmap) {
+		if (self->cq_ring_size > self->sq_ring_size) self->sq_ring_size = self->cq_ring_size;
+		self->cq_ring_size = self->sq_ring_size;
+	}
+
+	self->sq_ring = mmap(
+		NULL, self->sq_ring_size,
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		self->ring_fd, IORING_OFF_SQ_RING
+	);
+	if (self->sq_ring == MAP_FAILED) {
+		perror("mmap");
+		return ERR_OUT_OF_MEMORY;
+	}
+
+	if (single_mmap) {
+		self->cq_ring = self->sq_ring;
+	} else {
+		self->cq_ring = mmap(
+			NULL, self->cq_ring_size,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			self->ring_fd, IORING_OFF_CQ_RING
+		);
+		if (self->cq_ring == MAP_FAILED) {
+			perror("mmap");
+			munmap(self->sq_ring, self->sq_ring_size);
+			return ERR_OUT_OF_MEMORY;
+		}
+	}
+
+	self->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+	self->sqes = mmap(
+		NULL, self->sqes_size,
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		self->ring_fd, IORING_OFF_SQES
+	);
+	if (self->sqes == MAP_FAILED) {
+		perror("mmap");
+		if (!single_mmap) munmap(self->cq_ring, self->cq_ring_size);
+		munmap(self->sq_ring, self->sq_ring_size);
+		return ERR_OUT_OF_MEMORY;
+	}
+
+	uint8_t *sq = (uint8_t*) self->sq_ring;
+	self->sq_head = (unsigned*) (sq + params->sq_off.head);
+	self->sq_tail = (unsigned*) (sq + params->sq_off.tail);
+	self->sq_array = (unsigned*) (sq + params->sq_off.array);
+	self->sq_mask = *(unsigned*) (sq + params->sq_off.ring_mask);
+	self->sq_entries = params->sq_entries;
+
+	uint8_t *cq = (uint8_t*) self->cq_ring;
+	self->cq_head = (unsigned*) (cq + params->cq_off.head);
+	self->cq_tail = (unsigned*) (cq + params->cq_off.tail);
+	self->cq_mask = *(unsigned*) (cq + params->cq_off.ring_mask);
+	self->cqes = (struct io_uring_cqe*) (cq + params->cq_off.cqes);
+
+	self->sq_tail_local = *self->sq_tail;
+	self->sqes_queued = 0;
+
+	return ERR_SUCCESS;
+}
+
+static void uring_loop_unmap_rings(UringLoop *self) {
+	munmap(self->sqes, self->sqes_size);
+	if (self->cq_ring != self->sq_ring) munmap(self->cq_ring, self->cq_ring_size);
+	munmap(self->sq_ring, self->sq_ring_size);
+}
+
+// Give buffer `buffer_id` back to the kernel, to be picked by a later `recv`.
+static void uring_loop_recycle_buffer(UringLoop *self, uint16_t buffer_id) {
+	struct io_uring_buf *buf = &self->buffer_ring->bufs[
+		self->buffer_ring_tail & (URING_LOOP_BUFFERS_COUNT - 1)
+	];
+
+	buf->addr = (uint64_t) (uintptr_t) (self->buffers + (size_t) buffer_id * URING_LOOP_BUFFER_SIZE);
+	buf->len = URING_LOOP_BUFFER_SIZE;
+	buf->bid = buffer_id;
+
+	self->buffer_ring_tail += 1;
+	__atomic_store_n(&self->buffer_ring->tail, self->buffer_ring_tail, __ATOMIC_RELEASE);
+}
+
+// Register a ring of provided buffers. This needs Linux 5.19, which is also
+// when multishot accept appeared; if this works, so will that.
+static Error uring_loop_setup_buffers(UringLoop *self) {
+	self->buffer_ring_size = URING_LOOP_BUFFERS_COUNT * sizeof(struct io_uring_buf);
+	self->buffer_ring = mmap(
+		NULL, self->buffer_ring_size,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (self->buffer_ring == MAP_FAILED) {
+		perror("mmap");
+		return ERR_OUT_OF_MEMORY;
+	}
+
+	self->buffers = malloc((size_t) URING_LOOP_BUFFERS_COUNT * URING_LOOP_BUFFER_SIZE);
+	if (self->buffers == NULL) {
+		munmap(self->buffer_ring, self->buffer_ring_size);
+		return ERR_OUT_OF_MEMORY;
+	}
+
+	struct io_uring_buf_reg registration = {
+		.ring_addr = (uint64_t) (uintptr_t) self->buffer_ring,
+		.ring_entries = URING_LOOP_BUFFERS_COUNT,
+		.bgid = URING_LOOP_BUFFER_GROUP,
+	};
+
+	if (sys_io_uring_register(self->ring_fd, IORING_REGISTER_PBUF_RING, &registration, 1) != 0) {
+		perror("io_uring_register(IORING_REGISTER_PBUF_RING)");
+		free(self->buffers);
+		munmap(self->buffer_ring, self->buffer_ring_size);
+		return ERR_UNKNOWN;
+	}
+
+	self->buffer_ring_tail = 0;
+	for (uint16_t i = 0; i < URING_LOOP_BUFFERS_COUNT; i++) {
+		uring_loop_recycle_buffer(self, i);
+	}
+
+	return ERR_SUCCESS;
+}
+
+// Hand all queued submissions to the kernel, and wait until at least
+// `wait_for` completions are available.
+static Error uring_loop_enter(UringLoop *self, unsigned wait_for) {
+	__atomic_store_n(self->sq_tail, self->sq_tail_local, __ATOMIC_RELEASE);
+
+	unsigned flags = wait_for > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+	int submitted = sys_io_uring_enter(self->ring_fd, self->sqes_queued, wait_for, flags);
+	if (submitted < 0) {
+		// Interrupted, or the completion queue is backed up; either way, reaping
+		// completions is the way forward.
+		if (errno == EINTR || errno == EAGAIN || errno == EBUSY) return ERR_SUCCESS;
+
+		perror("io_uring_enter");
+		return ERR_UNKNOWN;
+	}
+
+	assert((unsigned) submitted <= self->sqes_queued);
+	self->sqes_queued -= submitted;
+
+	return ERR_SUCCESS;
+}
+
+// Returns a zeroed submission queue entry. It's submitted by the next
+// `uring_loop_enter`.
+static struct io_uring_sqe *uring_loop_get_sqe(UringLoop *self) {
+	while (self->sq_tail_local - __atomic_load_n(self->sq_head, __ATOMIC_ACQUIRE) >= self->sq_entries) {
+		// The submission queue is full; make room without waiting for anything.
+		Error err = uring_loop_enter(self, 0);
+		(void) err;
+	}
+
+	unsigned index = self->sq_tail_local & self->sq_mask;
+
+	struct io_uring_sqe *sqe = &self->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+
+	self->sq_array[index] = index;
+	self->sq_tail_local += 1;
+	self->sqes_queued += 1;
+
+	return sqe;
+}
+
+static void uring_loop_submit_accept(UringLoop *self, UringListener *listener) {
+	struct io_uring_sqe *sqe = uring_loop_get_sqe(self);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = self->server->addresses[listener->address_index].listen_fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	// Accepted sockets don't inherit `O_NONBLOCK` from the listener, and
+	// `sendfile` runs on this thread; a blocking one would stall every
+	// connection behind a slow reader.
+	sqe->accept_flags = SOCK_CLOEXEC | SOCK_NONBLOCK;
+	sqe->user_data = pack_user_data(listener, URING_OPERATION_ACCEPT);
+
+	listener->accepting = true;
+}
+
+static void uring_loop_submit_timeout_check(UringLoop *self) {
+	struct io_uring_sqe *sqe = uring_loop_get_sqe(self);
+
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (uint64_t) (uintptr_t) &self->timeout_check_interval;
+	sqe->len = 1;
+	sqe->user_data = pack_user_data(self, URING_OPERATION_TIMEOUT_CHECK);
+}
+
+// Leave `listener` disarmed for a while, after its accept failed with
+// `errnum`.
+static void uring_loop_pause_accepting(UringLoop *self, UringListener *listener, int errnum) {
+	listener->accepting = false;
+
+	self->accept_paused = true;
+	if (server_accept_error_exhausted(errnum)) self->accept_resume_on_close = true;
+
+	if (self->accept_backoff_pending) return;
+
+	struct io_uring_sqe *sqe = uring_loop_get_sqe(self);
+
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (uint64_t) (uintptr_t) &self->accept_backoff_interval;
+	sqe->len = 1;
+	sqe->user_data = pack_user_data(self, URING_OPERATION_ACCEPT_BACKOFF);
+
+	self->accept_backoff_pending = true;
+}
+
+// Arm every listener whose accept failed again.
+static void uring_loop_resume_accepting(UringLoop *self) {
+	if (!self->accept_paused) return;
+
+	for (size_t i = 0; i < self->server->addresses_count; i++) {
+		UringListener *listener = &self->listeners[i];
+
+		if (!listener->accepting) uring_loop_submit_accept(self, listener);
+	}
+
+	self->accept_paused = false;
+	self->accept_resume_on_close = false;
+}
+
+static void uring_loop_submit_recv(UringLoop *self, UringConnection *connection) {
+	struct io_uring_sqe *sqe = uring_loop_get_sqe(self);
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = connection->connection.fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_LOOP_BUFFER_GROUP;
+	sqe->user_data = pack_user_data(connection, URING_OPERATION_RECV);
+
+	connection->operations_pending += 1;
+}
+
+// Wait for `connection`'s socket to become writable.
+static void uring_loop_submit_poll_write(UringLoop *self, UringConnection *connection) {
+	struct io_uring_sqe *sqe = uring_loop_get_sqe(self);
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = connection->connection.fd;
+	sqe->poll32_events = POLLOUT;
+	sqe->user_data = pack_user_data(connection, URING_OPERATION_POLL_WRITE);
+
+	connection->operations_pending += 1;
+}
+
+// Send pending output, up to the first file range. If nothing more will be
+// read from this connection and that's all of it, its close is linked after
+// the send.
+static void uring_loop_submit_send(UringLoop *self, UringConnection *connection) {
+	size_t pending_len = http_connection_pending_output_len(&connection->http);
+	assert(pending_len > 0);
+
+	// io_uring has no `sendfile`; files are sent from here, once the socket can
+	// take them.
+	int file_fd;
+	off_t file_offset;
+	size_t file_len;
+	if (http_output_pending_file(&connection->http.output, &file_fd, &file_offset, &file_len)) {
+		connection->send_len = 0;
+		uring_loop_submit_poll_write(self, connection);
+		return;
+	}
+
+	connection->send_message = (struct msghdr) {
+		.msg_iov = connection->send_iovecs,
+		.msg_iovlen = http_output_pending_iovecs(
+			&connection->http.output,
+			connection->send_iovecs,
+			HTTP_OUTPUT_MAX_SEGMENTS
+		),
+	};
+
+	size_t send_len = 0;
+	for (size_t i = 0; i < connection->send_message.msg_iovlen; i++) {
+		send_len += connection->send_iovecs[i].iov_len;
+	}
+	connection->send_len = send_len;
+
+	bool close_after = connection->http.closing && send_len == pending_len;
+
+	struct io_uring_sqe *sqe = uring_loop_get_sqe(self);
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = connection->connection.fd;
+	sqe->addr = (uint64_t) (uintptr_t) &connection->send_message;
+	sqe->len = 1;
+
+	// `MSG_WAITALL` makes a short send break the link, instead of closing the
+	// socket with data still unsent.
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	sqe->user_data = pack_user_data(connection, URING_OPERATION_SEND);
+	if (close_after) sqe->flags = IOSQE_IO_LINK;
+
+	connection->operations_pending += 1;
+
+	if (!close_after) return;
+
+	sqe = uring_loop_get_sqe(self);
+
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = connection->connection.fd;
+	sqe->user_data = pack_user_data(connection, URING_OPERATION_CLOSE);
+
+	connection->operations_pending += 1;
+	connection->close_submitted = true;
+}
+
+static void uring_loop_unlink_connection(UringLoop *self, UringConnection *connection) {
+	if (connection->prev != NULL) {
+		connection->prev->next = connection->next;
+	} else {
+		self->connections = connection->next;
+	}
+
+	if (connection->next != NULL) {
+		connection->next->prev = connection->prev;
+	} else {
+		self->connections_tail = connection->prev;
+	}
+}
+
+static void uring_loop_append_connection(UringLoop *self, UringConnection *connection) {
+	connection->prev = self->connections_tail;
+	connection->next = NULL;
+
+	if (self->connections_tail != NULL) {
+		self->connections_tail->next = connection;
+	} else {
+		self->connections = connection;
+	}
+
+	self->connections_tail = connection;
+}
+
+// Free `connection` if its socket is closed and the kernel is done with it.
+static void uring_loop_release_connection(UringLoop *self, UringConnection *connection) {
+	if (connection->connection.fd != -1) return;
+	if (connection->operations_pending > 0) return;
+
+	connection_timeout_deinit(&connection->timeout, &self->timers);
+
+	http_connection_deinit(&connection->http);
+	server_connection_deinit(&connection->connection);
+
+	uring_loop_unlink_connection(self, connection);
+
+	assert(self->connections_count > 0);
+	self->connections_count -= 1;
+
+	free(connection);
+
+	// That's a descriptor free to accept another connection with.
+	if (self->accept_resume_on_close) uring_loop_resume_accepting(self);
+}
+
+// Tear `connection` down after an error or end of file.
+static void uring_loop_fail_connection(UringLoop *self, UringConnection *connection) {
+	connection->failed = true;
+
+	// It's done waiting for anything.
+	connection_timeout_deinit(&connection->timeout, &self->timers);
+
+	// A linked close will still complete (probably cancelled), and is handled
+	// then.
+	if (!connection->close_submitted && connection->connection.fd != -1) {
+		close(connection->connection.fd);
+		connection->connection.fd = -1;
+	}
+
+	uring_loop_release_connection(self, connection);
+}
+
+// Decide what `connection` should wait for next, now that nothing is in flight.
+static void uring_loop_continue_connection(UringLoop *self, UringConnection *connection) {
+	assert(connection->operations_pending == 0);
+
+	if (
+		http_connection_pending_output_len(&connection->http) == 0 &&
+		http_connection_has_buffered_input(&connection->http)
+	) {
+		// The client sent another request along with the last one.
+		Error err = http_connection_receive(
+			&connection->http,
+			slice_new(),
+			self->handler,
+			self->handler_userdata
+		);
+		if (err != ERR_SUCCESS) {
+			printf("error parsing request: %s\n", error_to_string(err));
+			uring_loop_fail_connection(self, connection);
+			return;
+		}
+	}
+
+	if (http_connection_finished(&connection->http)) {
+		uring_loop_fail_connection(self, connection);
+		return;
+	}
+
+	if (http_connection_pending_output_len(&connection->http) > 0) {
+		uring_loop_submit_send(self, connection);
+	} else {
+		connection->send_len = 0;
+		uring_loop_submit_recv(self, connection);
+	}
+
+	connection_timeout_update(
+		&connection->timeout,
+		&self->timers,
+		self->server,
+		&connection->http,
+		connection->send_len,
+		self->now_ms
+	);
+}
+
+static void uring_loop_complete_accept(UringLoop *self, UringListener *listener, struct io_uring_cqe *cqe) {
+	// Multishot accept stays armed until it says otherwise.
+	bool disarmed = (cqe->flags & IORING_CQE_F_MORE) == 0;
+
+	if (cqe->res < 0 && cqe->res != -ECONNABORTED && cqe->res != -EAGAIN) {
+		accept_error_log_report(&self->accept_errors, -cqe->res, self->now_ms);
+
+		// Arming it again straight away would only fail again, as long as
+		// connections are waiting in the backlog.
+		if (disarmed) uring_loop_pause_accepting(self, listener, -cqe->res);
+
+		return;
+	}
+
+	if (disarmed) uring_loop_submit_accept(self, listener);
+
+	if (cqe->res < 0) return;
+
+	UringConnection *connection = malloc(sizeof(*connection));
+	if (connection == NULL) {
+		close(cqe->res);
+		return;
+	}
+
+	// Multishot accept can't return addresses, and nothing needs them.
+	connection->connection = (ServerConnection) {
+		.fd = cqe->res,
+
+		.client_addr_len = 0,
+	};
+	http_connection_init(&connection->http);
+
+	connection->operations_pending = 0;
+	connection->send_len = 0;
+	connection->close_submitted = false;
+	connection->failed = false;
+
+	uring_loop_append_connection(self, connection);
+	self->connections_count += 1;
+
+	connection_timeout_init(&connection->timeout, connection);
+
+	uring_loop_continue_connection(self, connection);
+}
+
+static void uring_loop_complete_recv(UringLoop *self, UringConnection *connection, struct io_uring_cqe *cqe) {
+	assert(connection->operations_pending > 0);
+	connection->operations_pending -= 1;
+
+	if (cqe->res == -ENOBUFS) {
+		// Every buffer is in use; they'll be recycled by the time this is
+		// picked up again.
+		uring_loop_submit_recv(self, connection);
+		return;
+	}
+
+	if (cqe->res <= 0) {
+		uring_loop_fail_connection(self, connection);
+		return;
+	}
+
+	assert((cqe->flags & IORING_CQE_F_BUFFER) != 0);
+	uint16_t buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+	Slice bytes = slice_from_len(
+		self->buffers + (size_t) buffer_id * URING_LOOP_BUFFER_SIZE,
+		cqe->res
+	);
+
+	Error err = http_connection_receive(
+		&connection->http,
+		bytes,
+		self->handler,
+		self->handler_userdata
+	);
+
+	// The parser copies what it needs.
+	uring_loop_recycle_buffer(self, buffer_id);
+
+	if (err != ERR_SUCCESS) {
+		printf("error parsing request: %s\n", error_to_string(err));
+		uring_loop_fail_connection(self, connection);
+		return;
+	}
+
+	uring_loop_continue_connection(self, connection);
+}
+
+static void uring_loop_complete_send(UringLoop *self, UringConnection *connection, struct io_uring_cqe *cqe) {
+	assert(connection->operations_pending > 0);
+	connection->operations_pending -= 1;
+
+	if (cqe->res < 0) {
+		uring_loop_fail_connection(self, connection);
+		return;
+	}
+
+	http_connection_consume_output(&connection->http, cqe->res);
+
+	// Wait for the linked close.
+	if (connection->close_submitted) return;
+
+	uring_loop_continue_connection(self, connection);
+}
+
+static void uring_loop_complete_poll_write(UringLoop *self, UringConnection *connection, struct io_uring_cqe *cqe) {
+	assert(connection->operations_pending > 0);
+	connection->operations_pending -= 1;
+
+	if (cqe->res < 0 || connection->failed) {
+		uring_loop_fail_connection(self, connection);
+		return;
+	}
+
+	// The socket is non-blocking, so this only sends what it can take right
+	// now. Whatever's left is waited for again.
+	bool blocked;
+	Error err = http_connection_send(&connection->http, connection->connection.fd, &blocked);
+	if (err != ERR_SUCCESS) {
+		uring_loop_fail_connection(self, connection);
+		return;
+	}
+
+	uring_loop_continue_connection(self, connection);
+}
+
+static void uring_loop_complete_close(UringLoop *self, UringConnection *connection, struct io_uring_cqe *cqe) {
+	assert(connection->operations_pending > 0);
+	connection->operations_pending -= 1;
+
+	connection->close_submitted = false;
+
+	if (cqe->res != -ECANCELED) {
+		connection->connection.fd = -1;
+		uring_loop_release_connection(self, connection);
+		return;
+	}
+
+	// The send before this close was short, or failed.
+	if (connection->failed) {
+		uring_loop_fail_connection(self, connection);
+		return;
+	}
+
+	uring_loop_continue_connection(self, connection);
+}
+
+static void uring_loop_complete_accept_backoff(UringLoop *self) {
+	self->accept_backoff_pending = false;
+
+	uring_loop_resume_accepting(self);
+}
+
+// Shut down connections whose timers have expired. Their in-flight operations
+// complete with an error or end of file, and they're torn down from there.
+static void uring_loop_complete_timeout_check(UringLoop *self) {
+	uring_loop_submit_timeout_check(self);
+
+	while (true) {
+		Timer *timer = timer_wheel_take_expired(&self->timers, self->now_ms);
+		if (timer == NULL) break;
+
+		UringConnection *connection = (UringConnection*) timer->data;
+
+		connection_timeout_count(connection->timeout.kind);
+
+		if (connection->connection.fd != -1) {
+			shutdown(connection->connection.fd, SHUT_RDWR);
+		}
+	}
+}
+
+Error uring_loop_init(
+	UringLoop *self,
+	Server *server,
+	HttpHandler handler,
+	void *handler_userdata
+) {
+	set_undefined(self, sizeof(*self));
+
+	Error err;
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	self->ring_fd = sys_io_uring_setup(URING_LOOP_ENTRIES, &params);
+	if (self->ring_fd < 0) {
+		perror("io_uring_setup");
+		return ERR_UNKNOWN;
+	}
+
+	err = uring_loop_map_rings(self, &params);
+	if (err != ERR_SUCCESS) {
+		close(self->ring_fd);
+		return err;
+	}
+
+	err = uring_loop_setup_buffers(self);
+	if (err != ERR_SUCCESS) {
+		uring_loop_unmap_rings(self);
+		close(self->ring_fd);
+		return err;
+	}
+
+	self->server = server;
+
+	self->handler = handler;
+	self->handler_userdata = handler_userdata;
+
+	self->connections = NULL;
+	self->connections_tail = NULL;
+	self->connections_count = 0;
+
+	self->now_ms = monotonic_ms();
+
+	timer_wheel_init(&self->timers, self->now_ms);
+
+	self->accept_paused = false;
+	self->accept_resume_on_close = false;
+	self->accept_backoff_pending = false;
+	self->accept_backoff_interval = (struct __kernel_timespec) {
+		.tv_sec = SERVER_ACCEPT_BACKOFF_MS / 1000,
+		.tv_nsec = (long long) (SERVER_ACCEPT_BACKOFF_MS % 1000) * 1000000,
+	};
+
+	accept_error_log_init(&self->accept_errors);
+
+	for (size_t i = 0; i < server->addresses_count; i++) {
+		self->listeners[i].address_index = i;
+
+		uring_loop_submit_accept(self, &self->listeners[i]);
+	}
+
+	// Check a few times per timeout period, but at least once a second, and no
+	// more often than the timer wheel ticks.
+	unsigned timeouts_ms[] = {
+		server->idle_timeout_ms,
+		server->header_timeout_ms,
+		server->send_timeout_ms,
+	};
+
+	unsigned interval_ms = 0;
+	for (size_t i = 0; i < sizeof(timeouts_ms) / sizeof(timeouts_ms[0]); i++) {
+		if (timeouts_ms[i] == 0) continue;
+
+		unsigned check_ms = timeouts_ms[i] / 4;
+		if (check_ms > 1000) check_ms = 1000;
+		if (check_ms < TIMER_WHEEL_TICK_MS) check_ms = TIMER_WHEEL_TICK_MS;
+
+		if (interval_ms == 0 || check_ms < interval_ms) interval_ms = check_ms;
+	}
+
+	if (interval_ms > 0) {
+		self->timeout_check_interval = (struct __kernel_timespec) {
+			.tv_sec = interval_ms / 1000,
+			.tv_nsec = (long long) (interval_ms % 1000) * 1000000,
+		};
+
+		uring_loop_submit_timeout_check(self);
+	}
+
+	return ERR_SUCCESS;
+}
+
+void uring_loop_deinit(UringLoop *self) {
+	// Nothing more can be submitted once the ring is gone.
+	self->accept_resume_on_close = false;
+
+	// Closing the ring cancels everything in flight.
+	uring_loop_unmap_rings(self);
+	close(self->ring_fd);
+
+	while (self->connections != NULL) {
+		UringConnection *connection = self->connections;
+		connection->operations_pending = 0;
+
+		if (connection->connection.fd != -1) {
+			close(connection->connection.fd);
+			connection->connection.fd = -1;
+		}
+
+		uring_loop_release_connection(self, connection);
+	}
+
+	munmap(self->buffer_ring, self->buffer_ring_size);
+	free(self->buffers);
+
+	timer_wheel_deinit(&self->timers);
+
+	set_undefined(self, sizeof(*self));
+}
+
+Error uring_loop_run(UringLoop *self) {
+	while (true) {
+		Error err = uring_loop_enter(self, 1);
+		if (err != ERR_SUCCESS) return err;
+
+		self->now_ms = monotonic_ms();
+
+		unsigned head = *self->cq_head;
+
+		while (head != __atomic_load_n(self->cq_tail, __ATOMIC_ACQUIRE)) {
+			// Copy the completion out, so its slot can be given back before
+			// handling it (which may submit more work).
+			struct io_uring_cqe cqe = self->cqes[head & self->cq_mask];
+
+			head += 1;
+			__atomic_store_n(self->cq_head, head, __ATOMIC_RELEASE);
+
+			void *ptr = (void*) (uintptr_t) (cqe.user_data & ~(uint64_t) URING_OPERATION_MASK);
+			UringOperation operation = cqe.user_data & URING_OPERATION_MASK;
+
+			switch (operation) {
+			case URING_OPERATION_ACCEPT:
+				uring_loop_complete_accept(self, (UringListener*) ptr, &cqe);
+				break;
+			case URING_OPERATION_RECV:
+				uring_loop_complete_recv(self, (UringConnection*) ptr, &cqe);
+				break;
+			case URING_OPERATION_SEND:
+				uring_loop_complete_send(self, (UringConnection*) ptr, &cqe);
+				break;
+			case URING_OPERATION_CLOSE:
+				uring_loop_complete_close(self, (UringConnection*) ptr, &cqe);
+				break;
+			case URING_OPERATION_TIMEOUT_CHECK:
+				uring_loop_complete_timeout_check(self);
+				break;
+			case URING_OPERATION_POLL_WRITE:
+				uring_loop_complete_poll_write(self, (UringConnection*) ptr, &cqe);
+				break;
+			case URING_OPERATION_ACCEPT_BACKOFF:
+				uring_loop_complete_accept_backoff(self);
+				break;
+			}
+		}
+	}
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include "http/connection.h"
+#include "net/server.h"
+#include "net/timeout.h"
+#include "net/timer_wheel.h"
+
+#include "warble/error.h"
+
+#include <linux/time_types.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// Defined in <linux/io_uring.h>; only pointed to from here.
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+
+typedef struct UringListener {
+	// Index into `Server.addresses`.
+	size_t address_index;
+
+	// A multishot accept is armed for this listener.
+	bool accepting;
+} UringListener;
+
+typedef struct UringConnection {
+	ServerConnection connection;
+	HttpConnection http;
+
+	// Submitted operations on this connection that haven't completed yet. The
+	// kernel may still write into this connection's memory until this reaches
+	// zero, so it's only freed then.
+	unsigned operations_pending;
+
+	// The message that an in-flight send is gathering pending output with, and
+	// how many bytes it's sending.
+	struct msghdr send_message;
+	struct iovec send_iovecs[HTTP_OUTPUT_MAX_SEGMENTS];
+	size_t send_len;
+
+	// A close is linked after an in-flight send.
+	bool close_submitted;
+
+	// The connection is being torn down because something went wrong; don't
+	// submit anything more for it.
+	bool failed;
+
+	// Shuts the connection down if it waits too long for the client.
+	ConnectionTimeout timeout;
+
+	// Links in `UringLoop.connections`.
+	struct UringConnection *prev;
+	struct UringConnection *next;
+} UringConnection;
+
+// An alternative to `EventLoop`, built on io_uring: listen sockets use
+// multishot accept, reads come from a ring of kernel-selected buffers, and a
+// connection's last response is sent with its close linked after it. Every
+// loop iteration submits and reaps with a single `io_uring_enter`.
+typedef struct UringLoop {
+	int ring_fd;
+
+	// Submission queue, shared with the kernel.
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	// Our copy of the submission queue's tail, published to the kernel when
+	// submitting.
+	unsigned sq_tail_local;
+
+	// Number of queued entries that the kernel hasn't consumed yet.
+	unsigned sqes_queued;
+
+	// Completion queue, shared with the kernel. May be the same mapping as
+	// `sq_ring`.
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	// Buffers that the kernel picks from when a `recv` completes.
+	struct io_uring_buf_ring *buffer_ring;
+	size_t buffer_ring_size;
+	uint8_t *buffers;
+	uint16_t buffer_ring_tail;
+
+	// Not owned.
+	Server *server;
+
+	UringListener listeners[SERVER_MAX_ADDRESSES];
+
+	HttpHandler handler;
+	void *handler_userdata;
+
+	// Every open connection, oldest first.
+	UringConnection *connections;
+	UringConnection *connections_tail;
+	size_t connections_count;
+
+	// Every connection's `timeout`.
+	TimerWheel timers;
+
+	// The time that completions are being handled at, updated after every wait.
+	uint64_t now_ms;
+
+	// Interval of the timeout that wakes the loop up to look for expired
+	// timers. The kernel reads it when the timeout is submitted.
+	struct __kernel_timespec timeout_check_interval;
+
+	// Set while a listener's accept has failed and hasn't been armed again.
+	// Listeners are re-armed when the backoff timeout completes, or, if the
+	// loop ran out of descriptors, as soon as one of its connections closes.
+	bool accept_paused;
+	bool accept_resume_on_close;
+
+	// A backoff timeout is in flight; `accept_backoff_interval` is its length.
+	bool accept_backoff_pending;
+	struct __kernel_timespec accept_backoff_interval;
+
+	AcceptErrorLog accept_errors;
+} UringLoop;
+
+// Set up an io_uring for serving `server`. If the kernel doesn't support
+// io_uring, or any of the features this needs, an error is returned and the
+// caller should fall back to an `EventLoop`.
+//
+// `server` must outlive `self`, and must not start listening on more addresses
+// after this is called.
+Error uring_loop_init(
+	UringLoop *self,
+	Server *server,
+	HttpHandler handler,
+	void *handler_userdata
+);
+
+// Closes all open connections.
+void uring_loop_deinit(UringLoop *self);
+
+// Serve connections forever, closing connections that wait longer than the
+// server's timeouts allow. Only returns if the ring fails.
+Error uring_loop_run(UringLoop *self);
@@ -0,0 +1,33 @@
+#include "test/allocations.h"
+
+#include <stddef.h>
+
+// Provided by the linker's `--wrap`.
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t count, size_t size);
+void *__wrap_realloc(void *pointer, size_t size);
+
+static _Thread_local size_t allocations_count = 0;
+
+void *__wrap_malloc(size_t size) {
+	allocations_count += 1;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+	allocations_count += 1;
+	return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size) {
+	allocations_count += 1;
+	return __real_realloc(pointer, size);
+}
+
+size_t test_allocations_count(void) {
+	return allocations_count;
+}
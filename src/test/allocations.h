@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stddef.h>
+
+// Number of heap allocations made so far on this thread by code linked into
+// userve, counted by wrapping `malloc`, `calloc` and `realloc` at link time
+// (see `LDFLAGS` in the Makefile). Allocations made inside libc itself aren't
+// counted.
+size_t test_allocations_count(void);
@@ -24,6 +24,68 @@ void test_arguments(TestContext *ctx) {
 	arguments_parse(&arguments, 4, (const char*[]) { "@test5", "-p", "", "-t" });
 	EXPECT(ctx, strcmp(arguments.port, "") == 0);
 	EXPECT(ctx, arguments.test);
+
+	arguments_parse(&arguments, 1, (const char*[]) { "@test6" });
+	EXPECT(ctx, arguments.workers == 1);
+
+	arguments_parse(&arguments, 3, (const char*[]) { "@test7", "-w", "32" });
+	EXPECT(ctx, arguments.workers == 32);
+
+	arguments_parse(&arguments, 2, (const char*[]) { "@test8", "--workers=0" });
+	EXPECT(ctx, arguments.workers == 0);
+
+	arguments_parse(&arguments, 3, (const char*[]) { "@test9", "--sendfile-threshold", "4096" });
+	EXPECT(ctx, arguments.sendfile_threshold == 4096);
+
+	arguments_parse(&arguments, 2, (const char*[]) { "@test10", "--sendfile-threshold=16k" });
+	EXPECT(ctx, arguments.sendfile_threshold == 16 * 1024);
+
+	arguments_parse(&arguments, 2, (const char*[]) { "@test11", "--sendfile-threshold=2M" });
+	EXPECT(ctx, arguments.sendfile_threshold == 2 * 1024 * 1024);
+	EXPECT(ctx, !arguments.mmap);
+
+	arguments_parse(&arguments, 2, (const char*[]) { "@test12", "--mmap" });
+	EXPECT(ctx, arguments.mmap);
+	EXPECT(ctx, arguments.cache_size == 0);
+
+	arguments_parse(&arguments, 3, (const char*[]) { "@test13", "--cache-size", "64m" });
+	EXPECT(ctx, arguments.cache_size == 64 * 1024 * 1024);
+	EXPECT(ctx, !arguments.watch);
+
+	arguments_parse(&arguments, 2, (const char*[]) { "@test14", "--watch" });
+	EXPECT(ctx, arguments.watch);
+	EXPECT(ctx, arguments.pack == NULL);
+	EXPECT(ctx, arguments.pack_output == NULL);
+
+	arguments_parse(&arguments, 3, (const char*[]) { "@test15", "--pack", "site.upk" });
+	EXPECT(ctx, strcmp(arguments.pack, "site.upk") == 0);
+
+	arguments_parse(&arguments, 4, (const char*[]) { "@test16", "pack", "public", "site.upk" });
+	EXPECT(ctx, strcmp(arguments.pack_directory, "public") == 0);
+	EXPECT(ctx, strcmp(arguments.pack_output, "site.upk") == 0);
+
+	arguments_parse(&arguments, 2, (const char*[]) { "@test17", "--bench" });
+	EXPECT(ctx, arguments.bench);
+	EXPECT(ctx, !arguments.test);
+
+	arguments_parse(&arguments, 1, (const char*[]) { "@test18" });
+	EXPECT(ctx, arguments.max_request_line == 8 * 1024);
+	EXPECT(ctx, arguments.max_headers == 64);
+	EXPECT(ctx, arguments.request_memory == 0);
+
+	arguments_parse(&arguments, 6, (const char*[]) { "@test19", "--max-request-line=2k", "--max-header-size", "32k", "--max-headers=16", "--request-memory=256m" });
+	EXPECT(ctx, arguments.max_request_line == 2 * 1024);
+	EXPECT(ctx, arguments.max_header_size == 32 * 1024);
+	EXPECT(ctx, arguments.max_headers == 16);
+	EXPECT(ctx, arguments.request_memory == 256 * 1024 * 1024);
+	EXPECT(ctx, arguments.header_timeout == 10);
+	EXPECT(ctx, arguments.send_timeout == 10);
+	EXPECT(ctx, arguments.min_send_rate == 1024);
+
+	arguments_parse(&arguments, 5, (const char*[]) { "@test20", "--header-timeout=5", "--send-timeout", "30", "--min-send-rate=0" });
+	EXPECT(ctx, arguments.header_timeout == 5);
+	EXPECT(ctx, arguments.send_timeout == 30);
+	EXPECT(ctx, arguments.min_send_rate == 0);
 }
 
 
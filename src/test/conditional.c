@@ -0,0 +1,166 @@
+#include "test/conditional.h"
+#include "http/request.h"
+#include "util.h"
+
+#include <string.h>
+
+// Returns true if `format_etag` writes `expected` for `hash` and `suffix`.
+static bool etag_is(uint64_t hash, const char *suffix, const char *expected) {
+	Buffer etag;
+	buffer_init(&etag);
+
+	Error err = format_etag(&etag, hash, suffix);
+	bool matches = err == ERR_SUCCESS && slice_equal(buffer_slice(&etag), slice_from_cstr(expected));
+
+	buffer_deinit(&etag);
+
+	return matches;
+}
+
+// What `http_request_ranges` makes of a GET with `range` and `if_range`, for a
+// representation of `size` bytes with ETag `"e"`, modified at 784111777.
+static HttpRanges ranges_of(
+	const char *range,
+	const char *if_range,
+	size_t size,
+	HttpByteRange *out_ranges,
+	size_t *out_count
+) {
+	HttpRequest request = {
+		.method = slice_from_cstr("GET"),
+		.range = slice_from_cstr(range),
+		.if_range = slice_from_cstr(if_range),
+	};
+
+	return http_request_ranges(&request, size, slice_from_cstr("\"e\""), 784111777, out_ranges, out_count);
+}
+
+void test_conditional(TestContext *ctx) {
+	test(ctx, "conditional: content hashes are XXH64");
+	{
+		EXPECT(ctx, content_hash(slice_new()) == 0xEF46DB3751D8E999);
+		EXPECT(ctx, content_hash(slice_from_cstr("abc")) == 0x44BC2CF5AD770999);
+
+		// Long enough to go through the four lanes.
+		Slice fox = slice_from_cstr("The quick brown fox jumps over the lazy dog");
+		EXPECT(ctx, content_hash(fox) == 0x0B242D361FDA71BC);
+
+		EXPECT(ctx, etag_is(0x0B242D361FDA71BC, "", "\"0b242d361fda71bc\""));
+		EXPECT(ctx, etag_is(1, "-gzip", "\"0000000000000001-gzip\""));
+
+		// Files sent from disk go by inode, modification time and size.
+		Buffer file_etag;
+		buffer_init(&file_etag);
+		Error err = format_file_etag(&file_etag, 0x2a, 1700000000123456789, 4096);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, slice_equal(buffer_slice(&file_etag), slice_from_cstr("\"2a-17979cfe3d85cd15-1000\"")));
+		buffer_deinit(&file_etag);
+	}
+
+	test(ctx, "conditional: If-None-Match lists");
+	{
+		Slice etag = slice_from_cstr("\"0b242d361fda71bc\"");
+
+		EXPECT(ctx, list_matches_etag(slice_from_cstr("\"0b242d361fda71bc\""), etag));
+		EXPECT(ctx, list_matches_etag(slice_from_cstr("W/\"0b242d361fda71bc\""), etag));
+		EXPECT(ctx, list_matches_etag(slice_from_cstr("\"a\", \"0b242d361fda71bc\""), etag));
+		EXPECT(ctx, list_matches_etag(slice_from_cstr("\"a\",W/\"0b242d361fda71bc\" , \"b\""), etag));
+		EXPECT(ctx, list_matches_etag(slice_from_cstr("*"), etag));
+
+		EXPECT(ctx, !list_matches_etag(slice_from_cstr(""), etag));
+		EXPECT(ctx, !list_matches_etag(slice_from_cstr("\"0b242d361fda71b\""), etag));
+		EXPECT(ctx, !list_matches_etag(slice_from_cstr("\"0b242d361fda71bc-gzip\""), etag));
+		EXPECT(ctx, !list_matches_etag(slice_from_cstr("0b242d361fda71bc"), etag));
+	}
+
+	test(ctx, "conditional: HTTP dates");
+	{
+		Buffer date;
+		buffer_init(&date);
+
+		EXPECT(ctx, format_http_date(&date, 784111777) == ERR_SUCCESS);
+		EXPECT(ctx, slice_equal(buffer_slice(&date), slice_from_cstr("Sun, 06 Nov 1994 08:49:37 GMT")));
+
+		int64_t seconds = 0;
+		EXPECT(ctx, parse_http_date(buffer_slice(&date), &seconds));
+		EXPECT(ctx, seconds == 784111777);
+
+		buffer_clear(&date);
+		EXPECT(ctx, format_http_date(&date, 0) == ERR_SUCCESS);
+		EXPECT(ctx, parse_http_date(buffer_slice(&date), &seconds));
+		EXPECT(ctx, seconds == 0);
+
+		// The obsolete RFC 850 and asctime formats.
+		EXPECT(ctx, !parse_http_date(slice_from_cstr("Sunday, 06-Nov-94 08:49:37 GMT"), &seconds));
+		EXPECT(ctx, !parse_http_date(slice_from_cstr("Sun Nov  6 08:49:37 1994"), &seconds));
+		EXPECT(ctx, !parse_http_date(slice_from_cstr("Sun, 06 Nov 1994 08:49:37 UTC"), &seconds));
+		EXPECT(ctx, !parse_http_date(slice_from_cstr("Sun, 06 Nov 1994 08:49:37 GMT "), &seconds));
+		EXPECT(ctx, !parse_http_date(slice_from_cstr(""), &seconds));
+
+		buffer_deinit(&date);
+	}
+
+	test(ctx, "conditional: byte ranges");
+	{
+		HttpByteRange ranges[HTTP_REQUEST_MAX_RANGES];
+		size_t count;
+
+		EXPECT(ctx, ranges_of("bytes=0-499", "", 1000, ranges, &count) == HTTP_RANGES_SATISFIABLE);
+		EXPECT(ctx, count == 1 && ranges[0].offset == 0 && ranges[0].len == 500);
+
+		// Open-ended, past the end, and suffixes.
+		EXPECT(ctx, ranges_of("bytes=900-", "", 1000, ranges, &count) == HTTP_RANGES_SATISFIABLE);
+		EXPECT(ctx, count == 1 && ranges[0].offset == 900 && ranges[0].len == 100);
+		EXPECT(ctx, ranges_of("bytes=900-5000", "", 1000, ranges, &count) == HTTP_RANGES_SATISFIABLE);
+		EXPECT(ctx, count == 1 && ranges[0].offset == 900 && ranges[0].len == 100);
+		EXPECT(ctx, ranges_of("bytes=-100", "", 1000, ranges, &count) == HTTP_RANGES_SATISFIABLE);
+		EXPECT(ctx, count == 1 && ranges[0].offset == 900 && ranges[0].len == 100);
+		EXPECT(ctx, ranges_of("bytes=-5000", "", 1000, ranges, &count) == HTTP_RANGES_SATISFIABLE);
+		EXPECT(ctx, count == 1 && ranges[0].offset == 0 && ranges[0].len == 1000);
+
+		// Sorted, with overlapping and touching ranges merged, and ones past
+		// the end dropped.
+		EXPECT(ctx, ranges_of("bytes=500-599, 0-9,5-19,20-29, 2000-", "", 1000, ranges, &count) == HTTP_RANGES_SATISFIABLE);
+		EXPECT(ctx, count == 2);
+		EXPECT(ctx, ranges[0].offset == 0 && ranges[0].len == 30);
+		EXPECT(ctx, ranges[1].offset == 500 && ranges[1].len == 100);
+
+		EXPECT(ctx, ranges_of("bytes=1000-", "", 1000, ranges, &count) == HTTP_RANGES_NOT_SATISFIABLE);
+		EXPECT(ctx, ranges_of("bytes=-0", "", 1000, ranges, &count) == HTTP_RANGES_NOT_SATISFIABLE);
+
+		// Too many.
+		EXPECT(ctx, ranges_of("bytes=0-0,2-2,4-4,6-6,8-8,10-10,12-12,14-14,16-16", "", 1000, ranges, &count) == HTTP_RANGES_NONE);
+		EXPECT(ctx, ranges_of("bytes=0-0,2-2,4-4,6-6,8-8,10-10,12-12,14-14,1-16", "", 1000, ranges, &count) == HTTP_RANGES_SATISFIABLE);
+		EXPECT(ctx, count == 1 && ranges[0].offset == 0 && ranges[0].len == 17);
+
+		// Ignored.
+		EXPECT(ctx, ranges_of("", "", 1000, ranges, &count) == HTTP_RANGES_NONE);
+		EXPECT(ctx, ranges_of("bytes=0-499", "", 0, ranges, &count) == HTTP_RANGES_NONE);
+		EXPECT(ctx, ranges_of("items=0-4", "", 1000, ranges, &count) == HTTP_RANGES_NONE);
+		EXPECT(ctx, ranges_of("bytes=5-1", "", 1000, ranges, &count) == HTTP_RANGES_NONE);
+		EXPECT(ctx, ranges_of("bytes=0-1x", "", 1000, ranges, &count) == HTTP_RANGES_NONE);
+		EXPECT(ctx, ranges_of("bytes=", "", 1000, ranges, &count) == HTTP_RANGES_NONE);
+		EXPECT(ctx, ranges_of("bytes=99999999999999999999999-", "", 1000, ranges, &count) == HTTP_RANGES_NONE);
+
+		HttpRequest head = {
+			.method = slice_from_cstr("HEAD"),
+			.range = slice_from_cstr("bytes=0-1"),
+			.if_range = slice_new(),
+		};
+		EXPECT(ctx, http_request_ranges(&head, 1000, slice_from_cstr("\"e\""), 0, ranges, &count) == HTTP_RANGES_NONE);
+	}
+
+	test(ctx, "conditional: If-Range");
+	{
+		HttpByteRange ranges[HTTP_REQUEST_MAX_RANGES];
+		size_t count;
+
+		EXPECT(ctx, ranges_of("bytes=0-1", "\"e\"", 1000, ranges, &count) == HTTP_RANGES_SATISFIABLE);
+		EXPECT(ctx, ranges_of("bytes=0-1", "Sun, 06 Nov 1994 08:49:37 GMT", 1000, ranges, &count) == HTTP_RANGES_SATISFIABLE);
+
+		EXPECT(ctx, ranges_of("bytes=0-1", "\"f\"", 1000, ranges, &count) == HTTP_RANGES_NONE);
+		EXPECT(ctx, ranges_of("bytes=0-1", "W/\"e\"", 1000, ranges, &count) == HTTP_RANGES_NONE);
+		EXPECT(ctx, ranges_of("bytes=0-1", "Sun, 06 Nov 1994 08:49:38 GMT", 1000, ranges, &count) == HTTP_RANGES_NONE);
+		EXPECT(ctx, ranges_of("bytes=0-1", "yesterday", 1000, ranges, &count) == HTTP_RANGES_NONE);
+	}
+}
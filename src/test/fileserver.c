@@ -0,0 +1,548 @@
+#include "test/fileserver.h"
+#include "test/helpers.h"
+#include "http/connection.h"
+#include "main/fileserver.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// Enough files to be loaded by several threads, and merged into a new base.
+#define TEST_FILESERVER_MANY_FILES 100
+
+// Everything `reader` answers a GET of `target` with; see `test_request`.
+static Error request_from_fileserver(
+	FileServerReader *reader,
+	const char *target,
+	const char *headers,
+	Buffer *out_response
+) {
+	return test_request(test_respond_from_fileserver, reader, target, headers, out_response);
+}
+
+static bool serves(FileServerReader *reader, const char *target, const char *body) {
+	return test_serves(test_respond_from_fileserver, reader, target, body);
+}
+
+// Returns true if `response` has a gzip-compressed body that decompresses to
+// `body`.
+static bool has_gzip_body(const Buffer *response, const char *body) {
+	const char *text = (const char*) response->bytes;
+	if (strstr(text, "Content-Encoding: gzip\r\n") == NULL) return false;
+
+	const char *found_body = strstr(text, "\r\n\r\n");
+	if (found_body == NULL) return false;
+	found_body += strlen("\r\n\r\n");
+
+	uint8_t decompressed[4096];
+
+	z_stream stream = { 0 };
+	if (inflateInit2(&stream, 15 + 16) != Z_OK) return false;
+
+	stream.next_in = (uint8_t*) found_body;
+	// Not counting the NUL.
+	stream.avail_in = response->len - 1 - (found_body - text);
+	stream.next_out = decompressed;
+	stream.avail_out = sizeof(decompressed);
+
+	int z_err = inflate(&stream, Z_FINISH);
+	size_t decompressed_len = stream.total_out;
+	inflateEnd(&stream);
+
+	return
+		z_err == Z_STREAM_END &&
+		decompressed_len == strlen(body) &&
+		memcmp(decompressed, body, decompressed_len) == 0;
+}
+
+// Copy the value of the `name` header in `response` to `out`, NUL-terminated.
+// Empty if there isn't one.
+static void find_header(const Buffer *response, const char *name, char *out, size_t out_size) {
+	char prefix[64];
+	snprintf(prefix, sizeof(prefix), "\r\n%s: ", name);
+
+	out[0] = '\0';
+
+	const char *found = strstr((const char*) response->bytes, prefix);
+	if (found == NULL) return;
+	found += strlen(prefix);
+
+	const char *end = strstr(found, "\r\n");
+	if (end == NULL || (size_t) (end - found) >= out_size) return;
+
+	memcpy(out, found, end - found);
+	out[end - found] = '\0';
+}
+
+// Returns true if `response` is a 304 Not Modified, with no body.
+static bool is_not_modified(const Buffer *response) {
+	const char *text = (const char*) response->bytes;
+	const char *found_body = strstr(text, "\r\n\r\n");
+
+	return
+		strncmp(text, "HTTP/1.1 304", strlen("HTTP/1.1 304")) == 0 &&
+		strstr(text, "Content-Length") == NULL &&
+		found_body != NULL &&
+		found_body[strlen("\r\n\r\n")] == '\0';
+}
+
+static void remove_file(const char *directory, const char *name) {
+	char path[512];
+	snprintf(path, sizeof(path), "%s/%s", directory, name);
+
+	(void) unlink(path);
+}
+
+// Fill `directory` with the files the tests expect.
+static void create_tree(const char *directory) {
+	char path[512];
+
+	test_write_file(directory, "index.html", "home");
+	test_write_file(directory, "a.txt", "alpha");
+	test_write_file(directory, ".hidden", "hidden");
+
+	snprintf(path, sizeof(path), "%s/sub", directory);
+	(void) mkdir(path, 0700);
+	test_write_file(directory, "sub/page.html", "page");
+
+	for (int i = 0; i < TEST_FILESERVER_MANY_FILES; i++) {
+		char name[32], contents[32];
+		snprintf(name, sizeof(name), "n%d.txt", i);
+		snprintf(contents, sizeof(contents), "file %d", i);
+
+		test_write_file(directory, name, contents);
+	}
+}
+
+static void remove_tree(const char *directory) {
+	char path[512];
+
+	remove_file(directory, "index.html");
+	remove_file(directory, "a.txt");
+	remove_file(directory, "b.txt");
+	remove_file(directory, ".hidden");
+	remove_file(directory, "sub/page.html");
+
+	snprintf(path, sizeof(path), "%s/sub", directory);
+	(void) rmdir(path);
+
+	for (int i = 0; i < TEST_FILESERVER_MANY_FILES; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "n%d.txt", i);
+
+		remove_file(directory, name);
+	}
+
+	(void) rmdir(directory);
+}
+
+void test_fileserver(TestContext *ctx) {
+	FileServer fileserver;
+	FileServerReader reader;
+	FileServerUpdate update;
+	Error err;
+
+	char directory[] = "/tmp/userve-test-XXXXXX";
+	EXPECT(ctx, mkdtemp(directory) != NULL);
+
+	create_tree(directory);
+
+	test(ctx, "fileserver: directories are loaded by several threads");
+	{
+		fileserver_init(&fileserver);
+		fileserver.load_threads = 4;
+		fileserver_reader_init(&reader, &fileserver);
+
+		err = fileserver_register_directory(&fileserver, directory, slice_from_cstr("/"));
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, fileserver.load_stats.files == TEST_FILESERVER_MANY_FILES + 3);
+
+		EXPECT(ctx, serves(&reader, "/", "home"));
+		EXPECT(ctx, serves(&reader, "/a.txt", "alpha"));
+		EXPECT(ctx, serves(&reader, "/sub/page", "page"));
+		EXPECT(ctx, serves(&reader, "/sub/page?from=index", "page"));
+		EXPECT(ctx, serves(&reader, "/?", "home"));
+		EXPECT(ctx, serves(&reader, "/n0.txt", "file 0"));
+		EXPECT(ctx, serves(&reader, "/n99.txt", "file 99"));
+		EXPECT(ctx, serves(&reader, "/sub/page.html", NULL));
+		EXPECT(ctx, serves(&reader, "/.hidden", NULL));
+	}
+
+	test(ctx, "fileserver: updates add and remove files");
+	{
+		test_write_file(directory, "a.txt", "changed");
+		test_write_file(directory, "b.txt", "beta");
+
+		char path[512];
+
+		err = fileserver_update_begin(&fileserver, &update);
+		EXPECT(ctx, err == ERR_SUCCESS);
+
+		snprintf(path, sizeof(path), "%s/a.txt", directory);
+		EXPECT(ctx, fileserver_update_add_file(&update, path, slice_from_cstr("/a.txt")) == ERR_SUCCESS);
+
+		snprintf(path, sizeof(path), "%s/b.txt", directory);
+		EXPECT(ctx, fileserver_update_add_file(&update, path, slice_from_cstr("/b.txt")) == ERR_SUCCESS);
+
+		EXPECT(ctx, fileserver_update_remove_file(&update, slice_from_cstr("/n0.txt")) == ERR_SUCCESS);
+
+		// Nothing changes until the update is committed.
+		EXPECT(ctx, serves(&reader, "/a.txt", "alpha"));
+		EXPECT(ctx, serves(&reader, "/b.txt", NULL));
+
+		fileserver_update_commit(&update);
+
+		EXPECT(ctx, serves(&reader, "/a.txt", "changed"));
+		EXPECT(ctx, serves(&reader, "/b.txt", "beta"));
+		EXPECT(ctx, serves(&reader, "/n0.txt", NULL));
+		EXPECT(ctx, serves(&reader, "/n1.txt", "file 1"));
+
+		err = fileserver_update_begin(&fileserver, &update);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, fileserver_update_remove_directory(&update, slice_from_cstr("/sub")) == ERR_SUCCESS);
+		fileserver_update_commit(&update);
+
+		EXPECT(ctx, serves(&reader, "/sub/page", NULL));
+		EXPECT(ctx, serves(&reader, "/", "home"));
+
+		fileserver_reader_deinit(&reader);
+		fileserver_deinit(&fileserver);
+	}
+
+	test(ctx, "fileserver: files are loaded when first asked for with a cache budget");
+	{
+		fileserver_init(&fileserver);
+		fileserver.cache_size = 16;
+		fileserver_reader_init(&reader, &fileserver);
+
+		err = fileserver_register_directory(&fileserver, directory, slice_from_cstr("/"));
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, fileserver.load_stats.bytes == 0);
+
+		EXPECT(ctx, serves(&reader, "/n5.txt", "file 5"));
+		EXPECT(ctx, serves(&reader, "/b.txt", "beta"));
+		EXPECT(ctx, serves(&reader, "/n5.txt", "file 5"));
+
+		FileServerCacheStats stats = fileserver_cache_stats(&fileserver);
+		EXPECT(ctx, stats.misses == 3);
+		EXPECT(ctx, stats.evictions >= 2);
+
+		// Deleted from disk, but not yet from the index.
+		remove_file(directory, "b.txt");
+		EXPECT(ctx, serves(&reader, "/b.txt", NULL));
+
+		fileserver_reader_deinit(&reader);
+		fileserver_deinit(&fileserver);
+	}
+
+	test(ctx, "fileserver: the cache keeps few files open to send from disk");
+	{
+		fileserver_init(&fileserver);
+		fileserver.cache_size = 1024 * 1024;
+		fileserver.cache_max_fds = 1;
+		fileserver.sendfile_threshold = 0;
+		fileserver_reader_init(&reader, &fileserver);
+
+		err = fileserver_register_directory(&fileserver, directory, slice_from_cstr("/"));
+		EXPECT(ctx, err == ERR_SUCCESS);
+
+		// Bodies sent from disk aren't in the output; only heads are.
+		Buffer response;
+		buffer_init(&response);
+
+		const char *targets[] = { "/n5.txt", "/a.txt", "/a.txt" };
+		for (size_t i = 0; i < sizeof(targets) / sizeof(targets[0]); i++) {
+			buffer_clear(&response);
+			(void) request_from_fileserver(&reader, targets[i], "", &response);
+			EXPECT(ctx, strncmp((const char*) response.bytes, "HTTP/1.1 200", strlen("HTTP/1.1 200")) == 0);
+		}
+
+		buffer_deinit(&response);
+
+		// Well within the budget, but `n5.txt` was holding one descriptor too
+		// many.
+		FileServerCacheStats stats = fileserver_cache_stats(&fileserver);
+		EXPECT(ctx, stats.used < stats.size);
+		EXPECT(ctx, stats.fds == 1);
+		EXPECT(ctx, stats.evictions == 1);
+		EXPECT(ctx, stats.hits == 1);
+
+		fileserver_reader_deinit(&reader);
+		fileserver_deinit(&fileserver);
+	}
+
+	test(ctx, "fileserver: text files are sent compressed to clients that accept it");
+	{
+		// Compresses well.
+		char text[1024];
+		for (size_t i = 0; i < sizeof(text) - 1; i++) {
+			text[i] = "compressible "[i % strlen("compressible ")];
+		}
+		text[sizeof(text) - 1] = '\0';
+
+		test_write_file(directory, "text.md", text);
+		test_write_file(directory, "image.png", text);
+
+		// Not what `side.txt` compresses to, so that it's clear which was sent.
+		Buffer sidecar;
+		buffer_init(&sidecar);
+		(void) gzip_compress(slice_from_cstr("from the sidecar"), 1, &sidecar);
+		test_write_file(directory, "side.txt", text);
+		test_write_file_bytes(directory, "side.txt.gz", buffer_slice(&sidecar));
+		buffer_deinit(&sidecar);
+
+		fileserver_init(&fileserver);
+		fileserver_reader_init(&reader, &fileserver);
+
+		err = fileserver_register_directory(&fileserver, directory, slice_from_cstr("/"));
+		EXPECT(ctx, err == ERR_SUCCESS);
+
+		Buffer response;
+		buffer_init(&response);
+
+		(void) request_from_fileserver(&reader, "/text.md", "Accept-Encoding: br, gzip;q=0.5\r\n", &response);
+		EXPECT(ctx, has_gzip_body(&response, text));
+		EXPECT(ctx, strstr((const char*) response.bytes, "Vary: Accept-Encoding\r\n") != NULL);
+
+		buffer_clear(&response);
+		(void) request_from_fileserver(&reader, "/text.md", "Accept-Encoding: *\r\n", &response);
+		EXPECT(ctx, has_gzip_body(&response, text));
+
+		// Plain, but still varies with what's accepted.
+		buffer_clear(&response);
+		(void) request_from_fileserver(&reader, "/text.md", "Accept-Encoding: gzip;q=0, *\r\n", &response);
+		EXPECT(ctx, strstr((const char*) response.bytes, "Content-Encoding") == NULL);
+		EXPECT(ctx, strstr((const char*) response.bytes, "Vary: Accept-Encoding\r\n") != NULL);
+		EXPECT(ctx, serves(&reader, "/text.md", text));
+
+		// Images are compressed already.
+		buffer_clear(&response);
+		(void) request_from_fileserver(&reader, "/image.png", "Accept-Encoding: gzip\r\n", &response);
+		EXPECT(ctx, strstr((const char*) response.bytes, "Content-Encoding") == NULL);
+		EXPECT(ctx, strstr((const char*) response.bytes, "Vary") == NULL);
+
+		buffer_clear(&response);
+		(void) request_from_fileserver(&reader, "/side.txt", "Accept-Encoding: gzip\r\n", &response);
+		EXPECT(ctx, has_gzip_body(&response, "from the sidecar"));
+
+		// Files too small to shrink are only sent plain.
+		buffer_clear(&response);
+		(void) request_from_fileserver(&reader, "/a.txt", "Accept-Encoding: gzip\r\n", &response);
+		EXPECT(ctx, strstr((const char*) response.bytes, "Content-Encoding") == NULL);
+
+		buffer_deinit(&response);
+
+		fileserver_reader_deinit(&reader);
+		fileserver_deinit(&fileserver);
+
+		remove_file(directory, "text.md");
+		remove_file(directory, "image.png");
+		remove_file(directory, "side.txt");
+		remove_file(directory, "side.txt.gz");
+	}
+
+	test(ctx, "fileserver: conditional requests are answered with 304 Not Modified");
+	{
+		char text[1024];
+		for (size_t i = 0; i < sizeof(text) - 1; i++) {
+			text[i] = "compressible "[i % strlen("compressible ")];
+		}
+		text[sizeof(text) - 1] = '\0';
+
+		test_write_file(directory, "text.md", text);
+
+		fileserver_init(&fileserver);
+		fileserver_reader_init(&reader, &fileserver);
+
+		err = fileserver_register_directory(&fileserver, directory, slice_from_cstr("/"));
+		EXPECT(ctx, err == ERR_SUCCESS);
+
+		Buffer response;
+		buffer_init(&response);
+
+		char etag[64], last_modified[64], headers[256];
+
+		// The ETag is the hash of the contents, which an earlier test changed.
+		Buffer expected_etag;
+		buffer_init(&expected_etag);
+		(void) format_etag(&expected_etag, content_hash(slice_from_cstr("changed")), "");
+		(void) buffer_concat(&expected_etag, slice_from_len((uint8_t*) "\x00", 1));
+
+		(void) request_from_fileserver(&reader, "/a.txt", "", &response);
+		find_header(&response, "ETag", etag, sizeof(etag));
+		find_header(&response, "Last-Modified", last_modified, sizeof(last_modified));
+		EXPECT(ctx, strcmp(etag, (const char*) expected_etag.bytes) == 0);
+		EXPECT(ctx, last_modified[0] != '\0');
+
+		buffer_clear(&response);
+		snprintf(headers, sizeof(headers), "If-None-Match: \"x\", %s\r\n", etag);
+		(void) request_from_fileserver(&reader, "/a.txt", headers, &response);
+		EXPECT(ctx, is_not_modified(&response));
+		EXPECT(ctx, strstr((const char*) response.bytes, etag) != NULL);
+
+		buffer_clear(&response);
+		snprintf(headers, sizeof(headers), "If-Modified-Since: %s\r\n", last_modified);
+		(void) request_from_fileserver(&reader, "/a.txt", headers, &response);
+		EXPECT(ctx, is_not_modified(&response));
+
+		// If-None-Match wins over If-Modified-Since.
+		buffer_clear(&response);
+		snprintf(headers, sizeof(headers), "If-None-Match: \"x\"\r\nIf-Modified-Since: %s\r\n", last_modified);
+		(void) request_from_fileserver(&reader, "/a.txt", headers, &response);
+		EXPECT(ctx, strncmp((const char*) response.bytes, "HTTP/1.1 200", strlen("HTTP/1.1 200")) == 0);
+
+		buffer_clear(&response);
+		(void) request_from_fileserver(&reader, "/a.txt", "If-Modified-Since: Thu, 01 Jan 1970 00:00:00 GMT\r\n", &response);
+		EXPECT(ctx, strncmp((const char*) response.bytes, "HTTP/1.1 200", strlen("HTTP/1.1 200")) == 0);
+
+		// The compressed copy has an ETag of its own, which only matches it.
+		char gzip_etag[64];
+		buffer_clear(&response);
+		(void) request_from_fileserver(&reader, "/text.md", "Accept-Encoding: gzip\r\n", &response);
+		find_header(&response, "ETag", gzip_etag, sizeof(gzip_etag));
+		EXPECT(ctx, strstr(gzip_etag, "-gzip\"") != NULL);
+
+		buffer_clear(&response);
+		snprintf(headers, sizeof(headers), "Accept-Encoding: gzip\r\nIf-None-Match: %s\r\n", gzip_etag);
+		(void) request_from_fileserver(&reader, "/text.md", headers, &response);
+		EXPECT(ctx, is_not_modified(&response));
+		EXPECT(ctx, strstr((const char*) response.bytes, "Vary: Accept-Encoding\r\n") != NULL);
+
+		buffer_clear(&response);
+		snprintf(headers, sizeof(headers), "If-None-Match: %s\r\n", gzip_etag);
+		(void) request_from_fileserver(&reader, "/text.md", headers, &response);
+		EXPECT(ctx, strncmp((const char*) response.bytes, "HTTP/1.1 200", strlen("HTTP/1.1 200")) == 0);
+
+		fileserver_reader_deinit(&reader);
+		fileserver_deinit(&fileserver);
+
+		// Files sent from disk aren't hashed, and get ETags of their own.
+		fileserver_init(&fileserver);
+		fileserver.sendfile_threshold = 0;
+		fileserver_reader_init(&reader, &fileserver);
+
+		err = fileserver_register_directory(&fileserver, directory, slice_from_cstr("/"));
+		EXPECT(ctx, err == ERR_SUCCESS);
+
+		buffer_clear(&response);
+		snprintf(headers, sizeof(headers), "If-None-Match: %s\r\n", etag);
+		(void) request_from_fileserver(&reader, "/a.txt", headers, &response);
+		EXPECT(ctx, strncmp((const char*) response.bytes, "HTTP/1.1 200", strlen("HTTP/1.1 200")) == 0);
+
+		char file_etag[64];
+		find_header(&response, "ETag", file_etag, sizeof(file_etag));
+		EXPECT(ctx, strcmp(file_etag, etag) != 0);
+
+		buffer_clear(&response);
+		snprintf(headers, sizeof(headers), "If-None-Match: %s\r\n", file_etag);
+		(void) request_from_fileserver(&reader, "/a.txt", headers, &response);
+		EXPECT(ctx, is_not_modified(&response));
+
+		buffer_deinit(&expected_etag);
+		buffer_deinit(&response);
+
+		fileserver_reader_deinit(&reader);
+		fileserver_deinit(&fileserver);
+
+		remove_file(directory, "text.md");
+	}
+
+	test(ctx, "fileserver: ranges are sent with 206 Partial Content");
+	{
+		test_write_file(directory, "media.bin", "0123456789abcdefghij");
+
+		fileserver_init(&fileserver);
+		fileserver_reader_init(&reader, &fileserver);
+
+		err = fileserver_register_directory(&fileserver, directory, slice_from_cstr("/"));
+		EXPECT(ctx, err == ERR_SUCCESS);
+
+		Buffer response;
+		buffer_init(&response);
+
+		(void) request_from_fileserver(&reader, "/media.bin", "", &response);
+		EXPECT(ctx, strstr((const char*) response.bytes, "Accept-Ranges: bytes\r\n") != NULL);
+
+		buffer_clear(&response);
+		(void) request_from_fileserver(&reader, "/media.bin", "Range: bytes=2-5\r\n", &response);
+		EXPECT(ctx, strncmp((const char*) response.bytes, "HTTP/1.1 206", strlen("HTTP/1.1 206")) == 0);
+		EXPECT(ctx, strstr((const char*) response.bytes, "Content-Range: bytes 2-5/20\r\n") != NULL);
+		EXPECT(ctx, strstr((const char*) response.bytes, "ETag: \"") != NULL);
+		EXPECT(ctx, strcmp(strstr((const char*) response.bytes, "\r\n\r\n"), "\r\n\r\n2345") == 0);
+
+		// More than one is sent as a multipart body.
+		buffer_clear(&response);
+		(void) request_from_fileserver(&reader, "/media.bin", "Range: bytes=0-1,-2\r\n", &response);
+		const char *boundary = strstr((const char*) response.bytes, "multipart/byteranges; boundary=");
+		EXPECT(ctx, boundary != NULL);
+		if (boundary != NULL) {
+			boundary += strlen("multipart/byteranges; boundary=");
+
+			char expected[512];
+			int boundary_len = strcspn(boundary, "\r");
+			int body_len = snprintf(
+				expected,
+				sizeof(expected),
+				"--%.*s\r\n"
+				"Content-Type: application/octet-stream\r\n"
+				"Content-Range: bytes 0-1/20\r\n"
+				"\r\n"
+				"01\r\n"
+				"--%.*s\r\n"
+				"Content-Type: application/octet-stream\r\n"
+				"Content-Range: bytes 18-19/20\r\n"
+				"\r\n"
+				"ij\r\n"
+				"--%.*s--\r\n",
+				boundary_len, boundary,
+				boundary_len, boundary,
+				boundary_len, boundary
+			);
+
+			char content_length[64];
+			find_header(&response, "Content-Length", content_length, sizeof(content_length));
+			EXPECT(ctx, atoi(content_length) == body_len);
+			EXPECT(ctx, strcmp(strstr((const char*) response.bytes, "\r\n\r\n") + strlen("\r\n\r\n"), expected) == 0);
+		}
+
+		buffer_clear(&response);
+		(void) request_from_fileserver(&reader, "/media.bin", "Range: bytes=20-\r\n", &response);
+		EXPECT(ctx, strncmp((const char*) response.bytes, "HTTP/1.1 416", strlen("HTTP/1.1 416")) == 0);
+		EXPECT(ctx, strstr((const char*) response.bytes, "Content-Range: bytes */20\r\n") != NULL);
+
+		// A different version than the client has; all of it.
+		buffer_clear(&response);
+		(void) request_from_fileserver(&reader, "/media.bin", "Range: bytes=2-5\r\nIf-Range: \"x\"\r\n", &response);
+		EXPECT(ctx, strncmp((const char*) response.bytes, "HTTP/1.1 200", strlen("HTTP/1.1 200")) == 0);
+
+		fileserver_reader_deinit(&reader);
+		fileserver_deinit(&fileserver);
+
+		// Sent from disk, at an offset.
+		fileserver_init(&fileserver);
+		fileserver.sendfile_threshold = 0;
+		fileserver_reader_init(&reader, &fileserver);
+
+		err = fileserver_register_directory(&fileserver, directory, slice_from_cstr("/"));
+		EXPECT(ctx, err == ERR_SUCCESS);
+
+		buffer_clear(&response);
+		(void) request_from_fileserver(&reader, "/media.bin", "Range: bytes=-3\r\n", &response);
+		EXPECT(ctx, strncmp((const char*) response.bytes, "HTTP/1.1 206", strlen("HTTP/1.1 206")) == 0);
+		EXPECT(ctx, strstr((const char*) response.bytes, "Content-Range: bytes 17-19/20\r\n") != NULL);
+		EXPECT(ctx, strstr((const char*) response.bytes, "Content-Length: 3\r\n") != NULL);
+
+		buffer_deinit(&response);
+
+		fileserver_reader_deinit(&reader);
+		fileserver_deinit(&fileserver);
+
+		remove_file(directory, "media.bin");
+	}
+
+	remove_tree(directory);
+}
@@ -0,0 +1,91 @@
+#include "test/helpers.h"
+
+#include <stdio.h>
+#include <string.h>
+
+void test_respond_from_fileserver(void *userdata, const HttpRequest *request, HttpResponse *response) {
+	FileServerReader *reader = (FileServerReader*) userdata;
+
+	Error err = fileserver_respond(reader, request, response);
+	if (err == ERR_HTTP_NOT_FOUND) {
+		(void) http_response_not_found(response);
+	} else if (err != ERR_SUCCESS) {
+		(void) http_response_internal_server_error(response);
+	}
+}
+
+Error test_request(
+	HttpHandler handler,
+	void *handler_userdata,
+	const char *target,
+	const char *headers,
+	Buffer *out_response
+) {
+	HttpConnection connection;
+	http_connection_init(&connection);
+
+	char request[512];
+	snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\n%s\r\n", target, headers);
+
+	Error err = http_connection_receive(
+		&connection,
+		slice_from_cstr(request),
+		handler,
+		handler_userdata
+	);
+
+	struct iovec iovecs[HTTP_OUTPUT_MAX_SEGMENTS];
+	size_t iovecs_count = http_output_pending_iovecs(
+		&connection.output,
+		iovecs,
+		HTTP_OUTPUT_MAX_SEGMENTS
+	);
+
+	for (size_t i = 0; i < iovecs_count; i++) {
+		(void) buffer_concat(out_response, slice_from_len(iovecs[i].iov_base, iovecs[i].iov_len));
+	}
+	(void) buffer_concat(out_response, slice_from_len((uint8_t*) "\x00", 1));
+
+	http_connection_deinit(&connection);
+
+	return err;
+}
+
+bool test_serves(HttpHandler handler, void *handler_userdata, const char *target, const char *body) {
+	Buffer output;
+	buffer_init(&output);
+
+	Error err = test_request(handler, handler_userdata, target, "", &output);
+
+	const char *text = (const char*) output.bytes;
+
+	bool matches = err == ERR_SUCCESS;
+	if (body == NULL) {
+		matches = matches && strncmp(text, "HTTP/1.1 404", strlen("HTTP/1.1 404")) == 0;
+	} else {
+		const char *found_body = strstr(text, "\r\n\r\n");
+		matches = matches &&
+			strncmp(text, "HTTP/1.1 200", strlen("HTTP/1.1 200")) == 0 &&
+			found_body != NULL &&
+			strcmp(found_body + strlen("\r\n\r\n"), body) == 0;
+	}
+
+	buffer_deinit(&output);
+
+	return matches;
+}
+
+void test_write_file_bytes(const char *directory, const char *name, Slice contents) {
+	char path[512];
+	snprintf(path, sizeof(path), "%s/%s", directory, name);
+
+	FILE *file = fopen(path, "wb");
+	if (file == NULL) return;
+
+	fwrite(contents.bytes, 1, contents.len, file);
+	fclose(file);
+}
+
+void test_write_file(const char *directory, const char *name, const char *contents) {
+	test_write_file_bytes(directory, name, slice_from_cstr(contents));
+}
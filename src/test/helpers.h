@@ -0,0 +1,32 @@
+#pragma once
+
+#include "http/connection.h"
+#include "main/fileserver.h"
+#include "warble/buffer.h"
+#include "warble/error.h"
+#include "warble/slice.h"
+
+#include <stdbool.h>
+
+// An `HttpHandler` that answers every request from the `FileServerReader` in
+// `userdata`, with a 404 or 500 if it fails.
+void test_respond_from_fileserver(void *userdata, const HttpRequest *request, HttpResponse *response);
+
+// Append everything `handler` answers a GET of `target` with to
+// `out_response`, NUL-terminated. `headers` are sent with the request, each
+// followed by CRLF. Bodies sent from a file descriptor aren't included.
+Error test_request(
+	HttpHandler handler,
+	void *handler_userdata,
+	const char *target,
+	const char *headers,
+	Buffer *out_response
+);
+
+// Returns true if `handler` answers a GET of `target` with a body of `body`,
+// or with a 404 if `body` is `NULL`.
+bool test_serves(HttpHandler handler, void *handler_userdata, const char *target, const char *body);
+
+// Create or replace the file `name` in `directory`, ignoring errors.
+void test_write_file_bytes(const char *directory, const char *name, Slice contents);
+void test_write_file(const char *directory, const char *name, const char *contents);
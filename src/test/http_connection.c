@@ -0,0 +1,979 @@
+#include "test/http_connection.h"
+#include "http/connection.h"
+#include "test/allocations.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Answers every request with a body of "ok", and counts how many it's seen.
+static void respond_ok(void *userdata, const HttpRequest *request, HttpResponse *response) {
+	(void) request;
+
+	size_t *requests_count = (size_t*) userdata;
+	*requests_count += 1;
+
+	http_response_set_status(response, HTTP_OK);
+	(void) http_response_end_with_body(response, slice_from_cstr("ok"));
+}
+
+static uint8_t big_body[4096];
+
+// Answers every request with `big_body`, without copying it.
+static void respond_big(void *userdata, const HttpRequest *request, HttpResponse *response) {
+	(void) userdata;
+	(void) request;
+
+	http_response_set_status(response, HTTP_OK);
+	(void) http_response_end_with_borrowed_body(
+		response,
+		slice_from_len(big_body, sizeof(big_body))
+	);
+}
+
+// Answers every request with a response prepared in `userdata`, with a body
+// of "ok".
+static void respond_prepared(void *userdata, const HttpRequest *request, HttpResponse *response) {
+	(void) request;
+
+	Buffer *head = (Buffer*) userdata;
+	(void) http_response_end_prepared(response, buffer_slice(head), slice_from_cstr("ok"));
+}
+
+// Answers every request with the file descriptor in `userdata`, which is
+// expected to hold "file contents".
+static void respond_file(void *userdata, const HttpRequest *request, HttpResponse *response) {
+	(void) request;
+
+	int fd = *(int*) userdata;
+
+	Buffer head;
+	buffer_init(&head);
+	(void) http_response_head_begin(&head, HTTP_OK);
+	(void) http_response_head_end(&head, strlen("file contents"));
+
+	// `head` is short enough to be copied.
+	(void) http_response_end_prepared_with_file(response, buffer_slice(&head), fd, strlen("file contents"));
+
+	buffer_deinit(&head);
+}
+
+// Answers every request with a copy of a body as long as `userdata` says.
+static void respond_copied(void *userdata, const HttpRequest *request, HttpResponse *response) {
+	(void) request;
+
+	size_t len = *(size_t*) userdata;
+
+	Buffer body;
+	buffer_init(&body);
+	if (buffer_reserve_additional(&body, len) == ERR_SUCCESS) {
+		memset(body.bytes, 'c', len);
+		body.len = len;
+	}
+
+	http_response_set_status(response, HTTP_OK);
+	(void) http_response_end_with_body(response, buffer_slice(&body));
+
+	buffer_deinit(&body);
+}
+
+// Returns true if the pending output of `connection` contains `needle`.
+static bool output_contains(HttpConnection *connection, const char *needle) {
+	struct iovec iovecs[HTTP_OUTPUT_MAX_SEGMENTS];
+	size_t iovecs_count = http_output_pending_iovecs(
+		&connection->output,
+		iovecs,
+		HTTP_OUTPUT_MAX_SEGMENTS
+	);
+
+	Buffer output;
+	buffer_init(&output);
+	for (size_t i = 0; i < iovecs_count; i++) {
+		(void) buffer_concat(&output, slice_from_len(iovecs[i].iov_base, iovecs[i].iov_len));
+	}
+
+	size_t needle_len = strlen(needle);
+
+	bool found = false;
+	for (size_t i = 0; i + needle_len <= output.len; i++) {
+		if (memcmp(output.bytes + i, needle, needle_len) == 0) {
+			found = true;
+			break;
+		}
+	}
+
+	buffer_deinit(&output);
+
+	return found;
+}
+
+// Answers every request with a chunked body: "a" written a hundred times, and
+// then more than a chunk's worth of "b" in one go.
+static void respond_chunks(void *userdata, const HttpRequest *request, HttpResponse *response) {
+	(void) userdata;
+	(void) request;
+
+	http_response_set_status(response, HTTP_OK);
+	for (int i = 0; i < 100; i++) {
+		(void) http_response_write_chunk(response, slice_from_cstr("a"));
+	}
+
+	static uint8_t b[HTTP_RESPONSE_CHUNK_SIZE];
+	memset(b, 'b', sizeof(b));
+	(void) http_response_write_chunk(response, slice_from_len(b, sizeof(b)));
+
+	(void) http_response_end(response);
+}
+
+// A body streamed a thousand bytes at a time.
+typedef struct TestStream {
+	size_t len;
+	size_t produced;
+	size_t releases_count;
+} TestStream;
+
+#define TEST_STREAM_PIECE 1000
+
+static Error produce_stream(void *data, HttpResponse *response) {
+	TestStream *stream = (TestStream*) data;
+
+	if (stream->produced == stream->len) return http_response_end(response);
+
+	static uint8_t piece[TEST_STREAM_PIECE];
+	memset(piece, 's', sizeof(piece));
+
+	size_t len = stream->len - stream->produced;
+	if (len > sizeof(piece)) len = sizeof(piece);
+
+	stream->produced += len;
+
+	return http_response_write_chunk(response, slice_from_len(piece, len));
+}
+
+static void release_stream(void *data) {
+	TestStream *stream = (TestStream*) data;
+	stream->releases_count += 1;
+}
+
+// Streams the `TestStream` in `userdata`.
+static void respond_stream(void *userdata, const HttpRequest *request, HttpResponse *response) {
+	(void) request;
+
+	http_response_set_status(response, HTTP_OK);
+	(void) http_response_stream(response, produce_stream, release_stream, userdata);
+}
+
+// Decode the chunked body in `*bytes` as far as it goes, taking complete chunks
+// off the front and counting their bytes in `*out_len`. Returns true once the
+// last chunk has been seen, and false if the framing is wrong or incomplete.
+static bool take_chunks(Slice *bytes, size_t *out_len, bool *out_malformed) {
+	*out_malformed = false;
+
+	while (bytes->len > 0) {
+		size_t size = 0;
+		size_t index = 0;
+		while (index < bytes->len && isxdigit(bytes->bytes[index])) {
+			uint8_t digit = bytes->bytes[index];
+			size = size * 16 + (isdigit(digit) ? digit - '0' : (digit | 0x20) - 'a' + 10);
+			index += 1;
+		}
+
+		if (index == 0 || index + 2 + size + 2 > bytes->len) {
+			*out_malformed = index == 0;
+			return false;
+		}
+		if (memcmp(bytes->bytes + index, "\r\n", 2) != 0 || memcmp(bytes->bytes + index + 2 + size, "\r\n", 2) != 0) {
+			*out_malformed = true;
+			return false;
+		}
+
+		*bytes = slice_remove_start(*bytes, index + 2 + size + 2);
+		*out_len += size;
+
+		if (size == 0) return true;
+	}
+
+	return false;
+}
+
+// Returns everything pending in the output of `connection`, NUL-terminated.
+static void pending_output(HttpConnection *connection, Buffer *out) {
+	struct iovec iovecs[HTTP_OUTPUT_MAX_SEGMENTS];
+	size_t iovecs_count = http_output_pending_iovecs(&connection->output, iovecs, HTTP_OUTPUT_MAX_SEGMENTS);
+
+	for (size_t i = 0; i < iovecs_count; i++) {
+		(void) buffer_concat(out, slice_from_len(iovecs[i].iov_base, iovecs[i].iov_len));
+	}
+	(void) buffer_concat(out, slice_from_len((uint8_t*) "\x00", 1));
+}
+
+// Pretend all pending output of `connection` was written to the socket.
+static void drain_output(HttpConnection *connection) {
+	http_connection_consume_output(
+		connection,
+		http_connection_pending_output_len(connection)
+	);
+}
+
+void test_http_connection(TestContext *ctx) {
+	HttpConnection connection;
+	size_t requests_count;
+	Error err;
+
+	test(ctx, "http_connection: HTTP/1.1 keeps the connection alive");
+	{
+		requests_count = 0;
+		http_connection_init(&connection);
+
+		for (int i = 0; i < 3; i++) {
+			err = http_connection_receive(
+				&connection,
+				slice_from_cstr("GET / HTTP/1.1\r\nHost: example.com\r\n\r\n"),
+				respond_ok,
+				&requests_count
+			);
+			EXPECT(ctx, err == ERR_SUCCESS);
+			EXPECT(ctx, output_contains(&connection, "\r\n\r\nok"));
+			EXPECT(ctx, !output_contains(&connection, "Connection:"));
+			EXPECT(ctx, !connection.closing);
+
+			drain_output(&connection);
+		}
+
+		EXPECT(ctx, requests_count == 3);
+		EXPECT(ctx, !http_connection_finished(&connection));
+
+		http_connection_deinit(&connection);
+	}
+
+	test(ctx, "http_connection: Connection: close");
+	{
+		requests_count = 0;
+		http_connection_init(&connection);
+
+		err = http_connection_receive(
+			&connection,
+			slice_from_cstr("GET / HTTP/1.1\r\nConnection: close\r\n\r\n"),
+			respond_ok,
+			&requests_count
+		);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, output_contains(&connection, "Connection: close\r\n"));
+		EXPECT(ctx, connection.closing);
+
+		drain_output(&connection);
+		EXPECT(ctx, http_connection_finished(&connection));
+
+		http_connection_deinit(&connection);
+	}
+
+	test(ctx, "http_connection: HTTP/1.0 closes unless asked not to");
+	{
+		requests_count = 0;
+		http_connection_init(&connection);
+
+		err = http_connection_receive(
+			&connection,
+			slice_from_cstr("GET / HTTP/1.0\r\nConnection: Keep-Alive\r\n\r\n"),
+			respond_ok,
+			&requests_count
+		);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, output_contains(&connection, "Connection: keep-alive\r\n"));
+		EXPECT(ctx, !connection.closing);
+
+		drain_output(&connection);
+
+		err = http_connection_receive(
+			&connection,
+			slice_from_cstr("GET / HTTP/1.0\r\n\r\n"),
+			respond_ok,
+			&requests_count
+		);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, output_contains(&connection, "Connection: close\r\n"));
+		EXPECT(ctx, connection.closing);
+
+		http_connection_deinit(&connection);
+	}
+
+	test(ctx, "http_connection: leftover bytes start the next request");
+	{
+		requests_count = 0;
+		http_connection_init(&connection);
+
+		err = http_connection_receive(
+			&connection,
+			slice_from_cstr("GET /a HTTP/1.1\r\n\r\nGET /b HT"),
+			respond_ok,
+			&requests_count
+		);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, requests_count == 1);
+
+		drain_output(&connection);
+
+		err = http_connection_receive(
+			&connection,
+			slice_from_cstr("TP/1.1\r\n\r\n"),
+			respond_ok,
+			&requests_count
+		);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, requests_count == 2);
+		EXPECT(ctx, !http_connection_has_buffered_input(&connection));
+
+		http_connection_deinit(&connection);
+	}
+
+	test(ctx, "http_connection: pipelined requests are answered together");
+	{
+		requests_count = 0;
+		http_connection_init(&connection);
+
+		err = http_connection_receive(
+			&connection,
+			slice_from_cstr(
+				"GET /a HTTP/1.1\r\n\r\n"
+				"GET /b HTTP/1.1\r\n\r\n"
+				"GET /c HTTP/1.1\r\nConnection: close\r\n\r\n"
+				"GET /ignored HTTP/1.1\r\n\r\n"
+			),
+			respond_ok,
+			&requests_count
+		);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, requests_count == 3);
+		EXPECT(ctx, connection.closing);
+		EXPECT(ctx, output_contains(
+			&connection,
+			"ok"
+			"HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok"
+			"HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: close\r\n\r\nok"
+		));
+
+		http_connection_deinit(&connection);
+	}
+
+	test(ctx, "http_connection: pipelining stops when output piles up");
+	{
+		requests_count = 0;
+		http_connection_init(&connection);
+
+		Buffer requests;
+		buffer_init(&requests);
+
+		size_t sent_count = HTTP_CONNECTION_MAX_BATCH_OUTPUT;
+		for (size_t i = 0; i < sent_count; i++) {
+			(void) buffer_concat(&requests, slice_from_cstr("GET / HTTP/1.1\r\n\r\n"));
+		}
+
+		err = http_connection_receive(&connection, buffer_slice(&requests), respond_ok, &requests_count);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, requests_count < sent_count);
+		EXPECT(ctx, http_connection_has_buffered_input(&connection));
+
+		while (http_connection_has_buffered_input(&connection)) {
+			drain_output(&connection);
+
+			err = http_connection_receive(&connection, slice_new(), respond_ok, &requests_count);
+			if (err != ERR_SUCCESS) break;
+		}
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, requests_count == sent_count);
+
+		buffer_deinit(&requests);
+		http_connection_deinit(&connection);
+	}
+
+	test(ctx, "http_connection: borrowed bodies are gathered, not copied");
+	{
+		http_connection_init(&connection);
+
+		err = http_connection_receive(
+			&connection,
+			slice_from_cstr("GET / HTTP/1.1\r\n\r\nGET / HTTP/1.1\r\n\r\n"),
+			respond_big,
+			NULL
+		);
+		EXPECT(ctx, err == ERR_SUCCESS);
+
+		struct iovec iovecs[HTTP_OUTPUT_MAX_SEGMENTS];
+		size_t iovecs_count = http_output_pending_iovecs(
+			&connection.output,
+			iovecs,
+			HTTP_OUTPUT_MAX_SEGMENTS
+		);
+
+		// Headers, body, headers, body.
+		EXPECT(ctx, iovecs_count == 4);
+		EXPECT(ctx, iovecs[1].iov_base == big_body);
+		EXPECT(ctx, iovecs[3].iov_base == big_body);
+		EXPECT(ctx, output_contains(&connection, "Content-Length: 4096\r\n\r\n"));
+
+		// Stop partway through the first body.
+		size_t headers_len = iovecs[0].iov_len;
+		http_connection_consume_output(&connection, headers_len + 100);
+
+		iovecs_count = http_output_pending_iovecs(
+			&connection.output,
+			iovecs,
+			HTTP_OUTPUT_MAX_SEGMENTS
+		);
+		EXPECT(ctx, iovecs_count == 3);
+		EXPECT(ctx, iovecs[0].iov_base == big_body + 100);
+		EXPECT(ctx, iovecs[0].iov_len == sizeof(big_body) - 100);
+		EXPECT(ctx, http_connection_pending_output_len(&connection) == headers_len + sizeof(big_body) * 2 - 100);
+
+		drain_output(&connection);
+		EXPECT(ctx, http_connection_pending_output_len(&connection) == 0);
+
+		http_connection_deinit(&connection);
+	}
+
+	test(ctx, "http_connection: prepared responses");
+	{
+		http_connection_init(&connection);
+
+		Buffer head;
+		buffer_init(&head);
+		err = http_response_head_begin(&head, HTTP_OK);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		err = http_response_head_add_header(&head, slice_from_cstr("Content-Type"), slice_from_cstr("text/plain"));
+		EXPECT(ctx, err == ERR_SUCCESS);
+		err = http_response_head_end(&head, 2);
+		EXPECT(ctx, err == ERR_SUCCESS);
+
+		err = http_connection_receive(
+			&connection,
+			slice_from_cstr(
+				"GET / HTTP/1.1\r\n\r\n"
+				"HEAD / HTTP/1.1\r\n\r\n"
+				"GET / HTTP/1.1\r\nConnection: close\r\n\r\n"
+			),
+			respond_prepared,
+			&head
+		);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, output_contains(
+			&connection,
+			"HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 2\r\n\r\nok"
+			"HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 2\r\n\r\n"
+			"HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 2\r\nConnection: close\r\n\r\nok"
+		));
+
+		buffer_deinit(&head);
+		http_connection_deinit(&connection);
+	}
+
+	test(ctx, "http_connection: requests don't allocate once warmed up");
+	{
+		http_connection_init(&connection);
+
+		Buffer head;
+		buffer_init(&head);
+		(void) http_response_head_begin(&head, HTTP_OK);
+		(void) http_response_head_end(&head, 2);
+
+		size_t allocations_before = 0;
+		bool all_succeeded = true;
+
+		// The first rounds grow every buffer to the size it needs to be.
+		for (int round = 0; round < 100; round++) {
+			if (round == 10) allocations_before = test_allocations_count();
+
+			// One request completes along with the start of another.
+			err = http_connection_receive(
+				&connection,
+				slice_from_cstr("GET / HTTP/1.1\r\nHost: example.com\r\n\r\nGET /a"),
+				respond_prepared,
+				&head
+			);
+			if (err != ERR_SUCCESS) all_succeeded = false;
+
+			err = http_connection_receive(
+				&connection,
+				slice_from_cstr(" HTTP/1.1\r\n\r\n"),
+				respond_prepared,
+				&head
+			);
+			if (err != ERR_SUCCESS) all_succeeded = false;
+
+			drain_output(&connection);
+		}
+
+		EXPECT(ctx, all_succeeded);
+		EXPECT(ctx, test_allocations_count() == allocations_before);
+
+		buffer_deinit(&head);
+		http_connection_deinit(&connection);
+	}
+
+	test(ctx, "http_connection: file bodies are sent with sendfile");
+	{
+		http_connection_init(&connection);
+
+		FILE *file = tmpfile();
+		EXPECT(ctx, file != NULL);
+		fputs("file contents", file);
+		fflush(file);
+
+		int file_fd = fileno(file);
+
+		int sockets[2];
+		EXPECT(ctx, socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+
+		err = http_connection_receive(
+			&connection,
+			slice_from_cstr("GET / HTTP/1.1\r\n\r\nGET / HTTP/1.1\r\n\r\n"),
+			respond_file,
+			&file_fd
+		);
+		EXPECT(ctx, err == ERR_SUCCESS);
+
+		bool blocked;
+		err = http_connection_send(&connection, sockets[0], &blocked);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, !blocked);
+		EXPECT(ctx, http_connection_pending_output_len(&connection) == 0);
+
+		const char *expected =
+			"HTTP/1.1 200 OK\r\nContent-Length: 13\r\n\r\nfile contents"
+			"HTTP/1.1 200 OK\r\nContent-Length: 13\r\n\r\nfile contents";
+
+		char received[256];
+		size_t received_len = 0;
+		while (received_len < strlen(expected)) {
+			ssize_t amount_read = read(sockets[1], received + received_len, sizeof(received) - received_len);
+			if (amount_read <= 0) break;
+
+			received_len += amount_read;
+		}
+		EXPECT(ctx, received_len == strlen(expected));
+		EXPECT(ctx, memcmp(received, expected, strlen(expected)) == 0);
+
+		close(sockets[0]);
+		close(sockets[1]);
+		fclose(file);
+		http_connection_deinit(&connection);
+	}
+
+	test(ctx, "http_connection: request bodies are skipped, not taken for requests");
+	{
+		requests_count = 0;
+		http_connection_init(&connection);
+
+		err = http_connection_receive(
+			&connection,
+			slice_from_cstr(
+				"POST /a HTTP/1.1\r\nContent-Length: 24\r\n\r\n"
+				"GET /secret HTTP/1.1\r\n\r\n"
+				"GET /b HTTP/1.1\r\n\r\n"
+			),
+			respond_ok,
+			&requests_count
+		);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, requests_count == 2);
+		EXPECT(ctx, !http_connection_has_buffered_input(&connection));
+		EXPECT(ctx, !http_connection_reading_request(&connection));
+
+		drain_output(&connection);
+
+		// A body that arrives a piece at a time.
+		err = http_connection_receive(
+			&connection,
+			slice_from_cstr("POST /c HTTP/1.1\r\nContent-Length: 24\r\n\r\nGET /se"),
+			respond_ok,
+			&requests_count
+		);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, requests_count == 3);
+		EXPECT(ctx, http_connection_reading_request(&connection));
+
+		drain_output(&connection);
+
+		// The rest of it read straight into the parser.
+		Slice rest = slice_from_cstr("cret HTTP/1.1\r\n\r\nGET /d HTTP/1.1\r\n\r\n");
+		Slice space;
+		err = http_connection_reserve(&connection, &space);
+		EXPECT(ctx, err == ERR_SUCCESS && space.len >= rest.len);
+		memcpy(space.bytes, rest.bytes, rest.len);
+
+		err = http_connection_commit(&connection, rest.len, respond_ok, &requests_count);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, requests_count == 4);
+		EXPECT(ctx, !http_connection_has_buffered_input(&connection));
+
+		http_connection_deinit(&connection);
+	}
+
+	test(ctx, "http_connection: bodies that can't be skipped are turned away");
+	{
+		static const struct {
+			const char *request;
+			const char *status_line;
+		} cases[] = {
+			{
+				"POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n\r\n",
+				"HTTP/1.1 501 Not Implemented\r\n",
+			},
+			{
+				"POST / HTTP/1.1\r\nContent-Length: 1, 1\r\n\r\nx",
+				"HTTP/1.1 400 Bad Request\r\n",
+			},
+			{
+				"POST / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\nxx",
+				"HTTP/1.1 400 Bad Request\r\n",
+			},
+			{
+				"POST / HTTP/1.1\r\nContent-Length: 99999999999999999999999\r\n\r\n",
+				"HTTP/1.1 400 Bad Request\r\n",
+			},
+		};
+
+		for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+			requests_count = 0;
+			http_connection_init(&connection);
+
+			err = http_connection_receive(
+				&connection,
+				slice_from_cstr(cases[i].request),
+				respond_ok,
+				&requests_count
+			);
+			EXPECT(ctx, err == ERR_SUCCESS);
+			EXPECT(ctx, requests_count == 0);
+			EXPECT(ctx, output_contains(&connection, cases[i].status_line));
+			EXPECT(ctx, connection.closing);
+
+			http_connection_deinit(&connection);
+		}
+	}
+
+	test(ctx, "http_connection: malformed request");
+	{
+		requests_count = 0;
+		http_connection_init(&connection);
+
+		err = http_connection_receive(
+			&connection,
+			slice_from_cstr("GET / HTTP/1.1\r\n Header: Value\r\n\r\n"),
+			respond_ok,
+			&requests_count
+		);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, requests_count == 0);
+		EXPECT(ctx, output_contains(&connection, "HTTP/1.1 400 Bad Request\r\n"));
+		EXPECT(ctx, output_contains(&connection, "Connection: close\r\n"));
+		EXPECT(ctx, connection.closing);
+
+		http_connection_deinit(&connection);
+	}
+
+	HttpParserLimits default_limits = http_parser_get_limits();
+
+	test(ctx, "http_connection: requests past the limits are turned away");
+	{
+		HttpParserLimits limits = default_limits;
+		limits.max_request_line = 64;
+		limits.max_head = 256;
+		limits.max_headers = 4;
+		http_parser_set_limits(limits);
+
+		static const struct {
+			const char *request;
+			const char *status_line;
+		} cases[] = {
+			{
+				"GET /aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa HTTP/1.1\r\n\r\n",
+				"HTTP/1.1 414 URI Too Long\r\n",
+			},
+			{
+				"GET / HTTP/1.1\r\nCookie: aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\r\n\r\n",
+				"HTTP/1.1 431 Request Header Fields Too Large\r\n",
+			},
+			{
+				"GET / HTTP/1.1\r\nA: 1\r\nB: 2\r\nC: 3\r\nD: 4\r\nE: 5\r\n\r\n",
+				"HTTP/1.1 431 Request Header Fields Too Large\r\n",
+			},
+		};
+
+		for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+			requests_count = 0;
+			http_connection_init(&connection);
+
+			// A byte at a time, so that nothing past the limits is held.
+			Slice request = slice_from_cstr(cases[i].request);
+			for (size_t j = 0; j < request.len && !connection.closing; j++) {
+				err = http_connection_receive(
+					&connection,
+					slice_from_len(request.bytes + j, 1),
+					respond_ok,
+					&requests_count
+				);
+				if (err != ERR_SUCCESS) break;
+			}
+
+			EXPECT(ctx, err == ERR_SUCCESS);
+			EXPECT(ctx, requests_count == 0);
+			EXPECT(ctx, output_contains(&connection, cases[i].status_line));
+			EXPECT(ctx, connection.closing);
+			EXPECT(ctx, connection.parser.buffer.len <= limits.max_head + 1);
+
+			http_connection_deinit(&connection);
+		}
+
+		http_parser_set_limits(default_limits);
+	}
+
+	test(ctx, "http_connection: reads past the memory budget are turned away");
+	{
+		HttpConnection other;
+		http_connection_init(&other);
+
+		// The other connection takes up all of the budget.
+		Slice space;
+		err = http_connection_reserve(&other, &space);
+		EXPECT(ctx, err == ERR_SUCCESS && space.len > 0);
+
+		HttpParserLimits limits = default_limits;
+		limits.memory_budget = http_parser_memory_used();
+		http_parser_set_limits(limits);
+
+		http_connection_init(&connection);
+
+		err = http_connection_reserve(&connection, &space);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, space.len == 0);
+		EXPECT(ctx, output_contains(&connection, "HTTP/1.1 503 Service Unavailable\r\n"));
+		EXPECT(ctx, connection.closing);
+
+		http_connection_deinit(&connection);
+
+		// So are bytes that have to be copied in behind requests that are
+		// waiting for output to be written.
+		http_parser_set_limits(default_limits);
+		http_connection_init(&connection);
+
+		Buffer requests;
+		buffer_init(&requests);
+		for (size_t i = 0; i <= HTTP_CONNECTION_MAX_BATCH_OUTPUT / sizeof(big_body); i++) {
+			(void) buffer_concat(&requests, slice_from_cstr("GET / HTTP/1.1\r\n\r\n"));
+		}
+
+		err = http_connection_receive(&connection, buffer_slice(&requests), respond_big, NULL);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, http_connection_has_buffered_input(&connection));
+
+		buffer_deinit(&requests);
+
+		limits.memory_budget = http_parser_memory_used();
+		http_parser_set_limits(limits);
+
+		static uint8_t header[HTTP_PARSER_MAX_READ_SIZE];
+		memset(header, 'a', sizeof(header));
+		err = http_connection_receive(&connection, slice_from_len(header, sizeof(header)), respond_big, NULL);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, output_contains(&connection, "HTTP/1.1 503 Service Unavailable\r\n"));
+		EXPECT(ctx, connection.closing);
+
+		http_connection_deinit(&connection);
+
+		// Which it gives back when it's done.
+		size_t used = http_parser_memory_used();
+		http_connection_deinit(&other);
+		EXPECT(ctx, http_parser_memory_used() < used);
+
+		http_parser_set_limits(default_limits);
+	}
+
+	test(ctx, "http_connection: output grown for one big response is freed once it's written");
+	{
+		http_connection_init(&connection);
+
+		size_t len = 4 * HTTP_OUTPUT_MAX_RETAINED;
+		err = http_connection_receive(&connection, slice_from_cstr("GET / HTTP/1.1\r\n\r\n"), respond_copied, &len);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, http_connection_pending_output_len(&connection) > len);
+
+		// Written a bit at a time, as a slow client would take it.
+		while (http_connection_pending_output_len(&connection) > 0) {
+			size_t pending = http_connection_pending_output_len(&connection);
+			http_connection_consume_output(&connection, pending < 1000 ? pending : 1000);
+		}
+		EXPECT(ctx, connection.output.bytes.capacity <= HTTP_OUTPUT_MAX_RETAINED);
+
+		// Small responses keep theirs, to be reused.
+		len = 100;
+		err = http_connection_receive(&connection, slice_from_cstr("GET / HTTP/1.1\r\n\r\n"), respond_copied, &len);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		drain_output(&connection);
+		EXPECT(ctx, connection.output.bytes.capacity > 0);
+
+		http_connection_deinit(&connection);
+	}
+
+	test(ctx, "http_connection: small chunks are sent together");
+	{
+		http_connection_init(&connection);
+
+		err = http_connection_receive(&connection, slice_from_cstr("GET / HTTP/1.1\r\n\r\n"), respond_chunks, NULL);
+		EXPECT(ctx, err == ERR_SUCCESS);
+
+		Buffer output;
+		buffer_init(&output);
+		pending_output(&connection, &output);
+
+		const char *text = (const char*) output.bytes;
+		EXPECT(ctx, strstr(text, "Transfer-Encoding: chunked\r\n") != NULL);
+		EXPECT(ctx, strstr(text, "Content-Length") == NULL);
+
+		// The hundred "a"s are one chunk, and the "b"s another.
+		const char *body = strstr(text, "\r\n\r\n");
+		EXPECT(ctx, body != NULL && strncmp(body, "\r\n\r\n64\r\naaaa", strlen("\r\n\r\n64\r\naaaa")) == 0);
+		EXPECT(ctx, strstr(text, "a\r\n4000\r\nbbbb") != NULL);
+		EXPECT(ctx, output.len > 5 && strcmp(text + output.len - 1 - 7, "\r\n0\r\n\r\n") == 0);
+
+		EXPECT(ctx, !connection.closing);
+
+		buffer_deinit(&output);
+		http_connection_deinit(&connection);
+	}
+
+	test(ctx, "http_connection: streamed bodies are produced as the client keeps up");
+	{
+		TestStream stream = { .len = 1024 * 1024 };
+
+		http_connection_init(&connection);
+
+		// Pipelined behind the stream, and answered once it's done.
+		requests_count = 0;
+		err = http_connection_receive(&connection, slice_from_cstr("GET /stream HTTP/1.1\r\n\r\n"), respond_stream, &stream);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		err = http_connection_receive(&connection, slice_from_cstr("GET / HTTP/1.1\r\n\r\n"), respond_ok, &requests_count);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, requests_count == 0);
+
+		Buffer output;
+		buffer_init(&output);
+
+		// The first batch goes out with the headers.
+		size_t most_pending = http_connection_pending_output_len(&connection);
+
+		pending_output(&connection, &output);
+		const char *body = strstr((const char*) output.bytes, "\r\n\r\n");
+		EXPECT(ctx, strstr((const char*) output.bytes, "Transfer-Encoding: chunked\r\n") != NULL);
+		EXPECT(ctx, body != NULL);
+		drain_output(&connection);
+
+		// Everything the client has read of the body, of which the first
+		// `decoded` bytes are complete chunks.
+		Buffer received;
+		buffer_init(&received);
+		if (body != NULL) (void) buffer_concat(&received, slice_from_cstr(body + strlen("\r\n\r\n")));
+		size_t decoded = 0;
+
+		size_t body_len = 0;
+		bool ended = false;
+		bool malformed = false;
+
+		// The client reads everything, every time.
+		while (true) {
+			Slice chunks = slice_remove_start(buffer_slice(&received), decoded);
+			ended = take_chunks(&chunks, &body_len, &malformed);
+			decoded = received.len - chunks.len;
+
+			if (ended || malformed || !http_connection_has_buffered_input(&connection)) break;
+
+			err = http_connection_receive(&connection, slice_new(), respond_ok, &requests_count);
+			if (err != ERR_SUCCESS) break;
+
+			size_t pending = http_connection_pending_output_len(&connection);
+			if (pending > most_pending) most_pending = pending;
+
+			buffer_clear(&output);
+			pending_output(&connection, &output);
+			(void) buffer_concat(&received, slice_from_len(output.bytes, output.len - 1));
+			drain_output(&connection);
+		}
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, ended && !malformed);
+		EXPECT(ctx, body_len == stream.len);
+		EXPECT(ctx, stream.releases_count == 1);
+
+		// Never more than a batch, and whatever chunk was being put together.
+		EXPECT(ctx, most_pending > 0);
+		EXPECT(ctx, most_pending <= HTTP_CONNECTION_MAX_BATCH_OUTPUT + HTTP_RESPONSE_CHUNK_SIZE + 64);
+
+		// The request behind it went out with the end of the body.
+		EXPECT(ctx, requests_count == 1);
+		EXPECT(ctx, !connection.closing);
+
+		buffer_deinit(&received);
+		buffer_deinit(&output);
+		http_connection_deinit(&connection);
+	}
+
+	test(ctx, "http_connection: streams let go when the connection does");
+	{
+		TestStream stream = { .len = 1024 * 1024 };
+
+		http_connection_init(&connection);
+
+		err = http_connection_receive(&connection, slice_from_cstr("GET / HTTP/1.1\r\n\r\n"), respond_stream, &stream);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		drain_output(&connection);
+		err = http_connection_receive(&connection, slice_new(), respond_stream, &stream);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, stream.produced > 0 && stream.produced < stream.len);
+		EXPECT(ctx, stream.releases_count == 0);
+
+		http_connection_deinit(&connection);
+		EXPECT(ctx, stream.releases_count == 1);
+	}
+
+	test(ctx, "http_connection: HTTP/1.0 streams end with the connection");
+	{
+		TestStream stream = { .len = 3000 };
+
+		http_connection_init(&connection);
+
+		err = http_connection_receive(&connection, slice_from_cstr("GET / HTTP/1.0\r\nConnection: keep-alive\r\n\r\n"), respond_stream, &stream);
+		EXPECT(ctx, err == ERR_SUCCESS);
+
+		// The body as it is, with nothing after it.
+		Buffer output;
+		buffer_init(&output);
+		pending_output(&connection, &output);
+		const char *body = strstr((const char*) output.bytes, "\r\n\r\n");
+		EXPECT(ctx, strstr((const char*) output.bytes, "Connection: close\r\n") != NULL);
+		EXPECT(ctx, strstr((const char*) output.bytes, "Transfer-Encoding") == NULL);
+		EXPECT(ctx, body != NULL && strlen(body + strlen("\r\n\r\n")) == stream.len);
+		buffer_deinit(&output);
+
+		EXPECT(ctx, connection.closing);
+		EXPECT(ctx, stream.releases_count == 1);
+
+		http_connection_deinit(&connection);
+	}
+
+	test(ctx, "http_connection: HEAD requests aren't streamed");
+	{
+		TestStream stream = { .len = 3000 };
+
+		http_connection_init(&connection);
+
+		err = http_connection_receive(&connection, slice_from_cstr("HEAD / HTTP/1.1\r\n\r\n"), respond_stream, &stream);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, output_contains(&connection, "Transfer-Encoding: chunked\r\n\r\n"));
+		EXPECT(ctx, !output_contains(&connection, "0\r\n\r\n"));
+		EXPECT(ctx, stream.produced == 0);
+		EXPECT(ctx, stream.releases_count == 1);
+		EXPECT(ctx, !http_connection_has_buffered_input(&connection));
+
+		http_connection_deinit(&connection);
+	}
+}
@@ -2,6 +2,28 @@
 #include "http/parser.h"
 
 #include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+	const char *key;
+	const char *value;
+} Header;
+
+// Returns true if `request` has exactly `headers`, which end with an empty
+// one, in order.
+static bool has_headers(const HttpRequest *request, const Header *headers) {
+	size_t count = 0;
+	while (headers[count].key != NULL) count++;
+
+	if (request->headers_count != count) return false;
+
+	for (size_t i = 0; i < count; i++) {
+		if (!slice_equal(request->headers[i].name, slice_from_cstr(headers[i].key))) return false;
+		if (!slice_equal(request->headers[i].value, slice_from_cstr(headers[i].value))) return false;
+	}
+
+	return true;
+}
 
 void test_http_parser(TestContext *ctx) {
 	test(ctx, "http_parser");
@@ -10,10 +32,6 @@ void test_http_parser(TestContext *ctx) {
 		BAD,
 		INCOMPLETE
 	} Result;
-	typedef struct {
-		const char *key;
-		const char *value;
-	} Header;
 	struct {
 		const char *title;
 
@@ -187,6 +205,62 @@ void test_http_parser(TestContext *ctx) {
 
 			.trailing = "POST / HTTP/1.2\r\nheader2: header2\r\n",
 		},
+		{
+			"well-known headers",
+
+			GOOD,
+			"GET", "/", "HTTP/1.1",
+			(Header[]) {
+				{ "Host", "example.com" },
+				{ "accept-encoding", "gzip, br" },
+				{ "X-Other", "x" },
+				{ "If-None-Match", "\"a\", \"b\"" },
+				{ "Range", "bytes=0-99" },
+				{ "Connection", "keep-alive" },
+				{ "Connection", "close" },
+				{ "Content-Length", "0" },
+				{ 0 },
+			},
+
+			"GET / HTTP/1.1\r\n"
+			"Host: example.com\r\n"
+			"accept-encoding: gzip, br\r\n"
+			"X-Other: x\r\n"
+			"If-None-Match: \"a\", \"b\"\r\n"
+			"Range: bytes=0-99\r\n"
+			"Connection: keep-alive\r\n"
+			"Connection: close\r\n"
+			"Content-Length: 0\r\n"
+			"\r\n",
+
+			NULL
+		},
+
+		// Only lists can be sent more than once.
+		{
+			"duplicate Host",
+
+			BAD,
+			NULL, NULL, NULL, (Header[]) { 0 },
+			"GET / HTTP/1.1\r\n"
+			"Host: a\r\n"
+			"host: b\r\n"
+			"\r\n",
+
+			NULL
+		},
+		{
+			"duplicate Content-Length",
+
+			BAD,
+			NULL, NULL, NULL, (Header[]) { 0 },
+			"POST / HTTP/1.1\r\n"
+			"Content-Length: 0\r\n"
+			"Content-Length: 10\r\n"
+			"\r\n",
+
+			NULL
+		},
 	};
 
 	Error err;
@@ -217,6 +291,11 @@ void test_http_parser(TestContext *ctx) {
 			}
 
 			EXPECT(ctx, slice_equal(result.remainder_slice, trailing));
+
+			EXPECT(ctx, slice_equal(result.request.method, slice_from_cstr(cases[i].method)));
+			EXPECT(ctx, slice_equal(result.request.target, slice_from_cstr(cases[i].path)));
+			EXPECT(ctx, slice_equal(result.request.version, slice_from_cstr(cases[i].version)));
+			EXPECT(ctx, has_headers(&result.request, cases[i].headers));
 			break;
 		}
 
@@ -275,6 +354,7 @@ void test_http_parser(TestContext *ctx) {
 			}
 
 			EXPECT(ctx, slice_equal(remainder, trailing));
+			EXPECT(ctx, has_headers(&result.request, cases[i].headers));
 			break;
 		}
 
@@ -296,6 +376,115 @@ void test_http_parser(TestContext *ctx) {
 
 		http_parser_deinit(&parser);
 	}
-}
 
+	test(ctx, "http_parser: well-known headers have fields of their own");
+	{
+		http_parser_init(&parser);
+
+		HttpParserPollResult result;
+		err = http_parser_poll(&parser, slice_from_cstr(
+			"GET / HTTP/1.1\r\n"
+			"HOST: example.com\r\n"
+			"Connection: keep-alive\r\n"
+			"connection: close\r\n"
+			"Accept-Encoding: gzip\r\n"
+			"X-Forwarded-For: 10.0.0.1\r\n"
+			"\r\n"
+		), &result);
+
+		EXPECT(ctx, err == ERR_SUCCESS && result.done);
+		EXPECT(ctx, slice_equal(result.request.host, slice_from_cstr("example.com")));
+		EXPECT(ctx, slice_equal(result.request.connection, slice_from_cstr("keep-alive")));
+		EXPECT(ctx, slice_equal(result.request.accept_encoding, slice_from_cstr("gzip")));
+		EXPECT(ctx, result.request.range.len == 0);
+		EXPECT(ctx, result.request.if_none_match.len == 0);
+		EXPECT(ctx, result.request.content_length.len == 0);
+		EXPECT(ctx, result.request.body_len == 0);
+
+		Slice forwarded = http_request_header(&result.request, slice_from_cstr("x-forwarded-for"));
+		EXPECT(ctx, slice_equal(forwarded, slice_from_cstr("10.0.0.1")));
+		EXPECT(ctx, http_request_header(&result.request, slice_from_cstr("Cookie")).len == 0);
+
+		http_request_deinit(&result.request);
+		http_parser_deinit(&parser);
+	}
+
+	test(ctx, "http_parser: too many headers");
+	{
+		Buffer request;
+		buffer_init(&request);
+
+		(void) buffer_concat(&request, slice_from_cstr("GET / HTTP/1.1\r\n"));
+		for (int i = 0; i <= HTTP_REQUEST_MAX_HEADERS; i++) {
+			(void) buffer_concat_printf(&request, "X-Header-%d: %d\r\n", i, i);
+		}
+		(void) buffer_concat(&request, slice_from_cstr("\r\n"));
+
+		http_parser_init(&parser);
 
+		HttpParserPollResult result;
+		err = http_parser_poll(&parser, buffer_slice(&request), &result);
+		EXPECT(ctx, err == ERR_PARSE_FAILED);
+
+		http_parser_deinit(&parser);
+		buffer_deinit(&request);
+	}
+
+	test(ctx, "http_parser: reading straight into the parser");
+	{
+		http_parser_init(&parser);
+
+		// Two pipelined requests in one read, then one split across two.
+		const char *reads[] = {
+			"GET /a HTTP/1.1\r\nHost: x\r\n\r\nGET /b HTTP/1.1\r\n\r\nGET /c HT",
+			"TP/1.1\r\nHost: y\r\n\r\n",
+		};
+		const char *targets[] = { "/a", "/b", "/c" };
+
+		size_t targets_count = 0;
+		bool all_ok = true;
+
+		for (size_t i = 0; i < sizeof(reads) / sizeof(reads[0]); i++) {
+			Slice space;
+			err = http_parser_reserve(&parser, &space);
+			if (err != ERR_SUCCESS || space.len < HTTP_PARSER_MIN_READ_SIZE) all_ok = false;
+			if (err != ERR_SUCCESS) break;
+
+			memcpy(space.bytes, reads[i], strlen(reads[i]));
+			http_parser_commit(&parser, strlen(reads[i]));
+
+			while (true) {
+				HttpParserPollResult result;
+				err = http_parser_poll_buffered(&parser, &result);
+				if (err != ERR_SUCCESS) all_ok = false;
+				if (err != ERR_SUCCESS || !result.done) break;
+
+				if (
+					targets_count == sizeof(targets) / sizeof(targets[0]) ||
+					!slice_equal(result.request.target, slice_from_cstr(targets[targets_count]))
+				) {
+					all_ok = false;
+				}
+				targets_count += 1;
+
+				http_request_deinit(&result.request);
+				http_parser_reset(&parser);
+			}
+		}
+
+		EXPECT(ctx, all_ok);
+		EXPECT(ctx, targets_count == 3);
+		EXPECT(ctx, http_parser_unparsed_len(&parser) == 0);
+
+		// Reads that fill the space ask for more next time.
+		Slice space;
+		err = http_parser_reserve(&parser, &space);
+		EXPECT(ctx, err == ERR_SUCCESS);
+
+		size_t read_size = parser.read_size;
+		http_parser_commit(&parser, space.len);
+		EXPECT(ctx, parser.read_size == 2 * read_size);
+
+		http_parser_deinit(&parser);
+	}
+}
@@ -0,0 +1,115 @@
+#include "test/http_scan.h"
+#include "http/scan.h"
+
+#include <stdint.h>
+
+// Random inputs, mostly value bytes with the odd control character, so that
+// the end of a value turns up at every offset in a block.
+#define TEST_HTTP_SCAN_INPUTS 2000
+#define TEST_HTTP_SCAN_INPUT_MAX 200
+
+// xorshift64; the same inputs every run.
+static uint64_t next_random(uint64_t *state) {
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+
+	return x;
+}
+
+static bool is_token_byte(uint8_t byte) {
+	switch (byte) {
+	case '!':
+	case '#':
+	case '$':
+	case '%':
+	case '&':
+	case '\'':
+	case '*':
+	case '+':
+	case '-':
+	case '.':
+	case '^':
+	case '_':
+	case '`':
+	case '|':
+	case '~':
+		return true;
+	}
+
+	return
+		(byte >= '0' && byte <= '9') ||
+		(byte >= 'a' && byte <= 'z') ||
+		(byte >= 'A' && byte <= 'Z');
+}
+
+static bool has_class(uint8_t byte, HttpByteClass class) {
+	return (http_byte_classes[byte] & class) != 0;
+}
+
+void test_http_scan(TestContext *ctx) {
+	test(ctx, "http_scan: byte classes");
+	{
+		bool all_match = true;
+
+		for (int i = 0; i < 256; i++) {
+			uint8_t byte = i;
+
+			bool target = byte > ' ';
+			bool version = is_token_byte(byte) || byte == '/';
+			bool field_value = byte == ' ' || byte == '\t' || (byte > ' ' && byte != 0x7F);
+
+			if (has_class(byte, HTTP_BYTE_TOKEN) != is_token_byte(byte)) all_match = false;
+			if (has_class(byte, HTTP_BYTE_TARGET) != target) all_match = false;
+			if (has_class(byte, HTTP_BYTE_VERSION) != version) all_match = false;
+			if (has_class(byte, HTTP_BYTE_FIELD_VALUE) != field_value) all_match = false;
+		}
+
+		EXPECT(ctx, all_match);
+	}
+
+	uint64_t random = 0x9e3779b97f4a7c15;
+	uint8_t input[TEST_HTTP_SCAN_INPUT_MAX];
+
+	for (int implementation = 0; implementation < HTTP_SCAN_IMPLEMENTATIONS_COUNT; implementation++) {
+		if (!http_scan_supported(implementation)) continue;
+
+		test(ctx, "http_scan: %s agrees with scalar", http_scan_name(implementation));
+
+		bool all_agree = true;
+
+		for (int i = 0; i < TEST_HTTP_SCAN_INPUTS; i++) {
+			size_t len = next_random(&random) % TEST_HTTP_SCAN_INPUT_MAX;
+			for (size_t j = 0; j < len; j++) {
+				uint64_t pick = next_random(&random);
+				input[j] = pick % 64 == 0 ? (uint8_t) (pick >> 8) : 'a';
+			}
+
+			Slice bytes = slice_from_len(input, len);
+
+			// Every suffix, so that blocks start at every offset too.
+			for (size_t start = 0; start <= len; start++) {
+				Slice rest = slice_remove_start(bytes, start);
+
+				size_t expected = http_scan_field_value_with(HTTP_SCAN_SCALAR, rest);
+				if (http_scan_field_value_with(implementation, rest) != expected) all_agree = false;
+			}
+		}
+
+		EXPECT(ctx, all_agree);
+	}
+
+	test(ctx, "http_scan: end of a browser header value");
+	{
+		Slice value = slice_from_cstr(
+			"Mozilla/5.0 (X11; Linux x86_64; rv:128.0)\tGecko/20100101 Firefox/128.0 \r\n"
+			"Accept: */*\r\n"
+		);
+
+		size_t len = http_scan_field_value(value);
+
+		EXPECT(ctx, slice_equal(slice_remove_start(value, len), slice_from_cstr("\r\nAccept: */*\r\n")));
+	}
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+#include "warble/test.h"
+
+void test_http_scan(TestContext *ctx);
@@ -0,0 +1,164 @@
+#include "test/pack.h"
+#include "test/helpers.h"
+#include "http/connection.h"
+#include "main/pack.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Answers every request from the `Pack` in `userdata`.
+static void respond_from_pack(void *userdata, const HttpRequest *request, HttpResponse *response) {
+	const Pack *pack = (const Pack*) userdata;
+
+	Error err = pack_respond(pack, request, response);
+	if (err == ERR_HTTP_NOT_FOUND) {
+		(void) http_response_not_found(response);
+	}
+}
+
+// Everything `pack` answers a GET of `target` with; see `test_request`.
+static void request_from_pack(const Pack *pack, const char *target, const char *headers, Buffer *out_response) {
+	(void) test_request(respond_from_pack, (void*) pack, target, headers, out_response);
+}
+
+static bool pack_serves(const Pack *pack, const char *target, const char *body) {
+	return test_serves(respond_from_pack, (void*) pack, target, body);
+}
+
+void test_pack(TestContext *ctx) {
+	Pack pack;
+	Error err;
+
+	char directory[] = "/tmp/userve-test-XXXXXX";
+	EXPECT(ctx, mkdtemp(directory) != NULL);
+
+	char path[512], pack_path[512];
+	snprintf(pack_path, sizeof(pack_path), "%s.upk", directory);
+
+	// Longer than `HTTP_OUTPUT_MIN_BORROW`, so that it's sent straight from the
+	// mapping.
+	static char big[5000];
+	memset(big, 'b', sizeof(big) - 1);
+	big[sizeof(big) - 1] = '\0';
+
+	test_write_file(directory, "index.html", "home");
+	test_write_file(directory, "big.txt", big);
+	test_write_file(directory, "empty.txt", "");
+	snprintf(path, sizeof(path), "%s/sub", directory);
+	(void) mkdir(path, 0700);
+	test_write_file(directory, "sub/page.html", "page");
+
+	test(ctx, "pack: files are served from a pack");
+	{
+		PackWriteStats stats;
+		err = pack_write(directory, pack_path, &stats);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, stats.files == 4);
+
+		err = pack_open(&pack, pack_path);
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, pack_files_count(&pack) == 4);
+
+		EXPECT(ctx, pack_serves(&pack, "/", "home"));
+		EXPECT(ctx, pack_serves(&pack, "/big.txt", big));
+		EXPECT(ctx, pack_serves(&pack, "/empty.txt", ""));
+		EXPECT(ctx, pack_serves(&pack, "/sub/page", "page"));
+		EXPECT(ctx, pack_serves(&pack, "/sub/page?from=index", "page"));
+		EXPECT(ctx, pack_serves(&pack, "/sub/page.html", NULL));
+		EXPECT(ctx, pack_serves(&pack, "/missing", NULL));
+
+		Buffer response;
+		buffer_init(&response);
+		request_from_pack(&pack, "/sub/page", "", &response);
+		EXPECT(ctx, strstr((const char*) response.bytes, "Content-Type: text/html") != NULL);
+		EXPECT(ctx, strstr((const char*) response.bytes, "ETag: \"") != NULL);
+
+		// Compresses to a fraction of its size.
+		buffer_clear(&response);
+		request_from_pack(&pack, "/big.txt", "Accept-Encoding: gzip\r\n", &response);
+		EXPECT(ctx, strstr((const char*) response.bytes, "Content-Encoding: gzip\r\n") != NULL);
+		EXPECT(ctx, strstr((const char*) response.bytes, "-gzip\"\r\n") != NULL);
+		EXPECT(ctx, response.len < sizeof(big) / 2);
+
+		// Conditional requests get a 304, with the ETag of what was asked for.
+		char headers[256];
+		const char *etag = strstr((const char*) response.bytes, "ETag: ");
+		const char *etag_end = etag != NULL ? strstr(etag, "\r\n") : NULL;
+		EXPECT(ctx, etag_end != NULL);
+		if (etag_end != NULL) {
+			snprintf(headers, sizeof(headers), "Accept-Encoding: gzip\r\nIf-None-Match: %.*s\r\n", (int) (etag_end - etag - strlen("ETag: ")), etag + strlen("ETag: "));
+
+			buffer_clear(&response);
+			request_from_pack(&pack, "/big.txt", headers, &response);
+			EXPECT(ctx, strncmp((const char*) response.bytes, "HTTP/1.1 304", strlen("HTTP/1.1 304")) == 0);
+			EXPECT(ctx, strstr((const char*) response.bytes, "Vary: Accept-Encoding\r\n") != NULL);
+			EXPECT(ctx, strstr((const char*) response.bytes, "\r\n\r\n")[strlen("\r\n\r\n")] == '\0');
+
+			// Not the ETag of the plain representation.
+			buffer_clear(&response);
+			request_from_pack(&pack, "/big.txt", headers + strlen("Accept-Encoding: gzip\r\n"), &response);
+			EXPECT(ctx, strncmp((const char*) response.bytes, "HTTP/1.1 200", strlen("HTTP/1.1 200")) == 0);
+		}
+
+		buffer_clear(&response);
+		request_from_pack(&pack, "/big.txt", "Range: bytes=10-13\r\n", &response);
+		EXPECT(ctx, strncmp((const char*) response.bytes, "HTTP/1.1 206", strlen("HTTP/1.1 206")) == 0);
+		EXPECT(ctx, strstr((const char*) response.bytes, "Content-Range: bytes 10-13/4999\r\n") != NULL);
+		EXPECT(ctx, strcmp(strstr((const char*) response.bytes, "\r\n\r\n"), "\r\n\r\nbbbb") == 0);
+
+		buffer_clear(&response);
+		request_from_pack(&pack, "/big.txt", "Range: bytes=5000-\r\n", &response);
+		EXPECT(ctx, strncmp((const char*) response.bytes, "HTTP/1.1 416", strlen("HTTP/1.1 416")) == 0);
+		buffer_clear(&response);
+		request_from_pack(&pack, "/sub/page", "If-Modified-Since: Fri, 31 Dec 9999 23:59:59 GMT\r\n", &response);
+		EXPECT(ctx, strncmp((const char*) response.bytes, "HTTP/1.1 304", strlen("HTTP/1.1 304")) == 0);
+		EXPECT(ctx, strstr((const char*) response.bytes, "Last-Modified: ") != NULL);
+
+		buffer_deinit(&response);
+
+		pack_close(&pack);
+	}
+
+	test(ctx, "pack: damaged packs aren't opened");
+	{
+		// Every bucket taken, so that a lookup of a URL that isn't in the pack
+		// would never find an empty one. `buckets_count` and `buckets_offset`
+		// are the fifth and sixth fields of the header.
+		int fd = open(pack_path, O_RDWR);
+		EXPECT(ctx, fd != -1);
+
+		uint64_t buckets[2] = { 0 };
+		EXPECT(ctx, pread(fd, buckets, sizeof(buckets), 32) == sizeof(buckets));
+
+		uint32_t full = 1;
+		for (uint64_t i = 0; i < buckets[0] && i < 1024; i++) {
+			(void) pwrite(fd, &full, sizeof(full), buckets[1] + i * sizeof(full));
+		}
+		close(fd);
+
+		EXPECT(ctx, pack_open(&pack, pack_path) == ERR_PARSE_FAILED);
+
+		EXPECT(ctx, truncate(pack_path, 4096) == 0);
+		EXPECT(ctx, pack_open(&pack, pack_path) == ERR_PARSE_FAILED);
+
+		snprintf(path, sizeof(path), "%s/index.html", directory);
+		EXPECT(ctx, pack_open(&pack, path) == ERR_PARSE_FAILED);
+	}
+
+	unlink(pack_path);
+	snprintf(path, sizeof(path), "%s/index.html", directory);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/big.txt", directory);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/empty.txt", directory);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/sub/page.html", directory);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/sub", directory);
+	rmdir(path);
+	rmdir(directory);
+}
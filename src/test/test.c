@@ -1,7 +1,14 @@
 #include "test/test.h"
 
 #include "test/arguments.h"
+#include "test/conditional.h"
+#include "test/fileserver.h"
+#include "test/http_connection.h"
 #include "test/http_parser.h"
+#include "test/http_scan.h"
+#include "test/pack.h"
+#include "test/timeouts.h"
+#include "test/watcher.h"
 
 #include "warble/test.h"
 
@@ -18,6 +25,27 @@ Error test_all(void) {
 	printf("test http parser\n");
 	test_http_parser(&ctx);
 
+	printf("test http scan\n");
+	test_http_scan(&ctx);
+
+	printf("test http connection\n");
+	test_http_connection(&ctx);
+
+	printf("test fileserver\n");
+	test_fileserver(&ctx);
+
+	printf("test pack\n");
+	test_pack(&ctx);
+
+	printf("test conditional requests\n");
+	test_conditional(&ctx);
+
+	printf("test timeouts\n");
+	test_timeouts(&ctx);
+
+	printf("test watcher\n");
+	test_watcher(&ctx);
+
 	test_context_report(&ctx);
 
 	return ERR_SUCCESS;
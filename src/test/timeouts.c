@@ -0,0 +1,258 @@
+#include "test/timeouts.h"
+#include "net/timeout.h"
+#include "net/timer_wheel.h"
+
+#include <string.h>
+
+// Answers every request with a body of 1000 bytes.
+static void respond_thousand(void *userdata, const HttpRequest *request, HttpResponse *response) {
+	(void) userdata;
+	(void) request;
+
+	static uint8_t body[1000];
+	memset(body, 'x', sizeof(body));
+
+	http_response_set_status(response, HTTP_OK);
+	(void) http_response_end_with_body(response, slice_from_len(body, sizeof(body)));
+}
+
+// Feed `bytes` to `http`, and update its timeout at `now_ms`.
+static void receive_at(
+	ConnectionTimeout *timeout,
+	TimerWheel *timers,
+	const Server *server,
+	HttpConnection *http,
+	const char *bytes,
+	uint64_t now_ms
+) {
+	(void) http_connection_receive(http, slice_from_cstr(bytes), respond_thousand, NULL);
+	connection_timeout_update(timeout, timers, server, http, 0, now_ms);
+}
+
+void test_timeouts(TestContext *ctx) {
+	static TimerWheel timers;
+
+	test(ctx, "timeouts: timers expire once their deadline has passed");
+	{
+		timer_wheel_init(&timers, 1000);
+		EXPECT(ctx, timer_wheel_wait_timeout(&timers, 1000) == -1);
+
+		Timer a, b, c;
+		timer_init(&a, "a");
+		timer_init(&b, "b");
+		timer_init(&c, "c");
+
+		timer_wheel_schedule(&timers, &a, 1500);
+		timer_wheel_schedule(&timers, &b, 3000);
+		timer_wheel_schedule(&timers, &c, 1200);
+		EXPECT(ctx, timer_scheduled(&a) && timer_scheduled(&b) && timer_scheduled(&c));
+
+		// Woken up once the earliest one's tick has passed.
+		int wait_ms = timer_wheel_wait_timeout(&timers, 1000);
+		EXPECT(ctx, wait_ms > 200 && wait_ms <= 200 + TIMER_WHEEL_TICK_MS);
+
+		EXPECT(ctx, timer_wheel_take_expired(&timers, 1100) == NULL);
+
+		EXPECT(ctx, timer_wheel_take_expired(&timers, 1200 + TIMER_WHEEL_TICK_MS) == &c);
+		EXPECT(ctx, !timer_scheduled(&c));
+		EXPECT(ctx, timer_wheel_take_expired(&timers, 1200 + TIMER_WHEEL_TICK_MS) == NULL);
+
+		Timer *first = timer_wheel_take_expired(&timers, 5000);
+		Timer *second = timer_wheel_take_expired(&timers, 5000);
+		EXPECT(ctx, first == &a && second == &b);
+		EXPECT(ctx, timer_wheel_take_expired(&timers, 5000) == NULL);
+		EXPECT(ctx, timer_wheel_wait_timeout(&timers, 5000) == -1);
+
+		timer_wheel_deinit(&timers);
+	}
+
+	test(ctx, "timeouts: timers can be moved and cancelled");
+	{
+		timer_wheel_init(&timers, 0);
+
+		Timer a, b;
+		timer_init(&a, NULL);
+		timer_init(&b, NULL);
+
+		timer_wheel_schedule(&timers, &a, 1000);
+		timer_wheel_schedule(&timers, &b, 1000);
+
+		timer_wheel_schedule(&timers, &a, 5000);
+		timer_wheel_cancel(&timers, &b);
+		timer_wheel_cancel(&timers, &b);
+		EXPECT(ctx, !timer_scheduled(&b));
+
+		EXPECT(ctx, timer_wheel_take_expired(&timers, 2000) == NULL);
+		EXPECT(ctx, timer_wheel_take_expired(&timers, 6000) == &a);
+
+		// A deadline that's already passed expires on the next tick.
+		timer_wheel_schedule(&timers, &b, 10);
+		EXPECT(ctx, timer_wheel_take_expired(&timers, 6000 + TIMER_WHEEL_TICK_MS) == &b);
+
+		timer_wheel_deinit(&timers);
+	}
+
+	test(ctx, "timeouts: timers more than a turn away wait for their turn");
+	{
+		timer_wheel_init(&timers, 0);
+
+		uint64_t turn_ms = (uint64_t) TIMER_WHEEL_SLOTS * TIMER_WHEEL_TICK_MS;
+
+		Timer far, near;
+		timer_init(&far, NULL);
+		timer_init(&near, NULL);
+
+		// Both in the same slot.
+		timer_wheel_schedule(&timers, &far, 2 * turn_ms + 50);
+		timer_wheel_schedule(&timers, &near, 50);
+
+		EXPECT(ctx, timer_wheel_take_expired(&timers, turn_ms) == &near);
+		EXPECT(ctx, timer_wheel_take_expired(&timers, turn_ms + 200) == NULL);
+		EXPECT(ctx, timer_wheel_take_expired(&timers, 2 * turn_ms) == NULL);
+		EXPECT(ctx, timer_scheduled(&far));
+
+		// Long after, without having looked in between.
+		EXPECT(ctx, timer_wheel_take_expired(&timers, 50 * turn_ms) == &far);
+
+		timer_wheel_deinit(&timers);
+	}
+
+	Server server;
+	server_init(&server);
+	server.idle_timeout_ms = 10000;
+	server.header_timeout_ms = 5000;
+	server.send_timeout_ms = 8000;
+	server.min_send_rate = 1000;
+
+	HttpConnection http;
+	ConnectionTimeout timeout;
+
+	test(ctx, "timeouts: a request's head has to arrive in time, however it trickles in");
+	{
+		timer_wheel_init(&timers, 0);
+		http_connection_init(&http);
+		connection_timeout_init(&timeout, &http);
+
+		connection_timeout_update(&timeout, &timers, &server, &http, 0, 0);
+		EXPECT(ctx, timeout.kind == CONNECTION_TIMEOUT_IDLE);
+		EXPECT(ctx, timeout.timer.deadline_ms == 10000);
+
+		receive_at(&timeout, &timers, &server, &http, "GET / HT", 1000);
+		EXPECT(ctx, timeout.kind == CONNECTION_TIMEOUT_HEADER);
+		EXPECT(ctx, timeout.timer.deadline_ms == 6000);
+
+		receive_at(&timeout, &timers, &server, &http, "TP/1.1\r\n", 3000);
+		receive_at(&timeout, &timers, &server, &http, "Host: a\r\n", 5000);
+		EXPECT(ctx, timeout.timer.deadline_ms == 6000);
+
+		EXPECT(ctx, timer_wheel_take_expired(&timers, 6000 + TIMER_WHEEL_TICK_MS) == &timeout.timer);
+		EXPECT(ctx, timeout.timer.data == &http);
+
+		connection_timeout_deinit(&timeout, &timers);
+		http_connection_deinit(&http);
+		timer_wheel_deinit(&timers);
+	}
+
+	test(ctx, "timeouts: clients have to keep taking their output");
+	{
+		timer_wheel_init(&timers, 0);
+		http_connection_init(&http);
+		connection_timeout_init(&timeout, &http);
+
+		receive_at(&timeout, &timers, &server, &http, "GET / HTTP/1.1\r\n\r\n", 1000);
+		EXPECT(ctx, timeout.kind == CONNECTION_TIMEOUT_SEND);
+		EXPECT(ctx, timeout.timer.deadline_ms == 9000);
+
+		// Every byte taken buys a millisecond, up to the timeout from now.
+		http_connection_consume_output(&http, 500);
+		connection_timeout_update(&timeout, &timers, &server, &http, 0, 2000);
+		EXPECT(ctx, timeout.timer.deadline_ms == 9500);
+
+		http_connection_consume_output(&http, 10);
+		connection_timeout_update(&timeout, &timers, &server, &http, 0, 9000);
+		EXPECT(ctx, timeout.timer.deadline_ms == 9510);
+
+		// Whatever's in a send that hasn't completed is allowed for too.
+		http_connection_consume_output(&http, 200);
+		connection_timeout_update(&timeout, &timers, &server, &http, 2000, 9000);
+		EXPECT(ctx, timeout.timer.deadline_ms == 9710);
+
+		// Once it's all written, the connection waits for the next request.
+		http_connection_consume_output(&http, http_connection_pending_output_len(&http));
+		connection_timeout_update(&timeout, &timers, &server, &http, 0, 9600);
+		EXPECT(ctx, timeout.kind == CONNECTION_TIMEOUT_IDLE);
+		EXPECT(ctx, timeout.timer.deadline_ms == 19600);
+
+		connection_timeout_deinit(&timeout, &timers);
+		EXPECT(ctx, !timer_scheduled(&timeout.timer));
+		http_connection_deinit(&http);
+		timer_wheel_deinit(&timers);
+	}
+
+	test(ctx, "timeouts: every request starts the clock again");
+	{
+		timer_wheel_init(&timers, 0);
+		http_connection_init(&http);
+		connection_timeout_init(&timeout, &http);
+
+		receive_at(&timeout, &timers, &server, &http, "GET / HT", 1000);
+		EXPECT(ctx, timeout.timer.deadline_ms == 6000);
+
+		// The response is written straight away, and the next request has
+		// started arriving behind it.
+		(void) http_connection_receive(&http, slice_from_cstr("TP/1.1\r\n\r\nGET / HT"), respond_thousand, NULL);
+		http_connection_consume_output(&http, http_connection_pending_output_len(&http));
+		connection_timeout_update(&timeout, &timers, &server, &http, 0, 4000);
+		EXPECT(ctx, timeout.kind == CONNECTION_TIMEOUT_HEADER);
+		EXPECT(ctx, timeout.timer.deadline_ms == 9000);
+
+		(void) http_connection_receive(&http, slice_from_cstr("TP/1.1\r\n\r\n"), respond_thousand, NULL);
+		http_connection_consume_output(&http, http_connection_pending_output_len(&http));
+		connection_timeout_update(&timeout, &timers, &server, &http, 0, 5000);
+		EXPECT(ctx, timeout.kind == CONNECTION_TIMEOUT_IDLE);
+		EXPECT(ctx, timeout.timer.deadline_ms == 15000);
+
+		// So does one that arrives all at once, and is answered straight away.
+		(void) http_connection_receive(&http, slice_from_cstr("GET / HTTP/1.1\r\n\r\n"), respond_thousand, NULL);
+		http_connection_consume_output(&http, http_connection_pending_output_len(&http));
+		connection_timeout_update(&timeout, &timers, &server, &http, 0, 7000);
+		EXPECT(ctx, timeout.kind == CONNECTION_TIMEOUT_IDLE);
+		EXPECT(ctx, timeout.timer.deadline_ms == 17000);
+
+		connection_timeout_deinit(&timeout, &timers);
+		http_connection_deinit(&http);
+		timer_wheel_deinit(&timers);
+	}
+
+	test(ctx, "timeouts: a timeout of zero never expires");
+	{
+		Server patient = server;
+		patient.header_timeout_ms = 0;
+
+		timer_wheel_init(&timers, 0);
+		http_connection_init(&http);
+		connection_timeout_init(&timeout, &http);
+
+		receive_at(&timeout, &timers, &patient, &http, "GET / HT", 1000);
+		EXPECT(ctx, timeout.kind == CONNECTION_TIMEOUT_HEADER);
+		EXPECT(ctx, !timer_scheduled(&timeout.timer));
+
+		connection_timeout_deinit(&timeout, &timers);
+		http_connection_deinit(&http);
+		timer_wheel_deinit(&timers);
+	}
+
+	test(ctx, "timeouts: timeouts are counted by kind");
+	{
+		size_t header = connection_timeouts_count(CONNECTION_TIMEOUT_HEADER);
+		size_t send = connection_timeouts_count(CONNECTION_TIMEOUT_SEND);
+
+		connection_timeout_count(CONNECTION_TIMEOUT_HEADER);
+		connection_timeout_count(CONNECTION_TIMEOUT_HEADER);
+
+		EXPECT(ctx, connection_timeouts_count(CONNECTION_TIMEOUT_HEADER) == header + 2);
+		EXPECT(ctx, connection_timeouts_count(CONNECTION_TIMEOUT_SEND) == send);
+	}
+
+	server_deinit(&server);
+}
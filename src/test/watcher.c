@@ -0,0 +1,67 @@
+#include "test/watcher.h"
+#include "test/helpers.h"
+#include "main/fileserver.h"
+#include "main/watcher.h"
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Apply the changes that `watcher` has been told about, if any arrive within a
+// second. Returns true if any were applied.
+static bool apply_changes(FileWatcher *watcher) {
+	struct pollfd pollfd = { .fd = watcher->inotify_fd, .events = POLLIN };
+	if (poll(&pollfd, 1, 1000) <= 0) return false;
+
+	size_t changes;
+	Error err = file_watcher_apply_changes(watcher, &changes);
+
+	return err == ERR_SUCCESS && changes > 0;
+}
+
+void test_watcher(TestContext *ctx) {
+	FileServer fileserver;
+	FileServerReader reader;
+	FileWatcher watcher;
+	Error err;
+
+	char directory[] = "/tmp/userve-test-XXXXXX";
+	EXPECT(ctx, mkdtemp(directory) != NULL);
+
+	char from[512], to[512];
+	snprintf(from, sizeof(from), "%s/a.txt", directory);
+	snprintf(to, sizeof(to), "%s/b.txt", directory);
+
+	test(ctx, "watcher: created, renamed and deleted files are picked up");
+	{
+		fileserver_init(&fileserver);
+		fileserver_reader_init(&reader, &fileserver);
+
+		err = file_watcher_init(&watcher, &fileserver);
+		EXPECT(ctx, err == ERR_SUCCESS);
+
+		err = file_watcher_watch_directory(&watcher, directory, slice_from_cstr("/"));
+		EXPECT(ctx, err == ERR_SUCCESS);
+		EXPECT(ctx, test_serves(test_respond_from_fileserver, &reader, "/a.txt", NULL));
+
+		test_write_file(directory, "a.txt", "alpha");
+		EXPECT(ctx, apply_changes(&watcher));
+		EXPECT(ctx, test_serves(test_respond_from_fileserver, &reader, "/a.txt", "alpha"));
+
+		EXPECT(ctx, rename(from, to) == 0);
+		EXPECT(ctx, apply_changes(&watcher));
+		EXPECT(ctx, test_serves(test_respond_from_fileserver, &reader, "/a.txt", NULL));
+		EXPECT(ctx, test_serves(test_respond_from_fileserver, &reader, "/b.txt", "alpha"));
+
+		EXPECT(ctx, unlink(to) == 0);
+		EXPECT(ctx, apply_changes(&watcher));
+		EXPECT(ctx, test_serves(test_respond_from_fileserver, &reader, "/b.txt", NULL));
+
+		file_watcher_deinit(&watcher);
+		fileserver_reader_deinit(&reader);
+		fileserver_deinit(&fileserver);
+	}
+
+	rmdir(directory);
+}
@@ -5,7 +5,10 @@
 
 #include <limits.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 Error write_all_to_fd(int fd, Slice slice) {
 	while (slice.len > 0) {
@@ -24,6 +27,360 @@ Error write_all_to_fd(int fd, Slice slice) {
 	return ERR_SUCCESS;
 }
 
+uint64_t monotonic_ms(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint8_t ascii_lowercase(uint8_t byte) {
+	if (byte >= 'A' && byte <= 'Z') return byte - 'A' + 'a';
+
+	return byte;
+}
+
+bool slice_equal_ignore_case(Slice a, Slice b) {
+	if (a.len != b.len) return false;
+
+	for (size_t i = 0; i < a.len; i++) {
+		if (ascii_lowercase(a.bytes[i]) != ascii_lowercase(b.bytes[i])) return false;
+	}
+
+	return true;
+}
+
+bool list_contains_token(Slice list, Slice token) {
+	size_t start = 0;
+
+	while (start < list.len) {
+		size_t end = start;
+		while (end < list.len && list.bytes[end] != ',') end++;
+
+		Slice element = slice_from_len(list.bytes + start, end - start);
+
+		// Trim optional whitespace on both sides.
+		while (element.len > 0 && (element.bytes[0] == ' ' || element.bytes[0] == '\t')) {
+			element = slice_remove_start(element, 1);
+		}
+		while (element.len > 0 && (
+			element.bytes[element.len - 1] == ' ' ||
+			element.bytes[element.len - 1] == '\t'
+		)) {
+			element.len -= 1;
+		}
+
+		if (slice_equal_ignore_case(element, token)) return true;
+
+		// Skip the comma.
+		start = end + 1;
+	}
+
+	return false;
+}
+
+// Returns true unless `weight`, the value of a `q` parameter, is zero.
+static bool weight_is_nonzero(Slice weight) {
+	// "0", "0." or "0.000", say.
+	if (weight.len == 0 || weight.bytes[0] != '0') return true;
+
+	for (size_t i = 1; i < weight.len; i++) {
+		if (weight.bytes[i] != '.' && weight.bytes[i] != '0') return true;
+	}
+
+	return false;
+}
+
+bool list_accepts_token(Slice list, Slice token) {
+	// Only matters if `token` isn't named.
+	bool wildcard = false;
+
+	size_t start = 0;
+
+	while (start < list.len) {
+		size_t end = start;
+		while (end < list.len && list.bytes[end] != ',') end++;
+
+		Slice element = slice_from_len(list.bytes + start, end - start);
+
+		// Skip the comma.
+		start = end + 1;
+
+		// The token, and its parameters after the first `;`.
+		size_t name_end = 0;
+		while (name_end < element.len && element.bytes[name_end] != ';') name_end++;
+
+		Slice name = slice_from_len(element.bytes, name_end);
+		Slice parameters = slice_remove_start(element, name_end);
+
+		while (name.len > 0 && (name.bytes[0] == ' ' || name.bytes[0] == '\t')) {
+			name = slice_remove_start(name, 1);
+		}
+		while (name.len > 0 && (name.bytes[name.len - 1] == ' ' || name.bytes[name.len - 1] == '\t')) {
+			name.len -= 1;
+		}
+
+		// Any parameter other than the weight is ignored.
+		bool accepted = true;
+		while (parameters.len > 0) {
+			// Skip the `;`, and whitespace after it.
+			parameters = slice_remove_start(parameters, 1);
+			while (parameters.len > 0 && (parameters.bytes[0] == ' ' || parameters.bytes[0] == '\t')) {
+				parameters = slice_remove_start(parameters, 1);
+			}
+
+			size_t parameter_end = 0;
+			while (parameter_end < parameters.len && parameters.bytes[parameter_end] != ';') parameter_end++;
+
+			Slice parameter = slice_from_len(parameters.bytes, parameter_end);
+			parameters = slice_remove_start(parameters, parameter_end);
+
+			while (parameter.len > 0 && (
+				parameter.bytes[parameter.len - 1] == ' ' ||
+				parameter.bytes[parameter.len - 1] == '\t'
+			)) {
+				parameter.len -= 1;
+			}
+
+			if (parameter.len >= 2 && (parameter.bytes[0] == 'q' || parameter.bytes[0] == 'Q') && parameter.bytes[1] == '=') {
+				accepted = weight_is_nonzero(slice_remove_start(parameter, 2));
+			}
+		}
+
+		if (slice_equal_ignore_case(name, token)) return accepted;
+		if (slice_equal(name, slice_from_cstr("*"))) wildcard = accepted;
+	}
+
+	return wildcard;
+}
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotate_left(uint64_t value, int bits) {
+	return (value << bits) | (value >> (64 - bits));
+}
+
+// Little-endian, whatever the machine is, so that hashes are the same
+// everywhere.
+static uint64_t read_u64_le(const uint8_t *bytes) {
+	uint64_t value = 0;
+	for (int i = 7; i >= 0; i--) value = (value << 8) | bytes[i];
+
+	return value;
+}
+
+static uint32_t read_u32_le(const uint8_t *bytes) {
+	return
+		(uint32_t) bytes[0] |
+		(uint32_t) bytes[1] << 8 |
+		(uint32_t) bytes[2] << 16 |
+		(uint32_t) bytes[3] << 24;
+}
+
+static uint64_t xxh64_round(uint64_t accumulator, uint64_t input) {
+	accumulator += input * XXH_PRIME64_2;
+	accumulator = rotate_left(accumulator, 31);
+
+	return accumulator * XXH_PRIME64_1;
+}
+
+static uint64_t xxh64_merge_round(uint64_t accumulator, uint64_t value) {
+	accumulator ^= xxh64_round(0, value);
+
+	return accumulator * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+uint64_t content_hash(Slice bytes) {
+	const uint8_t *cursor = bytes.bytes;
+	const uint8_t *end = bytes.bytes + bytes.len;
+
+	uint64_t hash;
+
+	if (bytes.len >= 32) {
+		// Four lanes, 8 bytes each, so that they can run in parallel.
+		uint64_t lanes[4] = {
+			XXH_PRIME64_1 + XXH_PRIME64_2,
+			XXH_PRIME64_2,
+			0,
+			-XXH_PRIME64_1,
+		};
+
+		for (; end - cursor >= 32; cursor += 32) {
+			for (int i = 0; i < 4; i++) {
+				lanes[i] = xxh64_round(lanes[i], read_u64_le(cursor + i * 8));
+			}
+		}
+
+		hash =
+			rotate_left(lanes[0], 1) +
+			rotate_left(lanes[1], 7) +
+			rotate_left(lanes[2], 12) +
+			rotate_left(lanes[3], 18);
+
+		for (int i = 0; i < 4; i++) hash = xxh64_merge_round(hash, lanes[i]);
+	} else {
+		hash = XXH_PRIME64_5;
+	}
+
+	hash += bytes.len;
+
+	for (; end - cursor >= 8; cursor += 8) {
+		hash ^= xxh64_round(0, read_u64_le(cursor));
+		hash = rotate_left(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	}
+
+	if (end - cursor >= 4) {
+		hash ^= read_u32_le(cursor) * XXH_PRIME64_1;
+		hash = rotate_left(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		cursor += 4;
+	}
+
+	for (; cursor < end; cursor++) {
+		hash ^= *cursor * XXH_PRIME64_5;
+		hash = rotate_left(hash, 11) * XXH_PRIME64_1;
+	}
+
+	// Avalanche.
+	hash ^= hash >> 33;
+	hash *= XXH_PRIME64_2;
+	hash ^= hash >> 29;
+	hash *= XXH_PRIME64_3;
+	hash ^= hash >> 32;
+
+	return hash;
+}
+
+Error format_etag(Buffer *out, uint64_t hash, const char *suffix) {
+	return buffer_concat_printf(out, "\"%016llx%s\"", (unsigned long long) hash, suffix);
+}
+
+Error format_file_etag(Buffer *out, uint64_t inode, int64_t modified_ns, uint64_t size) {
+	return buffer_concat_printf(
+		out,
+		"\"%llx-%llx-%llx\"",
+		(unsigned long long) inode,
+		(unsigned long long) modified_ns,
+		(unsigned long long) size
+	);
+}
+
+bool list_matches_etag(Slice list, Slice etag) {
+	size_t index = 0;
+
+	while (index < list.len) {
+		// Skip separators, and any whitespace around them.
+		uint8_t byte = list.bytes[index];
+		if (byte == ',' || byte == ' ' || byte == '\t') {
+			index += 1;
+			continue;
+		}
+
+		if (byte == '*') return true;
+
+		// Weak and strong ETags are compared alike; see
+		// https://datatracker.ietf.org/doc/html/rfc9110#section-13.1.2.
+		if (byte == 'W' && index + 1 < list.len && list.bytes[index + 1] == '/') index += 2;
+
+		// Garbage; don't guess.
+		if (index >= list.len || list.bytes[index] != '"') return false;
+
+		// Up to and including the closing quote. ETags may contain commas.
+		size_t end = index + 1;
+		while (end < list.len && list.bytes[end] != '"') end++;
+		if (end == list.len) return false;
+		end += 1;
+
+		if (slice_equal(slice_from_len(list.bytes + index, end - index), etag)) return true;
+
+		index = end;
+	}
+
+	return false;
+}
+
+static const char *const http_date_days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char *const http_date_months[] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+};
+
+Error format_http_date(Buffer *out, int64_t seconds) {
+	time_t time = seconds;
+
+	struct tm date;
+	if (gmtime_r(&time, &date) == NULL) return ERR_UNKNOWN;
+
+	// Not `strftime`, whose names depend on the locale.
+	return buffer_concat_printf(
+		out,
+		"%s, %02d %s %04d %02d:%02d:%02d GMT",
+		http_date_days[date.tm_wday],
+		date.tm_mday,
+		http_date_months[date.tm_mon],
+		date.tm_year + 1900,
+		date.tm_hour,
+		date.tm_min,
+		date.tm_sec
+	);
+}
+
+// Parse exactly `len` decimal digits at `bytes`.
+static bool parse_digits(const uint8_t *bytes, size_t len, int *out_value) {
+	int value = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (bytes[i] < '0' || bytes[i] > '9') return false;
+
+		value = value * 10 + (bytes[i] - '0');
+	}
+
+	*out_value = value;
+	return true;
+}
+
+bool parse_http_date(Slice date, int64_t *out_seconds) {
+	// Sun, 06 Nov 1994 08:49:37 GMT
+	// 0         1         2
+	// 01234567890123456789012345678
+	if (date.len != 29) return false;
+
+	const uint8_t *bytes = date.bytes;
+	if (memcmp(bytes + 3, ", ", 2) != 0 || memcmp(bytes + 25, " GMT", 4) != 0) return false;
+	if (bytes[7] != ' ' || bytes[11] != ' ' || bytes[16] != ' ') return false;
+	if (bytes[19] != ':' || bytes[22] != ':') return false;
+
+	struct tm tm = { 0 };
+
+	int month = -1;
+	for (int i = 0; i < 12; i++) {
+		if (memcmp(bytes + 8, http_date_months[i], 3) == 0) month = i;
+	}
+	if (month == -1) return false;
+	tm.tm_mon = month;
+
+	int year;
+	if (
+		!parse_digits(bytes + 5, 2, &tm.tm_mday) ||
+		!parse_digits(bytes + 12, 4, &year) ||
+		!parse_digits(bytes + 17, 2, &tm.tm_hour) ||
+		!parse_digits(bytes + 20, 2, &tm.tm_min) ||
+		!parse_digits(bytes + 23, 2, &tm.tm_sec)
+	) {
+		return false;
+	}
+	tm.tm_year = year - 1900;
+
+	if (tm.tm_mday < 1 || tm.tm_mday > 31 || tm.tm_hour > 23 || tm.tm_min > 59 || tm.tm_sec > 60) {
+		return false;
+	}
+
+	*out_seconds = timegm(&tm);
+
+	return true;
+}
+
 Slice detect_content_type(Slice path) {
 	struct ContentType {
 		Slice suffix;
@@ -74,3 +431,61 @@ Slice detect_content_type(Slice path) {
 	return slice_from_cstr("application/octet-stream");
 }
 
+bool content_type_is_compressible(Slice content_type) {
+	Slice compressible[] = {
+		slice_from_cstr("text/"),
+		slice_from_cstr("image/svg+xml"),
+		slice_from_cstr("application/wasm"),
+	};
+
+	for (size_t i = 0; i < sizeof(compressible) / sizeof(compressible[0]); i++) {
+		Slice prefix = compressible[i];
+		if (content_type.len < prefix.len) continue;
+
+		if (memcmp(content_type.bytes, prefix.bytes, prefix.len) == 0) return true;
+	}
+
+	return false;
+}
+
+Error gzip_compress(Slice bytes, int level, Buffer *out) {
+	// A single call only takes this much.
+	if (bytes.len > UINT_MAX) return ERR_UNKNOWN;
+
+	// The smallest window that holds all of `bytes` compresses it just as well
+	// as a bigger one, and a hash table in proportion to it is much cheaper
+	// to set up for small files.
+	int window_bits = 9;
+	while (window_bits < 15 && ((size_t) 1 << window_bits) < bytes.len) window_bits++;
+	int mem_level = window_bits - 7;
+
+	z_stream stream = { 0 };
+
+	// 16 more than the window size picks the gzip wrapper over zlib's.
+	int z_err = deflateInit2(&stream, level, Z_DEFLATED, window_bits + 16, mem_level, Z_DEFAULT_STRATEGY);
+	if (z_err != Z_OK) return ERR_OUT_OF_MEMORY;
+
+	// Enough that a single call compresses everything.
+	Error err = buffer_reserve_additional(out, deflateBound(&stream, bytes.len));
+	if (err != ERR_SUCCESS) {
+		deflateEnd(&stream);
+		return err;
+	}
+
+	Slice uninit = buffer_uninitialized(out);
+
+	stream.next_in = bytes.bytes;
+	stream.avail_in = bytes.len;
+	stream.next_out = uninit.bytes;
+	stream.avail_out = uninit.len < UINT_MAX ? uninit.len : UINT_MAX;
+
+	z_err = deflate(&stream, Z_FINISH);
+	if (z_err == Z_STREAM_END) out->len += stream.total_out;
+
+	deflateEnd(&stream);
+
+	if (z_err != Z_STREAM_END) return ERR_UNKNOWN;
+
+	return ERR_SUCCESS;
+}
+
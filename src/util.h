@@ -1,10 +1,65 @@
 #pragma once
 
+#include "warble/buffer.h"
 #include "warble/slice.h"
 #include "warble/error.h"
 
+#include <stdint.h>
+
 // Write all of `slice` to `fd`, returning an error if `write` fails.
 Error write_all_to_fd(int fd, Slice slice);
 
+// Milliseconds since some arbitrary point in the past, from a clock that never
+// jumps.
+uint64_t monotonic_ms(void);
+
+// Returns true if `a` and `b` are equal, ignoring the case of ASCII letters.
+bool slice_equal_ignore_case(Slice a, Slice b);
+
+// Returns true if the comma-separated list `list` (e.g. a `Connection` header)
+// contains `token`, ignoring case and surrounding whitespace.
+bool list_contains_token(Slice list, Slice token);
+
+// Returns true if the comma-separated list of weighted tokens `list` (e.g. an
+// `Accept-Encoding` header) accepts `token`: names it, or `*`, without a
+// weight of zero.
+bool list_accepts_token(Slice list, Slice token);
+
+// A 64-bit hash of `bytes` (XXH64, with a seed of zero): fast enough to run
+// over every file that's loaded, and good enough to tell versions of a file
+// apart.
+uint64_t content_hash(Slice bytes);
+
+// Append a strong ETag, quotes included, for contents whose `content_hash` is
+// `hash`. `suffix` is added inside the quotes, to tell other representations
+// of the same contents apart; e.g. `-gzip`.
+Error format_etag(Buffer *out, uint64_t hash, const char *suffix);
+
+// Append a strong ETag, quotes included, for a file that's sent from disk
+// rather than hashed: from its inode, modification time in nanoseconds, and
+// size. It changes whenever the file is written, but also when it's only
+// touched.
+Error format_file_etag(Buffer *out, uint64_t inode, int64_t modified_ns, uint64_t size);
+
+// Returns true if the `If-None-Match` value `list` matches `etag`: names it,
+// with or without `W/`, or is `*`.
+bool list_matches_etag(Slice list, Slice etag);
+
+// Append `seconds` since the epoch as an HTTP date, e.g.
+// `Sun, 06 Nov 1994 08:49:37 GMT`.
+Error format_http_date(Buffer *out, int64_t seconds);
+
+// Parse an HTTP date in the format `format_http_date` writes. The obsolete
+// formats HTTP/1.1 still allows aren't understood, and return false.
+bool parse_http_date(Slice date, int64_t *out_seconds);
+
 // Doesn't really belong in this file, but whatever.
 Slice detect_content_type(Slice path);
+
+// Returns true if files of `content_type` tend to get smaller when they're
+// compressed. Images, audio and video are compressed already.
+bool content_type_is_compressible(Slice content_type);
+
+// Append `bytes`, compressed with gzip at `level` (as in zlib, 1 to 9), to
+// `out`.
+Error gzip_compress(Slice bytes, int level, Buffer *out);